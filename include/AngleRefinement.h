@@ -0,0 +1,186 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_ANGLEREFINEMENT_H
+#define CY_RSOXS_ANGLEREFINEMENT_H
+
+#include <Datatypes.h>
+#include <Input/InputData.h>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
+/**
+ * @brief Order in which the E angles of one (energy, k) are computed. Without refinement, every angle in order.
+ * With EAngleAdaptive, the angles are computed level by level: the coarsest level takes every s-th angle, where s is
+ * the largest power of 2 leaving at least EAngleInitialCount angles, and every further level bisects the previous
+ * one (stride s/2, s/4, ..., 1). At the end of a level, the average of the angles computed so far is compared to the
+ * average of the previous level, and the refinement stops once the relative change is below EAngleTolerance.
+ *
+ * The intensity is quadratic in the polarization, and in the lab frame the E angles theta and theta + 180 give
+ * polarizations of opposite sign, hence the same projection. With EAngleFolding (and without refinement), the angles
+ * equal modulo 180 degrees form a group: the projection is computed for the first angle of the group only, and
+ * rotated and accumulated for every angle of the group.
+ */
+class AngleRefinement {
+  /// Angle indices in the order they are computed
+  std::vector<UINT> order_;
+  /// Number of angles computed at the end of every level
+  std::vector<UINT> levelEnd_;
+  /// Angles sharing the projection of every angle. Empty for all but the first angle of a group.
+  std::vector<std::vector<UINT>> partners_;
+  const bool adaptive_;
+  const Real tolerance_;
+  const UINT norm_;
+  /// Current level
+  UINT level_ = 0;
+  /// Average at the end of the current and the previous level
+  std::vector<Real> current_, previous_;
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] inputData input data
+   * @param [in] numAngles number of E angles
+   */
+  AngleRefinement(const InputData &inputData, const UINT numAngles)
+    : adaptive_(inputData.eAngleAdaptive), tolerance_(inputData.eAngleTolerance), norm_(inputData.eAngleNorm) {
+    UINT stride = 1;
+    if (adaptive_) {
+      while ((2 * stride <= numAngles - 1) and ((numAngles - 1) / (2 * stride) + 1 >= inputData.eAngleInitialCount)) {
+        stride *= 2;
+      }
+    }
+    for (UINT i = 0; i < numAngles; i += stride) {
+      order_.push_back(i);
+    }
+    levelEnd_.push_back(order_.size());
+    for (UINT h = stride / 2; h >= 1; h /= 2) {
+      for (UINT i = h; i < numAngles; i += 2 * h) {
+        order_.push_back(i);
+      }
+      levelEnd_.push_back(order_.size());
+    }
+
+    partners_.resize(numAngles);
+    const bool fold = inputData.eAngleFolding and not(adaptive_) and (inputData.referenceFrame == ReferenceFrame::LAB);
+    /// First angle of every group, keyed by the angle modulo 180 degrees (in 1E-6 degrees)
+    std::map<long long, UINT> groups;
+    static constexpr long long HALF_TURN = 180000000LL;
+    for (UINT i = 0; i < numAngles; i++) {
+      if (not(fold)) {
+        partners_[i].push_back(i);
+        continue;
+      }
+      const long long angle = std::llround((inputData.startAngle + i * static_cast<double>(inputData.incrementAngle)) * 1E6);
+      const long long key = ((angle % HALF_TURN) + HALF_TURN) % HALF_TURN;
+      const auto group = groups.insert({key, i});
+      partners_[group.first->second].push_back(i);
+    }
+  }
+
+  /**
+   * @return angle indices in the order they are computed
+   */
+  inline const std::vector<UINT> &getOrder() const {
+    return order_;
+  }
+
+  /**
+   * @param [in] angleID angle index
+   * @return true if the projection of the angle has to be computed
+   */
+  inline bool isRepresentative(const UINT angleID) const {
+    return not(partners_[angleID].empty());
+  }
+
+  /**
+   * @param [in] angleID angle index of the first angle of a group
+   * @return angles sharing the projection of the angle, including itself
+   */
+  inline const std::vector<UINT> &getPartners(const UINT angleID) const {
+    return partners_[angleID];
+  }
+
+  /**
+   * @brief restarts the refinement for the next (energy, k)
+   */
+  inline void reset() {
+    level_ = 0;
+  }
+
+  /**
+   * @param [in] numComputed number of angles computed
+   * @return true if the convergence has to be checked after numComputed angles
+   */
+  inline bool isLevelEnd(const UINT numComputed) const {
+    return adaptive_ and (level_ < levelEnd_.size()) and (numComputed == levelEnd_[level_]);
+  }
+
+  /**
+   * @brief buffer the average at the end of a level is copied into
+   * @param [in] size number of pixels compared
+   * @return buffer
+   */
+  inline Real *getBuffer(const std::size_t size) {
+    current_.resize(size);
+    return current_.data();
+  }
+
+  /**
+   * @brief compares the average in getBuffer() with the one of the previous level. Pixels that are NaN in
+   * either average are ignored.
+   * @return true if the relative change is below the tolerance
+   */
+  bool isConverged() {
+    const bool isFirst = (level_ == 0);
+    level_++;
+    std::swap(current_, previous_);
+    if (isFirst or (current_.size() != previous_.size())) {
+      return false;
+    }
+    double change = 0, value = 0;
+    for (std::size_t i = 0; i < previous_.size(); i++) {
+      if (std::isnan(previous_[i]) or std::isnan(current_[i])) {
+        continue;
+      }
+      const double diff = std::fabs(static_cast<double>(previous_[i]) - current_[i]);
+      const double magnitude = std::fabs(static_cast<double>(previous_[i]));
+      if (norm_ == ConvergenceNorm::Type::LINF) {
+        change = std::max(change, diff);
+        value = std::max(value, magnitude);
+      } else {
+        change += diff * diff;
+        value += magnitude * magnitude;
+      }
+    }
+    if (norm_ == ConvergenceNorm::Type::LINF) {
+      return (change <= tolerance_ * value);
+    }
+    return (change <= tolerance_ * tolerance_ * value);
+  }
+};
+
+#endif //CY_RSOXS_ANGLEREFINEMENT_H
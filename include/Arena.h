@@ -0,0 +1,211 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_ARENA_H
+#define CY_RSOXS_ARENA_H
+
+#include <cudaHeaders.h>
+#include <Datatypes.h>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+/**
+ * @brief Memory an arena lives in
+ */
+namespace MemorySpace {
+enum Type : UINT {
+  /// cudaMalloc
+  DEVICE = 0,
+  /// cudaMallocHost
+  PINNED = 1,
+  /// regular host memory
+  HOST = 2
+};
+}
+
+/**
+ * @brief Stack allocator over a single block. The block is allocated once, sized for the largest stage, and the
+ * buffers of a stage are handed out one after the other. A stage takes a mark() before its allocations and
+ * reset() to it once its buffers are dead, so the buffers of the next stage alias the same memory. Nothing is
+ * freed until release().
+ */
+class Arena {
+  /// Alignment of every buffer (in bytes). Matches cudaMalloc.
+  static constexpr std::size_t ALIGNMENT = 256;
+
+  MemorySpace::Type space_;
+  char *base_ = nullptr;
+  std::size_t capacity_ = 0;
+  std::size_t offset_ = 0;
+
+public:
+  /**
+   * @brief Constructor. Nothing is allocated until reserve().
+   * @param [in] space memory the block lives in
+   */
+  explicit Arena(const MemorySpace::Type space)
+    : space_(space) {
+  }
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  Arena(Arena &&other) noexcept
+    : space_(other.space_), base_(other.base_), capacity_(other.capacity_), offset_(other.offset_) {
+    other.base_ = nullptr;
+    other.capacity_ = other.offset_ = 0;
+  }
+
+  /**
+   * @brief Destructor. Frees the block.
+   */
+  ~Arena() {
+    release();
+  }
+
+  /**
+   * @brief Bytes a buffer takes in the arena, including the alignment
+   * @tparam T type of the buffer
+   * @param [in] count number of elements
+   * @return bytes
+   */
+  template<typename T>
+  static inline std::size_t getBytes(const std::size_t count) {
+    return ((sizeof(T) * count + ALIGNMENT - 1) / ALIGNMENT) * ALIGNMENT;
+  }
+
+  /**
+   * @brief Makes sure the block holds at least the given number of bytes. The block is only (re-)allocated
+   * if it is smaller. No buffer may be handed out at that time.
+   * @param [in] bytes bytes of the largest stage
+   * @throws std::runtime_error if the block has to grow while buffers are in use
+   */
+  void reserve(const std::size_t bytes) {
+    if (bytes <= capacity_) {
+      return;
+    }
+    if (offset_ != 0) {
+      throw std::runtime_error("[Arena] Cannot grow an arena with buffers in use");
+    }
+    release();
+    if (space_ == MemorySpace::DEVICE) {
+      mallocGPU(base_, bytes);
+    } else if (space_ == MemorySpace::PINNED) {
+      mallocCPUPinned(base_, bytes);
+    } else {
+      mallocCPU(base_, bytes);
+    }
+    capacity_ = bytes;
+  }
+
+  /**
+   * @brief Hands out the next buffer of the current stage
+   * @tparam T type of the buffer
+   * @param [in] count number of elements
+   * @return buffer, valid until the arena is reset to a mark taken before this call
+   * @throws std::runtime_error if the block is too small
+   */
+  template<typename T>
+  T *allocate(const std::size_t count) {
+    const std::size_t bytes = getBytes<T>(count);
+    if (offset_ + bytes > capacity_) {
+      throw std::runtime_error("[Arena] Out of memory: " + std::to_string(offset_ + bytes) + " bytes requested, "
+                               + std::to_string(capacity_) + " reserved");
+    }
+    T *buffer = reinterpret_cast<T *>(base_ + offset_);
+    offset_ += bytes;
+    return buffer;
+  }
+
+  /**
+   * @return position to reset() to once the buffers handed out after this call are dead
+   */
+  inline std::size_t mark() const {
+    return offset_;
+  }
+
+  /**
+   * @brief Returns the buffers handed out after the mark. Their memory is reused by the next allocations.
+   * @param [in] mark position returned by mark()
+   */
+  inline void reset(const std::size_t mark = 0) {
+    offset_ = mark;
+  }
+
+  /**
+   * @return bytes reserved
+   */
+  inline std::size_t capacity() const {
+    return capacity_;
+  }
+
+  /**
+   * @brief frees the block. The device arena must be released on its device.
+   */
+  void release() {
+    if (base_ != nullptr) {
+      if (space_ == MemorySpace::DEVICE) {
+        freeCudaMemory(base_);
+      } else if (space_ == MemorySpace::PINNED) {
+        cudaFreeHost(base_);
+      } else {
+        delete[] base_;
+      }
+    }
+    base_ = nullptr;
+    capacity_ = offset_ = 0;
+  }
+};
+
+/**
+ * @brief Takes a mark() of an arena and resets it to the mark when it goes out of scope, so that the buffers
+ * handed out in between are returned on every exit path, exceptions included.
+ */
+class ArenaScope {
+  Arena &arena_;
+  const std::size_t mark_;
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] arena arena whose buffers handed out from now on are returned at the end of the scope
+   */
+  explicit ArenaScope(Arena &arena)
+    : arena_(arena), mark_(arena.mark()) {
+  }
+
+  ArenaScope(const ArenaScope &) = delete;
+  ArenaScope &operator=(const ArenaScope &) = delete;
+
+  /**
+   * @brief Destructor. Resets the arena to the mark.
+   */
+  ~ArenaScope() {
+    arena_.reset(mark_);
+  }
+};
+
+#endif //CY_RSOXS_ARENA_H
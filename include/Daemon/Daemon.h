@@ -0,0 +1,286 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_DAEMON_H
+#define CY_RSOXS_DAEMON_H
+
+#include <Daemon/Protocol.h>
+#include <Simulation.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unistd.h>
+#include <sys/time.h>
+
+namespace Daemon {
+
+/// A job waiting in the queue
+struct Job {
+  /// Job ID
+  std::size_t id;
+  /// Higher priority runs first
+  int priority;
+  /// submission order. Jobs of equal priority run first come first serve.
+  std::size_t sequence;
+  /// connection to the client to which the status is streamed
+  int clientFD;
+  /// The simulation
+  SimulationJob simulation;
+};
+
+/// Ordering of the priority queue
+struct JobOrder {
+  bool operator()(const Job &a, const Job &b) const {
+    if (a.priority != b.priority) {
+      return a.priority < b.priority;
+    }
+    return a.sequence > b.sequence;
+  }
+};
+
+/**
+ * @brief Long running server which executes the jobs submitted over a Unix domain socket one at a time.
+ * GPU contexts, cuFFT plans, device buffers, rotation matrices and the last morphology stay warm
+ * between jobs.
+ */
+class Server {
+  /// path to the socket
+  const std::string socketPath_;
+  /// listening socket
+  int listenFD_ = -1;
+  /// Queued jobs
+  std::priority_queue<Job, std::vector<Job>, JobOrder> queue_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  /// true once a shutdown is requested
+  bool shutdown_ = false;
+  std::size_t numSubmitted_ = 0;
+  std::size_t numCompleted_ = 0;
+  std::size_t numFailed_ = 0;
+  /// ID of the running job. 0 if idle.
+  std::size_t runningID_ = 0;
+  /// Executes the jobs
+  SimulationDriver driver_;
+
+  /**
+   * @brief Executes the jobs in the order of priority.
+   */
+  void worker() {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [this] { return shutdown_ or not(queue_.empty()); });
+        if (shutdown_) {
+          break;
+        }
+        job = queue_.top();
+        queue_.pop();
+        runningID_ = job.id;
+      }
+      const std::string id = std::to_string(job.id);
+      writeLine(job.clientFD, joinFields({replyName[Reply::STARTED], id}));
+      std::cout << GRN << "[DAEMON] Starting job " << id << " : " << job.simulation.morphologyFile << NRM << "\n";
+
+      /// The input readers throw on malformed input, so that a bad job fails without taking down the daemon
+      const auto start = std::chrono::steady_clock::now();
+      bool success = false;
+      std::string reason = "Simulation failed";
+      try {
+        success = (driver_.run(job.simulation) == EXIT_SUCCESS);
+      } catch (const std::exception &e) {
+        reason = e.what();
+      } catch (const H5::Exception &e) {
+        reason = "[HDF5 Error] " + e.getDetailMsg();
+      }
+      if (not(success)) {
+        std::cout << RED << "[DAEMON] " << reason << NRM << "\n";
+      }
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      if (success) {
+        writeLine(job.clientFD, joinFields({replyName[Reply::DONE], id, std::to_string(elapsed.count())}));
+      } else {
+        writeLine(job.clientFD, joinFields({replyName[Reply::FAILED], id, reason}));
+      }
+      close(job.clientFD);
+      std::cout << GRN << "[DAEMON] Finished job " << id << (success ? " [OK]" : " [FAILED]") << NRM << "\n";
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      runningID_ = 0;
+      if (success) {
+        numCompleted_++;
+      } else {
+        numFailed_++;
+      }
+    }
+
+    /// Jobs still queued at shutdown are reported as failed
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (not(queue_.empty())) {
+      const Job &job = queue_.top();
+      writeLine(job.clientFD, joinFields({replyName[Reply::FAILED], std::to_string(job.id), "Daemon shutting down"}));
+      close(job.clientFD);
+      queue_.pop();
+    }
+  }
+
+  /**
+   * @brief Reads the request from the client and responds to it
+   * @param fd connection to the client
+   * @return false if the daemon must shut down
+   */
+  bool handleConnection(int fd) {
+    std::string line;
+    if (not(readLine(fd, line))) {
+      close(fd);
+      return true;
+    }
+    const std::vector<std::string> fields = splitFields(line);
+    if (fields[0] == commandName[Command::SUBMIT]) {
+      if (fields.size() != 5) {
+        writeLine(fd, joinFields({replyName[Reply::ERROR], "SUBMIT expects priority, config, morphology and outputDir"}));
+        close(fd);
+        return true;
+      }
+      Job job;
+      job.priority = std::atoi(fields[1].c_str());
+      job.clientFD = fd;
+      job.simulation.configFile = fields[2];
+      const std::size_t pos = fields[2].find_last_of('/');
+      job.simulation.materialDir = (pos == std::string::npos) ? "" : fields[2].substr(0, pos);
+      job.simulation.morphologyFile = fields[3];
+      job.simulation.outputDir = fields[4];
+      job.simulation.logFile = fields[4] + "/CyRSoXS.log";
+      /// A job that does not fit next to the other processes on the GPU fails instead of running out of memory
+      job.simulation.checkDeviceMemory = true;
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      job.id = ++numSubmitted_;
+      job.sequence = job.id;
+      queue_.push(job);
+      writeLine(fd, joinFields({replyName[Reply::QUEUED], std::to_string(job.id), std::to_string(queue_.size())}));
+      condition_.notify_one();
+      return true;
+    }
+    if (fields[0] == commandName[Command::STATUS]) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      writeLine(fd, joinFields({replyName[Reply::OK],
+                                "queued=" + std::to_string(queue_.size()),
+                                "running=" + std::to_string(runningID_),
+                                "completed=" + std::to_string(numCompleted_),
+                                "failed=" + std::to_string(numFailed_)}));
+      close(fd);
+      return true;
+    }
+    if (fields[0] == commandName[Command::SHUTDOWN]) {
+      writeLine(fd, replyName[Reply::OK]);
+      close(fd);
+      return false;
+    }
+    writeLine(fd, joinFields({replyName[Reply::ERROR], "Unknown command " + fields[0]}));
+    close(fd);
+    return true;
+  }
+
+public:
+  /**
+   * @brief Constructor
+   * @param socketPath path of the Unix domain socket
+   */
+  Server(const std::string &socketPath)
+    : socketPath_(socketPath) {
+  }
+
+  /**
+   * @brief Listens for requests until a SHUTDOWN is received.
+   * @return EXIT_SUCCESS on clean shutdown
+   */
+  int run() {
+    sockaddr_un address;
+    if (not(makeAddress(socketPath_, address))) {
+      std::cout << RED << "[DAEMON] Socket path too long : " << socketPath_ << NRM << "\n";
+      return EXIT_FAILURE;
+    }
+    listenFD_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath_.c_str());
+    if ((listenFD_ < 0) or (bind(listenFD_, (sockaddr *) &address, sizeof(address)) != 0)
+        or (listen(listenFD_, 64) != 0)) {
+      std::cout << RED << "[DAEMON] Could not listen on " << socketPath_ << " (" << strerror(errno) << ")" << NRM << "\n";
+      return EXIT_FAILURE;
+    }
+
+    /// Creates the CUDA contexts upfront, so that the first job does not pay for it
+    int numGPU;
+    cudaGetDeviceCount(&numGPU);
+    for (int i = 0; i < numGPU; i++) {
+      cudaSetDevice(i);
+      warmup();
+    }
+    printCopyrightInfo();
+    std::cout << GRN << "[DAEMON] Listening on " << socketPath_ << " with " << numGPU << " GPU(s)" << NRM << "\n";
+
+    std::thread workerThread(&Server::worker, this);
+    while (true) {
+      const int fd = accept(listenFD_, nullptr, nullptr);
+      if (fd < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      /// A client that never sends its request must not block the daemon
+      timeval timeout{5, 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      if (not(handleConnection(fd))) {
+        break;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutdown_ = true;
+    }
+    condition_.notify_one();
+    workerThread.join();
+    close(listenFD_);
+    unlink(socketPath_.c_str());
+    std::cout << GRN << "[DAEMON] Shut down" << NRM << "\n";
+    return EXIT_SUCCESS;
+  }
+};
+}
+
+/**
+ * @brief Runs CyRSoXS as daemon
+ * @param socketPath path of the Unix domain socket
+ * @return EXIT_SUCCESS on clean shutdown
+ */
+static int runDaemon(const std::string &socketPath) {
+  Daemon::Server server(socketPath);
+  return server.run();
+}
+
+#endif //CY_RSOXS_DAEMON_H
@@ -0,0 +1,175 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_DAEMON_PROTOCOL_H
+#define CY_RSOXS_DAEMON_PROTOCOL_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Line based protocol between the CyRSoXS daemon and its clients. Every message is one line,
+ * fields are separated by tabs so that paths may contain spaces.
+ *
+ * Requests:
+ *  SUBMIT   <priority> <config> <morphology> <outputDir>
+ *  STATUS
+ *  SHUTDOWN
+ *
+ * Replies for SUBMIT (connection is kept open until the job finishes):
+ *  QUEUED   <jobID> <position>
+ *  STARTED  <jobID>
+ *  DONE     <jobID> <seconds>
+ *  FAILED   <jobID> <reason>
+ */
+namespace Daemon {
+
+/// Commands accepted by the daemon
+enum Command : int {
+  /// Submit a job
+  SUBMIT = 0,
+  /// Query the queue
+  STATUS = 1,
+  /// Stop the daemon after the running job
+  SHUTDOWN = 2,
+  /// Maximum command
+  MAX_COMMAND = 3
+};
+static const char *commandName[]{"SUBMIT", "STATUS", "SHUTDOWN"};
+static_assert(sizeof(commandName) / sizeof(char *) == Command::MAX_COMMAND,
+              "sizes dont match");
+
+/// Replies sent by the daemon
+enum Reply : int {
+  QUEUED = 0,
+  STARTED = 1,
+  DONE = 2,
+  FAILED = 3,
+  OK = 4,
+  ERROR = 5,
+  MAX_REPLY = 6
+};
+static const char *replyName[]{"QUEUED", "STARTED", "DONE", "FAILED", "OK", "ERROR"};
+static_assert(sizeof(replyName) / sizeof(char *) == Reply::MAX_REPLY,
+              "sizes dont match");
+
+static constexpr char FIELD_SEPARATOR = '\t';
+
+/**
+ * @brief splits the line into fields
+ * @param line line without the trailing new line
+ * @return fields
+ */
+static std::vector<std::string> splitFields(const std::string &line) {
+  std::vector<std::string> fields;
+  std::size_t start = 0;
+  while (true) {
+    const std::size_t end = line.find(FIELD_SEPARATOR, start);
+    fields.push_back(line.substr(start, end - start));
+    if (end == std::string::npos) {
+      break;
+    }
+    start = end + 1;
+  }
+  return fields;
+}
+
+/**
+ * @brief joins the fields into one line
+ * @param fields fields
+ * @return line without the trailing new line
+ */
+static std::string joinFields(const std::vector<std::string> &fields) {
+  std::string line;
+  for (std::size_t i = 0; i < fields.size(); i++) {
+    if (i > 0) {
+      line += FIELD_SEPARATOR;
+    }
+    line += fields[i];
+  }
+  return line;
+}
+
+/**
+ * @brief reads one line from the socket
+ * @param [in] fd socket
+ * @param [out] line line without the trailing new line
+ * @return false if the connection was closed before a full line was read
+ */
+static bool readLine(int fd, std::string &line) {
+  line.clear();
+  char c;
+  while (true) {
+    const ssize_t n = recv(fd, &c, 1, 0);
+    if (n <= 0) {
+      return false;
+    }
+    if (c == '\n') {
+      return true;
+    }
+    line += c;
+  }
+}
+
+/**
+ * @brief writes one line to the socket
+ * @param fd socket
+ * @param line line without the trailing new line
+ * @return false if the peer is gone
+ */
+static bool writeLine(int fd, const std::string &line) {
+  const std::string message = line + "\n";
+  std::size_t sent = 0;
+  while (sent < message.size()) {
+    const ssize_t n = send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+/**
+ * @brief fills the address for the socket path
+ * @param [in] socketPath path of the Unix domain socket
+ * @param [out] address address
+ * @return false if the path is too long
+ */
+static bool makeAddress(const std::string &socketPath, sockaddr_un &address) {
+  std::memset(&address, 0, sizeof(sockaddr_un));
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+  return true;
+}
+}
+
+#endif //CY_RSOXS_DAEMON_PROTOCOL_H
@@ -180,5 +180,118 @@ enum MorphologyOrder:int{
 static const char *morphologyOrderName[]{"ZYX","XYZ"};
 static_assert(sizeof(morphologyOrderName)/sizeof(char*) == MorphologyOrder::MAX_ORDER,
               "sizes dont match");
+
+/// HDF5 output of the scattering pattern
+namespace Output {
+
+    /// Compression of the datasets
+    enum Compression : UINT {
+        /// Contiguous, uncompressed
+        NONE = 0,
+        /// Chunked with shuffle and deflate filter
+        DEFLATE = 1,
+        /// Maximum type of compression
+        MAX_COMPRESSION = 2
+    };
+    static const char *compressionName[]{"None","Deflate"};
+    static_assert(sizeof(compressionName)/sizeof(char*) == Compression::MAX_COMPRESSION,
+                  "sizes dont match");
+
+    /// Type the scattering pattern is stored as
+    enum Precision : UINT {
+        /// Same as Real
+        FULL = 0,
+        /// IEEE half precision
+        HALF = 1,
+        /// 16 bit unsigned integer with per dataset scale and offset
+        SCALED_UINT16 = 2,
+        /// Maximum type of precision
+        MAX_PRECISION = 3
+    };
+    static const char *precisionName[]{"Full","Float16","ScaledUInt16"};
+    static_assert(sizeof(precisionName)/sizeof(char*) == Precision::MAX_PRECISION,
+                  "sizes dont match");
+
+    /// Layout of the output files
+    enum Layout : UINT {
+        /// One file Energy_<E>.h5 per energy with K<i>/projection
+        PER_ENERGY = 0,
+        /// Single file SpectralCube.h5 with projection[energy][k][qy][qx]
+        SPECTRAL_CUBE = 1,
+        /// Maximum type of layout
+        MAX_LAYOUT = 2
+    };
+    static const char *layoutName[]{"PerEnergy","SpectralCube"};
+    static_assert(sizeof(layoutName)/sizeof(char*) == Layout::MAX_LAYOUT,
+                  "sizes dont match");
+}
+
+namespace ROI {
+
+    /// Shape of the q region of interest
+    enum Type : UINT {
+        /// Full frame
+        NONE = 0,
+        /// qMin <= |q| <= qMax
+        ANNULUS = 1,
+        /// qxMin <= qx <= qxMax and qyMin <= qy <= qyMax
+        BOX = 2,
+        /// Maximum type of region of interest
+        MAX_ROI_TYPE = 3
+    };
+    static const char *roiTypeName[]{"None","Annulus","Box"};
+    static_assert(sizeof(roiTypeName)/sizeof(char*) == Type::MAX_ROI_TYPE,
+                  "sizes dont match");
+}
+
+namespace FourierCacheMode {
+
+    /// Use of the on-disk cache of the Fourier transformed Nt
+    enum Type : UINT {
+        /// No cache
+        NONE = 0,
+        /// Computes Nt and writes it to the cache
+        WRITE = 1,
+        /// Reads Nt from the cache. Energies missing in the cache are computed and written.
+        REPROJECT = 2,
+        /// Maximum type of cache mode
+        MAX_FOURIER_CACHE_MODE = 3
+    };
+    static const char *fourierCacheModeName[]{"None","Write","Reproject"};
+    static_assert(sizeof(fourierCacheModeName)/sizeof(char*) == Type::MAX_FOURIER_CACHE_MODE,
+                  "sizes dont match");
+}
+
+namespace ConvergenceNorm {
+
+    /// Norm measuring the change of the averaged projection
+    enum Type : UINT {
+        /// ||a - b||_2 / ||a||_2
+        L2 = 0,
+        /// max |a - b| / max |a|
+        LINF = 1,
+        /// Maximum type of norm
+        MAX_CONVERGENCE_NORM = 2
+    };
+    static const char *convergenceNormName[]{"L2","LInf"};
+    static_assert(sizeof(convergenceNormName)/sizeof(char*) == Type::MAX_CONVERGENCE_NORM,
+                  "sizes dont match");
+}
+
+namespace EwaldEngine {
+
+    /// Evaluation of the scattered field on the Ewald sphere
+    enum Type : UINT {
+        /// FFT on the voxel grid followed by the Ewald projection and the image rotations
+        UNIFORM = 0,
+        /// Non-uniform FFT evaluated directly at the q of every detector pixel
+        NUFFT = 1,
+        /// Maximum type of engine
+        MAX_EWALD_ENGINE = 2
+    };
+    static const char *ewaldEngineName[]{"Uniform","NUFFT"};
+    static_assert(sizeof(ewaldEngineName)/sizeof(char*) == Type::MAX_EWALD_ENGINE,
+                  "sizes dont match");
+}
 #endif
 
@@ -0,0 +1,222 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_FRAMEROI_H
+#define CY_RSOXS_FRAMEROI_H
+
+#include <Datatypes.h>
+#include <Input/InputData.h>
+#include <Rotation.h>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * @brief Rectangle of pixels of a scattering pattern, restricted to qMin <= |q| <= qMax.
+ * Only the pixels inside are evaluated by the Ewald projection.
+ */
+struct FrameROI {
+  /// First pixel in x and y
+  UINT x0 = 0;
+  UINT y0 = 0;
+  /// Number of pixels in x and y
+  UINT nx = 0;
+  UINT ny = 0;
+  /// Radial range (in nm^-1)
+  Real qMin = 0;
+  Real qMax = std::numeric_limits<Real>::infinity();
+};
+
+/**
+ * @brief q of a pixel along one dimension. Same grid as the Ewald projection: [-pi/physSize, pi/physSize]
+ * @param [in] id pixel index
+ * @param [in] n number of pixels
+ * @param [in] physSize physical size (in nm)
+ * @return q (in nm^-1)
+ */
+__host__ __device__ static inline Real getPixelQ(const UINT id, const UINT n, const Real physSize) {
+  const double dq = (n > 1) ? (2 * M_PI / physSize) / (n - 1) : 0;
+  return static_cast<Real>(-M_PI / physSize + id * dq);
+}
+
+/**
+ * @brief pixels of one dimension with qLow <= q <= qHigh
+ * @param [in] qLow lower bound
+ * @param [in] qHigh upper bound
+ * @param [in] n number of pixels
+ * @param [in] physSize physical size (in nm)
+ * @param [out] start first pixel
+ * @param [out] count number of pixels
+ */
+static inline void getPixelRange(const double qLow, const double qHigh, const UINT n, const Real physSize,
+                                 UINT &start, UINT &count) {
+  const double q0 = -M_PI / physSize;
+  const double dq = (n > 1) ? (2 * M_PI / physSize) / (n - 1) : 1;
+  const double first = std::max(std::ceil((qLow - q0) / dq - 1E-6), 0.0);
+  const double last = std::min(std::floor((qHigh - q0) / dq + 1E-6), n - 1.0);
+  start = static_cast<UINT>(first);
+  count = (last >= first) ? static_cast<UINT>(last - first) + 1 : 0;
+}
+
+/**
+ * @param [in] inputData input data
+ * @param [in] qx qx (in nm^-1)
+ * @param [in] qy qy (in nm^-1)
+ * @return true if q is inside the region of interest
+ */
+static inline bool isInsideROI(const InputData &inputData, const Real qx, const Real qy) {
+  if (inputData.roiType == ROI::Type::ANNULUS) {
+    const Real q = std::sqrt(qx * qx + qy * qy);
+    return (q >= inputData.roiQRange[0]) and (q <= inputData.roiQRange[1]);
+  }
+  if (inputData.roiType == ROI::Type::BOX) {
+    return (qx >= inputData.roiQBox[0]) and (qx <= inputData.roiQBox[1]) and (qy >= inputData.roiQBox[2])
+           and (qy <= inputData.roiQBox[3]);
+  }
+  return true;
+}
+
+/**
+ * @brief Region of the pattern that is written. The full frame without region of interest, otherwise the bounding
+ * box of the region of interest.
+ * @param [in] inputData input data
+ * @return region of the output frames
+ * @throws std::runtime_error if the region of interest does not contain any pixel
+ */
+static FrameROI getOutputROI(const InputData &inputData) {
+  FrameROI roi;
+  const UINT *voxel = inputData.voxelDims;
+  const Real physSize = inputData.physSize;
+  if (inputData.roiType == ROI::Type::NONE) {
+    roi.nx = voxel[0];
+    roi.ny = voxel[1];
+    return roi;
+  }
+  if (inputData.roiType == ROI::Type::ANNULUS) {
+    roi.qMin = inputData.roiQRange[0];
+    roi.qMax = inputData.roiQRange[1];
+    getPixelRange(-roi.qMax, roi.qMax, voxel[0], physSize, roi.x0, roi.nx);
+    getPixelRange(-roi.qMax, roi.qMax, voxel[1], physSize, roi.y0, roi.ny);
+  } else {
+    const Real *box = inputData.roiQBox;
+    /// Closest and farthest point of the box from the origin
+    const Real dx = std::max(std::max(box[0], -box[1]), static_cast<Real>(0));
+    const Real dy = std::max(std::max(box[2], -box[3]), static_cast<Real>(0));
+    const Real fx = std::max(std::fabs(box[0]), std::fabs(box[1]));
+    const Real fy = std::max(std::fabs(box[2]), std::fabs(box[3]));
+    roi.qMin = std::sqrt(dx * dx + dy * dy);
+    roi.qMax = std::sqrt(fx * fx + fy * fy);
+    getPixelRange(box[0], box[1], voxel[0], physSize, roi.x0, roi.nx);
+    getPixelRange(box[2], box[3], voxel[1], physSize, roi.y0, roi.ny);
+  }
+  if ((roi.nx == 0) or (roi.ny == 0)) {
+    throw std::runtime_error("[Input Error] The q region of interest does not contain any pixel");
+  }
+  return roi;
+}
+
+/**
+ * @brief Region that has to be evaluated so that a region is correct after a transformation that scales
+ * the distance to the center by sigmaMin ... sigmaMax, with bilinear interpolation
+ * @param [in] roi region needed after the transformation
+ * @param [in] inputData input data
+ * @param [in] sigmaMin minimum scaling
+ * @param [in] sigmaMax maximum scaling
+ * @param [in] margin number of pixels added for the interpolation
+ * @return region needed before the transformation
+ */
+static FrameROI getSourceROI(const FrameROI &roi, const InputData &inputData, const double sigmaMin,
+                             const double sigmaMax, const UINT margin = 2) {
+  const UINT *voxel = inputData.voxelDims;
+  const Real physSize = inputData.physSize;
+  if (inputData.roiType == ROI::Type::NONE) {
+    return getOutputROI(inputData);
+  }
+  const double dq = (2 * M_PI / physSize) / (std::max(std::min(voxel[0], voxel[1]), 2u) - 1);
+  FrameROI source;
+  source.qMin = static_cast<Real>(std::max(roi.qMin / sigmaMax - margin * dq, 0.0));
+  source.qMax = (sigmaMin > 0) ? static_cast<Real>(roi.qMax / sigmaMin + margin * dq)
+                               : std::numeric_limits<Real>::infinity();
+  getPixelRange(-source.qMax, source.qMax, voxel[0], physSize, source.x0, source.nx);
+  getPixelRange(-source.qMax, source.qMax, voxel[1], physSize, source.y0, source.ny);
+  return source;
+}
+
+/**
+ * @brief Region that has to be evaluated so that a region is correct after the affine map about the center
+ * with the linear part A. A point at |q| comes from |q| / sigma_max(A) ... |q| / sigma_min(A).
+ * @param [in] roi region needed after the map
+ * @param [in] inputData input data
+ * @param [in] A linear part of the map (only the upper 2 x 2 block is used)
+ * @param [in] margin number of pixels added for the interpolation
+ * @return region needed before the map
+ */
+static FrameROI getSourceROI(const FrameROI &roi, const InputData &inputData, const Matrix &A, const UINT margin = 2) {
+  const double a = A.getValue<0, 0>(), b = A.getValue<0, 1>(), c = A.getValue<1, 0>(), d = A.getValue<1, 1>();
+  const double S1 = a * a + b * b + c * c + d * d;
+  const double S2 = std::sqrt((a * a + b * b - c * c - d * d) * (a * a + b * b - c * c - d * d)
+                              + 4 * (a * c + b * d) * (a * c + b * d));
+  const double sigmaMax = std::sqrt((S1 + S2) / 2);
+  const double sigmaMin = std::sqrt(std::max((S1 - S2) / 2, 0.0));
+  return getSourceROI(roi, inputData, sigmaMin, sigmaMax, margin);
+}
+
+/**
+ * @param [in] inputData input data
+ * @param [in] roi region
+ * @param [in] dimID 0 for x, 1 for y
+ * @return q of the pixels of the region along the dimension (in nm^-1)
+ */
+static std::vector<Real> getROICoordinates(const InputData &inputData, const FrameROI &roi, const UINT dimID) {
+  const UINT start = (dimID == 0) ? roi.x0 : roi.y0;
+  std::vector<Real> q((dimID == 0) ? roi.nx : roi.ny);
+  for (UINT i = 0; i < q.size(); i++) {
+    q[i] = getPixelQ(start + i, inputData.voxelDims[dimID], inputData.physSize);
+  }
+  return q;
+}
+
+/**
+ * @brief sets the pixels of a region that are outside the region of interest to NaN
+ * @param [in] inputData input data
+ * @param [in] roi region the frame covers
+ * @param [in,out] frame frame of size roi.nx x roi.ny
+ */
+static void maskOutsideROI(const InputData &inputData, const FrameROI &roi, Real *frame) {
+  if (inputData.roiType == ROI::Type::NONE) {
+    return;
+  }
+  for (UINT Y = 0; Y < roi.ny; Y++) {
+    const Real qy = getPixelQ(roi.y0 + Y, inputData.voxelDims[1], inputData.physSize);
+    for (UINT X = 0; X < roi.nx; X++) {
+      const Real qx = getPixelQ(roi.x0 + X, inputData.voxelDims[0], inputData.physSize);
+      if (not(isInsideROI(inputData, qx, qy))) {
+        frame[static_cast<std::size_t>(Y) * roi.nx + X] = std::numeric_limits<Real>::quiet_NaN();
+      }
+    }
+  }
+}
+
+#endif //CY_RSOXS_FRAMEROI_H
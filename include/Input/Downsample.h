@@ -0,0 +1,188 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_DOWNSAMPLE_H
+#define CY_RSOXS_DOWNSAMPLE_H
+
+#include <Datatypes.h>
+#include <Input/Input.h>
+#include <algorithm>
+#include <cmath>
+
+/**
+ * @brief Eigen decomposition of a symmetric 3x3 matrix by cyclic Jacobi rotations.
+ * @param [in,out] A symmetric matrix. Diagonal on return.
+ * @param [out] V eigenvectors as columns
+ */
+static void symmetricEigen3(double A[3][3], double V[3][3]) {
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      V[i][j] = (i == j) ? 1.0 : 0.0;
+    }
+  }
+  static constexpr int pairs[3][2]{{0, 1}, {0, 2}, {1, 2}};
+  for (int sweep = 0; sweep < 50; sweep++) {
+    const double offDiagonal = A[0][1] * A[0][1] + A[0][2] * A[0][2] + A[1][2] * A[1][2];
+    const double diagonal = A[0][0] * A[0][0] + A[1][1] * A[1][1] + A[2][2] * A[2][2];
+    if (offDiagonal <= 1E-30 * diagonal) {
+      return;
+    }
+    for (const auto &pair: pairs) {
+      const int p = pair[0], q = pair[1];
+      if (A[p][q] == 0) {
+        continue;
+      }
+      const double theta = (A[q][q] - A[p][p]) / (2 * A[p][q]);
+      const double t = std::copysign(1.0, theta) / (std::fabs(theta) + std::sqrt(theta * theta + 1));
+      const double c = 1 / std::sqrt(t * t + 1);
+      const double s = t * c;
+      for (int k = 0; k < 3; k++) {
+        const double akp = A[k][p], akq = A[k][q];
+        A[k][p] = c * akp - s * akq;
+        A[k][q] = s * akp + c * akq;
+      }
+      for (int k = 0; k < 3; k++) {
+        const double apk = A[p][k], aqk = A[q][k];
+        A[p][k] = c * apk - s * aqk;
+        A[q][k] = s * apk + c * aqk;
+      }
+      for (int k = 0; k < 3; k++) {
+        const double vkp = V[k][p], vkq = V[k][q];
+        V[k][p] = c * vkp - s * vkq;
+        V[k][q] = s * vkp + c * vkq;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Dimensions of the morphology block averaged by factor. Z is not reduced for 2D morphologies.
+ * @param [in] dims dimensions [X Y Z]
+ * @param [in] factor block size
+ * @param [out] coarseDims dimensions after averaging
+ * @return false if the dimensions are not divisible by factor
+ */
+static bool getDownsampledDimensions(const UINT *dims, const UINT factor, UINT *coarseDims) {
+  for (int d = 0; d < 3; d++) {
+    const UINT f = ((d == 2) and (dims[2] == 1)) ? 1 : factor;
+    if (dims[d] % f != 0) {
+      return false;
+    }
+    coarseDims[d] = dims[d] / f;
+  }
+  return true;
+}
+
+/**
+ * @brief Block averages the morphology by factor along every axis (X and Y only for 2D morphologies).
+ * Nt depends on the aligned part of a material through the tensor phi_a s s^T and on the unaligned fraction,
+ * so these are averaged over each block. The director of the coarse voxel is the principal axis of the
+ * averaged tensor and its aligned fraction is the uniaxial part, lambda_1 - (lambda_2 + lambda_3) / 2.
+ * The rest of the aligned fraction becomes unaligned, so the volume fraction of every material is conserved.
+ * @param [in] voxel morphology in ZYX order
+ * @param [in] dims dimensions [X Y Z] of voxel. Must be divisible by factor.
+ * @param [in] factor block size
+ * @param [in] numMaterial number of material
+ * @param [in] type morphology type
+ * @param [out] coarseVoxel averaged morphology in ZYX order
+ */
+static void downsampleMorphology(const Voxel *voxel, const UINT *dims, const UINT factor, const int numMaterial,
+                                 const MorphologyType type, Voxel *coarseVoxel) {
+  UINT coarseDims[3];
+  getDownsampledDimensions(dims, factor, coarseDims);
+  const UINT blockZ = dims[2] / coarseDims[2];
+  const BigUINT numVoxels = static_cast<BigUINT>(dims[0]) * dims[1] * dims[2];
+  const BigUINT numCoarseVoxels = static_cast<BigUINT>(coarseDims[0]) * coarseDims[1] * coarseDims[2];
+  const double blockSize = static_cast<double>(factor) * factor * blockZ;
+#pragma omp parallel for collapse(2)
+  for (int numMat = 0; numMat < numMaterial; numMat++) {
+    for (BigUINT id = 0; id < numCoarseVoxels; id++) {
+      const UINT X = id % coarseDims[0];
+      const UINT Y = (id / coarseDims[0]) % coarseDims[1];
+      const UINT Z = id / (static_cast<BigUINT>(coarseDims[0]) * coarseDims[1]);
+      double Q[3][3]{}, phiUnaligned = 0;
+      for (UINT k = Z * blockZ; k < (Z + 1) * blockZ; k++) {
+        for (UINT j = Y * factor; j < (Y + 1) * factor; j++) {
+          for (UINT i = X * factor; i < (X + 1) * factor; i++) {
+            const Voxel &v = voxel[numMat * numVoxels + (static_cast<BigUINT>(k) * dims[1] + j) * dims[0] + i];
+            double s[3], phiAligned;
+            if (type == MorphologyType::EULER_ANGLES) {
+              const double theta = v.s1.y, psi = v.s1.z;
+              s[0] = std::cos(psi) * std::sin(theta);
+              s[1] = std::sin(psi) * std::sin(theta);
+              s[2] = std::cos(theta);
+              phiAligned = v.s1.w * v.s1.x;
+              phiUnaligned += v.s1.w - phiAligned;
+            } else {
+              /// |s|^2 is the aligned fraction
+              s[0] = v.s1.x; s[1] = v.s1.y; s[2] = v.s1.z;
+              phiAligned = 1;
+              phiUnaligned += v.s1.w;
+            }
+            for (int a = 0; a < 3; a++) {
+              for (int b = 0; b < 3; b++) {
+                Q[a][b] += phiAligned * s[a] * s[b];
+              }
+            }
+          }
+        }
+      }
+      phiUnaligned /= blockSize;
+      for (auto &row: Q) {
+        for (double &val: row) {
+          val /= blockSize;
+        }
+      }
+      const double trace = Q[0][0] + Q[1][1] + Q[2][2];
+      double V[3][3];
+      symmetricEigen3(Q, V);
+      int principal = 0;
+      for (int a = 1; a < 3; a++) {
+        if (Q[a][a] > Q[principal][principal]) {
+          principal = a;
+        }
+      }
+      const double director[3]{V[0][principal], V[1][principal], V[2][principal]};
+      const double phiAligned = std::max(0.0, std::min(trace, 1.5 * Q[principal][principal] - 0.5 * trace));
+      phiUnaligned += trace - phiAligned;
+
+      Real4 &s1 = coarseVoxel[numMat * numCoarseVoxels + id].s1;
+      if (type == MorphologyType::EULER_ANGLES) {
+        const double vFrac = phiAligned + phiUnaligned;
+        s1.x = (vFrac > 0) ? static_cast<Real>(phiAligned / vFrac) : 0;
+        s1.y = static_cast<Real>(std::acos(std::max(-1.0, std::min(1.0, director[2]))));
+        s1.z = static_cast<Real>(std::atan2(director[1], director[0]));
+        s1.w = static_cast<Real>(vFrac);
+      } else {
+        const double magnitude = std::sqrt(phiAligned);
+        s1.x = static_cast<Real>(magnitude * director[0]);
+        s1.y = static_cast<Real>(magnitude * director[1]);
+        s1.z = static_cast<Real>(magnitude * director[2]);
+        s1.w = static_cast<Real>(phiUnaligned);
+      }
+    }
+  }
+}
+
+#endif //CY_RSOXS_DOWNSAMPLE_H
@@ -25,6 +25,7 @@
 #ifndef PRS_READCONFIG_H
 #define PRS_READCONFIG_H
 #include <string>
+#include <stdexcept>
 #ifndef PYBIND
 #include <libconfig.h++>
 #include <array>
@@ -32,6 +33,7 @@
 #include <iostream>
 #include <Input/Input.h>
 #include <vector>
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <Rotation.h>
@@ -77,8 +79,7 @@ private:
   void ReadValueRequired(libconfig::Config & config, const std::string key, T & value ){
     bool res = config.lookupValue(key, value);
     if(res == false){
-      std::cerr << "[Input Error] No value corresponding to " << key  << " found. Exiting\n";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[Input Error] No value corresponding to " + key + " found");
     }
   }
   template<typename T,int size>
@@ -120,8 +121,7 @@ private:
    * vector is lost. Resizing will only happen if the input file has an array
    * of proper length associated with the given key.
    *
-   * If the key is not found, an error will be printed and the program will
-   * exit with failure.
+   * If the key is not found, a std::runtime_error is thrown.
    *
    * @param config libconfig object for file
    * @param key the name of the configuration value to retrieve
@@ -132,22 +132,18 @@ private:
                            std::vector<T>& arr, const UINT size = 0) {
         // this is here because lookup throws an exception if not found
         if (!config.exists(key)) {
-            std::cerr << "[Input Error] No value corresponding to " << key
-                      << " found. Exiting\n";
-            exit(EXIT_FAILURE);
+            throw std::runtime_error("[Input Error] No value corresponding to " + key + " found");
         }
 
         libconfig::Setting &setting = config.lookup(key);
         if (!setting.isArray()) {  // confirm this is an array
-            std::cerr << "expected array input but found single value "
-                      << "(key = " << key << ")\n";
-            exit(EXIT_FAILURE);
+            throw std::runtime_error("[Input Error] Expected array input but found single value (key = " + key + ")");
         }
         if(size > 0){
             if(setting.getLength() != size){
-                std::cout << RED << "[Input Error]: The array corresponding to " << key << " must be of length " << size
-                << ". But found of length " << setting.getLength() << NRM <<"\n";
-                exit(EXIT_FAILURE);
+                throw std::runtime_error("[Input Error] The array corresponding to " + key + " must be of length "
+                                         + std::to_string(size) + ". But found of length "
+                                         + std::to_string(setting.getLength()));
             }
         }
         arr.clear();
@@ -168,8 +164,8 @@ private:
   template<typename T>
   void validate(const std::string & name, const T & val, const UINT & max) const{
     if(val >= max){
-        std::cout << RED << "[Error] : " << name << "Wrong value. Max acceptable value " <<  max-1 << ". Value found =  " << val << NRM <<"\n";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[Input Error] " + name + ": Wrong value. Max acceptable value "
+                                 + std::to_string(max - 1) + ". Value found = " + std::to_string(val));
     }
   }
 
@@ -229,6 +225,90 @@ private:
 
   bool dumpMorphology = false;
 
+  /// Number of threads writing the output. Every HDF5 call, including the filters and the compression, holds the
+  /// HDF5 mutex, so more threads only overlap the work done outside the HDF5 library.
+  UINT numWriterThreads = 1;
+  /// Compression of the output
+  UINT outputCompression = Output::Compression::NONE;
+  /// Deflate level of the output (1-9)
+  int compressionLevel = 4;
+  /// Type the output is stored as
+  UINT outputPrecision = Output::Precision::FULL;
+  /// Layout of the output files
+  UINT outputLayout = Output::Layout::PER_ENERGY;
+  /// Write the spectral cube in single writer / multiple reader mode
+  bool outputSWMR = false;
+  /// Write the scattering patterns
+  bool writeFrames = true;
+  /// Write I(q), I(q, chi) and the anisotropy ratio of every scattering pattern
+  bool azimuthalIntegration = false;
+  /// Number of q bins of the azimuthal integration. 0 for min(X, Y) / 2
+  UINT numQBins = 0;
+  /// Number of chi sectors of the azimuthal integration
+  UINT numChiSectors = 4;
+  /// Resample the scattering patterns onto a detector
+  bool detectorRemesh = false;
+  /// Number of detector pixels in x and y
+  UINT detectorPixels[2]{0,0};
+  /// Detector pixel size (in mm)
+  Real detectorPixelSize = 0;
+  /// Sample to detector distance (in mm)
+  Real detectorDistance = 0;
+  /// Beam center on the detector (in pixels)
+  Real detectorBeamCenter[2]{0,0};
+  /// Number of detector pixels binned together along x and y
+  UINT detectorBinning = 1;
+  /// Shape of the q region of interest
+  UINT roiType = ROI::Type::NONE;
+  /// [qMin, qMax] of the annulus (in nm^-1)
+  Real roiQRange[2]{0,0};
+  /// [qxMin, qxMax, qyMin, qyMax] of the box (in nm^-1)
+  Real roiQBox[4]{0,0,0,0};
+  /// Use of the on-disk cache of the Fourier transformed Nt
+  UINT fourierCacheMode = FourierCacheMode::Type::NONE;
+  /// Directory of the Fourier cache
+  std::string fourierCacheDir = "FourierCache";
+  /// Directory of the result cache. Empty for no cache.
+  std::string resultCacheDir;
+  /// Size limit of the result cache (in MB)
+  UINT resultCacheSizeMB = 4096;
+  /// Compute the projection once for E angles that differ by 180 degrees
+  bool eAngleFolding = true;
+  /// Refine the E angles by bisection until the averaged projection converges
+  bool eAngleAdaptive = false;
+  /// Relative change of the averaged projection below which the refinement stops
+  Real eAngleTolerance = 1E-3;
+  /// Norm measuring the change of the averaged projection
+  UINT eAngleNorm = ConvergenceNorm::Type::L2;
+  /// Minimum number of E angles of the coarsest level
+  UINT eAngleInitialCount = 4;
+
+  /// File with the detector q points of a sparse evaluation. Empty to compute full frames.
+  std::string qPointsFile;
+  /// Evaluate the Fourier transform at the q points on the host instead of the device
+  bool qPointsOnHost = false;
+  /// Evaluation of the scattered field on the Ewald sphere
+  UINT ewaldEngine = EwaldEngine::Type::UNIFORM;
+  /// Relative accuracy of the non-uniform FFT
+  Real nufftTolerance = 1E-4;
+  /// Oversampling of the grid of the non-uniform FFT
+  Real nufftUpsampling = 2.0;
+  /// Block size of the morphology averaging of a preview run. 1 for full resolution.
+  UINT previewFactor = 1;
+  /// Energies computed again at full resolution after the preview. Empty for all energies.
+  std::vector<Real> previewRefineEnergies;
+  /// [qMin, qMax] (in nm^-1) computed again at full resolution after the preview. Empty for the whole q range.
+  std::vector<Real> previewRefineQRange;
+
+  /// Relative standard error of the ensemble mean below which an ensemble run stops. 0 to run all realizations.
+  Real ensembleTolerance = 0;
+  /// Minimum number of realizations before an ensemble run can stop
+  UINT ensembleMinRealizations = 2;
+  /// Select the fastest Algorithm and MaxStreams that fit in the device memory budget
+  bool autoPlan = false;
+  /// Device memory budget of the planner (in MB). 0 for the free memory of the GPU.
+  UINT deviceMemoryBudgetMB = 0;
+
   int NUM_MATERIAL;
 
   /**
@@ -238,6 +318,12 @@ private:
   inline bool if2DComputation() const {
      return enable2D_;
   }
+  /**
+   * @return true if a part of the preview is computed again at full resolution
+   */
+  inline bool isPreviewRefined() const {
+    return (previewFactor > 1) and (not(previewRefineEnergies.empty()) or not(previewRefineQRange.empty()));
+  }
   inline void check2D() {
     if (voxelDims[2] != 1) {
       enable2D_ = false;
@@ -254,6 +340,7 @@ private:
   /**
    * Constructor to read input data
    * @param filename filename, default is config.txt
+   * @throws std::runtime_error if the file can not be read or a required value is missing
    */
   InputData(std::string filename = "config.txt") {
     libconfig::Config cfg;
@@ -261,12 +348,10 @@ private:
       cfg.readFile(filename.c_str());
     }
     catch (libconfig::FileIOException & e) {
-      std::cerr << " Cannot read " << filename << "\n";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[Input Error] Cannot read " + filename);
     }catch (libconfig::ParseException &e) {
-      std::cerr << "Parse error at " << e.getFile() << ":" << e.getLine()
-                << " - " << e.getError() <<"\n";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[Input Error] Parse error at " + std::string(e.getFile()) + ":"
+                               + std::to_string(e.getLine()) + " - " + e.getError());
     }
     ReadValueRequired(cfg, "CaseType",caseType);
     ReadArrayRequired(cfg, "Energies", energies);
@@ -298,6 +383,61 @@ private:
     if(ReadValue(cfg,"ScatterApproach",scatterApproach)){}
     if(ReadValue(cfg,"DumpMorphology",dumpMorphology)){}
     if(ReadValue(cfg,"MaxStreams",numMaxStreams)){}
+    if(ReadValue(cfg,"NumWriterThreads",numWriterThreads)){}
+    if(ReadValue(cfg,"OutputCompression",outputCompression)){}
+    if(ReadValue(cfg,"CompressionLevel",compressionLevel)){}
+    if(ReadValue(cfg,"OutputPrecision",outputPrecision)){}
+    if(ReadValue(cfg,"OutputLayout",outputLayout)){}
+    if(ReadValue(cfg,"OutputSWMR",outputSWMR)){}
+    if(ReadValue(cfg,"WriteFrames",writeFrames)){}
+    if(ReadValue(cfg,"AzimuthalIntegration",azimuthalIntegration)){}
+    if(ReadValue(cfg,"NumQBins",numQBins)){}
+    if(ReadValue(cfg,"NumChiSectors",numChiSectors)){}
+    if(ReadValue(cfg,"DetectorRemesh",detectorRemesh) and detectorRemesh){
+      std::vector<UINT> pixels;
+      ReadArrayRequired(cfg, "DetectorPixels", pixels,2);
+      detectorPixels[0] = pixels[0]; detectorPixels[1] = pixels[1];
+      ReadValueRequired(cfg, "DetectorPixelSize", detectorPixelSize);
+      ReadValueRequired(cfg, "DetectorDistance", detectorDistance);
+      ReadArrayRequired(cfg, "DetectorBeamCenter", _temp,2);
+      detectorBeamCenter[0] = _temp[0]; detectorBeamCenter[1] = _temp[1];
+      if(ReadValue(cfg,"DetectorBinning",detectorBinning)){}
+    }
+    if(ReadValue(cfg,"ROIType",roiType)){
+      if(roiType == ROI::Type::ANNULUS){
+        ReadArrayRequired(cfg, "ROIQRange", _temp,2);
+        std::copy(_temp.begin(), _temp.end(), roiQRange);
+      }
+      else if(roiType == ROI::Type::BOX){
+        ReadArrayRequired(cfg, "ROIQBox", _temp,4);
+        std::copy(_temp.begin(), _temp.end(), roiQBox);
+      }
+    }
+    if(ReadValue(cfg,"FourierCacheMode",fourierCacheMode)){}
+    if(ReadValue(cfg,"FourierCacheDir",fourierCacheDir)){}
+    if(ReadValue(cfg,"ResultCacheDir",resultCacheDir)){}
+    if(ReadValue(cfg,"ResultCacheSizeMB",resultCacheSizeMB)){}
+    if(ReadValue(cfg,"EAngleFolding",eAngleFolding)){}
+    if(ReadValue(cfg,"EAngleAdaptive",eAngleAdaptive)){}
+    if(ReadValue(cfg,"EAngleTolerance",eAngleTolerance)){}
+    if(ReadValue(cfg,"EAngleNorm",eAngleNorm)){}
+    if(ReadValue(cfg,"EAngleInitialCount",eAngleInitialCount)){}
+    if(ReadValue(cfg,"QPointsFile",qPointsFile)){}
+    if(ReadValue(cfg,"QPointsOnHost",qPointsOnHost)){}
+    if(ReadValue(cfg,"EwaldEngine",ewaldEngine)){}
+    if(ReadValue(cfg,"NUFFTTolerance",nufftTolerance)){}
+    if(ReadValue(cfg,"NUFFTUpsampling",nufftUpsampling)){}
+    if(ReadValue(cfg,"PreviewFactor",previewFactor)){}
+    if(cfg.exists("PreviewRefineEnergies")){
+      ReadArrayRequired(cfg, "PreviewRefineEnergies", previewRefineEnergies);
+    }
+    if(cfg.exists("PreviewRefineQRange")){
+      ReadArrayRequired(cfg, "PreviewRefineQRange", previewRefineQRange,2);
+    }
+    if(ReadValue(cfg,"EnsembleTolerance",ensembleTolerance)){}
+    if(ReadValue(cfg,"EnsembleMinRealizations",ensembleMinRealizations)){}
+    if(ReadValue(cfg,"AutoPlan",autoPlan)){}
+    if(ReadValue(cfg,"DeviceMemoryBudgetMB",deviceMemoryBudgetMB)){}
     UINT _temp1;
     if(ReadValue(cfg,"ReferenceFrame",_temp1)){
       validate("Reference Frame ",_temp1,2);
@@ -310,9 +450,7 @@ private:
     else {
       const std::string key = "listKVectors";
       if (!cfg.exists(key)) {
-        std::cerr << "[Input Error] No value corresponding to " << key
-                  << " found. Exiting\n";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[Input Error] No value corresponding to " + key + " found");
       }
       const libconfig::Setting & listOfKVectors = cfg.getRoot()[key];
       kVectors.resize(listOfKVectors.getLength());
@@ -335,22 +473,27 @@ private:
     }
   }
 
-  void readRefractiveIndexData(std::vector<Material> &refractiveIndex) const {
+  /**
+   * @brief reads the optical constants from Material1.txt ... MaterialN.txt
+   * @param [out] refractiveIndex optical constants for every energy and material
+   * @param [in] dirName directory containing the material files. Empty for current directory.
+   * @throws std::runtime_error if a material file can not be read or misses an energy
+   */
+  void readRefractiveIndexData(std::vector<Material> &refractiveIndex, const std::string & dirName = "") const {
     libconfig::Config cfg;
     refractiveIndex.resize(energies.size()*NUM_MATERIAL);
     const UINT & numEnergy = energies.size();
+    const std::string prefix = dirName.empty() ? "" : dirName + "/";
     for (int numMaterial = 0; numMaterial < NUM_MATERIAL; numMaterial++) {
-      std::string fname = "Material" + std::to_string(numMaterial+1) + ".txt";
+      std::string fname = prefix + "Material" + std::to_string(numMaterial+1) + ".txt";
       try {
         cfg.readFile(fname.c_str());
       }
       catch (libconfig::FileIOException & e) {
-        std::cerr << " Cannot read " << fname << "\n";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[Input Error] Cannot read " + fname);
       }catch (libconfig::ParseException &e) {
-        std::cerr << "Parse error at " << e.getFile() << ":" << e.getLine()
-                  << " - " << e.getError() <<"\n";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[Input Error] Parse error at " + std::string(e.getFile()) + ":"
+                                 + std::to_string(e.getLine()) + " - " + e.getError());
       }
       for (int i = 0; i < numEnergy; i++) {
         const auto &global = cfg.getRoot()["EnergyData" + std::to_string(i)];
@@ -359,8 +502,7 @@ private:
         Real diff = fabs(energy - currEnergy);
 
         if (diff > 1E-3) {
-          std::cout << "[Input Error] No energy found for " << currEnergy << "\n";
-          exit(EXIT_FAILURE);
+          throw std::runtime_error("[Input Error] No energy found for " + std::to_string(currEnergy) + " in " + fname);
         }
 
         Real deltaPara = global["DeltaPara"];
@@ -377,12 +519,84 @@ private:
 
     }
   }
+
+  /**
+   * @brief checks the values read from the input file
+   * @throws std::runtime_error if a value is invalid
+   */
   void validate() const{
       validate("FFT Windowing",windowingType,FFT::FFTWindowing::MAX_SIZE);
       validate("Scatter Approach",scatterApproach,ScatterApproach::MAX_SCATTER_APPROACH);
       validate("Ewalds Interpolation",ewaldsInterpolation,Interpolation::EwaldsInterpolation::MAX_SIZE);
       validate("Morphology Type",ewaldsInterpolation,MorphologyType::MAX_MORPHOLOGY_TYPE);
       validate("Case Type",caseType,CaseTypes::MAX_CASE_TYPE);
+      validate("Output Compression",outputCompression,Output::Compression::MAX_COMPRESSION);
+      validate("Output Precision",outputPrecision,Output::Precision::MAX_PRECISION);
+      validate("Output Layout",outputLayout,Output::Layout::MAX_LAYOUT);
+      if(outputSWMR and (outputLayout != Output::Layout::SPECTRAL_CUBE)){
+        std::cout << YLW << "[WARNING] OutputSWMR requires OutputLayout = 1. Ignored." << NRM << "\n";
+      }
+      if(azimuthalIntegration and ((numChiSectors < 2) or (numChiSectors % 2 != 0))){
+        throw std::runtime_error("[Input Error] NumChiSectors must be even and at least 2");
+      }
+      if(detectorRemesh and ((detectorBinning == 0) or (detectorPixels[0] < detectorBinning) or (detectorPixels[1] < detectorBinning)
+                             or (detectorPixelSize <= 0) or (detectorDistance <= 0))){
+        throw std::runtime_error("[Input Error] Invalid detector geometry. DetectorPixels must be at least DetectorBinning, "
+                                 "DetectorPixelSize and DetectorDistance must be positive");
+      }
+      validate("ROI Type",roiType,ROI::Type::MAX_ROI_TYPE);
+      if(((roiType == ROI::Type::ANNULUS) and not((roiQRange[0] >= 0) and (roiQRange[0] < roiQRange[1])))
+         or ((roiType == ROI::Type::BOX) and not((roiQBox[0] < roiQBox[1]) and (roiQBox[2] < roiQBox[3])))){
+        throw std::runtime_error("[Input Error] Invalid q region of interest. Bounds must be increasing");
+      }
+      validate("Fourier Cache Mode",fourierCacheMode,FourierCacheMode::Type::MAX_FOURIER_CACHE_MODE);
+      if((fourierCacheMode != FourierCacheMode::Type::NONE) and (algorithmType != Algorithm::MemoryMinizing)){
+        throw std::runtime_error("[Input Error] FourierCacheMode requires Algorithm = 1");
+      }
+      validate("E Angle Norm",eAngleNorm,ConvergenceNorm::Type::MAX_CONVERGENCE_NORM);
+      if(eAngleAdaptive and ((eAngleTolerance <= 0) or (eAngleInitialCount < 2))){
+        throw std::runtime_error("[Input Error] EAngleTolerance must be positive and EAngleInitialCount at least 2");
+      }
+      if(not(qPointsFile.empty()) and ((algorithmType != Algorithm::MemoryMinizing) or eAngleAdaptive
+                                       or (fourierCacheMode != FourierCacheMode::Type::NONE))){
+        throw std::runtime_error("[Input Error] QPointsFile requires Algorithm = 1, without EAngleAdaptive and FourierCacheMode");
+      }
+      validate("Ewald Engine",ewaldEngine,EwaldEngine::Type::MAX_EWALD_ENGINE);
+      if(ewaldEngine == EwaldEngine::Type::NUFFT){
+        if((algorithmType != Algorithm::MemoryMinizing) or eAngleAdaptive or not(qPointsFile.empty())
+           or (fourierCacheMode != FourierCacheMode::Type::NONE)){
+          throw std::runtime_error("[Input Error] EwaldEngine = 1 requires Algorithm = 1, without EAngleAdaptive, QPointsFile and FourierCacheMode");
+        }
+        if(not((nufftTolerance > 0) and (nufftTolerance < 1)) or not(nufftUpsampling >= 1.25)){
+          throw std::runtime_error("[Input Error] NUFFTTolerance must be in (0,1) and NUFFTUpsampling at least 1.25");
+        }
+      }
+      if(previewFactor == 0){
+        throw std::runtime_error("[Input Error] PreviewFactor must be at least 1");
+      }
+      for(const Real & energy: previewRefineEnergies){
+        if(std::find_if(energies.begin(), energies.end(), [&](const Real & e){return FEQUALS(e, energy);}) == energies.end()){
+          throw std::runtime_error("[Input Error] PreviewRefineEnergies has the energy " + std::to_string(energy) + " that is not simulated");
+        }
+      }
+      if(not(previewRefineQRange.empty()) and not((previewRefineQRange[0] >= 0) and (previewRefineQRange[0] < previewRefineQRange[1]))){
+        throw std::runtime_error("[Input Error] Invalid PreviewRefineQRange. Bounds must be increasing");
+      }
+      if(not(previewRefineQRange.empty()) and (roiType != ROI::Type::NONE)){
+        throw std::runtime_error("[Input Error] PreviewRefineQRange can not be combined with ROIType");
+      }
+      if((previewFactor == 1) and (not(previewRefineEnergies.empty()) or not(previewRefineQRange.empty()))){
+        std::cout << YLW << "[WARNING] PreviewRefineEnergies and PreviewRefineQRange require PreviewFactor > 1. Ignored." << NRM << "\n";
+      }
+      if(not(resultCacheDir.empty()) and (resultCacheSizeMB == 0)){
+        throw std::runtime_error("[Input Error] ResultCacheSizeMB must be positive");
+      }
+      if(not(writeFrames) and not(azimuthalIntegration) and not(detectorRemesh)){
+        std::cout << YLW << "[WARNING] WriteFrames = false without AzimuthalIntegration or DetectorRemesh. No output is written." << NRM << "\n";
+      }
+      if((compressionLevel < 1) or (compressionLevel > 9)){
+        throw std::runtime_error("[Input Error] CompressionLevel must be between 1 and 9");
+      }
       if(referenceFrame == ReferenceFrame::MATERIAL){
       	std::cout << YLW<<  "[WARNING] Accuracy of Material reference frame is currently under investigation and should not be used for production runs" << NRM << "\n";
       } 
@@ -401,7 +615,15 @@ private:
         }
 
         std::cout << "PhysSize             : " << physSize << " nm \n";
+        if(previewFactor > 1) {
+          std::cout << "Preview Factor       : " << previewFactor << "\n";
+        }
         std::cout << "E Rotation Angle     : " << startAngle << " : " << incrementAngle << " : " <<endAngle << "\n";
+        std::cout << "E Angle Folding      : " << eAngleFolding << "\n";
+        if(eAngleAdaptive) {
+          std::cout << "E Angle Refinement   : " << ConvergenceNorm::convergenceNormName[eAngleNorm] << " < " << eAngleTolerance
+             << " from " << eAngleInitialCount << " angles\n";
+        }
         std::cout << "Morphology Type      : " << morphologyTypeName[morphologyType] << "\n";
         std::cout << "Morphology Order     : " << morphologyOrderName[morphologyOrder] << "\n";
         std::cout << "Energies simulated   : [";
@@ -413,8 +635,51 @@ private:
         std::cout << "Rotation Mask        : " << rotMask << "\n";
         std::cout << "Interpolation Type   : " << Interpolation::interpolationName[ewaldsInterpolation] << "\n";
         std::cout << "HDF Output Directory : " << HDF5DirName << "\n";
+        std::cout << "Output Compression   : " << Output::compressionName[outputCompression] << "\n";
+        std::cout << "Output Precision     : " << Output::precisionName[outputPrecision] << "\n";
+        std::cout << "Output Layout        : " << Output::layoutName[outputLayout] << "\n";
+        std::cout << "Output SWMR          : " << outputSWMR << "\n";
+        std::cout << "Write Frames         : " << writeFrames << "\n";
+        std::cout << "Azimuthal Integration: " << azimuthalIntegration << "\n";
+        if(azimuthalIntegration) {
+          std::cout << "NumQBins             : " << numQBins << "\n";
+          std::cout << "NumChiSectors        : " << numChiSectors << "\n";
+        }
+        std::cout << "Detector Remesh      : " << detectorRemesh << "\n";
+        if(detectorRemesh) {
+          std::cout << "Detector Pixels      : [" << detectorPixels[0] << " " << detectorPixels[1] << "]\n";
+          std::cout << "Detector Pixel Size  : " << detectorPixelSize << " mm\n";
+          std::cout << "Detector Distance    : " << detectorDistance << " mm\n";
+          std::cout << "Detector Beam Center : [" << detectorBeamCenter[0] << " " << detectorBeamCenter[1] << "]\n";
+          std::cout << "Detector Binning     : " << detectorBinning << "\n";
+        }
+        std::cout << "ROI Type             : " << ROI::roiTypeName[roiType] << "\n";
+        if(roiType == ROI::Type::ANNULUS) {
+          std::cout << "ROI q Range          : [" << roiQRange[0] << " " << roiQRange[1] << "] nm^-1\n";
+        }
+        else if(roiType == ROI::Type::BOX) {
+          std::cout << "ROI q Box            : [" << roiQBox[0] << " " << roiQBox[1] << " " << roiQBox[2] << " " << roiQBox[3] << "] nm^-1\n";
+        }
+        if(not(qPointsFile.empty())) {
+          std::cout << "Q Points File        : " << qPointsFile << (qPointsOnHost ? " (host)" : " (device)") << "\n";
+        }
+        std::cout << "Ewald Engine         : " << EwaldEngine::ewaldEngineName[ewaldEngine] << "\n";
+        if(ewaldEngine == EwaldEngine::Type::NUFFT) {
+          std::cout << "NUFFT Tolerance      : " << nufftTolerance << "\n";
+          std::cout << "NUFFT Upsampling     : " << nufftUpsampling << "\n";
+        }
+        std::cout << "Fourier Cache Mode   : " << FourierCacheMode::fourierCacheModeName[fourierCacheMode] << "\n";
+        if(fourierCacheMode != FourierCacheMode::Type::NONE) {
+          std::cout << "Fourier Cache Dir    : " << fourierCacheDir << "\n";
+        }
+        if(not(resultCacheDir.empty())) {
+          std::cout << "Result Cache Dir     : " << resultCacheDir << " (" << resultCacheSizeMB << " MB)\n";
+        }
         std::cout << "Scatter Approach     : " << scatterApproachName[scatterApproach] << "\n";
         std::cout << "Algorithm            : " << algorithmName[algorithmType] << "\n";
+        if(autoPlan) {
+          std::cout << "Auto Plan            : " << autoPlan << "\n";
+        }
 	std::cout << "Reference Frame      : " << referenceFrameName[(UINT)referenceFrame] << "(" << referenceFrame << ")\n";
          if(algorithmType==Algorithm::MemoryMinizing) {
           std::cout  << "MaxStreams           : " << numMaxStreams << "\n";
@@ -626,7 +891,15 @@ private:
           fout << "Dimensions [Z Y X]   : ["<< voxelDims[2] << " " <<  voxelDims[1] << " " << voxelDims[0] << "]\n";
         }
         fout << "PhysSize             : " << physSize << "nm \n";
+        if(previewFactor > 1) {
+          fout << "Preview Factor       : " << previewFactor << "\n";
+        }
         fout << "E Rotation Angle     : " << startAngle << " : " << incrementAngle << " : " <<endAngle << "\n";
+        fout << "E Angle Folding      : " << eAngleFolding << "\n";
+        if(eAngleAdaptive) {
+          fout << "E Angle Refinement   : " << ConvergenceNorm::convergenceNormName[eAngleNorm] << " < " << eAngleTolerance
+             << " from " << eAngleInitialCount << " angles\n";
+        }
         fout << "Energies simulated   : [";
         for (const auto & energy: energies) {
             fout << energy << " " ;
@@ -643,8 +916,51 @@ private:
 #ifndef PYBIND
         fout << "HDF Output Directory : " << HDF5DirName << "\n";
 #endif
+        fout << "Output Compression   : " << Output::compressionName[outputCompression] << "\n";
+        fout << "Output Precision     : " << Output::precisionName[outputPrecision] << "\n";
+        fout << "Output Layout        : " << Output::layoutName[outputLayout] << "\n";
+        fout << "Output SWMR          : " << outputSWMR << "\n";
+        fout << "Write Frames         : " << writeFrames << "\n";
+        fout << "Azimuthal Integration: " << azimuthalIntegration << "\n";
+        if(azimuthalIntegration) {
+          fout << "NumQBins             : " << numQBins << "\n";
+          fout << "NumChiSectors        : " << numChiSectors << "\n";
+        }
+        fout << "Detector Remesh      : " << detectorRemesh << "\n";
+        if(detectorRemesh) {
+          fout << "Detector Pixels      : [" << detectorPixels[0] << " " << detectorPixels[1] << "]\n";
+          fout << "Detector Pixel Size  : " << detectorPixelSize << " mm\n";
+          fout << "Detector Distance    : " << detectorDistance << " mm\n";
+          fout << "Detector Beam Center : [" << detectorBeamCenter[0] << " " << detectorBeamCenter[1] << "]\n";
+          fout << "Detector Binning     : " << detectorBinning << "\n";
+        }
+        fout << "ROI Type             : " << ROI::roiTypeName[roiType] << "\n";
+        if(roiType == ROI::Type::ANNULUS) {
+          fout << "ROI q Range          : [" << roiQRange[0] << " " << roiQRange[1] << "] nm^-1\n";
+        }
+        else if(roiType == ROI::Type::BOX) {
+          fout << "ROI q Box            : [" << roiQBox[0] << " " << roiQBox[1] << " " << roiQBox[2] << " " << roiQBox[3] << "] nm^-1\n";
+        }
+        if(not(qPointsFile.empty())) {
+          fout << "Q Points File        : " << qPointsFile << (qPointsOnHost ? " (host)" : " (device)") << "\n";
+        }
+        fout << "Ewald Engine         : " << EwaldEngine::ewaldEngineName[ewaldEngine] << "\n";
+        if(ewaldEngine == EwaldEngine::Type::NUFFT) {
+          fout << "NUFFT Tolerance      : " << nufftTolerance << "\n";
+          fout << "NUFFT Upsampling     : " << nufftUpsampling << "\n";
+        }
+        fout << "Fourier Cache Mode   : " << FourierCacheMode::fourierCacheModeName[fourierCacheMode] << "\n";
+        if(fourierCacheMode != FourierCacheMode::Type::NONE) {
+          fout << "Fourier Cache Dir    : " << fourierCacheDir << "\n";
+        }
+        if(not(resultCacheDir.empty())) {
+          fout << "Result Cache Dir     : " << resultCacheDir << " (" << resultCacheSizeMB << " MB)\n";
+        }
         fout << "Scatter Approach     : " << scatterApproachName[scatterApproach] << "\n";
         fout << "Algorithm            : " << algorithmName[algorithmType] << "\n";
+        if(autoPlan) {
+          fout << "Auto Plan            : " << autoPlan << "\n";
+        }
         if(algorithmType==Algorithm::MemoryMinizing) {
           fout << "MaxStreams           : " << numMaxStreams << "\n";
         }
@@ -29,6 +29,7 @@
 #include <fstream>      // std::ifstream
 #include <string>
 #include <sstream>      // std::stringstream
+#include <stdexcept>
 
 #include <vector>
 #include <assert.h>
@@ -48,14 +49,12 @@ namespace H5 {
     std::string dataName = "NumMaterial";
     bool groupExists = file.nameExists(groupName.c_str());
     if (not groupExists) {
-      std::cerr << "[HDF5 Error] Group " << groupName << " not found";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] Group " + groupName + " not found");
     }
     Group group = file.openGroup(groupName.c_str());
     bool dataExists = group.nameExists(dataName.c_str());
     if (not(dataExists)) {
-      std::cerr << "[HDF5 Error] DataSet " << dataName << "not found";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] DataSet " + dataName + " not found");
     }
     H5::DataSet dataSet = group.openDataSet(dataName.c_str());
     H5::DataType dataType = dataSet.getDataType();
@@ -78,14 +77,12 @@ namespace H5 {
       std::string dataName = "PhysSize";
       bool groupExists = file.nameExists(groupName.c_str());
       if (not groupExists) {
-        std::cerr << "[HDF5 Error] Group " << groupName << " not found";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[HDF5 Error] Group " + groupName + " not found");
       }
       Group group = file.openGroup(groupName.c_str());
       bool dataExists = group.nameExists(dataName.c_str());
       if (not(dataExists)) {
-        std::cerr << "[HDF5 Error] DataSet " << dataName << "not found";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[HDF5 Error] DataSet " + dataName + " not found");
       }
       H5::DataSet dataSet = group.openDataSet(dataName.c_str());
       H5::DataType dataType = dataSet.getDataType();
@@ -115,24 +112,21 @@ namespace H5 {
 
     bool groupExists = file.nameExists(groupName.c_str());
     if (not groupExists) {
-      std::cerr << "[HDF5 Error] Group " << groupName << " not found";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] Group " + groupName + " not found");
     }
 
     Group group = file.openGroup(groupName.c_str());
     bool dataExists = group.nameExists(dataName.c_str());
 
     if (not(dataExists)) {
-      std::cerr << "[HDF5 Error] DataSet " << dataName << "not found";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] DataSet " + dataName + " not found");
     }
     H5::DataSet dataSet = group.openDataSet(dataName.c_str());
     H5::DataSpace space = dataSet.getSpace();
     hsize_t voxelDims[3];
     const int ndims = space.getSimpleExtentDims(voxelDims, NULL);
     if (ndims != 3) {
-      std::cerr << "[HDF5 Error] Expected 3D array. Found Dim = " << ndims << "for " << dataName << "\n";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] Expected 3D array. Found Dim = " + std::to_string(ndims) + " for " + dataName);
     }
     char label[2][AXIS_LABEL_LEN];
     H5DSget_label(dataSet.getId(), 0, label[0], AXIS_LABEL_LEN);
@@ -208,14 +202,12 @@ namespace H5 {
     H5::DataSet dataSet;
     bool groupExists = file.nameExists(groupName.c_str());
     if (not groupExists) {
-      std::cerr << "[HDF5 Error] Group " << groupName << "not found";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] Group " + groupName + " not found");
     }
     Group group = file.openGroup(groupName.c_str());
     bool dataExists = group.nameExists(dataName.c_str());
     if (not(dataExists)) {
-      std::cerr << "[HDF5 Error] Dataset = " << dataName << "does not exists";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] DataSet " + dataName + " not found");
     }
 
     dataSet = group.openDataSet(dataName.c_str());
@@ -224,8 +216,7 @@ namespace H5 {
     hsize_t voxelDims[4];
     const int ndims = space.getSimpleExtentDims(voxelDims, NULL);
     if (ndims != 4) {
-      std::cerr << "[HDF5 Error] Expected 4D array. Found Dim = " << ndims << "for " << dataName << "\n";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] Expected 4D array. Found Dim = " + std::to_string(ndims) + " for " + dataName);
     }
     char label[2][AXIS_LABEL_LEN];
     H5DSget_label(dataSet.getId(), 0, label[0], AXIS_LABEL_LEN);
@@ -234,8 +225,7 @@ namespace H5 {
     // We store voxel dimension as (X,Y,Z) irrespective of HDF axis label
     if (morphologyOrder == MorphologyOrder::ZYX) {
       if (not((strcmp(label[0], "Z") == 0) and (strcmp(label[1], "X") == 0))) {
-        std::cerr << "[HDF5 Error] Axis label mismatch for morphology for " << dataName << "\n";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[HDF5 Error] Axis label mismatch for morphology for " + dataName);
       }
       if ((voxelDims[0] != voxelSize[2]) or (voxelDims[1] != voxelSize[1]) or
           (voxelDims[2] != voxelSize[0]) or (voxelDims[3] != 3)) {
@@ -251,8 +241,7 @@ namespace H5 {
     }
     if (morphologyOrder == MorphologyOrder::XYZ) {
       if (not((strcmp(label[0], "X") == 0) and (strcmp(label[1], "Z") == 0))) {
-        std::cerr << "[HDF5 Error] Axis label mismatch for morphology for " << dataName << "\n";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[HDF5 Error] Axis label mismatch for morphology for " + dataName);
       }
       if ((voxelDims[0] != voxelSize[0]) or (voxelDims[1] != voxelSize[1]) or
           (voxelDims[2] != voxelSize[2]) or (voxelDims[3] != 3)) {
@@ -268,8 +257,7 @@ namespace H5 {
     }
 #ifdef DOUBLE_PRECISION
     if(dataType != PredType::NATIVE_DOUBLE){
-       std::cerr << "[HDF5 Error] The data format is not supported for double precision \n";
-       exit(EXIT_FAILURE);
+       throw std::runtime_error("[HDF5 Error] The data format is not supported for double precision");
     }
 
     dataSet.read(inputData.data(), H5::PredType::NATIVE_DOUBLE);
@@ -332,8 +320,7 @@ namespace H5 {
 
     bool groupExists = file.nameExists(groupName.c_str());
     if (not groupExists) {
-      std::cerr << "[HDF5 Error] Group " << groupName << "not found";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] Group " + groupName + " not found");
     }
 
     Group group = file.openGroup(groupName.c_str());
@@ -341,8 +328,7 @@ namespace H5 {
 
     // Check if dataset exists and required
     if (isRequired and not(dataExists)) {
-      std::cerr << "[HDF5 Error] Dataset = " << dataName << "does not exists";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] DataSet " + dataName + " not found");
     }
 
     // Fill with 0 if not exists
@@ -357,8 +343,7 @@ namespace H5 {
     hsize_t voxelDims[3];
     const int ndims = space.getSimpleExtentDims(voxelDims, NULL);
     if (ndims != 3) {
-      std::cerr << "[HDF5 Error] Expected 3D array. Found Dim = " << ndims << "for " << dataName << "\n";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] Expected 3D array. Found Dim = " + std::to_string(ndims) + " for " + dataName);
     }
     char label[2][AXIS_LABEL_LEN];
     H5DSget_label(dataSet.getId(), 0, label[0], AXIS_LABEL_LEN);
@@ -368,8 +353,7 @@ namespace H5 {
     // We store voxel dimension as (X,Y,Z) irrespective of HDF axis label
     if (morphologyOrder == MorphologyOrder::ZYX) {
       if (not((strcmp(label[0], "Z") == 0) and (strcmp(label[1], "X") == 0))) {
-        std::cerr << "[HDF5 Error] Axis label mismatch for morphology for " << dataName << "\n";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[HDF5 Error] Axis label mismatch for morphology for " + dataName);
       }
       if ((voxelDims[0] != voxelSize[2]) or (voxelDims[1] != voxelSize[1]) or
           (voxelDims[2] != voxelSize[0])) {
@@ -386,8 +370,7 @@ namespace H5 {
     }
     if (morphologyOrder == MorphologyOrder::XYZ) {
       if (not((strcmp(label[0], "X") == 0) and (strcmp(label[1], "Z") == 0))) {
-        std::cerr << "[HDF5 Error] Axis label mismatch for morphology for " << dataName << "\n";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("[HDF5 Error] Axis label mismatch for morphology for " + dataName);
       }
       if ((voxelDims[0] != voxelSize[0]) or (voxelDims[1] != voxelSize[1]) or
           (voxelDims[2] != voxelSize[2])) {
@@ -405,8 +388,7 @@ namespace H5 {
 
 #ifdef DOUBLE_PRECISION
     if(dataType != PredType::NATIVE_DOUBLE){
-       std::cerr << "[HDF5 Error] The data format is not supported for double precision \n";
-       exit(EXIT_FAILURE);
+       throw std::runtime_error("[HDF5 Error] The data format is not supported for double precision");
     }
 
     dataSet.read(morphologyData.data(), H5::PredType::NATIVE_DOUBLE);
@@ -430,8 +412,7 @@ namespace H5 {
         XYZ_to_ZYX(morphologyData, 1, voxelSize);
       }
     } else {
-      std::cerr << "[HDF5 Error] This data format is not supported \n";
-      exit(EXIT_FAILURE);
+      throw std::runtime_error("[HDF5 Error] This data format is not supported");
     }
 #endif
     group.close();
@@ -0,0 +1,246 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_NUFFT_H
+#define CY_RSOXS_NUFFT_H
+
+#include <Datatypes.h>
+#include <Input/InputData.h>
+#include <Rotation.h>
+#include <cmath>
+#include <vector>
+
+/// Largest support of the spreading kernel (in grid points)
+static constexpr UINT MAX_NUFFT_WIDTH = 16;
+
+/**
+ * @brief Parameters of the non-uniform FFT. The Fourier transform of Nt at an arbitrary q is interpolated from
+ * the FFT of Nt on an oversampled grid with the "exponential of semicircle" kernel
+ * psi(t) = exp(beta (sqrt(1 - (2t/w)^2) - 1)), |t| <= w/2. Nt is divided by the Fourier transform of the kernel
+ * before the FFT, which cancels the smoothing of the interpolation.
+ */
+struct NUFFTKernel {
+  /// Support of the kernel (in grid points)
+  UINT width;
+  /// Shape parameter of the kernel
+  Real beta;
+  /// Size of the oversampled grid. 1 along the dimensions of a single voxel.
+  uint3 gridDims;
+  /// Correction factor of every voxel index, for x, y and z one after the other
+  std::vector<Real> correction;
+};
+
+/**
+ * @brief One E angle of the non-uniform FFT engine
+ */
+struct NUFFTAngle {
+  /// Rotation matrix of the E field
+  Matrix rotationMatrix;
+  /// cosine of the E angle
+  Real cosAngle;
+  /// sine of the E angle
+  Real sinAngle;
+};
+
+/**
+ * @brief Evaluates the spreading kernel
+ * @param [in] t distance to the grid point (in grid points)
+ * @param [in] width support of the kernel
+ * @param [in] beta shape parameter
+ * @return psi(t)
+ */
+__host__ __device__ inline Real evaluateNUFFTKernel(const Real t, const UINT width, const Real beta) {
+  const Real z = 2 * t / width;
+  if (fabs(z) >= 1) {
+    return 0;
+  }
+  return exp(beta * (sqrt(1 - z * z) - 1));
+}
+
+/**
+ * @brief Smallest even size >= n whose only prime factors are 2, 3 and 5, for which cuFFT is fastest
+ * @param [in] n minimum size
+ * @return size
+ */
+static UINT getNUFFTGridSize(const UINT n) {
+  for (UINT size = n + (n % 2);; size += 2) {
+    UINT m = size;
+    for (const UINT factor: {2u, 3u, 5u}) {
+      while (m % factor == 0) {
+        m /= factor;
+      }
+    }
+    if (m == 1) {
+      return size;
+    }
+  }
+}
+
+/**
+ * @brief Gauss-Legendre quadrature on [-1, 1]
+ * @param [in] n number of nodes
+ * @param [out] nodes nodes
+ * @param [out] weights weights
+ */
+static void getGaussLegendreQuadrature(const UINT n, std::vector<double> &nodes, std::vector<double> &weights) {
+  nodes.resize(n);
+  weights.resize(n);
+  for (UINT i = 0; i < n; i++) {
+    /// Newton iteration on P_n from the Chebyshev estimate of the root
+    double x = std::cos(M_PI * (i + 0.75) / (n + 0.5));
+    double dP = 1;
+    for (int iter = 0; iter < 100; iter++) {
+      double P0 = 1, P1 = x;
+      for (UINT j = 2; j <= n; j++) {
+        const double P2 = ((2 * j - 1) * x * P1 - (j - 1) * P0) / j;
+        P0 = P1;
+        P1 = P2;
+      }
+      dP = n * (x * P1 - P0) / (x * x - 1);
+      const double dx = P1 / dP;
+      x -= dx;
+      if (std::fabs(dx) < 1E-15) {
+        break;
+      }
+    }
+    nodes[i] = x;
+    weights[i] = 2 / ((1 - x * x) * dP * dP);
+  }
+}
+
+/**
+ * @brief Computes the kernel and the oversampled grid of the non-uniform FFT. The width and the shape follow the
+ * usual choice for the exponential of semicircle kernel: w = ceil(ln(1/tol) / (pi sqrt(1 - 1/sigma))) and
+ * beta = 0.97 pi (1 - 1/(2 sigma)) w for the oversampling sigma.
+ * @param [in] inputData input data
+ * @param [in] voxel number of voxels in each direction
+ * @return kernel parameters
+ */
+static NUFFTKernel getNUFFTKernel(const InputData &inputData, const UINT *voxel) {
+  const double sigma = inputData.nufftUpsampling;
+  NUFFTKernel kernel;
+  const double width = std::ceil(std::log(1.0 / inputData.nufftTolerance) / (M_PI * std::sqrt(1 - 1 / sigma)));
+  kernel.width = static_cast<UINT>(std::min(std::max(width, 2.0), static_cast<double>(MAX_NUFFT_WIDTH)));
+  kernel.beta = static_cast<Real>(0.97 * M_PI * (1 - 1 / (2 * sigma)) * kernel.width);
+
+  std::vector<double> nodes, weights;
+  getGaussLegendreQuadrature(2 * kernel.width + 16, nodes, weights);
+  UINT gridDims[3];
+  for (int d = 0; d < 3; d++) {
+    const UINT n = voxel[d];
+    gridDims[d] = (n == 1) ? 1 : getNUFFTGridSize(std::max(static_cast<UINT>(std::ceil(sigma * n)), 2 * kernel.width));
+    for (UINT i = 0; i < n; i++) {
+      if (gridDims[d] == 1) {
+        kernel.correction.push_back(1);
+        continue;
+      }
+      /// Fourier transform of the kernel at the frequency of the centered index
+      const double xi = 2 * M_PI * (static_cast<double>(i) - static_cast<double>(n / 2)) / gridDims[d];
+      double transform = 0;
+      for (UINT j = 0; j < nodes.size(); j++) {
+        const double t = nodes[j] * kernel.width / 2.;
+        transform += weights[j] * evaluateNUFFTKernel(static_cast<Real>(t), kernel.width, kernel.beta) * std::cos(xi * t);
+      }
+      kernel.correction.push_back(static_cast<Real>(2 / (kernel.width * transform)));
+    }
+  }
+  kernel.gridDims = uint3{gridDims[0], gridDims[1], gridDims[2]};
+  return kernel;
+}
+
+/**
+ * @brief Index of the oversampled grid that a voxel is placed at. Voxel indices are centered, which only changes
+ * the phase of the transform at q by a factor that is common to all components.
+ * @param [in] X voxel index along x
+ * @param [in] Y voxel index along y
+ * @param [in] Z voxel index along z
+ * @param [in] voxel number of voxels in each direction
+ * @param [in] gridDims size of the oversampled grid
+ * @return index into the grid
+ */
+__host__ __device__ inline BigUINT getNUFFTGridIndex(const UINT X, const UINT Y, const UINT Z, const uint3 &voxel,
+                                                     const uint3 &gridDims) {
+  const UINT gX = (X + gridDims.x - voxel.x / 2) % gridDims.x;
+  const UINT gY = (Y + gridDims.y - voxel.y / 2) % gridDims.y;
+  const UINT gZ = (Z + gridDims.z - voxel.z / 2) % gridDims.z;
+  return (static_cast<BigUINT>(gZ) * gridDims.y + gY) * gridDims.x + gX;
+}
+
+/**
+ * @brief Interpolates the six Fourier transformed components of Nt at q from the oversampled grid.
+ * @param [in] grid FFT of the corrected Nt on the oversampled grid, one component after the other
+ * @param [in] gridDims size of the oversampled grid
+ * @param [in] width support of the kernel
+ * @param [in] beta shape parameter of the kernel
+ * @param [in] q q (in nm^-1)
+ * @param [in] physSize physical size (in nm)
+ * @param [out] N 6 components of the Fourier transformed Nt at q
+ */
+__host__ __device__ inline void interpolateNUFFT(const Complex *grid, const uint3 &gridDims, const UINT width,
+                                                 const Real beta, const Real3 &q, const Real physSize, Complex *N) {
+  const BigUINT numGridPoints = static_cast<BigUINT>(gridDims.x) * gridDims.y * gridDims.z;
+  const UINT M[3]{gridDims.x, gridDims.y, gridDims.z};
+  const Real qDim[3]{q.x, q.y, q.z};
+  Real weight[3][MAX_NUFFT_WIDTH];
+  UINT index[3][MAX_NUFFT_WIDTH];
+  UINT numPoints[3];
+  for (int d = 0; d < 3; d++) {
+    if (M[d] == 1) {
+      numPoints[d] = 1;
+      weight[d][0] = 1;
+      index[d][0] = 0;
+      continue;
+    }
+    /// Position of q on the grid with spacing 2 pi / (M physSize)
+    Real s = static_cast<Real>(qDim[d] * physSize * M[d] / (2 * M_PI));
+    s -= M[d] * floor(s / M[d]);
+    const int start = static_cast<int>(ceil(s - width / static_cast<Real>(2)));
+    numPoints[d] = width;
+    for (UINT i = 0; i < width; i++) {
+      const int l = start + static_cast<int>(i);
+      weight[d][i] = evaluateNUFFTKernel(s - l, width, beta);
+      index[d][i] = static_cast<UINT>((l + static_cast<int>(M[d])) % static_cast<int>(M[d]));
+    }
+  }
+  for (int c = 0; c < 6; c++) {
+    N[c].x = 0;
+    N[c].y = 0;
+  }
+  for (UINT k = 0; k < numPoints[2]; k++) {
+    for (UINT j = 0; j < numPoints[1]; j++) {
+      const Real weightYZ = weight[1][j] * weight[2][k];
+      const BigUINT offset = (static_cast<BigUINT>(index[2][k]) * M[1] + index[1][j]) * M[0];
+      for (UINT i = 0; i < numPoints[0]; i++) {
+        const Real w = weightYZ * weight[0][i];
+        const BigUINT id = offset + index[0][i];
+        for (int c = 0; c < 6; c++) {
+          N[c].x += w * grid[c * numGridPoints + id].x;
+          N[c].y += w * grid[c * numGridPoints + id].y;
+        }
+      }
+    }
+  }
+}
+
+#endif //CY_RSOXS_NUFFT_H
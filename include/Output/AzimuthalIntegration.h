@@ -0,0 +1,326 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_AZIMUTHALINTEGRATION_H
+#define CY_RSOXS_AZIMUTHALINTEGRATION_H
+
+#include <Output/HDF5FrameSink.h>
+#include <FrameROI.h>
+#include <utils.h>
+#include <H5Cpp.h>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Reduces a scattering pattern to the azimuthally averaged I(q), the sector averages I(q, chi) and the
+ * anisotropy ratio AR(q) = (I(q, 0) - I(q, 90)) / (I(q, 0) + I(q, 90)). chi is measured from the qx axis and folded
+ * to [0, 180) as the pattern is centro-symmetric. The sectors are centered on 0, 180/N, ... with a width of 180/N,
+ * so that the sectors 0 and N/2 are the ones parallel and perpendicular to qx. The q bins are uniform
+ * in [0, pi/physSize], or in the radial range of the q region of interest. The bin of every pixel is computed once
+ * and reused for every frame. NaN pixels (rotation mask, outside the region of interest) are ignored.
+ */
+class AzimuthalIntegrator {
+  /// Number of q bins
+  UINT numQBins_ = 0;
+  /// Number of chi sectors
+  UINT numSectors_ = 0;
+  /// q range of the bins
+  double qLow_ = 0;
+  double qHigh_ = 0;
+  /// (q bin * numSectors + sector) of every pixel, -1 outside the q range
+  std::vector<int> pixelBin_;
+
+public:
+  /**
+   * @brief builds the pixel to bin table
+   * @param [in] inputData input data
+   * @param [in] roi region of the pattern the frames cover
+   * @param [in] numQBins number of q bins
+   * @param [in] numSectors number of chi sectors (even)
+   */
+  void init(const InputData &inputData, const FrameROI &roi, const UINT numQBins, const UINT numSectors) {
+    numQBins_ = numQBins;
+    numSectors_ = numSectors;
+    qLow_ = roi.qMin;
+    qHigh_ = std::min(static_cast<double>(roi.qMax), M_PI / inputData.physSize);
+    const double sectorWidth = 180.0 / numSectors;
+    pixelBin_.resize(static_cast<std::size_t>(roi.nx) * roi.ny);
+    for (UINT Y = 0; Y < roi.ny; Y++) {
+      const double qy = getPixelQ(roi.y0 + Y, inputData.voxelDims[1], inputData.physSize);
+      for (UINT X = 0; X < roi.nx; X++) {
+        const double qx = getPixelQ(roi.x0 + X, inputData.voxelDims[0], inputData.physSize);
+        const double q = std::sqrt(qx * qx + qy * qy);
+        int &bin = pixelBin_[static_cast<std::size_t>(Y) * roi.nx + X];
+        if ((q < qLow_) or (q > qHigh_)) {
+          bin = -1;
+          continue;
+        }
+        double chi = std::atan2(qy, qx) * 180.0 / M_PI;
+        if (chi < 0) {
+          chi += 180.0;
+        }
+        const UINT qBin = std::min(static_cast<UINT>((q - qLow_) / (qHigh_ - qLow_) * numQBins), numQBins - 1);
+        const UINT sector = static_cast<UINT>(std::floor(chi / sectorWidth + 0.5)) % numSectors;
+        bin = static_cast<int>(qBin * numSectors + sector);
+      }
+    }
+  }
+
+  /**
+   * @return number of q bins
+   */
+  UINT numQBins() const {
+    return numQBins_;
+  }
+
+  /**
+   * @return number of chi sectors
+   */
+  UINT numSectors() const {
+    return numSectors_;
+  }
+
+  /**
+   * @return center of every q bin (in nm^-1)
+   */
+  std::vector<Real> getQ() const {
+    std::vector<Real> q(numQBins_);
+    for (UINT i = 0; i < numQBins_; i++) {
+      q[i] = static_cast<Real>(qLow_ + (i + 0.5) * (qHigh_ - qLow_) / numQBins_);
+    }
+    return q;
+  }
+
+  /**
+   * @return center of every chi sector (in degrees)
+   */
+  std::vector<Real> getChi() const {
+    std::vector<Real> chi(numSectors_);
+    for (UINT i = 0; i < numSectors_; i++) {
+      chi[i] = static_cast<Real>(i * 180.0 / numSectors_);
+    }
+    return chi;
+  }
+
+  /**
+   * @brief reduces a frame. Can be called concurrently.
+   * @param [in] frame scattering pattern
+   * @param [out] Iq I(q) of size numQBins
+   * @param [out] Iqchi I(q, chi) of size numSectors x numQBins
+   * @param [out] AR anisotropy ratio of size numQBins
+   */
+  void reduce(const Real *frame, Real *Iq, Real *Iqchi, Real *AR) const {
+    std::vector<double> binSum(numQBins_ * numSectors_, 0.0);
+    std::vector<UINT> binCount(numQBins_ * numSectors_, 0);
+    for (std::size_t i = 0; i < pixelBin_.size(); i++) {
+      if ((pixelBin_[i] < 0) or std::isnan(frame[i])) {
+        continue;
+      }
+      binSum[pixelBin_[i]] += frame[i];
+      binCount[pixelBin_[i]]++;
+    }
+    const Real nan = std::numeric_limits<Real>::quiet_NaN();
+    for (UINT qBin = 0; qBin < numQBins_; qBin++) {
+      double sum = 0;
+      UINT count = 0;
+      for (UINT sector = 0; sector < numSectors_; sector++) {
+        const UINT bin = qBin * numSectors_ + sector;
+        sum += binSum[bin];
+        count += binCount[bin];
+        Iqchi[sector * numQBins_ + qBin] = (binCount[bin] > 0) ? static_cast<Real>(binSum[bin] / binCount[bin]) : nan;
+      }
+      Iq[qBin] = (count > 0) ? static_cast<Real>(sum / count) : nan;
+      const Real parallel = Iqchi[qBin];
+      const Real perpendicular = Iqchi[(numSectors_ / 2) * numQBins_ + qBin];
+      AR[qBin] = (parallel - perpendicular) / (parallel + perpendicular);
+    }
+  }
+};
+
+/**
+ * @brief Writes the azimuthal integration of every frame to Reduction.h5 with the datasets I_q[energy][k][q],
+ * I_qchi[energy][k][chi][q], AR[energy][k][q] and the coordinates energy, q and chi. The frames are reduced by the
+ * GPU thread that computed them. The results of an energy are written once all its k vectors are reduced,
+ * and the energy is recorded in ReducedEnergies.txt which allows a restarted run to skip it.
+ */
+class AzimuthalIntegrationWriter : public HDF5FrameSink {
+  /// Pixel to bin table shared by all the threads
+  AzimuthalIntegrator integrator_;
+
+  /// Results of the whole run, indexed by (energy, k)
+  std::vector<Real> Iq_, Iqchi_, AR_;
+  std::vector<UINT> numFramesReduced_;
+  std::mutex mutex_;
+
+  /**
+   * @param name dataset name
+   * @return dimension of a dataset for the whole run
+   */
+  std::vector<hsize_t> getDims(const std::string &name) const {
+    std::vector<hsize_t> dims{inputData_->energies.size(), inputData_->kVectors.size()};
+    if (name == "I_qchi") {
+      dims.push_back(integrator_.numSectors());
+    }
+    dims.push_back(integrator_.numQBins());
+    return dims;
+  }
+
+  /**
+   * @brief creates the coordinates and the (NaN filled) result datasets
+   */
+  void create() override {
+    writeCoordinate("energy", inputData_->energies, "eV");
+    writeCoordinate("q", integrator_.getQ(), "nm^-1");
+    writeCoordinate("chi", integrator_.getChi(), "degree");
+    writeKList(*file_, *inputData_);
+    const Real nan = std::numeric_limits<Real>::quiet_NaN();
+    H5::DSetCreatPropList plist;
+#ifdef DOUBLE_PRECISION
+    plist.setFillValue(H5::PredType::NATIVE_DOUBLE, &nan);
+#else
+    plist.setFillValue(H5::PredType::NATIVE_FLOAT, &nan);
+#endif
+    for (const std::string name: {"I_q", "I_qchi", "AR"}) {
+      const std::vector<hsize_t> dims = getDims(name);
+#ifdef DOUBLE_PRECISION
+      file_->createDataSet(name, H5::PredType::NATIVE_DOUBLE, H5::DataSpace(dims.size(), dims.data()), plist);
+#else
+      file_->createDataSet(name, H5::PredType::NATIVE_FLOAT, H5::DataSpace(dims.size(), dims.data()), plist);
+#endif
+    }
+  }
+
+  /**
+   * @brief checks the result datasets of a previous run
+   * @return false if they have different dimensions
+   */
+  bool open() override {
+    for (const std::string name: {"I_q", "I_qchi", "AR"}) {
+      if (not(hasDataSet(name))) {
+        return false;
+      }
+      const H5::DataSpace dataspace = file_->openDataSet(name).getSpace();
+      std::vector<hsize_t> fileDims(dataspace.getSimpleExtentNdims());
+      dataspace.getSimpleExtentDims(fileDims.data());
+      if (fileDims != getDims(name)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief writes the results of all the k vectors of an energy
+   * @param energyID energy index
+   */
+  void writeEnergy(const UINT energyID) {
+    {
+      std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+      for (const std::string name: {"I_q", "I_qchi", "AR"}) {
+        const std::vector<Real> &values = (name == "I_q") ? Iq_ : ((name == "I_qchi") ? Iqchi_ : AR_);
+        std::vector<hsize_t> count = getDims(name);
+        std::vector<hsize_t> offset(count.size(), 0);
+        const std::size_t energySize = values.size() / count[0];
+        offset[0] = energyID;
+        count[0] = 1;
+        H5::DataSet dataset = file_->openDataSet(name);
+        H5::DataSpace fileSpace = dataset.getSpace();
+        fileSpace.selectHyperslab(H5S_SELECT_SET, count.data(), offset.data());
+        H5::DataSpace memSpace(count.size(), count.data());
+#ifdef DOUBLE_PRECISION
+        dataset.write(&values[energyID * energySize], H5::PredType::NATIVE_DOUBLE, memSpace, fileSpace);
+#else
+        dataset.write(&values[energyID * energySize], H5::PredType::NATIVE_FLOAT, memSpace, fileSpace);
+#endif
+      }
+      file_->flush(H5F_SCOPE_GLOBAL);
+    }
+    manifest_.record(energyID);
+  }
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] resume skip the energies that a previous run completed
+   */
+  explicit AzimuthalIntegrationWriter(const bool resume = false)
+    : HDF5FrameSink(resume, "Reduction.h5", "ReducedEnergies.txt") {
+  }
+
+  AzimuthalIntegrationWriter(const AzimuthalIntegrationWriter &) = delete;
+  AzimuthalIntegrationWriter &operator=(const AzimuthalIntegrationWriter &) = delete;
+
+  ~AzimuthalIntegrationWriter() override {
+    end();
+  }
+
+  void begin(const InputData &inputData) override {
+    inputData_ = &inputData;
+    if (not(inputData.writeHDF5)) {
+      return;
+    }
+    const FrameROI roi = getOutputROI(inputData);
+    const UINT numQBins = (inputData.numQBins > 0) ? inputData.numQBins : std::max(std::min(roi.nx, roi.ny) / 2, 1u);
+    integrator_.init(inputData, roi, numQBins, inputData.numChiSectors);
+
+    const std::size_t numFrames = inputData.energies.size() * inputData.kVectors.size();
+    Iq_.assign(numFrames * numQBins, 0);
+    Iqchi_.assign(numFrames * numQBins * inputData.numChiSectors, 0);
+    AR_.assign(numFrames * numQBins, 0);
+    numFramesReduced_.assign(inputData.energies.size(), 0);
+    beginFile();
+  }
+
+  bool isComplete(const UINT energyID) const override {
+    return (file_ != nullptr) and manifest_.isComplete(energyID);
+  }
+
+  void write(const UINT energyID, const UINT kID, const Real *frame) override {
+    if (file_ == nullptr) {
+      return;
+    }
+    const UINT numQBins = integrator_.numQBins();
+    const std::size_t frameID = static_cast<std::size_t>(energyID) * inputData_->kVectors.size() + kID;
+    integrator_.reduce(frame, &Iq_[frameID * numQBins], &Iqchi_[frameID * numQBins * integrator_.numSectors()],
+                       &AR_[frameID * numQBins]);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (++numFramesReduced_[energyID] < inputData_->kVectors.size()) {
+        return;
+      }
+    }
+    writeEnergy(energyID);
+  }
+
+  void end() override {
+    if (file_ == nullptr) {
+      return;
+    }
+    endFile();
+  }
+};
+
+#endif //CY_RSOXS_AZIMUTHALINTEGRATION_H
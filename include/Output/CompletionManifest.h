@@ -0,0 +1,133 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_COMPLETIONMANIFEST_H
+#define CY_RSOXS_COMPLETIONMANIFEST_H
+
+#include <Datatypes.h>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/**
+ * @brief Record of the energies whose output is complete on disk. Every line of the manifest holds
+ * the energy and the file it was written to. A restarted run keeps the energies that are listed
+ * and whose file still exists.
+ */
+class CompletionManifest {
+  /// Energy as written to the manifest
+  std::vector<std::string> energyNames_;
+  /// Output file of every energy
+  std::vector<std::string> outputFiles_;
+  /// Energies that are complete
+  std::set<UINT> completed_;
+  std::ofstream file_;
+  std::mutex mutex_;
+
+  /**
+   * @param energyID energy index
+   * @return manifest entry of the energy
+   */
+  std::string entry(const UINT energyID) const {
+    return energyNames_[energyID] + " " + outputFiles_[energyID];
+  }
+
+public:
+  /**
+   * @brief opens the manifest. Without resume, the previous content is discarded.
+   * @param [in] fname manifest file
+   * @param [in] energies energies of the simulation
+   * @param [in] outputFiles output file of every energy
+   * @param [in] resume keep the energies that a previous run completed
+   */
+  void open(const std::string &fname, const std::vector<Real> &energies, const std::vector<std::string> &outputFiles,
+            const bool resume) {
+    energyNames_.resize(energies.size());
+    for (std::size_t i = 0; i < energies.size(); i++) {
+      std::stringstream stream;
+      stream << std::fixed << std::setprecision(2) << energies[i];
+      energyNames_[i] = stream.str();
+    }
+    outputFiles_ = outputFiles;
+    completed_.clear();
+    if (resume) {
+      std::set<std::string> entries;
+      std::ifstream fin(fname);
+      std::string line;
+      while (std::getline(fin, line)) {
+        entries.insert(line);
+      }
+      for (UINT i = 0; i < energies.size(); i++) {
+        struct stat fileStat{};
+        if ((entries.count(entry(i)) > 0) and (stat(outputFiles_[i].c_str(), &fileStat) == 0)) {
+          completed_.insert(i);
+        }
+      }
+    }
+    /// Only the energies verified above are kept.
+    file_.open(fname, std::ios::trunc);
+    for (const UINT energyID: completed_) {
+      file_ << entry(energyID) << "\n";
+    }
+    file_.flush();
+  }
+
+  /**
+   * @param [in] energyID energy index
+   * @return true if the energy is complete
+   */
+  bool isComplete(const UINT energyID) const {
+    return (completed_.count(energyID) > 0);
+  }
+
+  /**
+   * @return number of complete energies
+   */
+  std::size_t numComplete() const {
+    return completed_.size();
+  }
+
+  /**
+   * @brief records an energy as complete. Thread safe.
+   * @param [in] energyID energy index
+   */
+  void record(const UINT energyID) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    file_ << entry(energyID) << std::endl;
+  }
+
+  /**
+   * @brief closes the manifest
+   */
+  void close() {
+    file_.close();
+  }
+};
+
+#endif //CY_RSOXS_COMPLETIONMANIFEST_H
@@ -0,0 +1,325 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_DETECTORREMESH_H
+#define CY_RSOXS_DETECTORREMESH_H
+
+#include <Output/HDF5FrameSink.h>
+#include <Output/writeH5.h>
+#include <FrameROI.h>
+#include <utils.h>
+#include <H5Cpp.h>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Resamples the scattering patterns onto a flat detector normal to the beam (z). A detector pixel at (x, y)
+ * from the beam center at distance D sees qx = k x / R, qy = k y / R with R = sqrt(x^2 + y^2 + D^2). The value of a
+ * pixel is the bilinear interpolation of the pattern at its center, averaged over the binning x binning pixels of
+ * a binned pixel. The directions x / R, y / R of the pixels are computed once. As k depends on the energy, the
+ * sparse weights are built once per energy and reused for all its k vectors.
+ */
+class DetectorRemesher {
+public:
+  /// Sparse (CSR) interpolation weights from the pattern to the binned detector pixels
+  struct Weights {
+    std::vector<std::size_t> rowStart;
+    std::vector<UINT> column;
+    std::vector<Real> weight;
+  };
+
+private:
+  /// Size of the full pattern in x and y
+  UINT voxelSize_[2]{0, 0};
+  /// First pixel and size of the frames in x and y (region of interest)
+  UINT offset_[2]{0, 0};
+  UINT frameSize_[2]{0, 0};
+  /// Physical size (in nm)
+  Real physSize_ = 0;
+  /// Number of unbinned detector pixels in x and y
+  UINT numPixels_[2]{0, 0};
+  /// Binning factor
+  UINT binning_ = 1;
+  /// Direction x / R and y / R of every unbinned pixel
+  std::vector<Real> directionX_, directionY_;
+
+public:
+  /**
+   * @brief computes the direction of every pixel
+   * @param [in] inputData input data with the detector geometry
+   */
+  void init(const InputData &inputData) {
+    voxelSize_[0] = inputData.voxelDims[0];
+    voxelSize_[1] = inputData.voxelDims[1];
+    const FrameROI roi = getOutputROI(inputData);
+    offset_[0] = roi.x0;
+    offset_[1] = roi.y0;
+    frameSize_[0] = roi.nx;
+    frameSize_[1] = roi.ny;
+    physSize_ = inputData.physSize;
+    numPixels_[0] = inputData.detectorPixels[0];
+    numPixels_[1] = inputData.detectorPixels[1];
+    binning_ = inputData.detectorBinning;
+    const std::size_t numPixels = static_cast<std::size_t>(numPixels_[0]) * numPixels_[1];
+    directionX_.resize(numPixels);
+    directionY_.resize(numPixels);
+    const double distance = inputData.detectorDistance;
+    for (UINT j = 0; j < numPixels_[1]; j++) {
+      const double y = (j - inputData.detectorBeamCenter[1]) * inputData.detectorPixelSize;
+      for (UINT i = 0; i < numPixels_[0]; i++) {
+        const double x = (i - inputData.detectorBeamCenter[0]) * inputData.detectorPixelSize;
+        const double R = std::sqrt(x * x + y * y + distance * distance);
+        directionX_[static_cast<std::size_t>(j) * numPixels_[0] + i] = static_cast<Real>(x / R);
+        directionY_[static_cast<std::size_t>(j) * numPixels_[0] + i] = static_cast<Real>(y / R);
+      }
+    }
+  }
+
+  /**
+   * @param [in] dimID 0 for x, 1 for y
+   * @return number of binned pixels along the dimension
+   */
+  UINT getOutputSize(const UINT dimID) const {
+    return numPixels_[dimID] / binning_;
+  }
+
+  /**
+   * @brief builds the weights of an energy
+   * @param [in] energy energy (in eV)
+   * @param [out] weights interpolation weights
+   */
+  void computeWeights(const Real energy, Weights &weights) const {
+    const double kMagnitude = 2 * M_PI / (1239.84197 / energy);
+    const double start = -M_PI / physSize_;
+    const double dq[2]{(2 * M_PI / physSize_) / std::max(voxelSize_[0] - 1, 1u),
+                       (2 * M_PI / physSize_) / std::max(voxelSize_[1] - 1, 1u)};
+    const double binWeight = 1.0 / (binning_ * binning_);
+    const UINT outputSize[2]{getOutputSize(0), getOutputSize(1)};
+    weights.rowStart.assign(1, 0);
+    weights.column.clear();
+    weights.weight.clear();
+    for (UINT J = 0; J < outputSize[1]; J++) {
+      for (UINT I = 0; I < outputSize[0]; I++) {
+        for (UINT j = J * binning_; j < (J + 1) * binning_; j++) {
+          for (UINT i = I * binning_; i < (I + 1) * binning_; i++) {
+            const std::size_t pixelID = static_cast<std::size_t>(j) * numPixels_[0] + i;
+            /// Fractional index of the pixel in the frame
+            const double f[2]{(kMagnitude * directionX_[pixelID] - start) / dq[0] - offset_[0],
+                              (kMagnitude * directionY_[pixelID] - start) / dq[1] - offset_[1]};
+            if ((f[0] < 0) or (f[1] < 0) or (f[0] > frameSize_[0] - 1.0) or (f[1] > frameSize_[1] - 1.0)) {
+              continue;
+            }
+            const UINT X = std::min(static_cast<UINT>(f[0]), std::max(frameSize_[0], 2u) - 2);
+            const UINT Y = std::min(static_cast<UINT>(f[1]), std::max(frameSize_[1], 2u) - 2);
+            const double t[2]{f[0] - X, f[1] - Y};
+            for (UINT corner = 0; corner < 4; corner++) {
+              const UINT dx = corner % 2, dy = corner / 2;
+              const double w = (dx ? t[0] : 1 - t[0]) * (dy ? t[1] : 1 - t[1]) * binWeight;
+              if ((w > 0) and (X + dx < frameSize_[0]) and (Y + dy < frameSize_[1])) {
+                weights.column.push_back((Y + dy) * frameSize_[0] + X + dx);
+                weights.weight.push_back(static_cast<Real>(w));
+              }
+            }
+          }
+        }
+        weights.rowStart.push_back(weights.column.size());
+      }
+    }
+  }
+
+  /**
+   * @brief resamples a pattern. NaN pixels of the pattern are left out of the interpolation. Detector pixels
+   * outside the simulated q range (or the region of interest) are NaN.
+   * @param [in] weights weights of the energy of the pattern
+   * @param [in] frame scattering pattern
+   * @param [out] image detector image of size getOutputSize(0) x getOutputSize(1)
+   */
+  static void apply(const Weights &weights, const Real *frame, Real *image) {
+    const std::size_t numRows = weights.rowStart.size() - 1;
+    for (std::size_t row = 0; row < numRows; row++) {
+      double sum = 0, sumWeight = 0;
+      for (std::size_t id = weights.rowStart[row]; id < weights.rowStart[row + 1]; id++) {
+        const Real value = frame[weights.column[id]];
+        if (not(std::isnan(value))) {
+          sum += weights.weight[id] * value;
+          sumWeight += weights.weight[id];
+        }
+      }
+      image[row] = (sumWeight > 0) ? static_cast<Real>(sum / sumWeight) : std::numeric_limits<Real>::quiet_NaN();
+    }
+  }
+};
+
+/**
+ * @brief Writes the detector images to Detector.h5 with the dataset image[energy][k][y][x] and the coordinates
+ * energy, x and y (pixel centers in mm from the beam center). Images are written by the GPU thread that
+ * computed the pattern. An energy is recorded in DetectorEnergies.txt once all its k vectors are written,
+ * which allows a restarted run to skip it.
+ */
+class DetectorWriter : public HDF5FrameSink {
+  /// Storage options
+  H5::OutputOptions options_;
+  DetectorRemesher remesher_;
+  H5::DataSet dataset_;
+
+  /// Weights of every energy, built by the first of its frames and released once the energy is written
+  std::vector<std::unique_ptr<DetectorRemesher::Weights>> weights_;
+  std::unique_ptr<std::once_flag[]> weightsBuilt_;
+  std::vector<UINT> numFramesWritten_;
+
+  /**
+   * @return dimensions of the image dataset
+   */
+  std::array<hsize_t, 4> getDims() const {
+    return {inputData_->energies.size(), inputData_->kVectors.size(), remesher_.getOutputSize(1),
+            remesher_.getOutputSize(0)};
+  }
+
+  /**
+   * @brief creates the coordinates and the image dataset
+   */
+  void create() override {
+    const std::array<hsize_t, 4> dims = getDims();
+    const hsize_t chunkDims[4]{1, 1, dims[2], dims[3]};
+    H5::DSetCreatPropList plist = H5::getCreationProperties(4, chunkDims, options_);
+    plist.setChunk(4, chunkDims);
+    dataset_ = file_->createDataSet("image", H5::getFileType(options_), H5::DataSpace(4, dims.data()), plist);
+    writeCoordinate("energy", inputData_->energies, "eV");
+    for (UINT dimID = 0; dimID < 2; dimID++) {
+      const UINT binning = inputData_->detectorBinning;
+      std::vector<Real> position(remesher_.getOutputSize(dimID));
+      for (UINT i = 0; i < position.size(); i++) {
+        position[i] = static_cast<Real>((i * binning + (binning - 1) / 2.0 - inputData_->detectorBeamCenter[dimID])
+                                        * inputData_->detectorPixelSize);
+      }
+      writeCoordinate((dimID == 0) ? "x" : "y", position, "mm");
+    }
+    writeKList(*file_, *inputData_);
+  }
+
+  /**
+   * @brief opens the image dataset of a previous run
+   * @return false if it has different dimensions
+   */
+  bool open() override {
+    if (not(hasDataSet("image"))) {
+      return false;
+    }
+    dataset_ = file_->openDataSet("image");
+    const H5::DataSpace dataspace = dataset_.getSpace();
+    hsize_t dims[4];
+    if ((dataspace.getSimpleExtentNdims() != 4) or (dataset_.getDataType() != H5::getFileType(options_))) {
+      return false;
+    }
+    dataspace.getSimpleExtentDims(dims);
+    return std::equal(dims, dims + 4, getDims().begin());
+  }
+
+  void closeDatasets() override {
+    dataset_.close();
+  }
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] resume skip the energies that a previous run completed
+   */
+  explicit DetectorWriter(const bool resume = false)
+    : HDF5FrameSink(resume, "Detector.h5", "DetectorEnergies.txt") {
+  }
+
+  DetectorWriter(const DetectorWriter &) = delete;
+  DetectorWriter &operator=(const DetectorWriter &) = delete;
+
+  ~DetectorWriter() override {
+    end();
+  }
+
+  void begin(const InputData &inputData) override {
+    inputData_ = &inputData;
+    if (not(inputData.writeHDF5)) {
+      return;
+    }
+    options_ = getOutputOptions(inputData);
+    if (options_.precision == Output::Precision::SCALED_UINT16) {
+      std::cout << YLW << "[WARNING] ScaledUInt16 is not supported for the detector images. Storing Float16." << NRM
+                << "\n";
+      options_.precision = Output::Precision::HALF;
+    }
+    remesher_.init(inputData);
+    weights_.clear();
+    weights_.resize(inputData.energies.size());
+    weightsBuilt_.reset(new std::once_flag[inputData.energies.size()]);
+    numFramesWritten_.assign(inputData.energies.size(), 0);
+    beginFile();
+  }
+
+  bool isComplete(const UINT energyID) const override {
+    return (file_ != nullptr) and manifest_.isComplete(energyID);
+  }
+
+  void write(const UINT energyID, const UINT kID, const Real *frame) override {
+    if (file_ == nullptr) {
+      return;
+    }
+    std::call_once(weightsBuilt_[energyID], [this, energyID] {
+      weights_[energyID].reset(new DetectorRemesher::Weights);
+      remesher_.computeWeights(inputData_->energies[energyID], *weights_[energyID]);
+    });
+    const std::array<hsize_t, 4> dims = getDims();
+    std::vector<Real> image(dims[2] * dims[3]);
+    DetectorRemesher::apply(*weights_[energyID], frame, image.data());
+    {
+      std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+      const hsize_t offset[4]{energyID, kID, 0, 0};
+      const hsize_t count[4]{1, 1, dims[2], dims[3]};
+      H5::DataSpace fileSpace = dataset_.getSpace();
+      fileSpace.selectHyperslab(H5S_SELECT_SET, count, offset);
+      H5::DataSpace memSpace(2, &count[2]);
+#ifdef DOUBLE_PRECISION
+      dataset_.write(image.data(), H5::PredType::NATIVE_DOUBLE, memSpace, fileSpace);
+#else
+      dataset_.write(image.data(), H5::PredType::NATIVE_FLOAT, memSpace, fileSpace);
+#endif
+      if (++numFramesWritten_[energyID] < inputData_->kVectors.size()) {
+        return;
+      }
+      file_->flush(H5F_SCOPE_GLOBAL);
+      weights_[energyID].reset();
+    }
+    manifest_.record(energyID);
+  }
+
+  void end() override {
+    if (file_ == nullptr) {
+      return;
+    }
+    endFile();
+    weights_.clear();
+  }
+};
+
+#endif //CY_RSOXS_DETECTORREMESH_H
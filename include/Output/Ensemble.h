@@ -0,0 +1,119 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_ENSEMBLE_H
+#define CY_RSOXS_ENSEMBLE_H
+
+#include <Datatypes.h>
+#include <cmath>
+#include <vector>
+
+/**
+ * @brief Per-pixel running mean and variance of the scattering patterns of an ensemble of realizations
+ * (Welford's algorithm). Statistics are accumulated in double precision over the complete
+ * (energy, k, pixel) array, so that the individual realizations need not be stored.
+ */
+class EnsembleAccumulator {
+  /// Number of realizations added
+  UINT count_ = 0;
+  /// Running mean
+  std::vector<double> mean_;
+  /// Running sum of squared deviation from the mean
+  std::vector<double> m2_;
+
+public:
+  /**
+   * @brief adds a realization
+   * @param [in] projection scattering pattern of the realization
+   * @param [in] size number of entries in the scattering pattern
+   * @return false if the size does not match the previous realizations
+   */
+  bool add(const Real *projection, const std::size_t size) {
+    if (count_ == 0) {
+      mean_.assign(size, 0.0);
+      m2_.assign(size, 0.0);
+    } else if (size != mean_.size()) {
+      return false;
+    }
+    count_++;
+#pragma omp parallel for
+    for (std::size_t i = 0; i < size; i++) {
+      const double delta = projection[i] - mean_[i];
+      mean_[i] += delta / count_;
+      m2_[i] += delta * (projection[i] - mean_[i]);
+    }
+    return true;
+  }
+
+  /**
+   * @return number of realizations added
+   */
+  inline UINT count() const {
+    return count_;
+  }
+
+  /**
+   * @brief Relative standard error of the mean: \f$ \sqrt{\sum_i \sigma_i^2 / n} / \sqrt{\sum_i \mu_i^2} \f$.
+   * Masked (NaN) pixels are ignored.
+   * @return relative standard error. Infinity if less than two realizations are added.
+   */
+  double relativeStandardError() const {
+    if (count_ < 2) {
+      return INFINITY;
+    }
+    double sumVariance = 0, sumMeanSq = 0;
+#pragma omp parallel for reduction(+:sumVariance, sumMeanSq)
+    for (std::size_t i = 0; i < mean_.size(); i++) {
+      if (not(std::isnan(mean_[i]))) {
+        sumVariance += m2_[i] / (count_ - 1);
+        sumMeanSq += mean_[i] * mean_[i];
+      }
+    }
+    if (sumMeanSq == 0) {
+      return (sumVariance == 0) ? 0 : INFINITY;
+    }
+    return std::sqrt(sumVariance / count_ / sumMeanSq);
+  }
+
+  /**
+   * @brief gets the mean
+   * @param [out] mean mean of the realizations
+   */
+  void getMean(std::vector<Real> &mean) const {
+    mean.assign(mean_.begin(), mean_.end());
+  }
+
+  /**
+   * @brief gets the unbiased sample variance
+   * @param [out] variance variance of the realizations. 0 for a single realization.
+   */
+  void getVariance(std::vector<Real> &variance) const {
+    variance.resize(m2_.size());
+    for (std::size_t i = 0; i < m2_.size(); i++) {
+      variance[i] = (count_ > 1) ? static_cast<Real>(m2_[i] / (count_ - 1)) : 0;
+    }
+  }
+};
+
+#endif //CY_RSOXS_ENSEMBLE_H
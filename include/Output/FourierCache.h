@@ -0,0 +1,67 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_FOURIERCACHE_H
+#define CY_RSOXS_FOURIERCACHE_H
+
+#include <Datatypes.h>
+#include <Input/Input.h>
+#include <vector>
+
+class InputData;
+
+/**
+ * @brief Store of the Fourier transformed Nt = (NR:NR - I) of every energy. Nt does not depend on the k vectors,
+ * the E rotation angles, the detector or the Ewald interpolation, so a run that only changes those can reproject
+ * the stored Nt instead of computing the polarization and the FFT again. load() and store() are called
+ * concurrently from every GPU thread.
+ */
+class FourierCache {
+public:
+  virtual ~FourierCache() = default;
+
+  /**
+   * @brief called once before the computation starts
+   * @param [in] inputData input data of the simulation
+   * @param [in] materialInput optical constants of every energy and material
+   */
+  virtual void begin(const InputData &inputData, const std::vector<Material> &materialInput) {}
+
+  /**
+   * @brief reads the transformed Nt of an energy
+   * @param [in] energyID energy index
+   * @param [out] Nt transformed Nt of 6 x numVoxels in the device layout
+   * @return false if the energy is not in the cache
+   */
+  virtual bool load(const UINT energyID, Complex *Nt) = 0;
+
+  /**
+   * @brief stores the transformed Nt of an energy
+   * @param [in] energyID energy index
+   * @param [in] Nt transformed Nt of 6 x numVoxels in the device layout
+   */
+  virtual void store(const UINT energyID, const Complex *Nt) = 0;
+};
+
+#endif //CY_RSOXS_FOURIERCACHE_H
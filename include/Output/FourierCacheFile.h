@@ -0,0 +1,161 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_FOURIERCACHEFILE_H
+#define CY_RSOXS_FOURIERCACHEFILE_H
+
+#include <Output/FourierCache.h>
+#include <Output/outputUtils.h>
+#include <Input/InputData.h>
+#include <H5Cpp.h>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/**
+ * @brief Fourier cache with one HDF5 file per energy, <FourierCacheDir>/Fourier_<energy>.h5. The dataset Nt of
+ * dimension [3][Z][Y][X][4] holds the component pairs (0,1) (2,3) (4,5) of the symmetric tensor as (re, im, re, im),
+ * chunked by Z slice. The attribute Key holds the hash of the morphology, the dimensions, PhysSize, morphology type,
+ * energy, the optical constants, MAX_NUM_MATERIAL and the size of Real; an entry is used only if they match.
+ */
+class FourierCacheFile : public FourierCache {
+  /// Cache directory
+  std::string dirName_;
+  /// Reuse the entries of previous runs
+  bool reuse_ = false;
+  /// Hash of the morphology the entries are computed from
+  const uint64_t morphologyHash_;
+  /// Voxel dimensions
+  UINT voxelDims_[3]{0, 0, 0};
+  /// Key of every energy
+  std::vector<std::vector<double>> keys_;
+  /// File of every energy
+  std::vector<std::string> fileNames_;
+
+  /**
+   * @return datatype of the stored values
+   */
+  static const H5::PredType &getRealType() {
+#ifdef DOUBLE_PRECISION
+    return H5::PredType::NATIVE_DOUBLE;
+#else
+    return H5::PredType::NATIVE_FLOAT;
+#endif
+  }
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] morphologyHash hash of the morphology the entries are computed from
+   */
+  explicit FourierCacheFile(const uint64_t morphologyHash)
+    : morphologyHash_(morphologyHash) {
+  }
+
+  void begin(const InputData &inputData, const std::vector<Material> &materialInput) override {
+    dirName_ = inputData.fourierCacheDir;
+    reuse_ = (inputData.fourierCacheMode == FourierCacheMode::Type::REPROJECT);
+    std::copy(inputData.voxelDims, inputData.voxelDims + 3, voxelDims_);
+    createDirectory(dirName_);
+    const UINT numEnergy = inputData.energies.size();
+    const int numMaterial = inputData.NUM_MATERIAL;
+    keys_.resize(numEnergy);
+    fileNames_.resize(numEnergy);
+    for (UINT i = 0; i < numEnergy; i++) {
+      std::vector<double> &key = keys_[i];
+      /// The hash is split in two halves that are stored exactly as double
+      key = {static_cast<double>(morphologyHash_ >> 32), static_cast<double>(morphologyHash_ & 0xFFFFFFFFULL),
+             static_cast<double>(MAX_NUM_MATERIAL), static_cast<double>(sizeof(Real)),
+             static_cast<double>(voxelDims_[0]), static_cast<double>(voxelDims_[1]), static_cast<double>(voxelDims_[2]),
+             inputData.physSize, static_cast<double>(inputData.morphologyType), inputData.energies[i]};
+      for (int numMat = 0; numMat < numMaterial; numMat++) {
+        const Material &material = materialInput[i * numMaterial + numMat];
+        key.insert(key.end(), {material.npara.x, material.npara.y, material.nperp.x, material.nperp.y});
+      }
+      std::stringstream stream;
+      stream << std::fixed << std::setprecision(2) << inputData.energies[i];
+      fileNames_[i] = dirName_ + "/Fourier_" + stream.str() + ".h5";
+    }
+  }
+
+  bool load(const UINT energyID, Complex *Nt) override {
+    const std::string &fname = fileNames_[energyID];
+    struct stat fileStat{};
+    if (not(reuse_) or (stat(fname.c_str(), &fileStat) != 0)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+    const std::vector<double> &key = keys_[energyID];
+    try {
+      H5::H5File file(fname.c_str(), H5F_ACC_RDONLY);
+      const H5::Attribute attribute = file.openAttribute("Key");
+      std::vector<double> storedKey(attribute.getSpace().getSimpleExtentNpoints());
+      if (storedKey.size() == key.size()) {
+        attribute.read(H5::PredType::NATIVE_DOUBLE, storedKey.data());
+      }
+      if (storedKey != key) {
+        std::cout << YLW << "[WARNING] " << fname << " was computed with different parameters. Recomputing." << NRM << "\n";
+        return false;
+      }
+      const H5::DataSet dataset = file.openDataSet("Nt");
+      dataset.read(Nt, getRealType());
+    }
+    catch (const H5::Exception &error) {
+      std::cout << YLW << "[WARNING] Cannot read " << fname << ". Recomputing." << NRM << "\n";
+      return false;
+    }
+    return true;
+  }
+
+  void store(const UINT energyID, const Complex *Nt) override {
+    const std::string &fname = fileNames_[energyID];
+    /// Written to a temporary file first, so that an interrupted run does not leave a partial entry
+    const std::string tmpName = fname + ".tmp";
+    std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+    {
+      H5::H5File file(tmpName.c_str(), H5F_ACC_TRUNC);
+      const hsize_t dims[5]{3, voxelDims_[2], voxelDims_[1], voxelDims_[0], 4};
+      const hsize_t chunkDims[5]{1, 1, voxelDims_[1], voxelDims_[0], 4};
+      H5::DSetCreatPropList plist;
+      plist.setChunk(5, chunkDims);
+      const H5::DataSpace dataspace(5, dims);
+      H5::DataSet dataset = file.createDataSet("Nt", getRealType(), dataspace, plist);
+      dataset.write(Nt, getRealType());
+      const std::vector<double> &key = keys_[energyID];
+      const hsize_t keySize = key.size();
+      file.createAttribute("Key", H5::PredType::NATIVE_DOUBLE, H5::DataSpace(1, &keySize))
+          .write(H5::PredType::NATIVE_DOUBLE, key.data());
+    }
+    if (std::rename(tmpName.c_str(), fname.c_str()) != 0) {
+      std::cout << YLW << "[WARNING] Cannot write " << fname << NRM << "\n";
+    }
+  }
+};
+
+#endif //CY_RSOXS_FOURIERCACHEFILE_H
@@ -0,0 +1,117 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_FOURIERCACHEMEMORY_H
+#define CY_RSOXS_FOURIERCACHEMEMORY_H
+
+#include <Output/FourierCache.h>
+#include <Input/InputData.h>
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Fourier cache held in host memory, used to keep the transformed Nt between the runs of a session. An
+ * entry is keyed by the dimensions, PhysSize, morphology type, energy and the optical constants, as in
+ * FourierCacheFile. Entries that are not used by the current run are dropped in begin(). The incremental update
+ * of a session stores the entries again after adding the change of a few voxels on the device.
+ */
+class FourierCacheMemory : public FourierCache {
+  /// Transformed Nt of every key
+  std::map<std::vector<double>, std::vector<Complex>> entries_;
+  /// Key of every energy of the current run
+  std::vector<std::vector<double>> keys_;
+  /// Number of values of an entry
+  std::size_t entrySize_ = 0;
+  std::mutex mutex_;
+
+public:
+  void begin(const InputData &inputData, const std::vector<Material> &materialInput) override {
+    const UINT numEnergy = inputData.energies.size();
+    const int numMaterial = inputData.NUM_MATERIAL;
+    entrySize_ = static_cast<std::size_t>(inputData.voxelDims[0]) * inputData.voxelDims[1] * inputData.voxelDims[2] * 6;
+    keys_.resize(numEnergy);
+    for (UINT i = 0; i < numEnergy; i++) {
+      std::vector<double> &key = keys_[i];
+      key = {static_cast<double>(inputData.voxelDims[0]), static_cast<double>(inputData.voxelDims[1]),
+             static_cast<double>(inputData.voxelDims[2]), inputData.physSize,
+             static_cast<double>(inputData.morphologyType), inputData.energies[i]};
+      for (int numMat = 0; numMat < numMaterial; numMat++) {
+        const Material &material = materialInput[i * numMaterial + numMat];
+        key.insert(key.end(), {material.npara.x, material.npara.y, material.nperp.x, material.nperp.y});
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (std::find(keys_.begin(), keys_.end(), it->first) == keys_.end()) {
+        it = entries_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  bool load(const UINT energyID, Complex *Nt) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = entries_.find(keys_[energyID]);
+    if (it == entries_.end()) {
+      return false;
+    }
+    std::memcpy(Nt, it->second.data(), sizeof(Complex) * entrySize_);
+    return true;
+  }
+
+  void store(const UINT energyID, const Complex *Nt) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[keys_[energyID]].assign(Nt, Nt + entrySize_);
+  }
+
+  /**
+   * @brief transformed Nt of every energy of the current run
+   * @return entry of every energy. nullptr for the energies that are not stored.
+   */
+  std::vector<Complex *> getEntries() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Complex *> entries(keys_.size(), nullptr);
+    for (std::size_t i = 0; i < keys_.size(); i++) {
+      const auto it = entries_.find(keys_[i]);
+      if (it != entries_.end()) {
+        entries[i] = it->second.data();
+      }
+    }
+    return entries;
+  }
+
+  /**
+   * @brief drops every entry
+   */
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+  }
+};
+
+#endif //CY_RSOXS_FOURIERCACHEMEMORY_H
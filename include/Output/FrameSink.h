@@ -0,0 +1,78 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_FRAMESINK_H
+#define CY_RSOXS_FRAMESINK_H
+
+#include <Datatypes.h>
+
+class InputData;
+
+/**
+ * @brief Consumer of the scattering pattern of one (energy, k) pair as soon as it is computed.
+ * When a sink is passed to cudaMain / cudaMainStreams the patterns are not gathered in
+ * projectionGPUAveraged. write() is called concurrently from every GPU thread.
+ */
+class FrameSink {
+public:
+  virtual ~FrameSink() = default;
+
+  /**
+   * @brief called once before the computation starts
+   * @param [in] inputData input data of the simulation
+   */
+  virtual void begin(const InputData &inputData) {}
+
+  /**
+   * @param [in] energyID energy index
+   * @return true if the energy is already complete and need not be computed
+   */
+  virtual bool isComplete(const UINT energyID) const {
+    return false;
+  }
+
+  /**
+   * @brief consumes one frame. The frame is only valid during the call.
+   * @param [in] energyID energy index
+   * @param [in] kID k vector index
+   * @param [in] frame scattering pattern cropped to the output ROI, of size roi.nx x roi.ny (see getOutputROI)
+   */
+  virtual void write(const UINT energyID, const UINT kID, const Real *frame) = 0;
+
+  /**
+   * @brief records the number of E angles the frame of (energy, k) is averaged over. Only called with
+   * EAngleAdaptive, before write() of the frame.
+   * @param [in] energyID energy index
+   * @param [in] kID k vector index
+   * @param [in] numAngles number of E angles
+   */
+  virtual void setNumAngles(const UINT energyID, const UINT kID, const UINT numAngles) {}
+
+  /**
+   * @brief called once after all the frames have been written
+   */
+  virtual void end() {}
+};
+
+#endif //CY_RSOXS_FRAMESINK_H
@@ -0,0 +1,183 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_FRAMESTAGER_H
+#define CY_RSOXS_FRAMESTAGER_H
+
+#include <cudaHeaders.h>
+#include <Datatypes.h>
+#include <Arena.h>
+#include <FrameROI.h>
+#include <Input/InputData.h>
+#include <Output/FrameSink.h>
+#include <Output/WriterPool.h>
+#include <cuda_runtime.h>
+#include <exception>
+#include <future>
+#include <memory>
+
+/**
+ * @brief Hands the frames of one GPU to the sink without stalling the device. The region of interest of a frame is
+ * copied on a copy stream into one of two pinned buffers, and a host thread waits for the copy, masks the frame and
+ * writes it to the sink while the device computes the next (energy, k). The copy stream is a blocking stream, so the
+ * copy starts after the work already queued on the default stream and the next work queued on the default stream
+ * waits for the copy.
+ */
+class FrameStager {
+  static constexpr int NUM_BUFFERS = 2;
+
+  const InputData &inputData_;
+  const FrameROI roi_;
+  FrameSink *sink_;
+  const int deviceID_;
+  cudaStream_t copyStream_;
+  cudaEvent_t copied_[NUM_BUFFERS];
+  Real *frames_[NUM_BUFFERS];
+  /// Completion of the host stage of every buffer
+  std::future<void> pending_[NUM_BUFFERS];
+  /// First error of the host stage, rethrown by finish()
+  std::exception_ptr error_;
+  /// Index of the buffer of the next frame
+  int next_ = 0;
+  /// Runs the host stage of the frames in the order they were pushed
+  WriterPool hostStage_;
+
+  /**
+   * @brief waits for the host stage of a buffer and keeps its error
+   * @param [in] bufferID buffer
+   */
+  void wait(const int bufferID) {
+    if (not(pending_[bufferID].valid())) {
+      return;
+    }
+    try {
+      pending_[bufferID].get();
+    } catch (...) {
+      if (not(error_)) {
+        error_ = std::current_exception();
+      }
+    }
+  }
+
+public:
+  /**
+   * @brief Number of bytes of the staging buffers in the pinned arena
+   * @param [in] roi region of the frames that is written
+   * @return bytes
+   */
+  static inline std::size_t getBytes(const FrameROI &roi) {
+    return NUM_BUFFERS * Arena::getBytes<Real>(static_cast<std::size_t>(roi.nx) * roi.ny);
+  }
+
+  /**
+   * @brief Constructor. Must be called on the device that computes the frames.
+   * @param [in] inputData input data
+   * @param [in] roi region of the frames that is written
+   * @param [in] sink sink the frames are written to
+   * @param [in] deviceID GPU that computes the frames
+   * @param [in] pinnedArena arena with at least getBytes(roi) bytes free
+   */
+  FrameStager(const InputData &inputData, const FrameROI &roi, FrameSink *sink, const int deviceID, Arena &pinnedArena)
+    : inputData_(inputData), roi_(roi), sink_(sink), deviceID_(deviceID), hostStage_(1, NUM_BUFFERS) {
+    gpuErrchk(cudaStreamCreate(&copyStream_));
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+      gpuErrchk(cudaEventCreateWithFlags(&copied_[i], cudaEventDisableTiming));
+      frames_[i] = pinnedArena.allocate<Real>(static_cast<std::size_t>(roi.nx) * roi.ny);
+    }
+  }
+
+  FrameStager(const FrameStager &) = delete;
+  FrameStager &operator=(const FrameStager &) = delete;
+
+  /**
+   * @brief Destructor. Waits for the frames in flight. Errors are only reported by finish().
+   */
+  ~FrameStager() {
+    for (auto &pending: pending_) {
+      if (pending.valid()) {
+        pending.wait();
+      }
+    }
+    hostStage_.finish();
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+      cudaEventDestroy(copied_[i]);
+    }
+    cudaStreamDestroy(copyStream_);
+  }
+
+  /**
+   * @brief Queues the copy of a frame and its hand over to the sink. Blocks only if both buffers are in flight. Does
+   * not throw: an error of the sink is kept and rethrown by finish(), and the later frames are dropped.
+   * @param [in] d_frame frame of size voxelDims[0] x voxelDims[1] on the device. May be overwritten by the work
+   * queued on the default stream after this call.
+   * @param [in] energyID energy index
+   * @param [in] kID k vector index
+   * @param [in] numAngles number of E angles the frame is averaged over. 0 to not record it.
+   */
+  void push(const Real *d_frame, const UINT energyID, const UINT kID, const UINT numAngles = 0) {
+    const int bufferID = next_;
+    next_ = (next_ + 1) % NUM_BUFFERS;
+    wait(bufferID);
+    if (error_) {
+      return;
+    }
+    const UINT pitch = inputData_.voxelDims[0];
+    CUDA_CHECK_RETURN(cudaMemcpy2DAsync(frames_[bufferID], roi_.nx * sizeof(Real),
+                                        &d_frame[static_cast<std::size_t>(roi_.y0) * pitch + roi_.x0],
+                                        pitch * sizeof(Real), roi_.nx * sizeof(Real), roi_.ny,
+                                        cudaMemcpyDeviceToHost, copyStream_));
+    gpuErrchk(cudaEventRecord(copied_[bufferID], copyStream_));
+
+    std::shared_ptr<std::promise<void>> done(new std::promise<void>);
+    pending_[bufferID] = done->get_future();
+    hostStage_.submit(0, [this, bufferID, energyID, kID, numAngles, done]() {
+      try {
+        cudaSetDevice(deviceID_);
+        gpuErrchk(cudaEventSynchronize(copied_[bufferID]));
+        maskOutsideROI(inputData_, roi_, frames_[bufferID]);
+        if (numAngles > 0) {
+          sink_->setNumAngles(energyID, kID, numAngles);
+        }
+        sink_->write(energyID, kID, frames_[bufferID]);
+        done->set_value();
+      } catch (...) {
+        done->set_exception(std::current_exception());
+      }
+    });
+  }
+
+  /**
+   * @brief Waits until all the frames pushed so far are written. Rethrows the first exception of the sink.
+   */
+  void finish() {
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+      wait(i);
+    }
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+};
+
+#endif //CY_RSOXS_FRAMESTAGER_H
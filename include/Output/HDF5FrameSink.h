@@ -0,0 +1,186 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_HDF5FRAMESINK_H
+#define CY_RSOXS_HDF5FRAMESINK_H
+
+#include <Output/FrameSink.h>
+#include <Output/CompletionManifest.h>
+#include <Output/outputUtils.h>
+#include <Input/InputData.h>
+#include <H5Cpp.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/**
+ * @brief Base of the sinks that write a single HDF5 file for the whole run, with a manifest of the complete energies.
+ * On resume, the file of the previous run is reopened if its datasets match the current run. Otherwise the run
+ * starts over with a new file and an empty manifest.
+ */
+class HDF5FrameSink : public FrameSink {
+  /// Name of the output file in the output directory
+  const std::string fileName_;
+  /// Name of the manifest in the output directory
+  const std::string manifestName_;
+
+protected:
+  /// Skip the energies recorded in the manifest
+  const bool resume_;
+  /// Input data of the current simulation
+  const InputData *inputData_ = nullptr;
+  /// Manifest of complete energies
+  CompletionManifest manifest_;
+  /// Output file
+  std::unique_ptr<H5::H5File> file_;
+
+  /**
+   * @brief Constructor
+   * @param [in] resume skip the energies that a previous run completed
+   * @param [in] fileName name of the output file in the output directory
+   * @param [in] manifestName name of the manifest in the output directory
+   */
+  HDF5FrameSink(const bool resume, const std::string &fileName, const std::string &manifestName)
+    : fileName_(fileName), manifestName_(manifestName), resume_(resume) {
+  }
+
+  /**
+   * @brief creates the datasets in the new file_
+   */
+  virtual void create() = 0;
+
+  /**
+   * @brief opens the datasets of the file_ of a previous run
+   * @return false if they do not match the current run. The file is then closed by the caller.
+   */
+  virtual bool open() = 0;
+
+  /**
+   * @brief closes the datasets the sink holds open. A dataset left open keeps the file open.
+   */
+  virtual void closeDatasets() {
+  }
+
+  /**
+   * @return file access properties
+   */
+  virtual H5::FileAccPropList getFileAccessProperties() const {
+    return H5::FileAccPropList();
+  }
+
+  /**
+   * @return the file name
+   */
+  std::string getFileName() const {
+    return inputData_->HDF5DirName + "/" + fileName_;
+  }
+
+  /**
+   * @param [in] name dataset name
+   * @return true if the file has the dataset
+   */
+  bool hasDataSet(const std::string &name) const {
+    return H5Lexists(file_->getId(), name.c_str(), H5P_DEFAULT) > 0;
+  }
+
+  /**
+   * @brief closes the datasets and the file
+   */
+  void closeFile() {
+    closeDatasets();
+    file_.reset();
+  }
+
+  /**
+   * @brief opens the manifest, and the file of the previous run on resume or a new file otherwise. Holds the HDF5
+   * mutex. inputData_ must be set.
+   */
+  void beginFile() {
+    createDirectory(inputData_->HDF5DirName);
+    const std::string manifestName = inputData_->HDF5DirName + "/" + manifestName_;
+    const std::vector<std::string> outputFiles(inputData_->energies.size(), getFileName());
+    std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+    manifest_.open(manifestName, inputData_->energies, outputFiles, resume_);
+    if ((manifest_.numComplete() > 0) and openFile()) {
+      if (open()) {
+        return;
+      }
+      closeFile();
+    }
+    manifest_.close();
+    manifest_.open(manifestName, inputData_->energies, outputFiles, false);
+    file_.reset(new H5::H5File(getFileName().c_str(), H5F_ACC_TRUNC, H5::FileCreatPropList::DEFAULT,
+                               getFileAccessProperties()));
+    create();
+  }
+
+  /**
+   * @brief closes the file and the manifest. Holds the HDF5 mutex.
+   */
+  void endFile() {
+    std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+    closeFile();
+    manifest_.close();
+  }
+
+  /**
+   * @brief writes a 1D coordinate dataset
+   * @param name dataset name
+   * @param values values
+   * @param units units
+   * @return the coordinate dataset
+   */
+  H5::DataSet writeCoordinate(const std::string &name, const std::vector<Real> &values, const std::string &units) {
+    const hsize_t dims[1]{values.size()};
+#ifdef DOUBLE_PRECISION
+    H5::DataSet coordinate = file_->createDataSet(name, H5::PredType::NATIVE_DOUBLE, H5::DataSpace(1, dims));
+    coordinate.write(values.data(), H5::PredType::NATIVE_DOUBLE);
+#else
+    H5::DataSet coordinate = file_->createDataSet(name, H5::PredType::NATIVE_FLOAT, H5::DataSpace(1, dims));
+    coordinate.write(values.data(), H5::PredType::NATIVE_FLOAT);
+#endif
+    H5::StrType strType(H5::PredType::C_S1, units.size() + 1);
+    coordinate.createAttribute("units", strType, H5::DataSpace(H5S_SCALAR)).write(strType, units.c_str());
+    return coordinate;
+  }
+
+private:
+  /**
+   * @brief opens the file of a previous run
+   * @return false if the file does not exist or is not an HDF5 file
+   */
+  bool openFile() {
+    const std::string fname = getFileName();
+    struct stat fileStat{};
+    if ((stat(fname.c_str(), &fileStat) != 0) or (H5::H5File::isHdf5(fname.c_str()) <= 0)) {
+      return false;
+    }
+    file_.reset(new H5::H5File(fname.c_str(), H5F_ACC_RDWR, H5::FileCreatPropList::DEFAULT, getFileAccessProperties()));
+    return true;
+  }
+};
+
+#endif //CY_RSOXS_HDF5FRAMESINK_H
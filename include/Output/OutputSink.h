@@ -0,0 +1,106 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_OUTPUTSINK_H
+#define CY_RSOXS_OUTPUTSINK_H
+
+#include <Output/FrameSink.h>
+#include <Output/AzimuthalIntegration.h>
+#include <Output/DetectorRemesh.h>
+#include <Output/SpectralCube.h>
+#include <Output/StreamingWriter.h>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Writes the frames in the layout selected by OutputLayout of the input data, and their
+ * azimuthal integration with AzimuthalIntegration and their detector images with DetectorRemesh. An energy is complete once every output is complete.
+ */
+class OutputSink : public FrameSink {
+  /// Skip the energies that a previous run completed
+  const bool resume_;
+  /// Writer of the selected layout and reductions
+  std::vector<std::unique_ptr<FrameSink>> sinks_;
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] resume skip the energies that a previous run completed
+   */
+  explicit OutputSink(const bool resume = false)
+    : resume_(resume) {
+  }
+
+  void begin(const InputData &inputData) override {
+    sinks_.clear();
+    if (inputData.writeFrames) {
+      if (inputData.outputLayout == Output::Layout::SPECTRAL_CUBE) {
+        sinks_.emplace_back(new SpectralCubeWriter(resume_));
+      } else {
+        sinks_.emplace_back(new StreamingH5Writer(resume_));
+      }
+    }
+    if (inputData.azimuthalIntegration) {
+      sinks_.emplace_back(new AzimuthalIntegrationWriter(resume_));
+    }
+    if (inputData.detectorRemesh) {
+      sinks_.emplace_back(new DetectorWriter(resume_));
+    }
+    for (auto &sink: sinks_) {
+      sink->begin(inputData);
+    }
+  }
+
+  bool isComplete(const UINT energyID) const override {
+    if (sinks_.empty()) {
+      return false;
+    }
+    for (const auto &sink: sinks_) {
+      if (not(sink->isComplete(energyID))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void write(const UINT energyID, const UINT kID, const Real *frame) override {
+    for (auto &sink: sinks_) {
+      sink->write(energyID, kID, frame);
+    }
+  }
+
+  void setNumAngles(const UINT energyID, const UINT kID, const UINT numAngles) override {
+    for (auto &sink: sinks_) {
+      sink->setNumAngles(energyID, kID, numAngles);
+    }
+  }
+
+  void end() override {
+    for (auto &sink: sinks_) {
+      sink->end();
+    }
+  }
+};
+
+#endif //CY_RSOXS_OUTPUTSINK_H
@@ -0,0 +1,310 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_RESULTCACHE_H
+#define CY_RSOXS_RESULTCACHE_H
+
+#include <Output/FrameSink.h>
+#include <Output/outputUtils.h>
+#include <Input/Input.h>
+#include <Input/InputData.h>
+#include <FrameROI.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/**
+ * @brief 64 bit hash of a byte array
+ * @param [in] data data
+ * @param [in] numBytes number of bytes
+ * @param [in] seed hash to continue from
+ * @return hash
+ */
+static uint64_t hashBytes(const void *data, const std::size_t numBytes, uint64_t seed = 0xcbf29ce484222325ULL) {
+  static constexpr uint64_t prime = 0x9E3779B97F4A7C15ULL;
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  uint64_t hash = seed;
+  std::size_t i = 0;
+  for (; i + 8 <= numBytes; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, 8);
+    hash = (((hash << 27) | (hash >> 37)) ^ word) * prime;
+  }
+  for (; i < numBytes; i++) {
+    hash = (((hash << 27) | (hash >> 37)) ^ bytes[i]) * prime;
+  }
+  /// Final mixing, so that every input bit affects every output bit
+  hash ^= hash >> 31;
+  hash *= 0xBF58476D1CE4E5B9ULL;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+/**
+ * @brief Content addressed cache of the scattering patterns. Every energy is an entry <ResultCacheDir>/<key>.bin
+ * holding the frames of all k vectors and their number of E angles, where the key hashes the morphology, the optical constants of the energy
+ * and every input that affects the patterns. Wraps the sink of the run: in begin(), the energies found in the cache
+ * are written to the sink and reported complete, so they are not computed. The frames of the other energies are
+ * passed through and stored once all k vectors of an energy are computed. When the entries exceed
+ * ResultCacheSizeMB, the least recently used ones are removed; the modification time of an entry is its last use.
+ */
+class ResultCache : public FrameSink {
+  /// Identifies the cache entries
+  static constexpr std::size_t MAGIC_SIZE = 8;
+  static const char *getMagic() {
+    return "CYRSXRC2";
+  }
+
+  /// Sink receiving the frames
+  FrameSink *sink_;
+  /// Hash of the morphology
+  const uint64_t morphologyHash_;
+  /// Optical constants of every energy and material
+  const std::vector<Material> &materialInput_;
+  /// Cache directory
+  std::string dirName_;
+  /// Size limit of the cache (in bytes)
+  uint64_t maxSize_ = 0;
+  /// Number of k vectors
+  UINT numK_ = 0;
+  /// Number of pixels of a frame
+  std::size_t frameSize_ = 0;
+  /// Entry of every energy
+  std::vector<std::string> fileNames_;
+  /// Energies served from the cache
+  std::vector<bool> served_;
+  /// Frames of the energies being computed
+  std::vector<std::vector<Real>> pending_;
+  /// Number of frames in pending_
+  std::vector<UINT> numPending_;
+  /// Number of E angles of every (energy, k) frame. 0 if not recorded.
+  std::vector<uint64_t> numAngles_;
+  std::mutex mutex_;
+
+  /**
+   * @brief key of every energy
+   * @param [in] inputData input data
+   * @return file name of the entry of every energy
+   */
+  std::vector<std::string> getFileNames(const InputData &inputData) const {
+    std::vector<double> parameters{
+      static_cast<double>(inputData.voxelDims[0]), static_cast<double>(inputData.voxelDims[1]),
+      static_cast<double>(inputData.voxelDims[2]), inputData.physSize, static_cast<double>(inputData.NUM_MATERIAL),
+      static_cast<double>(inputData.morphologyType), static_cast<double>(inputData.caseType),
+      static_cast<double>(inputData.referenceFrame), static_cast<double>(inputData.algorithmType),
+      static_cast<double>(inputData.scatterApproach), static_cast<double>(inputData.ewaldsInterpolation),
+      static_cast<double>(inputData.windowingType), static_cast<double>(inputData.rotMask),
+      inputData.startAngle, inputData.incrementAngle, inputData.endAngle,
+      static_cast<double>(inputData.eAngleAdaptive), inputData.eAngleTolerance, static_cast<double>(inputData.eAngleNorm),
+      static_cast<double>(inputData.eAngleInitialCount),
+      inputData.detectorCoordinates.x, inputData.detectorCoordinates.y, inputData.detectorCoordinates.z,
+      static_cast<double>(inputData.roiType), inputData.roiQRange[0], inputData.roiQRange[1],
+      inputData.roiQBox[0], inputData.roiQBox[1], inputData.roiQBox[2], inputData.roiQBox[3],
+      static_cast<double>(inputData.ewaldEngine), inputData.nufftTolerance, inputData.nufftUpsampling,
+      static_cast<double>(sizeof(Real))};
+    for (const auto &kVec: inputData.kVectors) {
+      parameters.insert(parameters.end(), {kVec.x, kVec.y, kVec.z});
+    }
+    const uint64_t runHash = hashBytes(parameters.data(), parameters.size() * sizeof(double), morphologyHash_);
+    std::vector<std::string> fileNames(inputData.energies.size());
+    for (std::size_t i = 0; i < fileNames.size(); i++) {
+      uint64_t hash = hashBytes(&inputData.energies[i], sizeof(Real), runHash);
+      hash = hashBytes(&materialInput_[i * inputData.NUM_MATERIAL], sizeof(Material) * inputData.NUM_MATERIAL, hash);
+      char key[17];
+      std::snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(hash));
+      fileNames[i] = dirName_ + "/" + key + ".bin";
+    }
+    return fileNames;
+  }
+
+  /**
+   * @brief reads the frames of an entry
+   * @param [in] fname entry
+   * @param [out] frames frames of all k vectors
+   * @param [out] numAngles number of E angles of every k vector
+   * @return false if the entry does not exist or does not match
+   */
+  bool read(const std::string &fname, std::vector<Real> &frames, uint64_t *numAngles) const {
+    std::ifstream fin(fname, std::ios::binary);
+    char magic[MAGIC_SIZE];
+    uint64_t header[2];
+    if (not(fin.read(magic, sizeof(magic))) or not(fin.read(reinterpret_cast<char *>(header), sizeof(header)))
+        or (std::memcmp(magic, getMagic(), MAGIC_SIZE) != 0) or (header[0] != numK_) or (header[1] != frameSize_)) {
+      return false;
+    }
+    frames.resize(numK_ * frameSize_);
+    return (fin.read(reinterpret_cast<char *>(numAngles), sizeof(uint64_t) * numK_)
+            and fin.read(reinterpret_cast<char *>(frames.data()), sizeof(Real) * frames.size()));
+  }
+
+  /**
+   * @brief writes an entry and removes the least recently used entries beyond the size limit
+   * @param [in] fname entry
+   * @param [in] frames frames of all k vectors
+   * @param [in] numAngles number of E angles of every k vector
+   */
+  void store(const std::string &fname, const std::vector<Real> &frames, const uint64_t *numAngles) {
+    const uint64_t entrySize = MAGIC_SIZE + (2 + numK_) * sizeof(uint64_t) + sizeof(Real) * frames.size();
+    if (entrySize > maxSize_) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    evict(maxSize_ - entrySize);
+    /// Written to a temporary file first, so that an interrupted run does not leave a partial entry
+    const std::string tmpName = fname + ".tmp";
+    {
+      std::ofstream fout(tmpName, std::ios::binary);
+      const uint64_t header[2]{numK_, frameSize_};
+      fout.write(getMagic(), MAGIC_SIZE);
+      fout.write(reinterpret_cast<const char *>(header), sizeof(header));
+      fout.write(reinterpret_cast<const char *>(numAngles), sizeof(uint64_t) * numK_);
+      fout.write(reinterpret_cast<const char *>(frames.data()), sizeof(Real) * frames.size());
+    }
+    if (std::rename(tmpName.c_str(), fname.c_str()) != 0) {
+      std::cout << YLW << "[WARNING] Cannot write result cache entry " << fname << NRM << "\n";
+    }
+  }
+
+  /**
+   * @brief removes the least recently used entries until the cache holds at most maxSize bytes
+   * @param [in] maxSize size (in bytes)
+   */
+  void evict(const uint64_t maxSize) const {
+    struct Entry {
+      std::string fname;
+      uint64_t size;
+      timespec mtime;
+    };
+    std::vector<Entry> entries;
+    uint64_t totalSize = 0;
+    DIR *dir = opendir(dirName_.c_str());
+    if (dir == nullptr) {
+      return;
+    }
+    while (const dirent *dirEntry = readdir(dir)) {
+      const std::string name(dirEntry->d_name);
+      struct stat fileStat{};
+      if ((name.size() > 4) and (name.compare(name.size() - 4, 4, ".bin") == 0)
+          and (stat((dirName_ + "/" + name).c_str(), &fileStat) == 0)) {
+        entries.push_back({dirName_ + "/" + name, static_cast<uint64_t>(fileStat.st_size), fileStat.st_mtim});
+        totalSize += fileStat.st_size;
+      }
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+      return (a.mtime.tv_sec < b.mtime.tv_sec) or ((a.mtime.tv_sec == b.mtime.tv_sec) and (a.mtime.tv_nsec < b.mtime.tv_nsec));
+    });
+    for (std::size_t i = 0; (i < entries.size()) and (totalSize > maxSize); i++) {
+      if (std::remove(entries[i].fname.c_str()) == 0) {
+        totalSize -= entries[i].size;
+      }
+    }
+  }
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] sink sink receiving the frames
+   * @param [in] morphologyHash hash of the morphology
+   * @param [in] materialInput optical constants of every energy and material
+   */
+  ResultCache(FrameSink *sink, const uint64_t morphologyHash, const std::vector<Material> &materialInput)
+    : sink_(sink), morphologyHash_(morphologyHash), materialInput_(materialInput) {
+  }
+
+  void begin(const InputData &inputData) override {
+    sink_->begin(inputData);
+    dirName_ = inputData.resultCacheDir;
+    maxSize_ = static_cast<uint64_t>(inputData.resultCacheSizeMB) << 20;
+    createDirectory(dirName_);
+    const FrameROI roi = getOutputROI(inputData);
+    numK_ = inputData.kVectors.size();
+    frameSize_ = static_cast<std::size_t>(roi.nx) * roi.ny;
+    fileNames_ = getFileNames(inputData);
+    const UINT numEnergy = inputData.energies.size();
+    served_.assign(numEnergy, false);
+    pending_.assign(numEnergy, std::vector<Real>());
+    numPending_.assign(numEnergy, 0);
+    numAngles_.assign(numEnergy * numK_, 0);
+    std::vector<Real> frames;
+    UINT numServed = 0;
+    for (UINT i = 0; i < numEnergy; i++) {
+      if (sink_->isComplete(i) or not(read(fileNames_[i], frames, &numAngles_[i * numK_]))) {
+        continue;
+      }
+      for (UINT kID = 0; kID < numK_; kID++) {
+        if (numAngles_[i * numK_ + kID] > 0) {
+          sink_->setNumAngles(i, kID, numAngles_[i * numK_ + kID]);
+        }
+        sink_->write(i, kID, &frames[kID * frameSize_]);
+      }
+      /// Marks the entry as recently used
+      utimensat(AT_FDCWD, fileNames_[i].c_str(), nullptr, 0);
+      served_[i] = true;
+      numServed++;
+    }
+    std::cout << "[INFO] Result cache : " << numServed << " of " << numEnergy << " energies served from " << dirName_ << "\n";
+  }
+
+  bool isComplete(const UINT energyID) const override {
+    return served_[energyID] or sink_->isComplete(energyID);
+  }
+
+  void write(const UINT energyID, const UINT kID, const Real *frame) override {
+    sink_->write(energyID, kID, frame);
+    std::vector<Real> frames;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::vector<Real> &pending = pending_[energyID];
+      if (pending.empty()) {
+        pending.resize(numK_ * frameSize_);
+      }
+      std::copy(frame, frame + frameSize_, &pending[kID * frameSize_]);
+      if (++numPending_[energyID] < numK_) {
+        return;
+      }
+      std::swap(frames, pending);
+    }
+    store(fileNames_[energyID], frames, &numAngles_[energyID * numK_]);
+  }
+
+  void setNumAngles(const UINT energyID, const UINT kID, const UINT numAngles) override {
+    sink_->setNumAngles(energyID, kID, numAngles);
+    numAngles_[energyID * numK_ + kID] = numAngles;
+  }
+
+  void end() override {
+    sink_->end();
+  }
+};
+
+#endif //CY_RSOXS_RESULTCACHE_H
@@ -0,0 +1,315 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_SPECTRALCUBE_H
+#define CY_RSOXS_SPECTRALCUBE_H
+
+#include <Output/HDF5FrameSink.h>
+#include <Output/writeH5.h>
+#include <Output/WriterPool.h>
+#include <FrameROI.h>
+#include <utils.h>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Writes all the scattering patterns to a single file SpectralCube.h5 with the 4D dataset
+ * projection[energy][k][qy][qx] and the coordinate datasets energy, qy, qx (attached as dimension scales)
+ * and KVec. Chunks span several energies of a small tile of q, so that both a frame and the spectrum
+ * at one q are read from few chunks. Frames are written by a background thread as they are computed,
+ * and an energy is recorded in CompletedEnergies.txt once all its k vectors are written and flushed.
+ * frameComplete[energy][k] flags the frames that are written. With OutputSWMR the file is in single writer /
+ * multiple reader mode and every frame is flushed, so that readers can process frames while the simulation runs.
+ */
+class SpectralCubeWriter : public HDF5FrameSink {
+  /// Number of energies per chunk
+  static constexpr hsize_t ENERGIES_PER_CHUNK = 8;
+  /// Number of pixels along qx / qy per chunk
+  static constexpr hsize_t PIXELS_PER_CHUNK = 64;
+  /// Chunk cache of the dataset
+  static constexpr std::size_t CHUNK_CACHE_BYTES = 64 * 1024 * 1024;
+  /// Number of hash table slots of the chunk cache: the default of the file access properties
+  static constexpr std::size_t CHUNK_CACHE_SLOTS = H5D_CHUNK_CACHE_NSLOTS_DEFAULT;
+
+  /// Maximum number of frames waiting to be written
+  const std::size_t maxQueueLength_;
+  /// Storage options
+  H5::OutputOptions options_;
+  /// Region of the pattern the frames cover
+  FrameROI roi_;
+  /// Output dataset
+  H5::DataSet dataset_;
+  /// frameComplete[energy][k] is set to 1 once the frame is written
+  H5::DataSet frameComplete_;
+  /// numEAngles[energy][k] is the number of E angles of the frame. Only with EAngleAdaptive.
+  H5::DataSet numAngles_;
+  /// Number of E angles of every (energy, k) frame with EAngleAdaptive
+  std::vector<UINT> frameAngles_;
+  /// Single writer / multiple reader mode
+  bool swmr_ = false;
+  /// Number of frames written for every energy. Only accessed by the I/O thread.
+  std::vector<UINT> numFramesWritten_;
+  /// I/O thread
+  std::unique_ptr<WriterPool> pool_;
+
+  /**
+   * @return dimensions of the cube
+   */
+  std::array<hsize_t, 4> getDims() const {
+    return {inputData_->energies.size(), inputData_->kVectors.size(), roi_.ny, roi_.nx};
+  }
+
+  /**
+   * @brief writes a 1D coordinate and makes it a dimension scale of the cube
+   * @param name name of the dataset
+   * @param values coordinate values
+   * @param dimID dimension of the cube
+   * @param units units
+   */
+  void writeScale(const std::string &name, const std::vector<Real> &values, const UINT dimID,
+                  const std::string &units) {
+    const H5::DataSet coordinate = writeCoordinate(name, values, units);
+    H5DSset_scale(coordinate.getId(), name.c_str());
+    H5DSattach_scale(dataset_.getId(), coordinate.getId(), dimID);
+  }
+
+  /**
+   * @brief creates the cube and the coordinates, and starts SWMR mode
+   */
+  void create() override {
+    const std::array<hsize_t, 4> dims = getDims();
+    const hsize_t energiesPerChunk = ENERGIES_PER_CHUNK, pixelsPerChunk = PIXELS_PER_CHUNK;
+    const hsize_t chunkDims[4]{std::min(dims[0], energiesPerChunk), 1, std::min(dims[2], pixelsPerChunk),
+                               std::min(dims[3], pixelsPerChunk)};
+    H5::DSetCreatPropList plist = H5::getCreationProperties(4, chunkDims, options_);
+    plist.setChunk(4, chunkDims);
+    H5::DSetAccPropList accessList;
+    accessList.setChunkCache(CHUNK_CACHE_SLOTS, CHUNK_CACHE_BYTES, 1.0);
+    dataset_ = file_->createDataSet("projection", H5::getFileType(options_), H5::DataSpace(4, dims.data()), plist,
+                                    accessList);
+    H5DSset_label(dataset_.getId(), 0, "Energy");
+    H5DSset_label(dataset_.getId(), 1, "K");
+    H5DSset_label(dataset_.getId(), 2, "Qy");
+    H5DSset_label(dataset_.getId(), 3, "Qx");
+
+    writeScale("energy", inputData_->energies, 0, "eV");
+    writeScale("qy", getROICoordinates(*inputData_, roi_, 1), 2, "nm^-1");
+    writeScale("qx", getROICoordinates(*inputData_, roi_, 0), 3, "nm^-1");
+    writeKList(*file_, *inputData_);
+
+    const hsize_t frameDims[2]{dims[0], dims[1]};
+    const uint8_t notComplete = 0;
+    H5::DSetCreatPropList framePlist;
+    framePlist.setFillValue(H5::PredType::NATIVE_UINT8, &notComplete);
+    framePlist.setChunk(2, frameDims);
+    frameComplete_ = file_->createDataSet("frameComplete", H5::PredType::STD_U8LE, H5::DataSpace(2, frameDims),
+                                          framePlist);
+    if (inputData_->eAngleAdaptive) {
+      const UINT noAngles = 0;
+      H5::DSetCreatPropList anglePlist;
+      anglePlist.setFillValue(H5::PredType::NATIVE_UINT, &noAngles);
+      anglePlist.setChunk(2, frameDims);
+      numAngles_ = file_->createDataSet("numEAngles", H5::PredType::STD_U32LE, H5::DataSpace(2, frameDims), anglePlist);
+    }
+    if (not(startSWMR())) {
+      std::cout << YLW << "[WARNING] Could not start SWMR mode. Readers will only see the data once the file is closed."
+                << NRM << "\n";
+      swmr_ = false;
+    }
+  }
+
+  /**
+   * @return file access properties. SWMR requires the latest file format.
+   */
+  H5::FileAccPropList getFileAccessProperties() const override {
+    H5::FileAccPropList fapl;
+    if (swmr_) {
+      fapl.setLibverBounds(H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+    }
+    return fapl;
+  }
+
+  /**
+   * @brief switches the file to SWMR mode. No object or attribute can be created afterwards.
+   * @return false on failure
+   */
+  bool startSWMR() {
+    return (not(swmr_) or (H5Fstart_swmr_write(file_->getId()) >= 0));
+  }
+
+  void closeDatasets() override {
+    dataset_.close();
+    frameComplete_.close();
+    numAngles_.close();
+  }
+
+  /**
+   * @brief opens the cube of a previous run and starts SWMR mode
+   * @return false if the cube has different dimensions or SWMR mode cannot be started
+   */
+  bool open() override {
+    if (not(hasDataSet("projection")) or not(hasDataSet("frameComplete"))) {
+      return false;
+    }
+    H5::DSetAccPropList accessList;
+    accessList.setChunkCache(CHUNK_CACHE_SLOTS, CHUNK_CACHE_BYTES, 1.0);
+    dataset_ = file_->openDataSet("projection", accessList);
+    hsize_t dims[4];
+    const H5::DataSpace dataspace = dataset_.getSpace();
+    if ((dataspace.getSimpleExtentNdims() != 4) or (dataset_.getDataType() != H5::getFileType(options_))) {
+      return false;
+    }
+    dataspace.getSimpleExtentDims(dims);
+    if (not(std::equal(dims, dims + 4, getDims().begin()))) {
+      return false;
+    }
+    frameComplete_ = file_->openDataSet("frameComplete");
+    if (inputData_->eAngleAdaptive) {
+      if (not(hasDataSet("numEAngles"))) {
+        return false;
+      }
+      numAngles_ = file_->openDataSet("numEAngles");
+    }
+    return startSWMR();
+  }
+
+  /**
+   * @brief writes a frame into the cube
+   * @param energyID energy index
+   * @param kID k vector index
+   * @param frame frame
+   * @param numAngles number of E angles of the frame. 0 if not recorded.
+   */
+  void writeFrame(const UINT energyID, const UINT kID, const std::vector<Real> &frame, const UINT numAngles) {
+    {
+      std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+      const std::array<hsize_t, 4> dims = getDims();
+      const hsize_t offset[4]{energyID, kID, 0, 0};
+      const hsize_t count[4]{1, 1, dims[2], dims[3]};
+      H5::DataSpace fileSpace = dataset_.getSpace();
+      fileSpace.selectHyperslab(H5S_SELECT_SET, count, offset);
+      H5::DataSpace memSpace(2, &count[2]);
+#ifdef DOUBLE_PRECISION
+      dataset_.write(frame.data(), H5::PredType::NATIVE_DOUBLE, memSpace, fileSpace);
+#else
+      dataset_.write(frame.data(), H5::PredType::NATIVE_FLOAT, memSpace, fileSpace);
+#endif
+      const uint8_t complete = 1;
+      const hsize_t one[2]{1, 1};
+      H5::DataSpace frameSpace = frameComplete_.getSpace();
+      frameSpace.selectHyperslab(H5S_SELECT_SET, one, offset);
+      frameComplete_.write(&complete, H5::PredType::NATIVE_UINT8, H5::DataSpace(2, one), frameSpace);
+      if (numAngles > 0) {
+        H5::DataSpace angleSpace = numAngles_.getSpace();
+        angleSpace.selectHyperslab(H5S_SELECT_SET, one, offset);
+        numAngles_.write(&numAngles, H5::PredType::NATIVE_UINT, H5::DataSpace(2, one), angleSpace);
+      }
+      if (swmr_) {
+        /// Make the frame visible to the readers
+        H5Dflush(dataset_.getId());
+        H5Dflush(frameComplete_.getId());
+        if (numAngles > 0) {
+          H5Dflush(numAngles_.getId());
+        }
+      }
+      if (++numFramesWritten_[energyID] < inputData_->kVectors.size()) {
+        return;
+      }
+      file_->flush(H5F_SCOPE_GLOBAL);
+    }
+    manifest_.record(energyID);
+  }
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] resume skip the energies that a previous run completed
+   * @param [in] maxQueueLength maximum number of frames waiting to be written
+   */
+  explicit SpectralCubeWriter(const bool resume = false, const std::size_t maxQueueLength = 4)
+    : HDF5FrameSink(resume, "SpectralCube.h5", "CompletedEnergies.txt"), maxQueueLength_(maxQueueLength) {
+  }
+
+  SpectralCubeWriter(const SpectralCubeWriter &) = delete;
+  SpectralCubeWriter &operator=(const SpectralCubeWriter &) = delete;
+
+  ~SpectralCubeWriter() override {
+    end();
+  }
+
+  void begin(const InputData &inputData) override {
+    inputData_ = &inputData;
+    if (not(inputData.writeHDF5)) {
+      return;
+    }
+    options_ = getOutputOptions(inputData);
+    roi_ = getOutputROI(inputData);
+    if (options_.precision == Output::Precision::SCALED_UINT16) {
+      std::cout << YLW << "[WARNING] ScaledUInt16 is not supported for the spectral cube. Storing Float16." << NRM
+                << "\n";
+      options_.precision = Output::Precision::HALF;
+    }
+    swmr_ = inputData.outputSWMR;
+    beginFile();
+    if (resume_) {
+      std::cout << "[INFO] Resuming : " << manifest_.numComplete() << "/" << inputData.energies.size()
+                << " energies already complete\n";
+    }
+    numFramesWritten_.assign(inputData.energies.size(), 0);
+    frameAngles_.assign(inputData.energies.size() * inputData.kVectors.size(), 0);
+    pool_.reset(new WriterPool(1, maxQueueLength_));
+  }
+
+  bool isComplete(const UINT energyID) const override {
+    return (pool_ != nullptr) and manifest_.isComplete(energyID);
+  }
+
+  void write(const UINT energyID, const UINT kID, const Real *frame) override {
+    if (pool_ == nullptr) {
+      return;
+    }
+    const std::size_t frameSize = static_cast<std::size_t>(roi_.nx) * roi_.ny;
+    std::shared_ptr<std::vector<Real>> data = std::make_shared<std::vector<Real>>(frame, frame + frameSize);
+    const UINT numAngles = frameAngles_[energyID * inputData_->kVectors.size() + kID];
+    pool_->submit(0, [this, energyID, kID, data, numAngles] {
+      writeFrame(energyID, kID, *data, numAngles);
+    });
+  }
+
+  void setNumAngles(const UINT energyID, const UINT kID, const UINT numAngles) override {
+    if (pool_ != nullptr) {
+      frameAngles_[energyID * inputData_->kVectors.size() + kID] = numAngles;
+    }
+  }
+
+  void end() override {
+    if (pool_ == nullptr) {
+      return;
+    }
+    pool_.reset();
+    endFile();
+  }
+};
+
+#endif //CY_RSOXS_SPECTRALCUBE_H
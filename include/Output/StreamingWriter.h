@@ -0,0 +1,196 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_STREAMINGWRITER_H
+#define CY_RSOXS_STREAMINGWRITER_H
+
+#include <Output/FrameSink.h>
+#include <Output/outputUtils.h>
+#include <Output/writeH5.h>
+#include <Output/WriterPool.h>
+#include <Output/CompletionManifest.h>
+#include <FrameROI.h>
+#include <utils.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Writes every (energy, k) frame to Energy_<E>.h5 as soon as it is computed. Frames are handed
+ * to a WriterPool, with all the frames of an energy going to the same I/O thread. The GPU threads block
+ * once the queues are full, so that the host memory stays O(queue length) frames independent of the
+ * number of energies. The file of an energy is complete once all its k vectors are written. Complete
+ * energies are appended to CompletedEnergies.txt, which allows a restarted run to skip them.
+ */
+class StreamingH5Writer : public FrameSink {
+  /// Maximum number of frames waiting to be written per I/O thread
+  const std::size_t maxQueueLength_;
+  /// Skip the energies recorded in the manifest
+  const bool resume_;
+  /// Input data of the current simulation
+  const InputData *inputData_ = nullptr;
+  /// Manifest of complete energies
+  CompletionManifest manifest_;
+  /// Storage options
+  H5::OutputOptions options_;
+  /// Region of the pattern the frames cover
+  FrameROI roi_;
+  /// I/O threads
+  std::unique_ptr<WriterPool> pool_;
+
+  /// File of every energy while it has frames missing, and the number of frames written.
+  /// Entries of an energy are only accessed by the I/O thread the energy is assigned to.
+  std::vector<std::unique_ptr<H5::H5File>> files_;
+  std::vector<UINT> numFramesWritten_;
+  /// Number of E angles of every (energy, k) frame with EAngleAdaptive
+  std::vector<UINT> numAngles_;
+
+  /**
+   * @brief writes the q of the pixels of the cropped frames
+   * @param file output file
+   * @param name dataset name
+   * @param values q (in nm^-1)
+   */
+  static void writeCoordinate(H5::H5File &file, const std::string &name, const std::vector<Real> &values) {
+    const hsize_t dims[1]{values.size()};
+#ifdef DOUBLE_PRECISION
+    file.createDataSet(name, H5::PredType::NATIVE_DOUBLE, H5::DataSpace(1, dims)).write(values.data(), H5::PredType::NATIVE_DOUBLE);
+#else
+    file.createDataSet(name, H5::PredType::NATIVE_FLOAT, H5::DataSpace(1, dims)).write(values.data(), H5::PredType::NATIVE_FLOAT);
+#endif
+  }
+
+  /**
+   * @brief writes a frame to the file of its energy
+   * @param energyID energy index
+   * @param kID k vector index
+   * @param frame frame
+   * @param numAngles number of E angles of the frame. 0 if not recorded.
+   */
+  void writeFrame(const UINT energyID, const UINT kID, const std::vector<Real> &frame, const UINT numAngles) {
+    const UINT voxelSize[2]{roi_.nx, roi_.ny};
+    const std::string fname = getEnergyFileName(inputData_->HDF5DirName, inputData_->energies[energyID]);
+    std::unique_ptr<H5::H5File> &file = files_[energyID];
+    {
+      std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+      if (file == nullptr) {
+        file.reset(new H5::H5File(fname.c_str(), H5F_ACC_TRUNC));
+        writeKList(*file, *inputData_);
+        if (inputData_->roiType != ROI::Type::NONE) {
+          writeCoordinate(*file, "qx", getROICoordinates(*inputData_, roi_, 0));
+          writeCoordinate(*file, "qy", getROICoordinates(*inputData_, roi_, 1));
+        }
+      }
+      H5::writeFile2D(*file, frame.data(), voxelSize, "K" + std::to_string(kID), "projection", options_);
+      if (numAngles > 0) {
+        H5::DataSet dataset = file->openDataSet("K" + std::to_string(kID) + "/projection");
+        dataset.createAttribute("NumEAngles", H5::PredType::STD_U32LE, H5::DataSpace(H5S_SCALAR))
+            .write(H5::PredType::NATIVE_UINT, &numAngles);
+      }
+      if (++numFramesWritten_[energyID] < inputData_->kVectors.size()) {
+        return;
+      }
+      file->close();
+      file.reset();
+    }
+    manifest_.record(energyID);
+  }
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] resume skip the energies that a previous run completed
+   * @param [in] maxQueueLength maximum number of frames waiting to be written per I/O thread
+   */
+  explicit StreamingH5Writer(const bool resume = false, const std::size_t maxQueueLength = 4)
+    : maxQueueLength_(maxQueueLength), resume_(resume) {
+  }
+
+  StreamingH5Writer(const StreamingH5Writer &) = delete;
+  StreamingH5Writer &operator=(const StreamingH5Writer &) = delete;
+
+  ~StreamingH5Writer() override {
+    end();
+  }
+
+  void begin(const InputData &inputData) override {
+    inputData_ = &inputData;
+    if (not(inputData.writeHDF5)) {
+      return;
+    }
+    createDirectory(inputData.HDF5DirName);
+    std::vector<std::string> outputFiles(inputData.energies.size());
+    for (UINT i = 0; i < inputData.energies.size(); i++) {
+      outputFiles[i] = getEnergyFileName(inputData.HDF5DirName, inputData.energies[i]);
+    }
+    manifest_.open(inputData.HDF5DirName + "/CompletedEnergies.txt", inputData.energies, outputFiles, resume_);
+    if (resume_) {
+      std::cout << "[INFO] Resuming : " << manifest_.numComplete() << "/" << inputData.energies.size()
+                << " energies already complete\n";
+    }
+    files_.clear();
+    files_.resize(inputData.energies.size());
+    numFramesWritten_.assign(inputData.energies.size(), 0);
+    numAngles_.assign(inputData.energies.size() * inputData.kVectors.size(), 0);
+    options_ = getOutputOptions(inputData);
+    roi_ = getOutputROI(inputData);
+    pool_.reset(new WriterPool(inputData.numWriterThreads, maxQueueLength_));
+  }
+
+  bool isComplete(const UINT energyID) const override {
+    return (pool_ != nullptr) and manifest_.isComplete(energyID);
+  }
+
+  void write(const UINT energyID, const UINT kID, const Real *frame) override {
+    if (pool_ == nullptr) {
+      return;
+    }
+    const std::size_t frameSize = static_cast<std::size_t>(roi_.nx) * roi_.ny;
+    std::shared_ptr<std::vector<Real>> data = std::make_shared<std::vector<Real>>(frame, frame + frameSize);
+    const UINT numAngles = numAngles_[energyID * inputData_->kVectors.size() + kID];
+    pool_->submit(energyID, [this, energyID, kID, data, numAngles] {
+      writeFrame(energyID, kID, *data, numAngles);
+    });
+  }
+
+  void setNumAngles(const UINT energyID, const UINT kID, const UINT numAngles) override {
+    if (pool_ != nullptr) {
+      numAngles_[energyID * inputData_->kVectors.size() + kID] = numAngles;
+    }
+  }
+
+  void end() override {
+    if (pool_ == nullptr) {
+      return;
+    }
+    pool_.reset();
+    /// Energies with missing frames are not recorded as complete and will be recomputed on resume.
+    std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+    files_.clear();
+    numFramesWritten_.clear();
+    manifest_.close();
+  }
+};
+
+#endif //CY_RSOXS_STREAMINGWRITER_H
@@ -0,0 +1,145 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_WRITERPOOL_H
+#define CY_RSOXS_WRITERPOOL_H
+
+#include <Datatypes.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Pool of I/O threads consuming write tasks while the computation continues.
+ * Tasks submitted with the same key run on the same thread in the order of submission, so that
+ * a file is only ever touched by one thread. Every thread has a bounded queue: submit() blocks
+ * while the queue is full, which limits the memory held by pending writes.
+ */
+class WriterPool {
+  struct Worker {
+    std::deque<std::function<void()>> queue;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    bool finished = false;
+    std::thread thread;
+  };
+
+  /// Maximum number of pending tasks per thread
+  const std::size_t maxQueueLength_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  /**
+   * @brief runs the tasks of a thread until it is finished and its queue is empty
+   * @param worker worker
+   */
+  static void workerLoop(Worker &worker) {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.notEmpty.wait(lock, [&worker] { return worker.finished or not(worker.queue.empty()); });
+        if (worker.queue.empty()) {
+          return;
+        }
+        task = std::move(worker.queue.front());
+        worker.queue.pop_front();
+      }
+      worker.notFull.notify_all();
+      task();
+    }
+  }
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] numThreads number of I/O threads. At least one thread is started.
+   * @param [in] maxQueueLength maximum number of pending tasks per thread
+   */
+  WriterPool(const UINT numThreads, const std::size_t maxQueueLength)
+    : maxQueueLength_(std::max(maxQueueLength, static_cast<std::size_t>(1))) {
+    workers_.resize(std::max(numThreads, 1u));
+    for (auto &worker: workers_) {
+      worker.reset(new Worker);
+      worker->thread = std::thread(workerLoop, std::ref(*worker));
+    }
+  }
+
+  WriterPool(const WriterPool &) = delete;
+  WriterPool &operator=(const WriterPool &) = delete;
+
+  /**
+   * @brief Destructor. Waits for the pending tasks.
+   */
+  ~WriterPool() {
+    finish();
+  }
+
+  /**
+   * @brief queues a task. Blocks while the queue of the thread is full.
+   * @param [in] key tasks with the same key run on the same thread
+   * @param [in] task task
+   */
+  void submit(const std::size_t key, std::function<void()> task) {
+    Worker &worker = *workers_[key % workers_.size()];
+    {
+      std::unique_lock<std::mutex> lock(worker.mutex);
+      worker.notFull.wait(lock, [&] { return worker.queue.size() < maxQueueLength_; });
+      worker.queue.push_back(std::move(task));
+    }
+    worker.notEmpty.notify_one();
+  }
+
+  /**
+   * @brief waits until all the tasks are complete and stops the threads
+   */
+  void finish() {
+    for (auto &worker: workers_) {
+      {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->finished = true;
+      }
+      worker->notEmpty.notify_one();
+    }
+    for (auto &worker: workers_) {
+      if (worker->thread.joinable()) {
+        worker->thread.join();
+      }
+    }
+  }
+
+  /**
+   * @return number of I/O threads
+   */
+  inline std::size_t size() const {
+    return workers_.size();
+  }
+};
+
+#endif //CY_RSOXS_WRITERPOOL_H
@@ -37,17 +37,44 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <cstring>
+#include <mutex>
+#include <Datatypes.h>
+#include <sstream>
+#include <stdexcept>
 
 /**
  * @brief Creates the directory.
  * @param dirname The name of the directory
+ * @throws std::runtime_error if the directory can not be created
  */
 static void createDirectory(const std::string & dirName){
 
   int ierr = mkdir(dirName.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
   if (ierr != 0 && errno != EEXIST) {
-    std::cout  << "Could not create folder for storing results (" <<  strerror(errno) << "\n";
-    exit(EXIT_FAILURE);
+    throw std::runtime_error("Could not create folder " + dirName + " for storing results (" + strerror(errno) + ")");
   }
 }
+
+/**
+ * @brief The HDF5 library is not necessarily built thread safe. HDF5 calls that can run
+ * concurrently with other HDF5 calls must hold this mutex. The filters run inside the HDF5 calls, so the compression
+ * of concurrent writers is serialized as well.
+ * @return mutex serializing the HDF5 calls
+ */
+inline std::mutex & getHDF5Mutex(){
+  static std::mutex hdf5Mutex;
+  return hdf5Mutex;
+}
+
+/**
+ * @brief Name of the output file of an energy
+ * @param dirName output directory
+ * @param energy energy (in eV)
+ * @return dirName/Energy_<energy>.h5
+ */
+static std::string getEnergyFileName(const std::string & dirName, const Real energy){
+  std::stringstream stream;
+  stream << std::fixed << std::setprecision(2) << energy;
+  return dirName + "/Energy_" + stream.str() + ".h5";
+}
 #endif //CY_RSOXS_OUTPUTUTILS_H
@@ -26,30 +26,133 @@
 #define CY_RSOXS_WRITEH5_H
 
 #include <Datatypes.h>
+#include <Arena.h>
 #include "H5Cpp.h"
 #include <Output/outputUtils.h>
 #include <hdf5_hl.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
 namespace H5 {
+/**
+ * @brief Storage options of the scattering patterns
+ */
+struct OutputOptions {
+  /// Compression filter
+  UINT compression = Output::Compression::NONE;
+  /// Deflate level (1-9)
+  int compressionLevel = 4;
+  /// Type the scattering patterns are stored as
+  UINT precision = Output::Precision::FULL;
+};
+
+/**
+ * @brief HDF5 type of the scattering pattern in the file
+ * @param [in] options storage options
+ * @return file datatype
+ */
+H5::DataType getFileType(const OutputOptions &options) {
+  if (options.precision == Output::Precision::HALF) {
+    /// IEEE 754 binary16
+    H5::FloatType halfType(H5::PredType::NATIVE_FLOAT);
+    halfType.setFields(15, 10, 5, 0, 10);
+    halfType.setOffset(0);
+    halfType.setPrecision(16);
+    halfType.setSize(2);
+    halfType.setEbias(15);
+    return halfType;
+  }
+  if (options.precision == Output::Precision::SCALED_UINT16) {
+    return H5::PredType::STD_U16LE;
+  }
+#ifdef DOUBLE_PRECISION
+  return H5::PredType::NATIVE_DOUBLE;
+#else
+  return H5::PredType::NATIVE_FLOAT;
+#endif
+}
+
+/**
+ * @brief Dataset creation properties: chunking and filters according to the options, with NaN
+ * (or the maximum integer for scaled storage) as fill value.
+ * @param [in] rank rank of the dataset
+ * @param [in] chunkDims chunk dimensions. Only used with compression.
+ * @param [in] options storage options
+ * @return property list
+ */
+H5::DSetCreatPropList getCreationProperties(const int rank, const hsize_t *chunkDims, const OutputOptions &options) {
+  H5::DSetCreatPropList plist;
+  if (options.precision == Output::Precision::SCALED_UINT16) {
+    const uint16_t fillValue = std::numeric_limits<uint16_t>::max();
+    plist.setFillValue(H5::PredType::NATIVE_UINT16, &fillValue);
+  } else {
+    const Real fillValue = std::numeric_limits<Real>::quiet_NaN();
+#ifdef DOUBLE_PRECISION
+    plist.setFillValue(H5::PredType::NATIVE_DOUBLE, &fillValue);
+#else
+    plist.setFillValue(H5::PredType::NATIVE_FLOAT, &fillValue);
+#endif
+  }
+  if (options.compression == Output::Compression::DEFLATE) {
+    plist.setChunk(rank, chunkDims);
+    plist.setShuffle();
+    plist.setDeflate(options.compressionLevel);
+  }
+  return plist;
+}
+
 /**
  * @brief Writes the final scattering pattern data in HDF5 file format
  * @param [in] file HDF5 file name
  * @param [in] data the data
  * @param [in] dim the dimension corresponding to the X and Y
- * @param groupname name of the group
+ * @param groupname name of the group. Created if it does not exist.
+ * @param datasetName name of the dataset within the group
+ * @param options storage options. Scaled storage writes the CF attributes scale_factor, add_offset and _FillValue.
  */
-  void writeFile2D(H5::H5File &file, const Real *data, const UINT *dim, const std::string &groupname) {
+  void writeFile2D(H5::H5File &file, const Real *data, const UINT *dim, const std::string &groupname,
+                   const std::string &datasetName = "projection", const OutputOptions &options = OutputOptions()) {
     try {
       const int RANK = 2;
       const hsize_t dims[2]{dim[1], dim[0]};
-      H5::Group group(file.createGroup(groupname.c_str()));
+      if (H5Lexists(file.getId(), groupname.c_str(), H5P_DEFAULT) <= 0) {
+        H5::Group group(file.createGroup(groupname.c_str()));
+      }
       H5::DataSpace dataspace(RANK, dims);
+      /// Chunks of whole rows of about 1 MB
+      const hsize_t chunkDims[2]{std::min(dims[0], std::max(static_cast<hsize_t>(1), (1 << 18) / dims[1])), dims[1]};
+      const H5::DSetCreatPropList plist = getCreationProperties(RANK, chunkDims, options);
+      H5::DataSet dataset = file.createDataSet(groupname + "/" + datasetName, getFileType(options), dataspace, plist);
+      if (options.precision == Output::Precision::SCALED_UINT16) {
+        /// value = scale_factor * stored + add_offset. NaN is stored as _FillValue.
+        const std::size_t numPixels = static_cast<std::size_t>(dims[0]) * dims[1];
+        double minValue = INFINITY, maxValue = -INFINITY;
+        for (std::size_t i = 0; i < numPixels; i++) {
+          if (std::isfinite(data[i])) {
+            minValue = std::min(minValue, static_cast<double>(data[i]));
+            maxValue = std::max(maxValue, static_cast<double>(data[i]));
+          }
+        }
+        const uint16_t fillValue = std::numeric_limits<uint16_t>::max();
+        const double offset = std::isfinite(minValue) ? minValue : 0.0;
+        const double scale = (maxValue > minValue) ? (maxValue - minValue) / (fillValue - 1) : 1.0;
+        std::vector<uint16_t> scaled(numPixels);
+        for (std::size_t i = 0; i < numPixels; i++) {
+          scaled[i] = std::isfinite(data[i]) ? static_cast<uint16_t>(std::lround((data[i] - offset) / scale)) : fillValue;
+        }
+        dataset.write(scaled.data(), H5::PredType::NATIVE_UINT16);
+        const H5::DataSpace scalar(H5S_SCALAR);
+        dataset.createAttribute("scale_factor", H5::PredType::NATIVE_DOUBLE, scalar).write(H5::PredType::NATIVE_DOUBLE, &scale);
+        dataset.createAttribute("add_offset", H5::PredType::NATIVE_DOUBLE, scalar).write(H5::PredType::NATIVE_DOUBLE, &offset);
+        dataset.createAttribute("_FillValue", H5::PredType::STD_U16LE, scalar).write(H5::PredType::NATIVE_UINT16, &fillValue);
+      } else {
 #ifdef DOUBLE_PRECISION
-      H5::DataSet dataset = file.createDataSet(groupname + "/projection", H5::PredType::NATIVE_DOUBLE, dataspace);
-      dataset.write(data, H5::PredType::NATIVE_DOUBLE);
+        dataset.write(data, H5::PredType::NATIVE_DOUBLE);
 #else
-      H5::DataSet dataset = file.createDataSet(groupname + "/projection", H5::PredType::NATIVE_FLOAT, dataspace);
-      dataset.write(data, H5::PredType::NATIVE_FLOAT);
+        dataset.write(data, H5::PredType::NATIVE_FLOAT);
 #endif
+      }
       H5DSset_label(dataset.getId(),0,"Qy");
       H5DSset_label(dataset.getId(),1,"Qx");
       dataset.close();
@@ -65,6 +168,9 @@ namespace H5 {
       H5::DataSpaceIException::printErrorStack();
 
     }
+    catch (H5::AttributeIException &error) {
+      H5::AttributeIException::printErrorStack();
+    }
   }
 
   /**
@@ -133,7 +239,10 @@ namespace H5 {
     try {
 
       const BigUINT numVoxels = inputData.voxelDims[0] * inputData.voxelDims[1] * inputData.voxelDims[2];
-      Real *data = new Real[numVoxels];
+      /// One component is converted at a time. The arena frees the buffer if the HDF5 library throws.
+      Arena arena(MemorySpace::HOST);
+      arena.reserve(Arena::getBytes<Real>(numVoxels));
+      Real *data = arena.allocate<Real>(numVoxels);
       const int RANK = 3;
       const hsize_t dims[3]{inputData.voxelDims[2], inputData.voxelDims[1], inputData.voxelDims[0]}; // C++ order
 
@@ -159,7 +268,6 @@ namespace H5 {
           dataSet.close();
         }
       }
-      delete[] data;
     }
     catch (H5::FileIException &error) {
       H5::FileIException::printErrorStack();
@@ -0,0 +1,470 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_PLANNER_H
+#define CY_RSOXS_PLANNER_H
+
+#include <Datatypes.h>
+#include <Input/Input.h>
+#include <Input/InputData.h>
+#include <AngleRefinement.h>
+#include <FrameROI.h>
+#include <NUFFT.h>
+#include <SimulationContext.h>
+#include <cudaMain.h>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+/**
+ * @brief One combination of algorithm, number of streams and scatter approach with its peak memory and
+ * estimated runtime.
+ */
+struct ExecutionPlan {
+  /// Algorithm
+  UINT algorithm = Algorithm::CommunicationMinimizing;
+  /// Value of MaxStreams. Algorithm 1 uses max(MaxStreams, 3) streams.
+  int numMaxStreams = 1;
+  /// Scatter approach
+  UINT scatterApproach = ScatterApproach::PARTIAL;
+  /// Peak device memory of one GPU (in bytes)
+  std::size_t deviceBytes = 0;
+  /// Peak host memory (in bytes)
+  std::size_t hostBytes = 0;
+  /// Estimated runtime (in s)
+  double seconds = 0;
+  /// false if the other options of the input data do not support the combination
+  bool isSupported = true;
+  /// true if the device memory fits in the budget
+  bool isFeasible = false;
+};
+
+/**
+ * @brief Throughputs the runtime estimate is computed from. Every kernel is memory bound: its runtime is the
+ * number of bytes it moves divided by the effective bandwidth, plus the launch latency.
+ */
+struct CostModel {
+  /// Peak device memory bandwidth (in bytes/s)
+  double deviceBandwidth = 500E9;
+  /// Fraction of the peak bandwidth the kernels achieve
+  double efficiency = 0.6;
+  /// Host <-> device bandwidth (in bytes/s)
+  double hostBandwidth = 12E9;
+  /// Latency of a kernel launch (in s)
+  double launchLatency = 5E-6;
+  /// Number of GPUs the energies are divided over
+  int numGPU = 1;
+  /// false if the default throughputs are used, because no GPU was found or the measurement failed
+  bool isCalibrated = false;
+
+  /**
+   * @param [in] bytes bytes read and written on the device
+   * @param [in] numLaunches number of kernel launches
+   * @return runtime (in s)
+   */
+  inline double device(const double bytes, const double numLaunches = 1) const {
+    return bytes / (deviceBandwidth * efficiency) + numLaunches * launchLatency;
+  }
+
+  /**
+   * @param [in] bytes bytes copied between host and device
+   * @return runtime (in s)
+   */
+  inline double transfer(const double bytes) const {
+    return bytes / hostBandwidth;
+  }
+};
+
+/**
+ * @brief Times a copy of bytes repeated numRepeats times, after one warm up copy.
+ * @param [out] dst destination
+ * @param [in] src source
+ * @param [in] bytes number of bytes to copy
+ * @param [in] kind direction of the copy
+ * @param [in] numRepeats number of timed copies
+ * @return runtime of one copy (in s). 0 on failure.
+ */
+static double timeCopy(void *dst, const void *src, const std::size_t bytes, const cudaMemcpyKind kind,
+                       const int numRepeats) {
+  cudaEvent_t start, stop;
+  if (cudaEventCreate(&start) != cudaSuccess) {
+    return 0;
+  }
+  if (cudaEventCreate(&stop) != cudaSuccess) {
+    cudaEventDestroy(start);
+    return 0;
+  }
+  float milliseconds = 0;
+  bool isSuccess = (cudaMemcpy(dst, src, bytes, kind) == cudaSuccess) and (cudaEventRecord(start) == cudaSuccess);
+  for (int i = 0; (i < numRepeats) and isSuccess; i++) {
+    isSuccess = (cudaMemcpyAsync(dst, src, bytes, kind) == cudaSuccess);
+  }
+  isSuccess = isSuccess and (cudaEventRecord(stop) == cudaSuccess) and (cudaEventSynchronize(stop) == cudaSuccess)
+              and (cudaEventElapsedTime(&milliseconds, start, stop) == cudaSuccess);
+  cudaEventDestroy(start);
+  cudaEventDestroy(stop);
+  return (isSuccess ? milliseconds * 1E-3 / numRepeats : 0);
+}
+
+/**
+ * @brief Calibrates the cost model on the first GPU. The peak memory bandwidth follows from the memory clock and bus
+ * width. The fraction of it the kernels achieve and the host to device bandwidth are measured with short copies of
+ * 64 MB between device buffers and from pinned host memory. Without GPU, or if a measurement fails, the default
+ * throughputs are used so that a plan can be made on a CPU only machine.
+ * @return cost model
+ */
+static CostModel measureCostModel() {
+  CostModel model;
+  int numGPU = 0;
+  if ((cudaGetDeviceCount(&numGPU) != cudaSuccess) or (numGPU < 1)) {
+    return model;
+  }
+  model.numGPU = numGPU;
+  cudaSetDevice(0);
+  int memoryClockRate = 0, memoryBusWidth = 0;
+  if ((cudaDeviceGetAttribute(&memoryClockRate, cudaDevAttrMemoryClockRate, 0) != cudaSuccess)
+      or (cudaDeviceGetAttribute(&memoryBusWidth, cudaDevAttrGlobalMemoryBusWidth, 0) != cudaSuccess)
+      or (memoryClockRate <= 0) or (memoryBusWidth <= 0)) {
+    return model;
+  }
+  /// Double data rate: clock (in kHz) x 2 x bus width (in bytes)
+  model.deviceBandwidth = 2.0 * memoryClockRate * 1E3 * (memoryBusWidth / 8.0);
+
+  static constexpr std::size_t BENCHMARK_BYTES = 64 * 1024 * 1024;
+  static constexpr int NUM_REPEATS = 4;
+  void *d_src = nullptr, *d_dst = nullptr, *h_src = nullptr;
+  if ((cudaMalloc(&d_src, BENCHMARK_BYTES) == cudaSuccess) and (cudaMalloc(&d_dst, BENCHMARK_BYTES) == cudaSuccess)
+      and (cudaMallocHost(&h_src, BENCHMARK_BYTES) == cudaSuccess)) {
+    /// A device to device copy reads and writes every byte
+    const double deviceSeconds = timeCopy(d_dst, d_src, BENCHMARK_BYTES, cudaMemcpyDeviceToDevice, NUM_REPEATS);
+    const double hostSeconds = timeCopy(d_dst, h_src, BENCHMARK_BYTES, cudaMemcpyHostToDevice, NUM_REPEATS);
+    if ((deviceSeconds > 0) and (hostSeconds > 0)) {
+      model.efficiency = std::min(2.0 * BENCHMARK_BYTES / deviceSeconds / model.deviceBandwidth, 1.0);
+      model.hostBandwidth = BENCHMARK_BYTES / hostSeconds;
+      model.isCalibrated = true;
+    }
+  }
+  cudaFree(d_src);
+  cudaFree(d_dst);
+  cudaFreeHost(h_src);
+  /// Clear the error of a failed measurement
+  cudaGetLastError();
+  return model;
+}
+
+/**
+ * @brief Cost model of the GPUs, measured once per process.
+ * @return cost model
+ */
+static CostModel getCostModel() {
+  static const CostModel model = measureCostModel();
+  return model;
+}
+
+/**
+ * @brief Device memory the plans have to fit in. DeviceMemoryBudgetMB if set, the free memory of the GPU
+ * with the least free memory otherwise. Without GPU and budget, the memory is not limited.
+ * @param [in] inputData input data
+ * @return budget (in bytes)
+ */
+static std::size_t getDeviceMemoryBudget(const InputData &inputData) {
+  if (inputData.deviceMemoryBudgetMB > 0) {
+    return static_cast<std::size_t>(inputData.deviceMemoryBudgetMB) * 1024 * 1024;
+  }
+  int numGPU = 0;
+  if ((cudaGetDeviceCount(&numGPU) != cudaSuccess) or (numGPU < 1)) {
+    std::cout << YLW << "[WARNING] No GPU found and no DeviceMemoryBudgetMB. The device memory is not limited."
+              << NRM << "\n";
+    return std::numeric_limits<std::size_t>::max();
+  }
+  std::size_t budget = std::numeric_limits<std::size_t>::max();
+  for (int i = 0; i < numGPU; i++) {
+    std::size_t freeMemory, totalMemory;
+    cudaSetDevice(i);
+    if (cudaMemGetInfo(&freeMemory, &totalMemory) == cudaSuccess) {
+      budget = std::min(budget, freeMemory);
+    }
+  }
+  cudaSetDevice(0);
+  return budget;
+}
+
+/**
+ * @brief Work area cuFFT allocates for a 3D plan. Falls back to one complex value per point if the
+ * estimate is not available.
+ * @param [in] nx number of points in x
+ * @param [in] ny number of points in y
+ * @param [in] nz number of points in z
+ * @return work area (in bytes)
+ */
+static std::size_t getFFTWorkspaceBytes(const UINT nx, const UINT ny, const UINT nz) {
+  std::size_t workSize = 0;
+  if (cufftEstimate3d(nz, ny, nx, fftType, &workSize) != CUFFT_SUCCESS) {
+    workSize = static_cast<std::size_t>(nx) * ny * nz * sizeof(Complex);
+  }
+  return workSize;
+}
+
+/**
+ * @brief Computes the peak memory and the estimated runtime of one combination. The memory follows the
+ * allocations of cudaMain (Algorithm 0), cudaMainStreams (Algorithm 1) and cudaMainNUFFT (EwaldEngine = 1).
+ * The output writer queue is not included.
+ * @param [in] inputData input data. The other options are taken from here.
+ * @param [in] model cost model
+ * @param [in] algorithm algorithm
+ * @param [in] numMaxStreams value of MaxStreams
+ * @param [in] scatterApproach scatter approach
+ * @param [in] isStreamed true if the patterns are streamed to a sink instead of being gathered on the host
+ * @return plan
+ */
+static ExecutionPlan getExecutionPlan(const InputData &inputData, const CostModel &model, const UINT algorithm,
+                                      const int numMaxStreams, const UINT scatterApproach, const bool isStreamed) {
+  ExecutionPlan plan;
+  plan.algorithm = algorithm;
+  plan.numMaxStreams = numMaxStreams;
+  plan.scatterApproach = scatterApproach;
+
+  const UINT *voxel = inputData.voxelDims;
+  const double numVoxels = static_cast<double>(voxel[0]) * voxel[1] * voxel[2];
+  const double numVoxel2D = static_cast<double>(voxel[0]) * voxel[1];
+  const double numMaterial = inputData.NUM_MATERIAL;
+  const bool isNUFFT = (inputData.ewaldEngine == EwaldEngine::Type::NUFFT);
+  const bool isFull = (scatterApproach == ScatterApproach::FULL);
+  const int numFFTStreams = DeviceWorkspace::NUM_FFT_STREAMS;
+  const int numStreams = (algorithm == Algorithm::CommunicationMinimizing) ? numFFTStreams
+                                                                           : std::max(numMaxStreams, numFFTStreams);
+  const UINT numAngles = static_cast<UINT>(
+    std::round((inputData.endAngle - inputData.startAngle) / inputData.incrementAngle + 1));
+  const FrameROI roi = getOutputROI(inputData);
+  const double numROIPixels = static_cast<double>(roi.nx) * roi.ny;
+  NUFFTKernel kernel{};
+  double numGridPoints = 0;
+  if (isNUFFT) {
+    kernel = getNUFFTKernel(inputData, voxel);
+    numGridPoints = static_cast<double>(kernel.gridDims.x) * kernel.gridDims.y * kernel.gridDims.z;
+  }
+
+  /// The non-uniform FFT, the sparse q points and the Fourier cache work on Nt
+  plan.isSupported = (algorithm == Algorithm::MemoryMinizing)
+                     or not(isNUFFT or not(inputData.qPointsFile.empty())
+                            or (inputData.fourierCacheMode != FourierCacheMode::Type::NONE));
+
+  /// Device memory
+  const double fftWorkspace = getFFTWorkspaceBytes(voxel[0], voxel[1], voxel[2]);
+  const double projectionBytes = 3 * numVoxel2D * sizeof(Real) + (inputData.rotMask ? numVoxel2D * sizeof(UINT) : 0);
+  const double polarizationBytes = 3 * numVoxels * sizeof(Complex) + (isFull ? numVoxels * sizeof(Real) : 0);
+  const double materialBytes = numMaterial * sizeof(Material);
+  double deviceBytes;
+  if (algorithm == Algorithm::CommunicationMinimizing) {
+    deviceBytes = numMaterial * numVoxels * sizeof(Voxel) + materialBytes + polarizationBytes + projectionBytes
+                  + numFFTStreams * fftWorkspace;
+  } else {
+    /// Nt persists. The stage arena holds the morphology of one material, then the polarization.
+    const double persistentBytes = 6 * numVoxels * sizeof(Complex) + materialBytes + numFFTStreams * fftWorkspace;
+    if (isNUFFT) {
+      deviceBytes = persistentBytes + Arena::getBytes<Voxel>(static_cast<std::size_t>(numVoxels))
+                    + 6 * numGridPoints * sizeof(Complex) + kernel.correction.size() * sizeof(Real)
+                    + numAngles * sizeof(NUFFTAngle) + numROIPixels * sizeof(Real)
+                    + getFFTWorkspaceBytes(kernel.gridDims.x, kernel.gridDims.y, kernel.gridDims.z);
+    } else {
+      deviceBytes = persistentBytes + DeviceWorkspace::getStageBytes(inputData, scatterApproach);
+    }
+  }
+  plan.deviceBytes = static_cast<std::size_t>(deviceBytes);
+
+  /// Host memory: the pinned morphology, a pinned frame per GPU and the gathered output
+  double hostBytes = numMaterial * numVoxels * sizeof(Voxel);
+  if (isStreamed) {
+    hostBytes += model.numGPU * numVoxel2D * sizeof(Real);
+  } else {
+    hostBytes += static_cast<double>(inputData.energies.size()) * inputData.kVectors.size() * numVoxel2D * sizeof(Real);
+  }
+  if ((algorithm == Algorithm::MemoryMinizing) and (inputData.fourierCacheMode != FourierCacheMode::Type::NONE)) {
+    hostBytes += model.numGPU * 6 * numVoxels * sizeof(Complex);
+  }
+  plan.hostBytes = static_cast<std::size_t>(hostBytes);
+
+  /// Runtime of the energies of one GPU
+  const AngleRefinement angles(inputData, numAngles);
+  double numComputedAngles = 0;
+  for (UINT i = 0; i < numAngles; i++) {
+    numComputedAngles += angles.isRepresentative(i) ? 1 : 0;
+  }
+  const double numK = inputData.kVectors.size();
+  const double numEnergyPerGPU = std::ceil(inputData.energies.size() * 1.0 / model.numGPU);
+  /// Every pass of cuFFT reads and writes the array once
+  const double numFFTPasses = (voxel[2] == 1) ? 2 : 3;
+  const double fftTime = model.device(2 * numFFTPasses * numVoxels * sizeof(Complex), numFFTPasses);
+  const double projectionTime = isFull
+    ? model.device(3 * numVoxels * sizeof(Complex) + numVoxels * sizeof(Real) + 6 * numVoxel2D * sizeof(Real), 5)
+    : model.device(6 * numVoxel2D * sizeof(Complex) + 5 * numVoxel2D * sizeof(Real), 4);
+  const double outputTime = model.transfer(numVoxel2D * sizeof(Real));
+
+  double setupTime = 0, energyTime, angleTime;
+  if (algorithm == Algorithm::CommunicationMinimizing) {
+    /// The morphology is uploaded once: the polarization is recomputed from all materials for every angle
+    setupTime = model.transfer(numMaterial * numVoxels * sizeof(Voxel));
+    energyTime = 0;
+    angleTime = model.device(numMaterial * numVoxels * sizeof(Voxel) + 3 * numVoxels * sizeof(Complex), 1)
+                + 3 * fftTime + projectionTime;
+  } else {
+    /// The upload of a material overlaps with the accumulation of Nt of the other streams
+    const double uploadTime = model.transfer(numMaterial * numVoxels * sizeof(Voxel));
+    const double ntTime = model.device(numMaterial * (numVoxels * sizeof(Voxel) + 12 * numVoxels * sizeof(Complex)),
+                                       numMaterial * numStreams);
+    energyTime = std::max(uploadTime, ntTime) + std::min(uploadTime, ntTime) / numStreams;
+    if (isNUFFT) {
+      const double numTaps = std::pow(static_cast<double>(kernel.width), (voxel[2] == 1) ? 2 : 3);
+      energyTime += model.device(6 * (numVoxels + numGridPoints) * sizeof(Complex), 6)
+                    + 6 * model.device(2 * numFFTPasses * numGridPoints * sizeof(Complex), numFFTPasses);
+      angleTime = model.device(6 * numROIPixels * numTaps * sizeof(Complex), 2);
+    } else {
+      /// FFT of the 6 components of Nt, followed by the DC component and the shift
+      energyTime += 6 * fftTime + model.device(4 * 6 * numVoxels * sizeof(Complex), 12);
+      angleTime = model.device(9 * numVoxels * sizeof(Complex), 1) + 3 * fftTime + projectionTime;
+    }
+  }
+  plan.seconds = setupTime + numEnergyPerGPU * (energyTime + numK * (numComputedAngles * angleTime + outputTime));
+  return plan;
+}
+
+/**
+ * @brief Computes the plans of every combination of algorithm, number of streams and scatter approach.
+ * @param [in] inputData input data
+ * @param [in] model cost model
+ * @param [in] budget device memory budget (in bytes)
+ * @param [in] isStreamed true if the patterns are streamed to a sink instead of being gathered on the host
+ * @return plans
+ */
+static std::vector<ExecutionPlan> getExecutionPlans(const InputData &inputData, const CostModel &model,
+                                                    const std::size_t budget, const bool isStreamed) {
+  static constexpr int streamCounts[]{3, 4, 8, 16};
+  std::vector<ExecutionPlan> plans;
+  for (UINT scatterApproach = 0; scatterApproach < ScatterApproach::MAX_SCATTER_APPROACH; scatterApproach++) {
+    plans.push_back(getExecutionPlan(inputData, model, Algorithm::CommunicationMinimizing, inputData.numMaxStreams,
+                                     scatterApproach, isStreamed));
+    for (const int numStreams: streamCounts) {
+      plans.push_back(getExecutionPlan(inputData, model, Algorithm::MemoryMinizing, numStreams, scatterApproach,
+                                       isStreamed));
+    }
+  }
+  for (ExecutionPlan &plan: plans) {
+    plan.isFeasible = plan.isSupported and (plan.deviceBytes <= budget);
+  }
+  return plans;
+}
+
+/**
+ * @brief Selects the fastest feasible plan. Only the plans with the scatter approach of the input data are
+ * considered, as the scatter approach changes the interpolation of the pattern.
+ * @param [in] inputData input data
+ * @param [in] plans plans
+ * @return index of the selected plan. -1 if no plan fits in the budget.
+ */
+static int selectExecutionPlan(const InputData &inputData, const std::vector<ExecutionPlan> &plans) {
+  int selected = -1;
+  for (int i = 0; i < static_cast<int>(plans.size()); i++) {
+    if (plans[i].isFeasible and (plans[i].scatterApproach == inputData.scatterApproach)
+        and ((selected < 0) or (plans[i].seconds < plans[selected].seconds))) {
+      selected = i;
+    }
+  }
+  return selected;
+}
+
+/**
+ * @brief Prints the plans, the budget and the selected plan.
+ * @param [in] plans plans
+ * @param [in] model cost model
+ * @param [in] budget device memory budget (in bytes)
+ * @param [in] selected index of the selected plan. -1 for none.
+ */
+static void printExecutionPlans(const std::vector<ExecutionPlan> &plans, const CostModel &model,
+                                const std::size_t budget, const int selected) {
+  static constexpr double MB = 1024.0 * 1024.0;
+  std::cout << "Cost Model           : " << model.deviceBandwidth / 1E9 << " GB/s device, "
+            << model.hostBandwidth / 1E9 << " GB/s host, " << model.efficiency << " efficiency, " << model.numGPU
+            << " GPU"
+            << (model.isCalibrated ? "" : " (default)") << "\n";
+  if (budget == std::numeric_limits<std::size_t>::max()) {
+    std::cout << "Device Memory Budget : unlimited\n";
+  } else {
+    std::cout << "Device Memory Budget : " << std::fixed << std::setprecision(1) << budget / MB << " MB\n";
+  }
+  std::cout << "  Algorithm  Streams  Scatter  Device (MB)  Host (MB)  Runtime (s)\n";
+  for (int i = 0; i < static_cast<int>(plans.size()); i++) {
+    const ExecutionPlan &plan = plans[i];
+    std::cout << ((i == selected) ? "* " : "  ") << std::setw(9) << plan.algorithm << "  " << std::setw(7)
+              << ((plan.algorithm == Algorithm::MemoryMinizing) ? plan.numMaxStreams : DeviceWorkspace::NUM_FFT_STREAMS)
+              << "  " << std::setw(7) << scatterApproachName[plan.scatterApproach] << "  " << std::fixed
+              << std::setprecision(1) << std::setw(11) << plan.deviceBytes / MB << "  " << std::setw(9)
+              << plan.hostBytes / MB << "  " << std::setprecision(3) << std::setw(11) << plan.seconds;
+    if (not(plan.isSupported)) {
+      std::cout << "  not supported";
+    } else if (not(plan.isFeasible)) {
+      std::cout << "  exceeds budget";
+    }
+    std::cout << "\n";
+  }
+  std::cout << std::defaultfloat << std::setprecision(6);
+  if (selected < 0) {
+    std::cout << RED << "[Plan] No configuration fits in the device memory budget" << NRM << "\n";
+  } else {
+    std::cout << GRN << "[Plan] Algorithm = " << plans[selected].algorithm;
+    if (plans[selected].algorithm == Algorithm::MemoryMinizing) {
+      std::cout << ", MaxStreams = " << plans[selected].numMaxStreams;
+    }
+    std::cout << NRM << "\n";
+  }
+}
+
+/**
+ * @brief Plans the computation and applies the fastest feasible algorithm and number of streams to the
+ * input data. The input data is not changed if no plan fits in the budget.
+ * @param [in,out] inputData input data
+ * @param [in] isStreamed true if the patterns are streamed to a sink instead of being gathered on the host
+ * @return true if a plan was applied
+ */
+static bool applyExecutionPlan(InputData &inputData, const bool isStreamed) {
+  const CostModel model = getCostModel();
+  const std::size_t budget = getDeviceMemoryBudget(inputData);
+  const std::vector<ExecutionPlan> plans = getExecutionPlans(inputData, model, budget, isStreamed);
+  const int selected = selectExecutionPlan(inputData, plans);
+  printExecutionPlans(plans, model, budget, selected);
+  if (selected < 0) {
+    std::cout << YLW << "[WARNING] AutoPlan found no feasible configuration. The configured Algorithm is used."
+              << NRM << "\n";
+    return false;
+  }
+  inputData.algorithmType = plans[selected].algorithm;
+  if (plans[selected].algorithm == Algorithm::MemoryMinizing) {
+    inputData.numMaxStreams = plans[selected].numMaxStreams;
+  }
+  return true;
+}
+
+#endif //CY_RSOXS_PLANNER_H
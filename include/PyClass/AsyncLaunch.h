@@ -0,0 +1,372 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_ASYNCLAUNCH_H
+#define CY_RSOXS_ASYNCLAUNCH_H
+
+#include <Input/InputData.h>
+#include <cudaMain.h>
+#include <FrameROI.h>
+#include <Output/FrameSink.h>
+#include <PyClass/VoxelData.h>
+#include <PyClass/RefractiveIndex.h>
+#include <PyClass/Session.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+
+namespace py = pybind11;
+
+/**
+ * @brief Sink queueing the frames of an asynchronous launch until Python consumes them. write() blocks while
+ * maxQueuedFrames frames are pending, which bounds the memory held by the frames not consumed yet. Once cancelled,
+ * the remaining energies are reported complete and are skipped by the computation.
+ */
+class FrameQueue : public FrameSink {
+public:
+  /// Frame of one (energy, k) pair
+  struct Frame {
+    UINT energyID = 0;
+    UINT kID = 0;
+    std::vector<Real> data;
+  };
+
+private:
+  /// Maximum number of pending frames. 0 for no limit.
+  const std::size_t maxQueuedFrames_;
+  /// Number of pixels of a frame
+  std::size_t frameSize_ = 0;
+  std::deque<Frame> frames_;
+  std::mutex mutex_;
+  std::condition_variable notEmpty_;
+  std::condition_variable notFull_;
+  /// true once the computation has ended
+  bool finished_ = false;
+  std::atomic<bool> cancelled_{false};
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] maxQueuedFrames maximum number of pending frames. 0 for no limit.
+   */
+  explicit FrameQueue(const std::size_t maxQueuedFrames)
+    : maxQueuedFrames_(maxQueuedFrames) {
+  }
+
+  void begin(const InputData &inputData) override {
+    const FrameROI roi = getOutputROI(inputData);
+    frameSize_ = static_cast<std::size_t>(roi.nx) * roi.ny;
+  }
+
+  bool isComplete(const UINT energyID) const override {
+    return cancelled_;
+  }
+
+  void write(const UINT energyID, const UINT kID, const Real *frame) override {
+    if (cancelled_) {
+      return;
+    }
+    Frame entry;
+    entry.energyID = energyID;
+    entry.kID = kID;
+    entry.data.assign(frame, frame + frameSize_);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      notFull_.wait(lock, [this] {
+        return cancelled_ or (maxQueuedFrames_ == 0) or (frames_.size() < maxQueuedFrames_);
+      });
+      if (cancelled_) {
+        return;
+      }
+      frames_.push_back(std::move(entry));
+    }
+    notEmpty_.notify_one();
+  }
+
+  void end() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_ = true;
+    }
+    notEmpty_.notify_all();
+  }
+
+  /**
+   * @brief Drops the pending frames and skips the energies not started yet
+   */
+  void cancel() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cancelled_ = true;
+      frames_.clear();
+    }
+    notFull_.notify_all();
+    notEmpty_.notify_all();
+  }
+
+  /**
+   * @return true if the launch was cancelled
+   */
+  bool isCancelled() const {
+    return cancelled_;
+  }
+
+  /**
+   * @brief Takes the next frame. Blocks until a frame is available or the computation has ended.
+   * @param [out] frame next frame
+   * @return false if no frame is left
+   */
+  bool pop(Frame &frame) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      notEmpty_.wait(lock, [this] { return finished_ or not(frames_.empty()); });
+      if (frames_.empty()) {
+        return false;
+      }
+      frame = std::move(frames_.front());
+      frames_.pop_front();
+    }
+    notFull_.notify_one();
+    return true;
+  }
+};
+
+/**
+ * @brief Handle of a computation running in the background. The frames are either passed to a callback, called from
+ * a background thread holding the GIL, or taken by iterating over the handle as (energy, kID, frame) as soon as every
+ * (energy, k) is computed. The input, energy and voxel data must not be modified until the launch is done.
+ */
+class AsyncLaunch {
+  /// Input data
+  const InputData &inputData_;
+  /// Refractive index data
+  const RefractiveIndexData &energyData_;
+  /// Voxel data
+  const VoxelData &voxelData_;
+  /// Frames computed and not consumed yet
+  FrameQueue queue_;
+  /// Called with (energy, kID, frame). None to iterate over the frames instead.
+  py::object callback_;
+  /// Completion of the computation
+  std::future<void> computed_;
+  /// Completion of the callbacks
+  std::future<void> dispatched_;
+
+  /**
+   * @brief Runs the computation, with the frames handed to the queue
+   */
+  void compute() {
+    RotationMatrix rotationMatrix(&inputData_);
+    const std::vector<Material> &materialInput = energyData_.getRefractiveIndexData();
+    queue_.begin(inputData_);
+    int status;
+    try {
+      if (inputData_.ewaldEngine == EwaldEngine::Type::NUFFT) {
+        status = cudaMainNUFFT(inputData_.voxelDims, inputData_, materialInput, nullptr, rotationMatrix, voxelData_.data(),
+                               nullptr, &queue_);
+      } else if (inputData_.algorithmType == Algorithm::CommunicationMinimizing) {
+        status = cudaMain(inputData_.voxelDims, inputData_, materialInput, nullptr, rotationMatrix, voxelData_.data(),
+                          nullptr, &queue_);
+      } else {
+        status = cudaMainStreams(inputData_.voxelDims, inputData_, materialInput, nullptr, rotationMatrix,
+                                 voxelData_.data(), nullptr, &queue_);
+      }
+    } catch (...) {
+      queue_.end();
+      throw;
+    }
+    queue_.end();
+    if (status != EXIT_SUCCESS) {
+      throw std::runtime_error("The computation failed");
+    }
+  }
+
+  /**
+   * @brief Passes the frames to the callback until the computation has ended. Cancels the launch if the callback
+   * raises.
+   */
+  void dispatch() {
+    FrameQueue::Frame frame;
+    while (queue_.pop(frame)) {
+      py::gil_scoped_acquire acquire;
+      try {
+        callback_(inputData_.energies[frame.energyID], frame.kID, toNumpy(frame));
+      } catch (...) {
+        queue_.cancel();
+        throw;
+      }
+    }
+  }
+
+  /**
+   * @brief Moves a frame to a numpy array without copying it
+   * @param [in] frame frame
+   * @return numpy array of shape (ny, nx) of the region of interest
+   */
+  py::array_t<Real> toNumpy(FrameQueue::Frame &frame) const {
+    const FrameROI roi = getOutputROI(inputData_);
+    std::vector<Real> *data = new std::vector<Real>(std::move(frame.data));
+    py::capsule owner(data, [](void *f) {
+      delete reinterpret_cast<std::vector<Real> *>(f);
+    });
+    return py::array_t<Real>({static_cast<py::ssize_t>(roi.ny), static_cast<py::ssize_t>(roi.nx)},
+                             {static_cast<py::ssize_t>(sizeof(Real) * roi.nx), static_cast<py::ssize_t>(sizeof(Real))},
+                             data->data(), owner);
+  }
+
+public:
+  /**
+   * @brief Constructor. Starts the computation.
+   * @param [in] inputData InputData
+   * @param [in] energyData Energy data
+   * @param [in] voxelData Voxel data
+   * @param [in] callback called with (energy, kID, frame) for every frame. None to iterate over the frames instead.
+   * @param [in] maxQueuedFrames maximum number of frames computed and not consumed yet. 0 for no limit.
+   */
+  AsyncLaunch(const InputData &inputData, const RefractiveIndexData &energyData, const VoxelData &voxelData,
+              const py::object &callback, const UINT maxQueuedFrames)
+    : inputData_(inputData), energyData_(energyData), voxelData_(voxelData), queue_(maxQueuedFrames),
+      callback_(callback) {
+    computed_ = std::async(std::launch::async, [this] { compute(); });
+    if (not(callback_.is_none())) {
+      dispatched_ = std::async(std::launch::async, [this] { dispatch(); });
+    }
+  }
+
+  AsyncLaunch(const AsyncLaunch &) = delete;
+  AsyncLaunch &operator=(const AsyncLaunch &) = delete;
+
+  /**
+   * @brief Destructor. Cancels the computation and waits for it.
+   */
+  ~AsyncLaunch() {
+    queue_.cancel();
+    py::gil_scoped_release release;
+    for (auto *future: {&computed_, &dispatched_}) {
+      if (future->valid()) {
+        future->wait();
+      }
+    }
+  }
+
+  /**
+   * @return true if the computation and the callbacks are complete
+   */
+  bool done() const {
+    for (const auto *future: {&computed_, &dispatched_}) {
+      if (future->valid() and (future->wait_for(std::chrono::seconds(0)) != std::future_status::ready)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Waits until the computation and the callbacks are complete. Rethrows their errors.
+   * @param [in] timeout maximum time to wait (in seconds). Negative to wait until complete.
+   * @return true if complete
+   */
+  bool wait(const double timeout = -1) {
+    {
+      py::gil_scoped_release release;
+      const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(std::max(timeout, 0.0));
+      for (auto *future: {&computed_, &dispatched_}) {
+        if (not(future->valid())) {
+          continue;
+        }
+        if (timeout < 0) {
+          future->wait();
+        } else if (future->wait_until(deadline) != std::future_status::ready) {
+          return false;
+        }
+      }
+    }
+    for (auto *future: {&computed_, &dispatched_}) {
+      if (future->valid()) {
+        future->get();
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Skips the energies not started yet and drops the frames not consumed yet
+   */
+  void cancel() {
+    queue_.cancel();
+  }
+
+  /**
+   * @return true if the launch was cancelled
+   */
+  bool isCancelled() const {
+    return queue_.isCancelled();
+  }
+
+  /**
+   * @brief Takes the next frame. Blocks until it is computed.
+   * @return (energy, kID, frame)
+   */
+  py::tuple next() {
+    if (not(callback_.is_none())) {
+      throw std::logic_error("The frames are passed to the callback");
+    }
+    FrameQueue::Frame frame;
+    bool isFrame;
+    {
+      py::gil_scoped_release release;
+      isFrame = queue_.pop(frame);
+    }
+    if (not isFrame) {
+      wait();
+      throw py::stop_iteration();
+    }
+    return py::make_tuple(inputData_.energies[frame.energyID], frame.kID, toNumpy(frame));
+  }
+};
+
+/**
+ * @brief Launch the GPU kernel in the background.
+ * @param [in] inputData InputData
+ * @param [in] energyData Energy data
+ * @param [in] voxelData Voxel data
+ * @param [in] callback called with (energy, kID, frame) for every frame. None to iterate over the handle instead.
+ * @param [in] maxQueuedFrames maximum number of frames computed and not consumed yet. 0 for no limit.
+ * @return handle of the computation. None if the input is not valid.
+ */
+static std::unique_ptr<AsyncLaunch> launchAsync(const InputData &inputData, const RefractiveIndexData &energyData,
+                                                const VoxelData &voxelData, const py::object &callback,
+                                                const UINT maxQueuedFrames) {
+  if (not(validateLaunchInput(inputData, energyData, voxelData))) {
+    return nullptr;
+  }
+  return std::unique_ptr<AsyncLaunch>(new AsyncLaunch(inputData, energyData, voxelData, callback, maxQueuedFrames));
+}
+
+#endif //CY_RSOXS_ASYNCLAUNCH_H
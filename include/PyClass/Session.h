@@ -0,0 +1,255 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_SESSION_H
+#define CY_RSOXS_SESSION_H
+
+#include <Input/InputData.h>
+#include <cudaMain.h>
+#include <SimulationContext.h>
+#include <Output/FourierCacheMemory.h>
+#include <utils.h>
+#include <cmath>
+#include <stdexcept>
+#include <PyClass/VoxelData.h>
+#include <PyClass/RefractiveIndex.h>
+#include <PyClass/ScatteringPattern.h>
+
+namespace py = pybind11;
+
+/**
+ * @brief Validates the input before launching the computation
+ * @param [in] inputData InputData
+ * @param [in] energyData Energy data
+ * @param [in] voxelData Voxel data
+ * @param [in] validateVoxelData whether to check the voxel data
+ * @return true if the computation can be launched
+ */
+static bool validateLaunchInput(const InputData &inputData, const RefractiveIndexData &energyData,
+                                const VoxelData &voxelData, bool validateVoxelData = true) {
+  if (not(inputData.validate())) {
+    py::print("Issues with Input Data");
+    return false;
+  }
+  if(inputData.caseType != CaseTypes::DEFAULT){
+    py::print("This is an experimental feature which is not tested");
+  }
+  if (not(energyData.validate())) {
+    py::print("Issues with Energy data");
+    return false;
+  }
+
+  if (validateVoxelData and not(voxelData.validate())) {
+    py::print("Issues with Voxel Data input");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Keeps the device buffers, FFT plans, streams and rotation matrices alive between
+ * consecutive runs. The morphology stays resident on the GPU and is uploaded again only if
+ * the VoxelData was modified. Optical constants / energies can be changed freely between runs.
+ */
+class Session {
+  /// Input data
+  const InputData &inputData_;
+  /// Refractive index data
+  const RefractiveIndexData &energyData_;
+  /// Voxel data
+  const VoxelData &voxelData_;
+  /// Device resources
+  SimulationContext context_;
+  /// Rotation matrices
+  RotationMatrix rotationMatrix_;
+  /// Version of the voxel data that is resident in context
+  std::uint64_t voxelDataVersion_ = 0;
+  /// Version of the voxel data that was last validated
+  std::uint64_t validatedVersion_ = 0;
+  /// true if the voxel data has been validated once
+  bool isValidated_ = false;
+  /// Transformed Nt of every energy, kept for the incremental updates
+  FourierCacheMemory fourierNt_;
+  /// Voxel data that fourierNt_ was computed from
+  std::vector<Voxel> snapshot_;
+
+  /**
+   * @brief validates the input and marks the morphology for upload if it was modified
+   * @return true if the computation can be launched
+   */
+  bool prepare() {
+    /// The NaN check on the morphology is only repeated if it was modified.
+    const bool validateVoxelData = (not isValidated_) or (validatedVersion_ != voxelData_.version());
+    if (not validateLaunchInput(inputData_, energyData_, voxelData_, validateVoxelData)) {
+      return false;
+    }
+    isValidated_ = true;
+    validatedVersion_ = voxelData_.version();
+    if (voxelDataVersion_ != voxelData_.version()) {
+      context_.markVoxelDataModified();
+      voxelDataVersion_ = voxelData_.version();
+    }
+    return true;
+  }
+
+public:
+  /**
+   * @brief Constructor
+   * @param [in] inputData InputData
+   * @param [in] energyData Energy data
+   * @param [in] voxelData Voxel data
+   */
+  Session(const InputData &inputData, const RefractiveIndexData &energyData, const VoxelData &voxelData)
+    : inputData_(inputData), energyData_(energyData), voxelData_(voxelData), rotationMatrix_(&inputData) {
+  }
+
+  /**
+   * @brief Launch the GPU kernel reusing the resources from the previous runs.
+   * @param [out] scatteringPattern compute I(q)
+   * @param [in] ifWriteMetadata weather to write metadata or not
+   * @throws std::runtime_error if the computation failed
+   */
+  void run(ScatteringPattern &scatteringPattern, bool ifWriteMetadata = false) {
+    if (not prepare()) {
+      return;
+    }
+
+    int status;
+    {
+      py::gil_scoped_release release;
+      if (inputData_.algorithmType == Algorithm::CommunicationMinimizing) {
+        status = cudaMain(inputData_.voxelDims, inputData_, energyData_.getRefractiveIndexData(),
+                          scatteringPattern.data(), rotationMatrix_, voxelData_.data(), &context_);
+      } else {
+        status = cudaMainStreams(inputData_.voxelDims, inputData_, energyData_.getRefractiveIndexData(),
+                                 scatteringPattern.data(), rotationMatrix_, voxelData_.data(), &context_);
+      }
+    }
+    if (status != EXIT_SUCCESS) {
+      throw std::runtime_error("The computation failed");
+    }
+    if (ifWriteMetadata) {
+      printMetaData(inputData_, rotationMatrix_);
+    }
+  }
+
+  /**
+   * @brief Launch the GPU kernel after a few voxels of the morphology were modified. The transformed Nt of every
+   * energy is kept from the previous update, and only the change at the listed voxels is added to it by direct
+   * summation, instead of computing Nt and its FFT again. The polarization of every angle is then computed in Fourier
+   * space from the transformed Nt. The first update, an update after the energies or optical constants changed, and
+   * an update that changes more than maxChangedVoxels voxels compute the full FFT. Requires Algorithm = 1.
+   *
+   * The direct sum costs one phase evaluation and six complex multiply-adds per changed voxel and frequency, about
+   * 50 flops per voxel for every changed voxel. The six FFTs it replaces cost about 30 log2(N) flops per voxel, so
+   * the direct sum only pays off for fewer than about log2(N) changed voxels, N being the number of voxels. This is
+   * the default of maxChangedVoxels.
+   * @param [out] scatteringPattern compute I(q)
+   * @param [in] changedVoxels flat indices (Z * Y * X order) of every voxel modified since the last update
+   * @param [in] maxChangedVoxels largest number of changed voxels that is updated incrementally. log2(N) if negative.
+   * @param [in] ifWriteMetadata weather to write metadata or not
+   * @throws std::runtime_error if the computation failed. The next update computes the full FFT.
+   */
+  void update(ScatteringPattern &scatteringPattern,
+              py::array_t<BigUINT, py::array::c_style | py::array::forcecast> &changedVoxels,
+              const int maxChangedVoxels = -1, bool ifWriteMetadata = false) {
+    if ((inputData_.algorithmType != Algorithm::MemoryMinizing) or (inputData_.ewaldEngine != EwaldEngine::Type::UNIFORM)) {
+      py::print("[ERROR] Incremental updates require Algorithm = 1 and EwaldEngine = 0");
+      return;
+    }
+    if (not prepare()) {
+      return;
+    }
+    const int NUM_MATERIAL = inputData_.NUM_MATERIAL;
+    const BigUINT numVoxels = inputData_.voxelDims[0] * inputData_.voxelDims[1] * inputData_.voxelDims[2];
+    std::vector<BigUINT> changed(changedVoxels.data(), changedVoxels.data() + changedVoxels.size());
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    if ((not changed.empty()) and (changed.back() >= numVoxels)) {
+      py::print("[ERROR] Changed voxel index out of range");
+      return;
+    }
+    const std::vector<Material> &materialInput = energyData_.getRefractiveIndexData();
+    fourierNt_.begin(inputData_, materialInput);
+    const std::vector<Complex *> entries = fourierNt_.getEntries();
+    const std::size_t maxChanged = (maxChangedVoxels < 0) ? static_cast<std::size_t>(std::log2(numVoxels))
+                                                          : static_cast<std::size_t>(maxChangedVoxels);
+    const bool isIncremental = (snapshot_.size() == numVoxels * NUM_MATERIAL)
+                               and (std::find(entries.begin(), entries.end(), nullptr) == entries.end())
+                               and (changed.size() <= maxChanged);
+    const Voxel *voxelInput = voxelData_.data();
+    {
+      py::gil_scoped_release release;
+      /// The change is added on the device to the transformed Nt read from the cache by the run
+      FourierNtUpdate fourierUpdate;
+      if (isIncremental) {
+        const std::size_t numChanged = changed.size();
+        fourierUpdate.changedVoxels = changed;
+        fourierUpdate.oldVoxels.resize(numChanged * NUM_MATERIAL);
+        fourierUpdate.newVoxels.resize(numChanged * NUM_MATERIAL);
+        for (int numMat = 0; numMat < NUM_MATERIAL; numMat++) {
+          for (std::size_t i = 0; i < numChanged; i++) {
+            const BigUINT id = numMat * numVoxels + changed[i];
+            fourierUpdate.oldVoxels[numMat * numChanged + i] = snapshot_[id];
+            fourierUpdate.newVoxels[numMat * numChanged + i] = voxelInput[id];
+          }
+        }
+      } else {
+        /// Computed and stored again by the run
+        fourierNt_.clear();
+      }
+      if (cudaMainStreams(inputData_.voxelDims, inputData_, materialInput, scatteringPattern.data(), rotationMatrix_,
+                          voxelInput, &context_, nullptr, &fourierNt_, &fourierUpdate) != EXIT_SUCCESS) {
+        /// The transformed Nt may be partially updated. The next update computes it again.
+        fourierNt_.clear();
+        snapshot_.clear();
+        throw std::runtime_error("The update of the scattering pattern failed");
+      }
+      if (isIncremental) {
+        for (int numMat = 0; numMat < NUM_MATERIAL; numMat++) {
+          for (const BigUINT id: changed) {
+            snapshot_[numMat * numVoxels + id] = voxelInput[numMat * numVoxels + id];
+          }
+        }
+      } else {
+        snapshot_.assign(voxelInput, voxelInput + numVoxels * NUM_MATERIAL);
+      }
+    }
+    if (ifWriteMetadata) {
+      printMetaData(inputData_, rotationMatrix_);
+    }
+  }
+
+  /**
+   * @brief Frees the device resources and the transformed Nt of the incremental updates. They are created again on
+   * the next run.
+   */
+  void release() {
+    context_.release();
+    fourierNt_.clear();
+    snapshot_.clear();
+  }
+};
+
+#endif //CY_RSOXS_SESSION_H
@@ -29,6 +29,8 @@
 #include <pybind11/numpy.h>
 #include <Output/writeH5.h>
 #include <Input/readH5.h>
+#include <cstdint>
+#include <stdexcept>
 
 
 namespace py = pybind11;
@@ -48,9 +50,153 @@ private:
   Voxel *voxel = nullptr; /// Voxel data
   const InputData &inputData_;           /// input data
   std::bitset<MAX_NUM_MATERIAL> validData_; /// Check that voxel data is correct
+  std::uint64_t version_ = 0;            /// Incremented every time the voxel data is modified
+  py::array view_;                       /// numpy array the voxel data points into, if it is not owned
+
+  /**
+   * @brief Strided read access to a numpy array of the morphology, in either morphology order.
+   */
+  struct ArrayView {
+    /// Array that is read. Either the array passed from Python or its contiguous copy.
+    py::array array;
+    const char *data = nullptr;
+    /// Strides in bytes along X, Y, Z and the component
+    py::ssize_t strides[4]{0, 0, 0, 0};
+
+    /**
+     * @brief Getter
+     * @param [in] x X index
+     * @param [in] y Y index
+     * @param [in] z Z index
+     * @param [in] c component
+     * @return value of the component at the voxel
+     */
+    inline Real operator()(const BigUINT x, const BigUINT y, const BigUINT z, const BigUINT c = 0) const {
+      return *reinterpret_cast<const Real *>(data + x * strides[0] + y * strides[1] + z * strides[2] + c * strides[3]);
+    }
+  };
+
+  /**
+   * @brief Views a numpy array of the morphology without copying it. The array is either of shape (Z, Y, X) for ZYX
+   * order or (X, Y, Z) for XYZ order, followed by the component axis if numComponents > 1, with any strides, or a
+   * contiguous array of any shape in the morphology order. Other arrays are copied to a contiguous array.
+   * @param [in] array numpy array
+   * @param [in] numComponents number of components per voxel
+   * @param [in] name name of the array for the error message
+   * @return view of the array
+   */
+  ArrayView getView(const py::array_t<Real, py::array::forcecast> &array, const UINT numComponents,
+                    const std::string &name) const {
+    const UINT *dims = inputData_.voxelDims;
+    const BigUINT numVoxels = static_cast<BigUINT>(dims[0]) * dims[1] * dims[2];
+    if (static_cast<BigUINT>(array.size()) != numVoxels * numComponents) {
+      throw std::logic_error(name + ": the number of entries does not match the voxel dimensions");
+    }
+    const bool isXYZ = (inputData_.morphologyOrder == MorphologyOrder::XYZ);
+    const py::ssize_t ndim = (numComponents > 1) ? 4 : 3;
+    ArrayView view;
+    if ((array.ndim() == ndim) and (array.shape(0) == (isXYZ ? dims[0] : dims[2])) and (array.shape(1) == dims[1])
+        and (array.shape(2) == (isXYZ ? dims[2] : dims[0]))) {
+      view.array = array;
+      view.strides[0] = array.strides(isXYZ ? 0 : 2);
+      view.strides[1] = array.strides(1);
+      view.strides[2] = array.strides(isXYZ ? 2 : 0);
+      view.strides[3] = (numComponents > 1) ? array.strides(3) : 0;
+    } else {
+      if (array.flags() & py::array::c_style) {
+        view.array = array;
+      } else {
+        view.array = py::array_t<Real, py::array::c_style | py::array::forcecast>(array);
+      }
+      const py::ssize_t component = sizeof(Real);
+      const py::ssize_t voxel = numComponents * component;
+      view.strides[0] = isXYZ ? voxel * dims[1] * dims[2] : voxel;
+      view.strides[1] = isXYZ ? voxel * dims[2] : voxel * dims[0];
+      view.strides[2] = isXYZ ? voxel : voxel * dims[0] * dims[1];
+      view.strides[3] = component;
+    }
+    view.data = static_cast<const char *>(view.array.data());
+    return view;
+  }
+
+  /**
+   * @brief Applies op(id, x, y, z) to every voxel, where id is the flat index in ZYX order. Runs in parallel with the
+   * GIL released, so op must not touch Python objects.
+   * @param [in] op operation
+   */
+  template<typename Op>
+  void forEachVoxel(const Op &op) const {
+    const BigUINT X = inputData_.voxelDims[0];
+    const BigUINT Y = inputData_.voxelDims[1];
+    const BigUINT Z = inputData_.voxelDims[2];
+    py::gil_scoped_release release;
+#pragma omp parallel for collapse(2)
+    for (BigUINT z = 0; z < Z; z++) {
+      for (BigUINT y = 0; y < Y; y++) {
+        const BigUINT offset = (z * Y + y) * X;
+        for (BigUINT x = 0; x < X; x++) {
+          op(offset + x, x, y, z);
+        }
+      }
+    }
+  }
+
+  /**
+   * @brief Voxel data that can be written. Allocates it on first use, and copies the materials already set if the
+   * voxel data points into a numpy array.
+   * @return The voxel data
+   */
+  Voxel *getWritableData() {
+    const BigUINT numVoxels = inputData_.voxelDims[0] * inputData_.voxelDims[1] * inputData_.voxelDims[2];
+    const BigUINT numEntries = numVoxels * inputData_.NUM_MATERIAL;
+    if (view_) {
+      Voxel *owned;
+      mallocCPU(owned, numEntries);
+      if (validData_.any()) {
+        const Voxel *source = voxel;
+        py::gil_scoped_release release;
+#pragma omp parallel for
+        for (BigUINT i = 0; i < numEntries; i++) {
+          owned[i] = source[i];
+        }
+      }
+      view_ = py::array();
+      voxel = owned;
+    } else if (voxel == nullptr) {
+      mallocCPU(voxel, numEntries);
+    }
+    return voxel;
+  }
+
+  /**
+   * @brief Checks the morphology type and the material ID before a material is added
+   * @param matID material ID . Start from 1 to NMat
+   * @param isEuler true if the material is added as Euler angles
+   * @return true if the material can be added
+   */
+  bool checkMaterial(const UINT matID, const bool isEuler) const {
+    if ((inputData_.morphologyType == MorphologyType::EULER_ANGLES) != isEuler) {
+      if (isEuler) {
+        py::print("Error: [Expected]: Euler Angles / Spherical Coordinates. [Found:] VectorMorphology\n");
+      } else {
+        py::print("Error: [Expected]: Vector Morphology [Found:] Euler Angles. Returning\n");
+      }
+      return false;
+    }
+    if ((matID > inputData_.NUM_MATERIAL) or (matID == 0)) {
+      throw std::logic_error(
+        "Number of material does not match with the compiled version. matID must range from 1 to NUM_MATERIAL");
+    }
+    if (validData_.test(matID - 1)) {
+      py::print("The material is already set. Please first reset to add the entries. Returning.");
+      return false;
+    }
+    return true;
+  }
+
 public:
   /**
-   * @brief constructor
+   * @brief constructor. The voxel data is allocated when the first material is added.
    * @param inputData Input data
    */
   VoxelData(const InputData &inputData)
@@ -61,132 +207,74 @@ public:
       return ;
     }
     clear();
-    const BigUINT numVoxels = inputData_.voxelDims[0] * inputData_.voxelDims[1] * inputData_.voxelDims[2];
-    mallocCPU(voxel, numVoxels * NUM_MATERIAL);
     validData_.reset();
   }
 
   /**
    * @brief add Material Alignment and unaligned data to the input for a given material. \n
-   * Once you add the material the bits corresponding to that bit is turned on.
+   * Once you add the material the bits corresponding to that bit is turned on. The arrays are read in place, with
+   * any strides, and converted in parallel.
    * @param matAlignementData Alignment data for the material. Must be in the order of Sx,Sy,Sz.
    * @param matUnalignedData The unalignment component for the material
    * @param matID material ID . Start from 1 to NMat
    */
-  void addMaterialDataVectorMorphology(py::array_t<Real, py::array::c_style | py::array::forcecast> &matAlignementData,
-                                       py::array_t<Real, py::array::c_style | py::array::forcecast> &matUnalignedData,
+  void addMaterialDataVectorMorphology(py::array_t<Real, py::array::forcecast> &matAlignementData,
+                                       py::array_t<Real, py::array::forcecast> &matUnalignedData,
                                        const UINT matID) {
-    const int NUM_MATERIAL = inputData_.NUM_MATERIAL;
-    if (inputData_.morphologyType == MorphologyType::EULER_ANGLES) {
-      py::print("Error: [Expected]: Vector Morphology [Found:] Euler Angles. Returning\n");
-      return;
-    }
-    if (matID > NUM_MATERIAL or (matID == 0)) {
-      throw std::logic_error(
-        "Number of material does not match with the compiled version. matID must range from 1 to NUM_MATERIAL");
-    }
-    if (validData_.test(matID - 1)) {
-      py::print("The material is already set. Please first reset to add the entries. Returning.");
+    if (not checkMaterial(matID, false)) {
       return;
     }
     const BigUINT numVoxels = inputData_.voxelDims[0] * inputData_.voxelDims[1] * inputData_.voxelDims[2];
-    std::vector<Real> _matAlignedData(numVoxels * 3);
-    std::vector<Real> _matUnalignedData(numVoxels);
-    for (int i = 0; i < numVoxels; i++) {
-      _matAlignedData[3 * i + 0] = matAlignementData.data()[3 * i + 0];
-      _matAlignedData[3 * i + 1] = matAlignementData.data()[3 * i + 1];
-      _matAlignedData[3 * i + 2] = matAlignementData.data()[3 * i + 2];
-      _matUnalignedData[i] = matUnalignedData.data()[i];
-    }
-    if (inputData_.morphologyOrder == MorphologyOrder::XYZ) {
-      H5::XYZ_to_ZYX(_matUnalignedData, 1, inputData_.voxelDims);
-      H5::XYZ_to_ZYX(_matAlignedData, 3, inputData_.voxelDims);
-    }
-    for (BigUINT i = 0; i < numVoxels; i++) {
-      voxel[(matID - 1) * numVoxels + i].s1.x = _matAlignedData.data()[i * 3 + 0];
-      voxel[(matID - 1) * numVoxels + i].s1.y = _matAlignedData.data()[i * 3 + 1];
-      voxel[(matID - 1) * numVoxels + i].s1.z = _matAlignedData.data()[i * 3 + 2];
-      voxel[(matID - 1) * numVoxels + i].s1.w = _matUnalignedData.data()[i];
-    }
+    const ArrayView aligned = getView(matAlignementData, 3, "AlignedData");
+    const ArrayView unaligned = getView(matUnalignedData, 1, "UnalignedData");
+    Voxel *material = &getWritableData()[(matID - 1) * numVoxels];
+    forEachVoxel([&](const BigUINT id, const BigUINT x, const BigUINT y, const BigUINT z) {
+      material[id].s1.x = aligned(x, y, z, 0);
+      material[id].s1.y = aligned(x, y, z, 1);
+      material[id].s1.z = aligned(x, y, z, 2);
+      material[id].s1.w = unaligned(x, y, z);
+    });
     validData_.set(matID - 1, true);
+    version_++;
   }
 
   /**
-   * @brief Adds the Euler Morphology input to the voxel data
+   * @brief Adds the Euler Morphology input to the voxel data. The arrays are read in place, with any strides, and
+   * converted in parallel.
    * @param matSVector Fraction of material that is aligned
    * @param matThetaVector First "real" rotation about X axis
    * @param matPhiVector Second rotation about Z axis
    * @param matVfracVector Volume fraction occupied by the material
    * @param matID material ID . Start from 1 to NMat
    */
-  void addMaterialDataEulerAngles(py::array_t<Real, py::array::c_style | py::array::forcecast> &matSVector,
-                                  py::array_t<Real, py::array::c_style | py::array::forcecast> &matThetaVector,
-                                  py::array_t<Real, py::array::c_style | py::array::forcecast> &matPsiVector,
-                                  py::array_t<Real, py::array::c_style | py::array::forcecast> &matVfracVector,
+  void addMaterialDataEulerAngles(py::array_t<Real, py::array::forcecast> &matSVector,
+                                  py::array_t<Real, py::array::forcecast> &matThetaVector,
+                                  py::array_t<Real, py::array::forcecast> &matPsiVector,
+                                  py::array_t<Real, py::array::forcecast> &matVfracVector,
                                   const UINT matID) {
-    const int NUM_MATERIAL = inputData_.NUM_MATERIAL;
-
-    if (inputData_.morphologyType != MorphologyType::EULER_ANGLES) {
-      py::print("Error: [Expected]: Euler Angles / Spherical Coordinates. [Found:] VectorMorphology\n");
-      return;
-    }
-    if ((matID > NUM_MATERIAL) or (matID == 0)) {
-      throw std::logic_error(
-        "Number of material does not match with the compiled version. matID must range from 1 to NUM_MATERIAL");
-    }
-    if (validData_.test(matID - 1)) {
-      py::print("The material is already set. Please first reset to add the entries. Returning.");
+    if (not checkMaterial(matID, true)) {
       return;
     }
     const BigUINT numVoxels = inputData_.voxelDims[0] * inputData_.voxelDims[1] * inputData_.voxelDims[2];
-
-    if (inputData_.morphologyOrder == MorphologyOrder::XYZ) {
-      std::vector<Real> _S(numVoxels);
-      std::vector<Real> _Theta(numVoxels);
-      std::vector<Real> _Psi(numVoxels);
-      std::vector<Real> _Vfrac(numVoxels);
-
-      for (BigUINT i = 0; i < numVoxels; i++) {
-        _S[i] = matSVector.data()[i];
-        _Theta[i] = matThetaVector.data()[i];
-        _Psi[i] = matPsiVector.data()[i];
-        _Vfrac[i] = matVfracVector.data()[i];
+    const ArrayView S = getView(matSVector, 1, "S");
+    const ArrayView theta = getView(matThetaVector, 1, "Theta");
+    const ArrayView psi = getView(matPsiVector, 1, "Psi");
+    const ArrayView vFrac = getView(matVfracVector, 1, "Vfrac");
+    Voxel *material = &getWritableData()[(matID - 1) * numVoxels];
+    forEachVoxel([&](const BigUINT id, const BigUINT x, const BigUINT y, const BigUINT z) {
+      const Real s = S(x, y, z);
+      material[id].s1.x = s;
+      if (s != 0) {
+        material[id].s1.y = theta(x, y, z);
+        material[id].s1.z = psi(x, y, z);
+      } else {
+        material[id].s1.y = 0;
+        material[id].s1.z = 0;
       }
-
-      H5::XYZ_to_ZYX(_S, 1, inputData_.voxelDims);
-      H5::XYZ_to_ZYX(_Theta, 1, inputData_.voxelDims);
-      H5::XYZ_to_ZYX(_Psi, 1, inputData_.voxelDims);
-      H5::XYZ_to_ZYX(_Vfrac, 1, inputData_.voxelDims);
-    
-
-      for (BigUINT i = 0; i < numVoxels; i++) {
-        voxel[(matID - 1) * numVoxels + i].s1.x = _S[i];
-        if (_S[i] != 0) {
-          voxel[(matID - 1) * numVoxels + i].s1.y = _Theta[i];
-          voxel[(matID - 1) * numVoxels + i].s1.z = _Psi[i];
-        } else {
-          voxel[(matID - 1) * numVoxels + i].s1.y = 0;
-          voxel[(matID - 1) * numVoxels + i].s1.z = 0;
-        }
-        voxel[(matID - 1) * numVoxels + i].s1.w = _Vfrac[i];
-      }
-    }
-    else{
-      // #pragma omp parallel for
-      for (BigUINT i = 0; i < numVoxels; i++) {
-        voxel[(matID - 1) * numVoxels + i].s1.x = matSVector.data()[i];
-        if (matSVector.data()[i] != 0) {
-          voxel[(matID - 1) * numVoxels + i].s1.y = matThetaVector.data()[i];
-          voxel[(matID - 1) * numVoxels + i].s1.z = matPsiVector.data()[i];
-        } else {
-          voxel[(matID - 1) * numVoxels + i].s1.y = 0;
-          voxel[(matID - 1) * numVoxels + i].s1.z = 0;
-        }
-        voxel[(matID - 1) * numVoxels + i].s1.w = matVfracVector.data()[i];
-      }
-    }
-
+      material[id].s1.w = vFrac(x, y, z);
+    });
     validData_.set(matID - 1, true);
+    version_++;
   }
 
   /**
@@ -194,39 +282,95 @@ public:
    * @param matVfracVector Vector for volume fraction
    * @param matID material ID
    */
-  void addMaterialDataEulerAnglesOnlyVFrac(py::array_t<Real, py::array::c_style | py::array::forcecast> &matVfracVector,
+  void addMaterialDataEulerAnglesOnlyVFrac(py::array_t<Real, py::array::forcecast> &matVfracVector,
                                   const UINT matID) {
-    const int NUM_MATERIAL = inputData_.NUM_MATERIAL;
-
-    if (inputData_.morphologyType != MorphologyType::EULER_ANGLES) {
-      py::print("Error: [Expected]: Euler Angles / Spherical Coordinates. [Found:] VectorMorphology\n");
-      return;
-    }
-    if ((matID > NUM_MATERIAL) or (matID == 0)) {
-      throw std::logic_error(
-        "Number of material does not match with the compiled version. matID must range from 1 to NUM_MATERIAL");
-    }
-    if (validData_.test(matID - 1)) {
-      py::print("The material is already set. Please first reset to add the entries. Returning.");
+    if (not checkMaterial(matID, true)) {
       return;
     }
     const BigUINT numVoxels = inputData_.voxelDims[0] * inputData_.voxelDims[1] * inputData_.voxelDims[2];
-    std::vector<Real> _Vfrac(numVoxels);
-    for (int i = 0; i < numVoxels; i++) {
-      _Vfrac[i] = matVfracVector.data()[i];
+    const ArrayView vFrac = getView(matVfracVector, 1, "Vfrac");
+    Voxel *material = &getWritableData()[(matID - 1) * numVoxels];
+    forEachVoxel([&](const BigUINT id, const BigUINT x, const BigUINT y, const BigUINT z) {
+      material[id].s1.x = 0;
+      material[id].s1.y = 0;
+      material[id].s1.z = 0;
+      material[id].s1.w = vFrac(x, y, z);
+    });
+    validData_.set(matID - 1, true);
+    version_++;
+  }
+
+  /**
+   * @brief Sets the voxel data of all the materials at once from an array of shape (NumMaterial, Z, Y, X, 4) in ZYX
+   * order or (NumMaterial, X, Y, Z, 4) in XYZ order. The last axis holds (Sx, Sy, Sz, unaligned fraction) for Vector
+   * Morphology and (S, \f$\theta\f$, \f$\psi\f$, Vfrac) for Euler angles, used as given. A contiguous array in ZYX order
+   * of the same floating point type as CyRSoXS is used in place without copying, and the simulation reads it directly.
+   * Call markModified after modifying it in place. Other arrays are converted in parallel, and later modifications of
+   * them are not seen by the simulation.
+   * @param array voxel data of all the materials
+   */
+  void setMaterialDataView(py::array &array) {
+    py::array_t<Real, py::array::forcecast> voxels;
+    if (array.dtype().equal(py::dtype::of<Real>())) {
+      voxels = py::array_t<Real, py::array::forcecast>(array);
+    } else {
+      py::print("[WARNING] The voxel data is not of type", (sizeof(Real) == 4 ? "float32" : "float64"),
+                "and is copied. Modifications of the array in place are not seen by the simulation.");
+      voxels = py::array_t<Real, py::array::forcecast>::ensure(array);
+      if (not voxels) {
+        throw std::invalid_argument("The voxel data cannot be converted to a floating point array");
+      }
     }
-    if (inputData_.morphologyOrder == MorphologyOrder::XYZ) {
-      H5::XYZ_to_ZYX(_Vfrac, 1, inputData_.voxelDims);
+    const UINT *dims = inputData_.voxelDims;
+    const BigUINT numVoxels = static_cast<BigUINT>(dims[0]) * dims[1] * dims[2];
+    const BigUINT numMaterial = inputData_.NUM_MATERIAL;
+    const bool isXYZ = (inputData_.morphologyOrder == MorphologyOrder::XYZ);
+    if ((voxels.ndim() != 5) or (static_cast<BigUINT>(voxels.shape(0)) != numMaterial) or (voxels.shape(1) != (isXYZ ? dims[0] : dims[2]))
+        or (voxels.shape(2) != dims[1]) or (voxels.shape(3) != (isXYZ ? dims[2] : dims[0])) or (voxels.shape(4) != 4)) {
+      throw std::logic_error("The shape of the voxel data must be (NumMaterial, Z, Y, X, 4) for ZYX order "
+                             "or (NumMaterial, X, Y, Z, 4) for XYZ order");
     }
-
-    for (BigUINT i = 0; i < numVoxels; i++) {
-      voxel[(matID - 1) * numVoxels + i].s1.x = 0;
-      voxel[(matID - 1) * numVoxels + i].s1.y = 0;
-      voxel[(matID - 1) * numVoxels + i].s1.z = 0;
-      voxel[(matID - 1) * numVoxels + i].s1.w = _Vfrac[i];
+    const bool isAligned = (reinterpret_cast<std::uintptr_t>(voxels.data()) % alignof(Voxel)) == 0;
+    if ((not isXYZ) and (voxels.flags() & py::array::c_style) and isAligned) {
+      clear();
+      view_ = voxels;
+      voxel = reinterpret_cast<Voxel *>(const_cast<Real *>(voxels.data()));
+    } else {
+      if (view_) {
+        clear();
+      }
+      Voxel *data = getWritableData();
+      const char *source = reinterpret_cast<const char *>(voxels.data());
+      py::ssize_t strides[5];
+      for (int i = 0; i < 5; i++) {
+        strides[i] = voxels.strides(i);
+      }
+      for (BigUINT numMat = 0; numMat < numMaterial; numMat++) {
+        ArrayView material;
+        material.data = source + numMat * strides[0];
+        material.strides[0] = strides[isXYZ ? 1 : 3];
+        material.strides[1] = strides[2];
+        material.strides[2] = strides[isXYZ ? 3 : 1];
+        material.strides[3] = strides[4];
+        Voxel *target = &data[numMat * numVoxels];
+        forEachVoxel([&](const BigUINT id, const BigUINT x, const BigUINT y, const BigUINT z) {
+          target[id].s1.x = material(x, y, z, 0);
+          target[id].s1.y = material(x, y, z, 1);
+          target[id].s1.z = material(x, y, z, 2);
+          target[id].s1.w = material(x, y, z, 3);
+        });
+      }
     }
+    validData_.set();
+    version_++;
+  }
 
-    validData_.set(matID - 1, true);
+  /**
+   * @brief Marks the voxel data as modified. Required after modifying the array passed to setMaterialDataView in
+   * place, so that the next launch of a Session uploads it again.
+   */
+  void markModified() {
+    version_++;
   }
 
   /**
@@ -258,9 +402,11 @@ public:
       return;
     }
 
+    getWritableData();
     H5::readFile(fname, inputData_.voxelDims, voxel, (MorphologyType) inputData_.morphologyType,
                  inputData_.morphologyOrder, inputData_.NUM_MATERIAL,true);
     validData_.set();
+    version_++;
   }
 
   /**
@@ -285,10 +431,13 @@ public:
    * Clear the voxel data.
    */
   void clear() {
-    if (voxel != nullptr) {
+    if (view_) {
+      view_ = py::array();
+    } else if (voxel != nullptr) {
       delete[] voxel;
     }
     voxel = nullptr;
+    version_++;
   }
 
   /**
@@ -306,6 +455,14 @@ public:
     return voxel;
   }
 
+  /**
+   * @brief Getter. Used by Session to detect whether the morphology needs to be uploaded again.
+   * @return The number of modifications made to the voxel data
+   */
+  std::uint64_t version() const {
+    return version_;
+  }
+
   /**
    * @brief Checks if the voxel data is correct.
    * @return True if the input is correct. False otherwise
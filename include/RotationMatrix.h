@@ -55,6 +55,18 @@ class RotationMatrix{
   Matrix detectorRotationMatrix_;
   /// The axis value for X, Y, Z for 0 degree E rotation
   std::vector<BaseAxis> baseAxis_;
+  /// k Vectors for which the matrices were computed
+  std::vector<Real3> computedKVectors_;
+  /// detector coordinates for which the matrices were computed
+  Real3 computedDetectorCoordinates_{0, 0, 0};
+  /// true if the rotation matrices have been computed
+  bool isComputed_ = false;
+
+  /**
+   * @brief checks if the matrices are already computed for the current k Vectors and detector coordinates
+   * @return true if nothing needs to be recomputed
+   */
+  bool isUpToDate() const;
 public:
   /**
    * @ brief Constructor
@@ -62,7 +74,17 @@ public:
    */
   RotationMatrix(const InputData * inputData);
   /**
-   * @brief computes the required rotation matrices
+   * @brief Sets the input data the matrices are computed for. The matrices are
+   * recomputed in initComputation only if k Vectors / detector coordinates differ.
+   * @param inputData input data
+   */
+  inline void setInputData(const InputData * inputData){
+    inputData_ = inputData;
+  }
+
+  /**
+   * @brief computes the required rotation matrices. Skipped if the k Vectors and detector coordinates
+   * are unchanged since the last call.
    */
   void initComputation();
 
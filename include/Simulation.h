@@ -0,0 +1,753 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_SIMULATION_H
+#define CY_RSOXS_SIMULATION_H
+
+#ifndef PYBIND
+#include <cudaMain.h>
+#include <Input/readH5.h>
+#include <Input/InputData.h>
+#include <Input/Downsample.h>
+#include <Output/writeH5.h>
+#include <SimulationContext.h>
+#include <Planner.h>
+#include <SparseQ.h>
+#include <utils.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <Output/Ensemble.h>
+#include <Output/OutputSink.h>
+#include <Output/FourierCacheFile.h>
+#include <Output/ResultCache.h>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Description of a single simulation run.
+ */
+struct SimulationJob {
+  /// config file
+  std::string configFile = "config.txt";
+  /// directory containing Material1.txt ... MaterialN.txt. Empty for current directory
+  std::string materialDir;
+  /// HDF5 morphology file
+  std::string morphologyFile;
+  /// Output directory. Empty to use HDF5DirName from the config file
+  std::string outputDir;
+  /// Sub directory of the output directory. Empty to write directly to the output directory.
+  std::string outputSubDir;
+  /// Name of the log file. Empty to write CyRSoXS.log to the output directory.
+  std::string logFile = "CyRSoXS.log";
+  /// Skip the energies that a previous run of the job completed
+  bool resume = false;
+  /// Print the execution plans without reading the morphology or computing
+  bool dryRun = false;
+  /// Fail instead of running if the configured algorithm does not fit in the device memory budget
+  bool checkDeviceMemory = false;
+};
+
+/**
+ * @brief Pinned host buffer holding a morphology read from HDF5 file.
+ */
+struct MorphologyBuffer {
+  /// morphology data
+  Voxel *data = nullptr;
+  /// Number of voxels (x number of material) the buffer can hold
+  std::size_t capacity = 0;
+  /// Morphology file that is in the buffer. Empty if none.
+  std::string file;
+  /// Modification time of the morphology file when it was read
+  timespec mtime{0, 0};
+  /// Parameters the morphology was read with
+  UINT dims[3]{0, 0, 0};
+  int numMaterial = 0;
+  UINT morphologyType = MorphologyType::MAX_MORPHOLOGY_TYPE;
+  /// false if the morphology has NaN
+  bool isValid = false;
+  /// Hash of the morphology. Computed on first use.
+  uint64_t hash = 0;
+  bool isHashed = false;
+  /// Block size if the buffer holds a block averaged morphology. 1 otherwise.
+  UINT factor = 1;
+
+  /**
+   * @brief checks if the buffer holds the unmodified file read with the same parameters
+   * @param [in] fname HDF5 file
+   * @param [in] inputData input data
+   * @return true if the file need not be read again
+   */
+  bool holds(const std::string &fname, const InputData &inputData) const {
+    struct stat fileStat{};
+    if ((file != fname) or (stat(fname.c_str(), &fileStat) != 0)) {
+      return false;
+    }
+    return ((mtime.tv_sec == fileStat.st_mtim.tv_sec) and (mtime.tv_nsec == fileStat.st_mtim.tv_nsec)
+            and (numMaterial == inputData.NUM_MATERIAL) and (morphologyType == inputData.morphologyType)
+            and (std::memcmp(dims, inputData.voxelDims, sizeof(UINT) * 3) == 0));
+  }
+
+  /**
+   * @brief reads the morphology
+   * @param [in] fname HDF5 file
+   * @param [in] type morphology type
+   * @return false if the morphology contains NaN
+   */
+  bool read(const std::string &fname, const MorphologyType type) {
+    std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+    struct stat fileStat{};
+    stat(fname.c_str(), &fileStat);
+    file.clear();
+    numMaterial = H5::getNumberOfMaterial(fname);
+    Real physSize;
+    MorphologyOrder order;
+    H5::getDimensionAndOrder(fname, type, dims, physSize, order);
+    const std::size_t numVoxels = static_cast<std::size_t>(dims[0]) * dims[1] * dims[2] * numMaterial;
+    if (numVoxels > capacity) {
+      release();
+      mallocCPUPinned(data, numVoxels);
+      capacity = numVoxels;
+    }
+    H5::readFile(fname, dims, data, type, order, numMaterial, true);
+    isValid = checkMorphology(data, dims, numMaterial);
+    isHashed = false;
+    file = fname;
+    mtime = fileStat.st_mtim;
+    morphologyType = type;
+    factor = 1;
+    return isValid;
+  }
+
+  /**
+   * @brief checks if the buffer holds the block averaged morphology of source
+   * @param [in] source morphology read from file
+   * @param [in] blockSize block size of the averaging
+   * @return true if the morphology need not be averaged again
+   */
+  bool isDownsampledFrom(const MorphologyBuffer &source, const UINT blockSize) const {
+    return ((factor == blockSize) and not(file.empty()) and (file == source.file) and (source.factor == 1)
+            and (mtime.tv_sec == source.mtime.tv_sec) and (mtime.tv_nsec == source.mtime.tv_nsec)
+            and (numMaterial == source.numMaterial) and (morphologyType == source.morphologyType));
+  }
+
+  /**
+   * @brief block averages the morphology of source
+   * @param [in] source morphology read from file
+   * @param [in] blockSize block size of the averaging. The dimensions of source must be divisible by it.
+   */
+  void downsample(const MorphologyBuffer &source, const UINT blockSize) {
+    file.clear();
+    getDownsampledDimensions(source.dims, blockSize, dims);
+    numMaterial = source.numMaterial;
+    const std::size_t numVoxels = static_cast<std::size_t>(dims[0]) * dims[1] * dims[2] * numMaterial;
+    if (numVoxels > capacity) {
+      release();
+      mallocCPUPinned(data, numVoxels);
+      capacity = numVoxels;
+    }
+    downsampleMorphology(source.data, source.dims, blockSize, numMaterial,
+                         static_cast<MorphologyType>(source.morphologyType), data);
+    isValid = source.isValid;
+    isHashed = false;
+    file = source.file;
+    mtime = source.mtime;
+    morphologyType = source.morphologyType;
+    factor = blockSize;
+  }
+
+  /**
+   * @return hash of the morphology
+   */
+  uint64_t getHash() {
+    if (not(isHashed)) {
+      hash = hashBytes(data, sizeof(Voxel) * static_cast<std::size_t>(dims[0]) * dims[1] * dims[2] * numMaterial);
+      isHashed = true;
+    }
+    return hash;
+  }
+
+  /**
+   * @brief frees the buffer
+   */
+  void release() {
+    if (data != nullptr) {
+      cudaFreeHost(data);
+    }
+    data = nullptr;
+    capacity = 0;
+    file.clear();
+  }
+};
+
+/**
+ * @brief Runs simulations one after another. Device resources, rotation matrices and the last
+ * morphology read are kept alive between runs, so that consecutive runs only pay for what changed.
+ * The morphology of the next run can be read in the background while the current one computes.
+ */
+class SimulationDriver {
+  /// Device resources
+  SimulationContext context_;
+  /// Rotation matrices
+  RotationMatrix rotationMatrix_{nullptr};
+  /// Morphology used by the current run
+  MorphologyBuffer resident_;
+  /// Morphology read in the background for the next run
+  MorphologyBuffer prefetched_;
+  /// Block averaged morphology of the preview runs
+  MorphologyBuffer preview_;
+  /// Morphology that the device holds
+  const MorphologyBuffer *uploaded_ = nullptr;
+  /// Thread reading prefetched_
+  std::thread prefetchThread_;
+  /// Morphology file of the last background read, and its error if the read failed
+  std::string prefetchFile_;
+  std::exception_ptr prefetchError_;
+
+  /**
+   * @brief waits until the background read is complete
+   */
+  void waitForPrefetch() {
+    if (prefetchThread_.joinable()) {
+      prefetchThread_.join();
+    }
+  }
+
+  /**
+   * @brief starts reading the morphology in the background. An error of the read is kept until the job of the
+   * morphology is loaded.
+   * @param fname HDF5 file
+   * @param type morphology type
+   */
+  void prefetch(const std::string &fname, const MorphologyType type) {
+    waitForPrefetch();
+    prefetchFile_ = fname;
+    prefetchError_ = nullptr;
+    prefetchThread_ = std::thread([this, fname, type] {
+      try {
+        prefetched_.read(fname, type);
+      } catch (...) {
+        prefetchError_ = std::current_exception();
+      }
+    });
+  }
+
+  /**
+   * @brief Makes the morphology of the job resident. It is read only if neither the resident nor
+   * the prefetched morphology is the same unmodified file.
+   * @param [in] job simulation job
+   * @param [in] inputData input data of the job
+   * @return true on success. false if the morphology contains NaN.
+   * @throws the error of the background read of the morphology, or of the read if it was not prefetched
+   */
+  bool loadMorphology(const SimulationJob &job, const InputData &inputData) {
+    if (resident_.holds(job.morphologyFile, inputData)) {
+      std::cout << "[INFO] Reusing morphology " << job.morphologyFile << "\n";
+    } else {
+      waitForPrefetch();
+      if (prefetchError_ and (prefetchFile_ == job.morphologyFile)) {
+        const std::exception_ptr error = prefetchError_;
+        prefetchError_ = nullptr;
+        std::cout << RED << "[Input Error] Could not read the prefetched morphology " << job.morphologyFile << NRM
+                  << "\n";
+        std::rethrow_exception(error);
+      }
+      if (prefetched_.holds(job.morphologyFile, inputData)) {
+        std::cout << "[INFO] Using prefetched morphology " << job.morphologyFile << "\n";
+        std::swap(resident_, prefetched_);
+      } else {
+        resident_.read(job.morphologyFile, static_cast<MorphologyType>(inputData.morphologyType));
+      }
+      context_.markVoxelDataModified();
+    }
+    if (not(resident_.isValid)) {
+      std::cout << RED << "[Input Error] Nan detected in the morphology " << job.morphologyFile << NRM << "\n";
+    }
+    return resident_.isValid;
+  }
+
+  /**
+   * @brief Makes the block averaged morphology of a preview run. It is kept for the next preview of the same
+   * morphology with the same PreviewFactor.
+   * @param [in,out] inputData input data. The dimensions and PhysSize are set to the ones of the preview.
+   * @return true on success. false if the dimensions are not divisible by PreviewFactor.
+   */
+  bool loadPreview(InputData &inputData) {
+    UINT coarseDims[3];
+    if (not(getDownsampledDimensions(inputData.voxelDims, inputData.previewFactor, coarseDims))) {
+      std::cout << RED << "[Input Error] The dimensions of the morphology are not divisible by PreviewFactor = "
+                << inputData.previewFactor << NRM << "\n";
+      return false;
+    }
+    if (preview_.isDownsampledFrom(resident_, inputData.previewFactor)) {
+      std::cout << "[INFO] Reusing preview morphology\n";
+    } else {
+      preview_.downsample(resident_, inputData.previewFactor);
+      context_.markVoxelDataModified();
+    }
+    std::memcpy(inputData.voxelDims, coarseDims, sizeof(UINT) * 3);
+    inputData.physSize *= inputData.previewFactor;
+    return true;
+  }
+
+  /**
+   * @brief Computes the scattering patterns of a morphology
+   * @param [in] inputData input data
+   * @param [in] materialInput optical constants
+   * @param [in] morphology morphology
+   * @param [in] sink receives every (energy, k) pattern as soon as it is computed. Can be nullptr.
+   * @param [out] projectionGPUAveraged the scattering patterns if sink is nullptr, nullptr otherwise. Freed by the
+   * caller.
+   * @return EXIT_SUCCESS on success. EXIT_FAILURE if the sink failed to write a frame.
+   */
+  int compute(const InputData &inputData, const std::vector<Material> &materialInput, MorphologyBuffer &morphology,
+              FrameSink *sink, Real *&projectionGPUAveraged) {
+    if (uploaded_ != &morphology) {
+      context_.markVoxelDataModified();
+      uploaded_ = &morphology;
+    }
+    /// Energies found in the result cache are served by the cache and not computed
+    std::unique_ptr<ResultCache> resultCache;
+    if ((sink != nullptr) and not(inputData.resultCacheDir.empty())) {
+      resultCache.reset(new ResultCache(sink, morphology.getHash(), materialInput));
+      sink = resultCache.get();
+    }
+    /// With a sink, the patterns are never gathered on the host
+    projectionGPUAveraged = nullptr;
+    if (sink != nullptr) {
+      sink->begin(inputData);
+    } else {
+      const UINT numEnergyLevel = inputData.energies.size();
+      const std::size_t totalArraySize = static_cast<std::size_t>(numEnergyLevel) *
+                                         static_cast<std::size_t>(inputData.voxelDims[0] * inputData.voxelDims[1]) *
+                                         inputData.kVectors.size();
+      projectionGPUAveraged = new Real[totalArraySize];
+    }
+
+    rotationMatrix_.setInputData(&inputData);
+    int status;
+    if (inputData.ewaldEngine == EwaldEngine::Type::NUFFT) {
+      status = cudaMainNUFFT(inputData.voxelDims, inputData, materialInput, projectionGPUAveraged, rotationMatrix_,
+                             morphology.data, &context_, sink);
+    } else if (inputData.algorithmType == Algorithm::MemoryMinizing) {
+      std::unique_ptr<FourierCacheFile> fourierCache;
+      if (inputData.fourierCacheMode != FourierCacheMode::Type::NONE) {
+        fourierCache.reset(new FourierCacheFile(morphology.getHash()));
+        fourierCache->begin(inputData, materialInput);
+      }
+      status = cudaMainStreams(inputData.voxelDims, inputData, materialInput, projectionGPUAveraged, rotationMatrix_,
+                               morphology.data, &context_, sink, fourierCache.get());
+    } else {
+      status = cudaMain(inputData.voxelDims, inputData, materialInput, projectionGPUAveraged, rotationMatrix_,
+                        morphology.data, &context_, sink);
+    }
+    if (sink != nullptr) {
+      sink->end();
+    }
+    return status;
+  }
+
+  /**
+   * @brief Checks the peak device memory that the planner estimates for the configured algorithm against the
+   * device memory budget. The workspaces kept from the previous run are released if the run fits without them.
+   * @param [in] inputData input data
+   * @param [in] isStreamed true if the patterns are streamed to a sink instead of being gathered on the host
+   * @return true if the run fits in the budget
+   */
+  bool fitsDeviceMemory(const InputData &inputData, const bool isStreamed) {
+    static constexpr double MB = 1024.0 * 1024.0;
+    const std::size_t deviceBytes = getExecutionPlan(inputData, getCostModel(), inputData.algorithmType,
+                                                     inputData.numMaxStreams, inputData.scatterApproach,
+                                                     isStreamed).deviceBytes;
+    if (deviceBytes <= getDeviceMemoryBudget(inputData)) {
+      return true;
+    }
+    context_.release();
+    const std::size_t budget = getDeviceMemoryBudget(inputData);
+    if (deviceBytes <= budget) {
+      return true;
+    }
+    std::cout << RED << "[Plan] The configured Algorithm needs " << deviceBytes / MB << " MB of device memory. Only "
+              << budget / MB << " MB are available" << NRM << "\n";
+    return false;
+  }
+
+  /**
+   * @brief Computes the energies and the q range flagged for refinement of a preview run at full resolution.
+   * The output is written to the sub directory Refined of the output directory.
+   * @param [in] fullInputData input data of the run at full resolution
+   * @param [in] materialInput optical constants of the energies of fullInputData
+   * @param [in] sink receives every (energy, k) pattern as soon as it is computed
+   * @param [in] checkDeviceMemory fail if the refinement does not fit in the device memory budget
+   * @return true on success. False if a refined energy is not simulated, the refinement does not fit in the
+   * device memory or a frame could not be written.
+   */
+  bool refinePreview(const InputData &fullInputData, const std::vector<Material> &materialInput, FrameSink *sink,
+                     const bool checkDeviceMemory) {
+    InputData inputData(fullInputData);
+    inputData.previewFactor = 1;
+    /// Optical constants of the refined energies, in the order of inputData.energies
+    std::vector<Material> refinedMaterialInput(materialInput);
+    if (not(fullInputData.previewRefineEnergies.empty())) {
+      const std::vector<Real> &energies = fullInputData.energies;
+      const UINT NUM_MATERIAL = fullInputData.NUM_MATERIAL;
+      std::vector<UINT> energyIDs;
+      for (const Real &energy: fullInputData.previewRefineEnergies) {
+        const auto it = std::find_if(energies.begin(), energies.end(),
+                                     [&](const Real &e) { return FEQUALS(e, energy); });
+        if (it == energies.end()) {
+          std::cout << RED << "[Input Error] PreviewRefineEnergies has the energy " << energy
+                    << " that is not simulated" << NRM << "\n";
+          return false;
+        }
+        energyIDs.push_back(static_cast<UINT>(it - energies.begin()));
+      }
+      std::sort(energyIDs.begin(), energyIDs.end());
+      energyIDs.erase(std::unique(energyIDs.begin(), energyIDs.end()), energyIDs.end());
+      inputData.energies.clear();
+      refinedMaterialInput.clear();
+      for (const UINT energyID: energyIDs) {
+        inputData.energies.push_back(energies[energyID]);
+        refinedMaterialInput.insert(refinedMaterialInput.end(), materialInput.begin() + energyID * NUM_MATERIAL,
+                                    materialInput.begin() + (energyID + 1) * NUM_MATERIAL);
+      }
+    }
+    if (not(fullInputData.previewRefineQRange.empty())) {
+      inputData.roiType = ROI::Type::ANNULUS;
+      inputData.roiQRange[0] = fullInputData.previewRefineQRange[0];
+      inputData.roiQRange[1] = fullInputData.previewRefineQRange[1];
+    }
+    inputData.HDF5DirName += "/Refined";
+    createDirectory(inputData.HDF5DirName);
+    inputData.check2D();
+    /// The preview was planned for the coarse morphology. Plan the refinement at full resolution.
+    if (inputData.autoPlan) {
+      applyExecutionPlan(inputData, true);
+    }
+    if (checkDeviceMemory and not(fitsDeviceMemory(inputData, true))) {
+      return false;
+    }
+    std::cout << GRN << "[PREVIEW] Refining " << inputData.energies.size() << " energies at full resolution" << NRM
+              << "\n";
+    Real *projectionGPUAveraged;
+    return (compute(inputData, refinedMaterialInput, resident_, sink, projectionGPUAveraged) == EXIT_SUCCESS);
+  }
+
+public:
+  SimulationDriver() = default;
+  SimulationDriver(const SimulationDriver &) = delete;
+  SimulationDriver &operator=(const SimulationDriver &) = delete;
+
+  /**
+   * @brief Destructor
+   */
+  ~SimulationDriver() {
+    waitForPrefetch();
+    resident_.release();
+    prefetched_.release();
+    preview_.release();
+  }
+
+  /**
+   * @return rotation matrices of the last run
+   */
+  inline const RotationMatrix &rotationMatrix() const {
+    return rotationMatrix_;
+  }
+
+  /**
+   * @brief Runs a simulation
+   * @param [in] job simulation job
+   * @param [in] nextJob job that runs next. Its morphology is read while this job computes. Can be nullptr.
+   * @param [in] output called with the input data and the scattering pattern once the simulation is complete.
+   * The scattering pattern is nullptr if sink is set.
+   * @param [in] sink receives every (energy, k) pattern as soon as it is computed. Can be nullptr.
+   * @return EXIT_SUCCESS on success
+   */
+  int simulate(const SimulationJob &job, const SimulationJob *nextJob,
+               const std::function<void(const InputData &, const Real *)> &output, FrameSink *sink = nullptr) {
+    std::vector<Material> materialInput;
+    InputData inputData(job.configFile);
+    inputData.NUM_MATERIAL = H5::getNumberOfMaterial(job.morphologyFile);
+    inputData.readRefractiveIndexData(materialInput, job.materialDir);
+    inputData.validate();
+    H5::getDimensionAndOrder(job.morphologyFile, (MorphologyType) inputData.morphologyType, inputData.voxelDims,
+                             inputData.physSize, inputData.morphologyOrder);
+    /// A dry run plans the full resolution morphology from its dimensions only
+    if (job.dryRun) {
+      inputData.check2D();
+      inputData.print();
+      const CostModel model = getCostModel();
+      const std::size_t budget = getDeviceMemoryBudget(inputData);
+      const std::vector<ExecutionPlan> plans = getExecutionPlans(inputData, model, budget, sink != nullptr);
+      printExecutionPlans(plans, model, budget, selectExecutionPlan(inputData, plans));
+      return EXIT_SUCCESS;
+    }
+    if (not(job.outputDir.empty())) {
+      inputData.HDF5DirName = job.outputDir;
+    }
+    if (not(job.outputSubDir.empty())) {
+      createDirectory(inputData.HDF5DirName);
+      inputData.HDF5DirName += "/" + job.outputSubDir;
+      createDirectory(inputData.HDF5DirName);
+    }
+    if (not(loadMorphology(job, inputData))) {
+      return EXIT_FAILURE;
+    }
+    /// A preview runs on the block averaged morphology
+    const InputData fullInputData(inputData);
+    MorphologyBuffer *morphology = &resident_;
+    if (inputData.previewFactor > 1) {
+      if (not(loadPreview(inputData))) {
+        return EXIT_FAILURE;
+      }
+      morphology = &preview_;
+    }
+    inputData.check2D();
+    if (inputData.autoPlan) {
+      applyExecutionPlan(inputData, sink != nullptr);
+    }
+    if (job.checkDeviceMemory and not(fitsDeviceMemory(inputData, sink != nullptr))) {
+      return EXIT_FAILURE;
+    }
+    inputData.print();
+    if (inputData.caseType != CaseTypes::DEFAULT) {
+      std::cout << BLU << "This is an experimental feature which is not tested. " << NRM << "\n";
+    }
+    if (inputData.dumpMorphology) {
+      H5::writeXDMF(inputData, morphology->data);
+    }
+    if (nextJob != nullptr) {
+      prefetch(nextJob->morphologyFile, static_cast<MorphologyType>(inputData.morphologyType));
+    }
+
+    printCopyrightInfo();
+    /// A sparse evaluation computes the listed q points only and writes them to QPoints.h5
+    if (not(inputData.qPointsFile.empty())) {
+      if (sink == nullptr) {
+        std::cout << RED << "[Input Error] QPointsFile requires streamed output" << NRM << "\n";
+        return EXIT_FAILURE;
+      }
+      const std::vector<Real2> qPoints = readQPoints(inputData.qPointsFile);
+      std::vector<Real> intensity(qPoints.size() * inputData.energies.size() * inputData.kVectors.size());
+      rotationMatrix_.setInputData(&inputData);
+      const int status = cudaMainQPoints(inputData.voxelDims, inputData, materialInput, qPoints, intensity.data(),
+                                         rotationMatrix_, morphology->data, &context_);
+      waitForPrefetch();
+      if (status != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+      }
+      writeQPointsH5(inputData, qPoints, intensity.data(), inputData.HDF5DirName);
+      output(inputData, nullptr);
+      return EXIT_SUCCESS;
+    }
+    Real *projectionGPUAveraged;
+    if (compute(inputData, materialInput, *morphology, sink, projectionGPUAveraged) != EXIT_SUCCESS) {
+      waitForPrefetch();
+      delete[] projectionGPUAveraged;
+      return EXIT_FAILURE;
+    }
+    if (inputData.isPreviewRefined()) {
+      if (sink != nullptr) {
+        const bool isRefined = refinePreview(fullInputData, materialInput, sink, job.checkDeviceMemory);
+        rotationMatrix_.setInputData(&inputData);
+        if (not(isRefined)) {
+          waitForPrefetch();
+          return EXIT_FAILURE;
+        }
+      } else {
+        std::cout << YLW << "[WARNING] The refinement of the preview requires streamed output. Ignored." << NRM
+                  << "\n";
+      }
+    }
+    /// The HDF5 library is not necessarily built thread safe. Finish reading before writing.
+    waitForPrefetch();
+    output(inputData, projectionGPUAveraged);
+    delete[] projectionGPUAveraged;
+    return EXIT_SUCCESS;
+  }
+
+  /**
+   * @brief Runs a simulation and writes the output. The output is written while the simulation runs.
+   * @param [in] job simulation job
+   * @param [in] nextJob job that runs next. Its morphology is read while this job computes. Can be nullptr.
+   * @return EXIT_SUCCESS on success
+   */
+  int run(const SimulationJob &job, const SimulationJob *nextJob = nullptr) {
+    /// Every (energy, k) pattern is written as soon as it is computed
+    OutputSink writer(job.resume);
+    return simulate(job, nextJob, [&](const InputData &inputData, const Real *) {
+      printMetaData(inputData, rotationMatrix_,
+                    job.logFile.empty() ? inputData.HDF5DirName + "/CyRSoXS.log" : job.logFile);
+    }, &writer);
+  }
+};
+
+/**
+ * @brief Reads the list of morphologies. Each line has the HDF5 file followed by an optional name of the
+ * output sub directory (default: name of the file without extension). Lines starting with # are ignored.
+ * @param [in] manifest manifest file
+ * @return jobs sharing config.txt and Material files in the current directory
+ */
+static std::vector<SimulationJob> readManifest(const std::string &manifest) {
+  std::ifstream fin(manifest);
+  if (not(fin.is_open())) {
+    std::cout << RED << "[Input Error] Cannot read " << manifest << NRM << "\n";
+    exit(EXIT_FAILURE);
+  }
+  std::vector<SimulationJob> jobs;
+  std::set<std::string> names;
+  std::string line;
+  while (std::getline(fin, line)) {
+    std::stringstream stream(line);
+    std::string morphologyFile, name;
+    if (not(stream >> morphologyFile) or (morphologyFile[0] == '#')) {
+      continue;
+    }
+    if (not(stream >> name)) {
+      const std::size_t start = morphologyFile.find_last_of('/') + 1;
+      name = morphologyFile.substr(start, morphologyFile.find_last_of('.') - start);
+    }
+    if (not(names.insert(name).second)) {
+      std::cout << RED << "[Input Error] Duplicate output name " << name << " in " << manifest
+                << ". Specify the name as second column." << NRM << "\n";
+      exit(EXIT_FAILURE);
+    }
+    SimulationJob job;
+    job.morphologyFile = morphologyFile;
+    job.outputSubDir = name;
+    job.logFile = "";
+    jobs.push_back(job);
+  }
+  return jobs;
+}
+
+/**
+ * @brief Runs a job. The input readers throw on malformed input: the error fails the job instead of the run.
+ * @param [in] job runs the job
+ * @return status of the job. EXIT_FAILURE if the job threw.
+ */
+static int runJob(const std::function<int()> &job) {
+  try {
+    return job();
+  } catch (const std::exception &e) {
+    std::cout << RED << "[ERROR] " << e.what() << NRM << "\n";
+  } catch (const H5::Exception &e) {
+    std::cout << RED << "[HDF5 Error] " << e.getDetailMsg() << NRM << "\n";
+  }
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief Runs all the morphologies of the manifest with the same configuration. Allocations, FFT plans and
+ * rotation matrices are reused, and the next morphology is read while the current one computes.
+ * @param [in] manifest manifest file
+ * @param [in] outputDir output directory. Empty to use HDF5DirName from the config file
+ * @param [in] resume skip the energies that a previous run completed
+ * @return EXIT_SUCCESS if all the morphologies succeeded
+ */
+static int runBatch(const std::string &manifest, const std::string &outputDir, const bool resume = false) {
+  std::vector<SimulationJob> jobs = readManifest(manifest);
+  SimulationDriver driver;
+  UINT numFailed = 0;
+  for (std::size_t i = 0; i < jobs.size(); i++) {
+    jobs[i].outputDir = outputDir;
+    jobs[i].resume = resume;
+    std::cout << GRN << "[BATCH] " << i + 1 << "/" << jobs.size() << " : " << jobs[i].morphologyFile << NRM << "\n";
+    const SimulationJob *nextJob = (i + 1 < jobs.size()) ? &jobs[i + 1] : nullptr;
+    if (runJob([&] { return driver.run(jobs[i], nextJob); }) != EXIT_SUCCESS) {
+      std::cout << RED << "[BATCH] Failed : " << jobs[i].morphologyFile << NRM << "\n";
+      numFailed++;
+    }
+  }
+  std::cout << "[BATCH] Completed " << jobs.size() - numFailed << "/" << jobs.size() << "\n";
+  return (numFailed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Runs all the morphologies of the manifest as realizations of one ensemble. Only the per-pixel mean and
+ * variance over the realizations are written. The run stops early once the relative standard error of the mean
+ * drops below EnsembleTolerance of the config file.
+ * @param [in] manifest manifest file
+ * @param [in] outputDir output directory. Empty to use HDF5DirName from the config file
+ * @return EXIT_SUCCESS if the statistics were written
+ */
+static int runEnsemble(const std::string &manifest, const std::string &outputDir) {
+  std::vector<SimulationJob> jobs = readManifest(manifest);
+  SimulationDriver driver;
+  EnsembleAccumulator accumulator;
+  std::unique_ptr<InputData> ensembleInput;
+  double relativeError = INFINITY;
+  for (std::size_t i = 0; i < jobs.size(); i++) {
+    jobs[i].outputDir = outputDir;
+    jobs[i].outputSubDir.clear();
+    std::cout << GRN << "[ENSEMBLE] " << i + 1 << "/" << jobs.size() << " : " << jobs[i].morphologyFile << NRM << "\n";
+    const SimulationJob *nextJob = (i + 1 < jobs.size()) ? &jobs[i + 1] : nullptr;
+    bool isConsistent = true;
+    const int status = runJob([&] {
+      return driver.simulate(jobs[i], nextJob, [&](const InputData &inputData, const Real *projection) {
+        const std::size_t size = static_cast<std::size_t>(inputData.voxelDims[0]) * inputData.voxelDims[1] *
+                                 inputData.energies.size() * inputData.kVectors.size();
+        isConsistent = accumulator.add(projection, size);
+        if (ensembleInput == nullptr) {
+          ensembleInput.reset(new InputData(inputData));
+          createDirectory(inputData.HDF5DirName);
+          printMetaData(inputData, driver.rotationMatrix(), inputData.HDF5DirName + "/CyRSoXS.log");
+        }
+      });
+    });
+    if ((status != EXIT_SUCCESS) or not(isConsistent)) {
+      std::cout << RED << "[ENSEMBLE] Skipped : " << jobs[i].morphologyFile
+                << (isConsistent ? "" : " (dimensions differ from the previous realizations)") << NRM << "\n";
+      continue;
+    }
+    relativeError = accumulator.relativeStandardError();
+    std::cout << "[ENSEMBLE] Realizations = " << accumulator.count() << " Relative standard error = " << relativeError
+              << "\n";
+    if ((ensembleInput->ensembleTolerance > 0) and (accumulator.count() >= ensembleInput->ensembleMinRealizations)
+        and (relativeError < ensembleInput->ensembleTolerance)) {
+      std::cout << GRN << "[ENSEMBLE] Converged after " << accumulator.count() << " realizations" << NRM << "\n";
+      break;
+    }
+  }
+  if (accumulator.count() == 0) {
+    std::cout << RED << "[ENSEMBLE] No realization completed" << NRM << "\n";
+    return EXIT_FAILURE;
+  }
+  std::vector<Real> mean, variance;
+  accumulator.getMean(mean);
+  accumulator.getVariance(variance);
+  writeEnsembleH5(*ensembleInput, ensembleInput->voxelDims, mean.data(), variance.data(), accumulator.count(),
+                  ensembleInput->HDF5DirName);
+  return EXIT_SUCCESS;
+}
+#endif
+
+#endif //CY_RSOXS_SIMULATION_H
@@ -0,0 +1,168 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_SIMULATIONCONTEXT_H
+#define CY_RSOXS_SIMULATIONCONTEXT_H
+
+#include <cudaHeaders.h>
+#include <Arena.h>
+#include <Datatypes.h>
+#include <Input/Input.h>
+#include <Input/InputData.h>
+#include <cufft.h>
+#include <cublas_v2.h>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Device resources owned by a single GPU. The buffers, streams, FFT plans and the
+ * cuBLAS handle stay alive between consecutive launches as long as the configuration
+ * they were created for does not change.
+ */
+struct DeviceWorkspace {
+  static constexpr int NUM_FFT_STREAMS = 3;
+
+  /// GPU on which the resources live
+  int deviceID = -1;
+  /// true if resources are allocated
+  bool allocated = false;
+  /// dimensions the workspace was created for
+  UINT voxelDims[3]{0, 0, 0};
+  /// number of materials the workspace was created for
+  int numMaterial = 0;
+  /// algorithm the workspace was created for
+  UINT algorithm = Algorithm::CommunicationMinimizing;
+  /// scatter approach the workspace was created for
+  UINT scatterApproach = ScatterApproach::PARTIAL;
+  /// rotation mask
+  bool rotMask = false;
+  /// Number of streams
+  int numStreams = 0;
+
+  std::vector<cudaStream_t> streams;
+  cufftHandle plan[NUM_FFT_STREAMS];
+  cublasHandle_t handle;
+
+  Material *d_materialConstants = nullptr;
+  /// Algorithm 0 only: morphology resident on the device
+  Voxel *d_voxelInput = nullptr;
+  /// Algorithm 1 only: Nt for the current energy
+  Complex *d_Nt = nullptr;
+  /// Algorithm 0 only: polarization / scattering buffers. Algorithm 1 allocates these per energy.
+  Complex *d_polarizationX = nullptr, *d_polarizationY = nullptr, *d_polarizationZ = nullptr;
+  Real *d_scatter3D = nullptr;
+  Real *d_projection = nullptr, *d_rotProjection = nullptr, *d_projectionAverage = nullptr;
+  UINT *d_mask = nullptr;
+  /// Algorithm 1 only: the morphology of the Nt stage and the buffers of the polarization stage, one after the other
+  Arena stageArena{MemorySpace::DEVICE};
+  /// Staging buffers of the frames handed to the sink and of the Fourier cache
+  Arena pinnedArena{MemorySpace::PINNED};
+
+  /// Version of the morphology resident in d_voxelInput (0 = nothing uploaded)
+  std::uint64_t voxelVersion = 0;
+
+  /**
+   * @brief Bytes of the stage arena of Algorithm 1: the larger of the morphology of one material (Nt stage) and
+   * the polarization, scatter and projection buffers (polarization stage)
+   * @param [in] idata input data
+   * @param [in] scatterApproach scatter approach
+   * @return bytes
+   */
+  static std::size_t getStageBytes(const InputData &idata, UINT scatterApproach);
+
+  /**
+   * @brief checks if the workspace was created for the given configuration
+   * @param [in] idata input data
+   * @return true if the resources can be reused
+   */
+  bool isCompatible(const InputData &idata) const;
+
+  /**
+   * @brief allocates the resources on the current device for the given configuration
+   * @param [in] idata input data
+   */
+  void allocate(const InputData &idata);
+
+  /**
+   * @brief frees all the resources.
+   */
+  void release();
+};
+
+/**
+ * @brief Holds one DeviceWorkspace per GPU so that repeated calls to cudaMain / cudaMainStreams
+ * can skip allocation, plan creation and the morphology upload.
+ */
+class SimulationContext {
+  /// workspace for each GPU
+  std::vector<DeviceWorkspace> workspaces_;
+  /// Version of the host morphology. Bumped whenever the host data changes.
+  std::uint64_t voxelVersion_ = 1;
+public:
+  SimulationContext() = default;
+  SimulationContext(const SimulationContext &) = delete;
+  SimulationContext &operator=(const SimulationContext &) = delete;
+
+  /**
+   * @brief Destructor. Frees all the device resources.
+   */
+  ~SimulationContext();
+
+  /**
+   * @brief Creates the workspace slots. Must be called outside the OpenMP region.
+   * @param [in] numGPU number of GPUs
+   */
+  void reserve(int numGPU);
+
+  /**
+   * @brief Returns the workspace for the current GPU. (Re-)allocates it if the configuration changed.
+   * Each OpenMP thread only touches its own slot.
+   * @param [in] deviceID GPU ID
+   * @param [in] idata input data
+   * @return workspace
+   */
+  DeviceWorkspace &acquire(int deviceID, const InputData &idata);
+
+  /**
+   * @brief Marks the host morphology as modified. The next launch re-uploads it.
+   */
+  inline void markVoxelDataModified() {
+    voxelVersion_++;
+  }
+
+  /**
+   * @brief Getter
+   * @return the current version of the host morphology
+   */
+  inline std::uint64_t voxelVersion() const {
+    return voxelVersion_;
+  }
+
+  /**
+   * @brief frees the resources on all GPUs
+   */
+  void release();
+};
+
+#endif //CY_RSOXS_SIMULATIONCONTEXT_H
@@ -0,0 +1,224 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CY_RSOXS_SPARSEQ_H
+#define CY_RSOXS_SPARSEQ_H
+
+#include <Datatypes.h>
+#include <Input/InputData.h>
+#include <Rotation.h>
+#include <RotationMatrix.h>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Reads the detector q points of a sparse evaluation. Each line has qx and qy (in nm^-1).
+ * Lines starting with # are ignored.
+ * @param [in] fname file with the q points
+ * @return q points
+ * @throws std::runtime_error if the file can not be read or has no q point
+ */
+static std::vector<Real2> readQPoints(const std::string &fname) {
+  std::ifstream fin(fname);
+  if (not(fin.is_open())) {
+    throw std::runtime_error("[Input Error] Cannot read " + fname);
+  }
+  std::vector<Real2> qPoints;
+  std::string line;
+  while (std::getline(fin, line)) {
+    std::stringstream stream(line);
+    Real2 qPoint;
+    if ((line.empty()) or (line[0] == '#') or not(stream >> qPoint.x)) {
+      continue;
+    }
+    if (not(stream >> qPoint.y)) {
+      throw std::runtime_error("[Input Error] Expected qx qy in " + fname + " : " + line);
+    }
+    qPoints.push_back(qPoint);
+  }
+  if (qPoints.empty()) {
+    throw std::runtime_error("[Input Error] No q point found in " + fname);
+  }
+  return qPoints;
+}
+
+/**
+ * @brief One term of the E angle average at a detector q point.
+ */
+struct QEvaluation {
+  /// q on the Ewald sphere (in nm^-1) at which the polarization is evaluated
+  Real3 q;
+  /// Rotation matrix of the E field
+  Matrix rotationMatrix;
+  /// false if q is outside the Ewald sphere or the Fourier domain of the morphology
+  bool isValid;
+};
+
+/**
+ * @brief Maps a q of the frame before the rotation by the E angle onto the Ewald sphere of the rotated frame.
+ * @param [in] qx qx before the rotation by the E angle (in nm^-1)
+ * @param [in] qy qy before the rotation by the E angle (in nm^-1)
+ * @param [in] cosAngle cosine of the E angle
+ * @param [in] sinAngle sine of the E angle
+ * @param [in] kVec k vector
+ * @param [in] kMagnitude magnitude of the k vector
+ * @param [in] qMax largest |q| of the Fourier domain of the morphology along each axis (in nm^-1)
+ * @param [in] enable2D 2D morphology
+ * @param [out] q q on the Ewald sphere (in nm^-1)
+ * @return false if q is outside the Ewald sphere or the Fourier domain of the morphology
+ */
+__host__ __device__ inline bool projectOnEwaldSphere(const double qx, const double qy, const double cosAngle,
+                                                     const double sinAngle, const Real3 &kVec, const Real kMagnitude,
+                                                     const double qMax, const bool enable2D, Real3 &q) {
+  q.x = static_cast<Real>(cosAngle * qx - sinAngle * qy);
+  q.y = static_cast<Real>(sinAngle * qx + cosAngle * qy);
+  const double kx = kMagnitude * kVec.x + q.x, ky = kMagnitude * kVec.y + q.y;
+  const double val = static_cast<double>(kMagnitude) * kMagnitude - kx * kx - ky * ky;
+  q.z = (val < 0) ? 0 : static_cast<Real>(-kMagnitude * kVec.z + sqrt(val));
+  return ((val >= 0) and (fabs(q.x) <= qMax) and (fabs(q.y) <= qMax) and (enable2D or (fabs(q.z) <= qMax)));
+}
+
+/**
+ * @brief Finds where each detector q point comes from for every E angle. The full frame is the average over the
+ * E angles of the Ewald projection rotated by the E angle, followed by the detector rotation. Both rotations are
+ * inverted here, so that the polarization is evaluated directly at the q that ends up at the detector point.
+ * @param [in] inputData input data
+ * @param [in] qPoints detector q points (in nm^-1)
+ * @param [in] rotationMatrix rotation matrices. initComputation() must have been called.
+ * @param [in] kID k vector index
+ * @param [in] kMagnitude magnitude of the k vector
+ * @param [in] numAngles number of E angles
+ * @param [out] evaluations (q point, E angle) pairs, with the E angle running fastest
+ */
+static void getQEvaluations(const InputData &inputData, const std::vector<Real2> &qPoints,
+                            const RotationMatrix &rotationMatrix, const UINT kID, const Real kMagnitude,
+                            const UINT numAngles, std::vector<QEvaluation> &evaluations) {
+  const auto &baseConfig = rotationMatrix.getBaseConfigurations()[kID];
+  const Real3 &kVec = inputData.kVectors[kID];
+  Matrix detectorRotation;
+  detectorRotation.performMatrixMultiplication<false, false>(rotationMatrix.getDetectorRotationMatrix(),
+                                                             baseConfig.matrix);
+  const double a = detectorRotation.getValue<0, 0>(), b = detectorRotation.getValue<0, 1>();
+  const double c = detectorRotation.getValue<1, 0>(), d = detectorRotation.getValue<1, 1>();
+  const double det = a * d - b * c;
+  const double qMax = M_PI / inputData.physSize;
+  const bool enable2D = inputData.if2DComputation();
+
+  evaluations.resize(qPoints.size() * numAngles);
+  for (std::size_t pointID = 0; pointID < qPoints.size(); pointID++) {
+    /// q before the detector rotation
+    const double qx = (d * qPoints[pointID].x - b * qPoints[pointID].y) / det;
+    const double qy = (-c * qPoints[pointID].x + a * qPoints[pointID].y) / det;
+    for (UINT i = 0; i < numAngles; i++) {
+      QEvaluation &evaluation = evaluations[pointID * numAngles + i];
+      const double Eangle = (baseConfig.baseRotAngle + inputData.startAngle + i * inputData.incrementAngle) * M_PI / 180.0;
+      computeRotationMatrix(kVec, baseConfig.matrix, evaluation.rotationMatrix, static_cast<Real>(Eangle));
+      const bool isOnSphere = projectOnEwaldSphere(qx, qy, std::cos(Eangle), std::sin(Eangle), kVec, kMagnitude,
+                                                   qMax, enable2D, evaluation.q);
+      evaluation.isValid = (std::isfinite(det) and (det != 0) and isOnSphere);
+    }
+  }
+}
+
+/**
+ * @brief weight of the Hanning window along one dimension. Same as the windowing of the polarization.
+ * @param [in] id voxel index
+ * @param [in] n number of voxels
+ * @return weight
+ */
+__host__ __device__ inline Real getHanningWeight(const UINT id, const UINT n) {
+  return static_cast<Real>(0.5 * (1 - cos(2 * M_PI * id / n)));
+}
+
+/**
+ * @brief Evaluates the Fourier transform of the six components of Nt at every valid q by direct summation on the
+ * host. The phase exp(-i q.r) is separable, so it is tabulated once per dimension and every row of voxels along x
+ * is a vectorized complex dot product.
+ * @param [in] Nt Nt stored as the pairs (0,1) (2,3) (4,5) per voxel
+ * @param [in] evaluations q at which Nt is evaluated
+ * @param [in] voxel number of voxels in each direction
+ * @param [in] physSize physical size (in nm)
+ * @param [in] hanning apply the Hanning window
+ * @param [in] enable2D 2D morphology
+ * @param [out] NtQ 6 components of the Fourier transformed Nt for every evaluation
+ */
+static void evaluateNtAtQHost(const Real4 *Nt, const std::vector<QEvaluation> &evaluations, const uint3 voxel,
+                              const Real physSize, const bool hanning, const bool enable2D, Complex *NtQ) {
+  const BigUINT numVoxels = static_cast<BigUINT>(voxel.x) * voxel.y * voxel.z;
+  const long numEvaluations = static_cast<long>(evaluations.size());
+#pragma omp parallel
+  {
+    std::vector<Complex> phaseX(voxel.x), phaseY(voxel.y), phaseZ(voxel.z);
+    auto tabulate = [&](std::vector<Complex> &phase, const Real q, const UINT n, const bool window) {
+      for (UINT i = 0; i < n; i++) {
+        const Real weight = window ? getHanningWeight(i, n) : static_cast<Real>(1);
+        phase[i].x = weight * std::cos(q * i * physSize);
+        phase[i].y = -weight * std::sin(q * i * physSize);
+      }
+    };
+#pragma omp for schedule(dynamic)
+    for (long id = 0; id < numEvaluations; id++) {
+      Complex *result = &NtQ[6 * id];
+      for (int c = 0; c < 6; c++) {
+        result[c] = {0, 0};
+      }
+      if (not(evaluations[id].isValid)) {
+        continue;
+      }
+      const Real3 &q = evaluations[id].q;
+      tabulate(phaseX, q.x, voxel.x, hanning);
+      tabulate(phaseY, q.y, voxel.y, hanning);
+      tabulate(phaseZ, enable2D ? 0 : q.z, voxel.z, hanning and not(enable2D));
+      for (UINT Z = 0; Z < voxel.z; Z++) {
+        for (UINT Y = 0; Y < voxel.y; Y++) {
+          const BigUINT offset = (static_cast<BigUINT>(Z) * voxel.y + Y) * voxel.x;
+          const Real4 *N01 = &Nt[offset], *N23 = &Nt[offset + numVoxels], *N45 = &Nt[offset + 2 * numVoxels];
+          Real row[12]{};
+#pragma omp simd reduction(+:row[:12])
+          for (UINT X = 0; X < voxel.x; X++) {
+            const Complex &phase = phaseX[X];
+            row[0] += N01[X].x * phase.x - N01[X].y * phase.y;  row[1] += N01[X].x * phase.y + N01[X].y * phase.x;
+            row[2] += N01[X].z * phase.x - N01[X].w * phase.y;  row[3] += N01[X].z * phase.y + N01[X].w * phase.x;
+            row[4] += N23[X].x * phase.x - N23[X].y * phase.y;  row[5] += N23[X].x * phase.y + N23[X].y * phase.x;
+            row[6] += N23[X].z * phase.x - N23[X].w * phase.y;  row[7] += N23[X].z * phase.y + N23[X].w * phase.x;
+            row[8] += N45[X].x * phase.x - N45[X].y * phase.y;  row[9] += N45[X].x * phase.y + N45[X].y * phase.x;
+            row[10] += N45[X].z * phase.x - N45[X].w * phase.y; row[11] += N45[X].z * phase.y + N45[X].w * phase.x;
+          }
+          const Complex phaseYZ{phaseY[Y].x * phaseZ[Z].x - phaseY[Y].y * phaseZ[Z].y,
+                                phaseY[Y].x * phaseZ[Z].y + phaseY[Y].y * phaseZ[Z].x};
+          for (int c = 0; c < 6; c++) {
+            result[c].x += row[2 * c] * phaseYZ.x - row[2 * c + 1] * phaseYZ.y;
+            result[c].y += row[2 * c] * phaseYZ.y + row[2 * c + 1] * phaseYZ.x;
+          }
+        }
+      }
+    }
+  }
+}
+
+#endif //CY_RSOXS_SPARSEQ_H
@@ -49,6 +49,17 @@ inline void gpuAssert(cudaError_t code, const char *file, int line, bool abort =
     }
 }
 
+/**
+ * Ends a stage of the pipeline. The stages are ordered on the device (default stream), so the host only checks
+ * the launch and keeps queuing work. With SYNCHRONIZE_STAGES or PROFILING, the host waits for every stage so that
+ * errors are reported where they happen and the timers measure the stage.
+ */
+#if defined(SYNCHRONIZE_STAGES) or defined(PROFILING)
+#define endStage() { cudaDeviceSynchronize(); gpuErrchk(cudaPeekAtLastError()); }
+#else
+#define endStage() gpuErrchk(cudaPeekAtLastError())
+#endif
+
 /**
  * Check the return value of the CUDA runtime API call and exit
  * the application if the call has failed.
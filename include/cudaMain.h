@@ -34,24 +34,46 @@
 #include <Rotation.h>
 #include <cufft.h>
 #include <RotationMatrix.h>
+#include <SimulationContext.h>
+#include <Output/FrameSink.h>
+#include <Output/FourierCache.h>
+#include <FrameROI.h>
 #ifdef DOUBLE_PRECISION
 static constexpr cufftType_t fftType = CUFFT_Z2Z;
 #else
 static constexpr cufftType_t fftType = CUFFT_C2C;
 #endif
 
+/**
+ * @brief Change of a few voxels since the transformed Nt in the Fourier cache was computed. Nt is local to a voxel
+ * and the FFT is linear, so the change is the Fourier transform of the change of Nt at the changed voxels, which is
+ * summed directly on the device.
+ */
+struct FourierNtUpdate {
+  /// indices of the changed voxels
+  std::vector<BigUINT> changedVoxels;
+  /// voxel input of the changed voxels before the change (NUM_MATERIAL x changedVoxels.size())
+  std::vector<Voxel> oldVoxels;
+  /// voxel input of the changed voxels after the change (NUM_MATERIAL x changedVoxels.size())
+  std::vector<Voxel> newVoxels;
+};
+
 /**
  * @brief calls for the cuda kernel are made through this function for Algorithm 1. Do not uses streams
  * @param [in] voxel array of size 3 which states the dimension along each axis
  * @param [in] idata inputData object
  * @param [in] materialInput material Input containing the information of material property
- * @param [out] projectionAverage I(q) projected on Ewalds sphere
+ * @param [out] projectionAverage I(q) projected on Ewalds sphere. Not used if sink is set.
  * @param [in] voxelInput  voxel input
  * @param [in] rotationMatrix rotation matrices for k / E vector
- * @return EXIT_SUCCESS on success of execution
+ * @param [in,out] context persistent device resources. If nullptr, they are created and destroyed within the call.
+ * @param [in] sink receives every (energy, k) pattern as soon as it is computed. Energies it reports complete are skipped.
+ * @return EXIT_SUCCESS on success of execution. EXIT_FAILURE if the computation failed or the sink failed to write
+ * a frame.
  */
 int cudaMain(const UINT *voxel, const InputData &idata, const std::vector<Material> &materialInput,
-             Real *projectionAverage, RotationMatrix & rotationMatrix, const Voxel *voxelInput);
+             Real *projectionAverage, RotationMatrix & rotationMatrix, const Voxel *voxelInput,
+             SimulationContext * context = nullptr, FrameSink * sink = nullptr);
 
 
 /**
@@ -59,13 +81,61 @@ int cudaMain(const UINT *voxel, const InputData &idata, const std::vector<Materi
  * @param [in] voxel array of size 3 which states the dimension along each axis
  * @param [in] idata inputData object
  * @param [in] materialInput material Input containing the information of material property
- * @param [out] projectionAverage I(q) projected on Ewalds sphere
+ * @param [out] projectionAverage I(q) projected on Ewalds sphere. Not used if sink is set.
  * @param [in] voxelInput  voxel input
  * @param [in] rotationMatrix rotation matrices for k / E vector
- * @return EXIT_SUCCESS on success of execution
+ * @param [in,out] context persistent device resources. If nullptr, they are created and destroyed within the call.
+ * @param [in] sink receives every (energy, k) pattern as soon as it is computed. Energies it reports complete are skipped.
+ * @param [in] fourierCache store of the Fourier transformed Nt. If set, Nt of the energies in the cache is read instead
+ * of computed, and the polarization of every angle is computed directly in Fourier space. Can be nullptr.
+ * @param [in] fourierUpdate change of a few voxels added on the device to the transformed Nt read from fourierCache,
+ * which then stores the updated Nt. Can be nullptr.
+ * @return EXIT_SUCCESS on success of execution. EXIT_FAILURE if the computation failed or the sink failed to write
+ * a frame.
  */
 int cudaMainStreams(const UINT *voxel, const InputData &idata, const std::vector<Material> &materialInput,
-                    Real *projectionAverage, RotationMatrix & rotationMatrix, const Voxel *voxelInput);
+                    Real *projectionAverage, RotationMatrix & rotationMatrix, const Voxel *voxelInput,
+                    SimulationContext * context = nullptr, FrameSink * sink = nullptr,
+                    FourierCache * fourierCache = nullptr, const FourierNtUpdate * fourierUpdate = nullptr);
+
+/**
+ * @brief evaluates the E angle averaged scattering intensity at a list of detector q points only. The Fourier
+ * transform of Nt is evaluated by direct summation at the q on the Ewald sphere that each point and E angle maps
+ * to, which is much cheaper than the FFT of the full frame for a few hundred points. Uses the device resources of
+ * Algorithm 1.
+ * @param [in] voxel array of size 3 which states the dimension along each axis
+ * @param [in] idata inputData object
+ * @param [in] materialInput material Input containing the information of material property
+ * @param [in] qPoints detector q points (in nm^-1)
+ * @param [out] intensity intensity[energy][k][q point]
+ * @param [in] rotationMatrix rotation matrices for k / E vector
+ * @param [in] voxelInput  voxel input
+ * @param [in,out] context persistent device resources. If nullptr, they are created and destroyed within the call.
+ * @return EXIT_SUCCESS on success of execution
+ */
+int cudaMainQPoints(const UINT *voxel, const InputData &idata, const std::vector<Material> &materialInput,
+                    const std::vector<Real2> &qPoints, Real *intensity, RotationMatrix & rotationMatrix,
+                    const Voxel *voxelInput, SimulationContext * context = nullptr);
+
+/**
+ * @brief computes the scattering patterns with the non-uniform FFT. The FFT of Nt on an oversampled grid is computed
+ * once per energy, and the E angle averaged intensity of every detector pixel is interpolated directly at the q on
+ * the Ewald sphere it maps to. No frame is formed on the voxel grid and no image rotation is needed, which suits the
+ * tilted k vectors of beam divergence and grazing incidence. Uses the device resources of Algorithm 1.
+ * @param [in] voxel array of size 3 which states the dimension along each axis
+ * @param [in] idata inputData object
+ * @param [in] materialInput material Input containing the information of material property
+ * @param [out] projectionAverage I(q) projected on Ewalds sphere. Not used if sink is set.
+ * @param [in] rotationMatrix rotation matrices for k / E vector
+ * @param [in] voxelInput  voxel input
+ * @param [in,out] context persistent device resources. If nullptr, they are created and destroyed within the call.
+ * @param [in] sink receives every (energy, k) pattern as soon as it is computed. Energies it reports complete are skipped.
+ * @return EXIT_SUCCESS on success of execution. EXIT_FAILURE if the computation failed or the sink failed to write
+ * a frame.
+ */
+int cudaMainNUFFT(const UINT *voxel, const InputData &idata, const std::vector<Material> &materialInput,
+                  Real *projectionAverage, RotationMatrix & rotationMatrix, const Voxel *voxelInput,
+                  SimulationContext * context = nullptr, FrameSink * sink = nullptr);
 
 /**
  * @brief calls to compute polarization only. Only called with Pybind interface. Used in debugging
@@ -200,7 +270,8 @@ __host__ INLINE inline cufftResult  performFFT(Complex *polarization, cufftHandl
 __host__ int performFFTShift(Complex *polarization, const UINT & blockSize, const uint3 & vx,  const cudaStream_t stream);
 
 /**
- * @brief Replaces the DC component (index 0,0,0) with the average of surrounding voxels
+ * @brief Replaces the DC component (index 0,0,0) with the average of its six face neighbors, or of the four in the
+ * plane for 2D morphologies
  * @param [in,out] polarization The FFT result to modify
  * @param [in] vx Voxel dimensions in all directions
  */
@@ -251,6 +322,7 @@ __host__ int performScatter3DComputation(const Complex * d_polarizationX, const
  * @param enable2D
  * @param blockSize
  * @param kVector
+ * @param roi pixels that are evaluated
  * @return
  */
 __host__ int peformEwaldProjectionGPU(Real * d_projection,
@@ -261,7 +333,8 @@ __host__ int peformEwaldProjectionGPU(Real * d_projection,
                                       const Interpolation::EwaldsInterpolation & interpolation,
                                       const bool & enable2D,
                                       const UINT & blockSize,
-                                      const Real3 & kVector);
+                                      const Real3 & kVector,
+                                      const FrameROI & roi);
 
 /**
  *
@@ -276,6 +349,7 @@ __host__ int peformEwaldProjectionGPU(Real * d_projection,
  * @param enable2D
  * @param blockSize
  * @param kVector
+ * @param roi pixels that are evaluated
  * @return
  */
 __host__ int peformEwaldProjectionGPU(Real * projection,
@@ -288,7 +362,8 @@ __host__ int peformEwaldProjectionGPU(Real * projection,
                                       const Interpolation::EwaldsInterpolation & interpolation,
                                       const bool & enable2D,
                                       const UINT & blockSize,
-                                      const Real3 & kVector);
+                                      const Real3 & kVector,
+                                      const FrameROI & roi);
 
 
 /**
@@ -320,5 +395,26 @@ __host__ int computeNt(const Material * d_materialConstants,
                        cudaStream_t stream,
                        const int NUM_MATERIAL);
 
+/**
+ * @brief CPU function to transform Nt in place to Fourier space for Algorithm 2. Every component goes
+ * through the same FFT, DC replacement and FFT shift as the polarization, so that the polarization
+ * computed from the transformed Nt is the Fourier space polarization.
+ * @param [in,out] d_Nt Nt = (NR:NR - I)
+ * @param [in] d_scratch three scratch arrays of numVoxels
+ * @param [in] plan FFT plans
+ * @param [in] streams stream context
+ * @param [in] vx voxel dims in all direction
+ * @param [in] blockSize blocksize for GPU
+ * @param [in] numVoxels Number of voxel.
+ * @return EXIT_SUCCESS if completed
+ */
+__host__ int transformNt(Complex * d_Nt,
+                         Complex * const d_scratch[3],
+                         cufftHandle * plan,
+                         const std::vector<cudaStream_t> & streams,
+                         const uint3 & vx,
+                         const UINT & blockSize,
+                         const BigUINT & numVoxels);
+
 
 
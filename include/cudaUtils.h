@@ -265,7 +265,7 @@ __global__ void  getMaxandMinimum(const Real *val, const int2 idx, const uint2 v
  * @param k magnitude of k
  * @return the magnitude
  */
-__device__ inline Real computeMagVec1TimesVec1TTimesVec2(const Real *vec1 ,const Complex *vec2, const Real & k) {
+__host__ __device__ inline Real computeMagVec1TimesVec1TTimesVec2(const Real *vec1 ,const Complex *vec2, const Real & k) {
     const Real d = k*k;
 
     const Real & a = vec1[0];
@@ -33,6 +33,7 @@
 #include <complex>
 #include <math.h>
 #include <Rotation.h>
+#include <FrameROI.h>
 
 #ifdef EOC
 #include <opencv2/opencv.hpp>
@@ -520,6 +521,29 @@ __global__ void computePolarizationVectorMorphologyLowMemory(const Real4 * __res
 
 }
 
+/**
+ * @brief copies one component of Nt from / to a contiguous array
+ * @tparam toNt true to copy the array into Nt, false to copy the component out of Nt
+ * @param [in,out] Nt Nt = (NR:NR - I) stored as the pairs (0,1) (2,3) (4,5) per voxel
+ * @param [in,out] component contiguous array of the component
+ * @param [in] componentID component of Nt (0 - 5)
+ * @param [in] numVoxels number of voxels
+ */
+template<bool toNt>
+__global__ void copyNtComponent(Complex * Nt, Complex * component, const UINT componentID, const BigUINT numVoxels) {
+  const BigUINT threadID = threadIdx.x + blockIdx.x * blockDim.x;
+  if(threadID >= numVoxels){
+    return;
+  }
+  const BigUINT id = 2*(threadID + (componentID/2)*numVoxels) + (componentID % 2);
+  if(toNt) {
+    Nt[id] = component[threadID];
+  }
+  else{
+    component[threadID] = Nt[id];
+  }
+}
+
 /**
  * @brief flattens 3D array to 1D array
  * @param [in] i X id
@@ -817,6 +841,7 @@ __device__ inline Real computeTrilinearInterpolation(const Real & data1,
  * @param [in] interpolation type of interpolation : Nearest neighbor / Trilinear interpolation
  * @param [in] enable2D 2D morpholgy or not
  * @param [in] kVector 3D k vector
+ * @param [in] roi pixels that are evaluated. The other pixels are left untouched.
  */
 __global__ void computeEwaldProjectionGPU(Real *projection,
                                           const Real *scatter3D,
@@ -825,9 +850,10 @@ __global__ void computeEwaldProjectionGPU(Real *projection,
                                           const Real physSize,
                                           const Interpolation::EwaldsInterpolation interpolation,
                                           const bool enable2D,
-                                          const Real3 kVector) {
+                                          const Real3 kVector,
+                                          const FrameROI roi) {
   UINT threadID = threadIdx.x + blockIdx.x * blockDim.x;
-  const UINT totalSize = voxel.x * voxel.y;
+  const UINT totalSize = roi.nx * roi.ny;
   if (threadID >= totalSize) {
     return;
   }
@@ -842,17 +868,22 @@ __global__ void computeEwaldProjectionGPU(Real *projection,
   if (not(enable2D)) {
     dx.z = static_cast<Real>((2.0 * M_PI / physSize) / ((voxel.z - 1) * 1.0));
   }
-  UINT Y = static_cast<UINT>(threadID / (voxel.x * 1.0));
-  UINT X = static_cast<UINT>(threadID - Y * voxel.x);
+  UINT Y = static_cast<UINT>(threadID / (roi.nx * 1.0));
+  UINT X = static_cast<UINT>(threadID - Y * roi.nx);
+  X += roi.x0;
+  Y += roi.y0;
+  threadID = Y * voxel.x + X;
   pos.y = (start + Y * dx.y) ;
   pos.x = (start + X * dx.x) ;
+  const Real qSquare = pos.x * pos.x + pos.y * pos.y;
+  const bool outsideROI = (qSquare < roi.qMin * roi.qMin) or (qSquare > roi.qMax * roi.qMax);
 
   const Real & kx = k*kVector.x;
   const Real & ky = k*kVector.y;
   const Real & kz = k*kVector.z;
   val = k * k - (kx + pos.x) * (kx + pos.x) - (ky + pos.y ) * (ky + pos.y);
 
-  if((val < 0) or (X == (voxel.x - 1)) or (Y == (voxel.y - 1))) {
+  if((val < 0) or (X == (voxel.x - 1)) or (Y == (voxel.y - 1)) or outsideROI) {
     projection[threadID] = NAN;
   }
   else
@@ -882,9 +913,10 @@ __global__ void computeEwaldProjectionGPU(Real *projection,
                                           const Real physSize,
                                           const Interpolation::EwaldsInterpolation interpolation,
                                           const bool enable2D,
-                                          const Real3 kVector) {
+                                          const Real3 kVector,
+                                          const FrameROI roi) {
     UINT threadID = threadIdx.x + blockIdx.x * blockDim.x;
-    const UINT totalSize = voxel.x * voxel.y;
+    const UINT totalSize = roi.nx * roi.ny;
     if (threadID >= totalSize) {
         return;
     }
@@ -899,17 +931,22 @@ __global__ void computeEwaldProjectionGPU(Real *projection,
     if (not(enable2D)) {
         dx.z = static_cast<Real>((2.0 * M_PI / physSize) / ((voxel.z - 1) * 1.0));
     }
-    UINT Y = static_cast<UINT>(threadID / (voxel.x * 1.0));
-    UINT X = static_cast<UINT>(threadID - Y * voxel.x);
+    UINT Y = static_cast<UINT>(threadID / (roi.nx * 1.0));
+    UINT X = static_cast<UINT>(threadID - Y * roi.nx);
+    X += roi.x0;
+    Y += roi.y0;
+    threadID = Y * voxel.x + X;
     pos.y = (start + Y * dx.y) ;
     pos.x = (start + X * dx.x) ;
+    const Real qSquare = pos.x * pos.x + pos.y * pos.y;
+    const bool outsideROI = (qSquare < roi.qMin * roi.qMin) or (qSquare > roi.qMax * roi.qMax);
     const Real & kx = kMagnitude * kVector.x;
     const Real & ky = kMagnitude * kVector.y;
     const Real & kz = kMagnitude * kVector.z;
 
     val = kMagnitude * kMagnitude - (kx + pos.x) * (kx + pos.x) - (ky + pos.y ) * (ky + pos.y);
 
-    if((val < 0) or (X == (voxel.x - 1)) or (Y == (voxel.y - 1))) {
+    if((val < 0) or (X == (voxel.x - 1)) or (Y == (voxel.y - 1)) or outsideROI) {
         projection[threadID] = NAN;
     }
     else
@@ -27,8 +27,45 @@
 #include <iomanip>
 #include <Output/outputUtils.h>
 #include <Output/writeVTI.h>
+#include <Output/WriterPool.h>
 #include "version.h"
 
+/**
+ * @brief storage options of the output
+ * @param inputData Input data
+ * @return options for H5::writeFile2D
+ */
+static H5::OutputOptions getOutputOptions(const InputData & inputData){
+    H5::OutputOptions options;
+    options.compression = inputData.outputCompression;
+    options.compressionLevel = inputData.compressionLevel;
+    options.precision = inputData.outputPrecision;
+    return options;
+}
+
+/**
+ * @brief writes the list of k vectors to KIDList/KVec
+ * @param file HDF5 file
+ * @param inputData Input data
+ */
+static void writeKList(H5::H5File & file, const InputData & inputData){
+    H5::Group group(file.createGroup("KIDList"));
+    std::vector<std::array<Real, 3>> _kList(inputData.kVectors.size());
+    for (int i = 0; i < _kList.size(); i++) {
+      _kList[i] = {inputData.kVectors[i].x, inputData.kVectors[i].y, inputData.kVectors[i].z};
+    }
+    const hsize_t dims[2]{inputData.kVectors.size(), 3};
+    const int RANK = 2;
+    H5::DataSpace dataspace(RANK, dims);
+    H5::DataSet dataset = group.createDataSet("KVec", H5::PredType::NATIVE_FLOAT, dataspace);
+#ifdef DOUBLE_PRECISION
+    dataset.write(_kList.data(), H5::PredType::NATIVE_DOUBLE);
+#else
+    dataset.write(_kList.data(), H5::PredType::NATIVE_FLOAT);
+#endif
+    group.close();
+}
+
 /**
  * @brief writes to HDF5 file
  * @param inputData Input data
@@ -37,54 +74,104 @@
  */
 static void writeH5(const InputData & inputData, const UINT * voxelSize,const Real *projectionGPUAveraged, const std::string dirName = "HDF5"){
     createDirectory(dirName);
-    // TODO: Make it work in parallel.
-    omp_set_num_threads(1);
-
     const UINT numEnergyLevel = inputData.energies.size();
-    const UINT voxel2DSize = voxelSize[0] * voxelSize[1];
-    Real *oneEnergyData = new Real[voxel2DSize];
-    UINT chunkSize = static_cast<UINT>(std::ceil(numEnergyLevel * 1.0 / (omp_get_num_threads() * 1.0)));
-    UINT threadID = omp_get_thread_num();
-    UINT startID = threadID * chunkSize;
-    UINT endID = ((threadID + 1) * chunkSize);
-
-    for (UINT csize = startID; csize < std::min(endID, numEnergyLevel); csize++) {
-
-      std::stringstream stream;
-      Real energy = inputData.energies[csize];
-      stream << std::fixed << std::setprecision(2) << energy;
-      std::string s = stream.str();
-      const std::string outputFname = dirName + "/Energy_" + s + ".h5";
+    const std::size_t voxel2DSize = voxelSize[0] * voxelSize[1];
+    /// One file per energy, written from the I/O threads of the pool. The HDF5 mutex is held for the whole file,
+    /// compression included, so the files are written one at a time.
+    const H5::OutputOptions options = getOutputOptions(inputData);
+    WriterPool pool(std::min(inputData.numWriterThreads, numEnergyLevel), 1);
+    for (UINT csize = 0; csize < numEnergyLevel; csize++) {
+      pool.submit(csize, [&, csize] {
+        const std::string outputFname = getEnergyFileName(dirName, inputData.energies[csize]);
+        std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+        H5::H5File file(outputFname.c_str(), H5F_ACC_TRUNC);
+        writeKList(file, inputData);
+        for (UINT kID = 0; kID < inputData.kVectors.size(); kID++) {
+          const std::size_t offset = (static_cast<std::size_t>(csize) * inputData.kVectors.size() + kID) * voxel2DSize;
+          const std::string groupname = "K" + std::to_string(kID);
+          H5::writeFile2D(file, &projectionGPUAveraged[offset], voxelSize, groupname, "projection", options);
+        }
+        file.close();
+      });
+    }
+    pool.finish();
+}
+/**
+ * @brief writes the ensemble statistics to HDF5 file. The layout follows writeH5, with the mean
+ * in K<i>/projection, the variance in K<i>/variance and the number of realizations in NumRealizations.
+ * @param inputData Input data
+ * @param voxelSize Voxel Size
+ * @param mean mean of the scattering patterns
+ * @param variance variance of the scattering patterns
+ * @param numRealizations number of realizations
+ * @param dirName output directory
+ */
+static void writeEnsembleH5(const InputData & inputData, const UINT * voxelSize, const Real * mean, const Real * variance,
+                            const UINT numRealizations, const std::string dirName = "HDF5"){
+    createDirectory(dirName);
+    const UINT numEnergyLevel = inputData.energies.size();
+    const std::size_t voxel2DSize = voxelSize[0] * voxelSize[1];
+    const H5::OutputOptions options = getOutputOptions(inputData);
+    for (UINT csize = 0; csize < numEnergyLevel; csize++) {
+      const std::string outputFname = getEnergyFileName(dirName, inputData.energies[csize]);
       H5::H5File file(outputFname.c_str(), H5F_ACC_TRUNC);
+      writeKList(file, inputData);
       {
-        H5::Group group(file.createGroup("KIDList"));
-        std::vector<std::array<Real, 3>> _kList(inputData.kVectors.size());
-        for (int i = 0; i < _kList.size(); i++) {
-          _kList[i] = {inputData.kVectors[i].x, inputData.kVectors[i].y, inputData.kVectors[i].z};
-        }
-        const hsize_t dims[2]{inputData.kVectors.size(), 3};
-        const int RANK = 2;
-        H5::DataSpace dataspace(RANK, dims);
-        H5::DataSet dataset = group.createDataSet("KVec", H5::PredType::NATIVE_FLOAT, dataspace);
-#ifdef DOUBLE_PRECISION
-        dataset.write(_kList.data(), H5::PredType::NATIVE_DOUBLE);
-#else
-        dataset.write(_kList.data(), H5::PredType::NATIVE_FLOAT);
-#endif
-        group.close();
+        const hsize_t dims[1]{1};
+        H5::DataSpace dataspace(1, dims);
+        H5::DataSet dataset = file.createDataSet("NumRealizations", H5::PredType::NATIVE_UINT, dataspace);
+        dataset.write(&numRealizations, H5::PredType::NATIVE_UINT);
       }
       for (UINT kID = 0; kID < inputData.kVectors.size(); kID++) {
-        const std::size_t offset = static_cast<std::size_t>(csize) * static_cast<std::size_t>(voxel2DSize) * inputData.kVectors.size() +
-          static_cast<std::size_t>(kID*voxel2DSize);
-        std::memcpy(oneEnergyData, &projectionGPUAveraged[offset], sizeof(Real) * voxel2DSize);
+        const std::size_t offset = (static_cast<std::size_t>(csize) * inputData.kVectors.size() + kID) * voxel2DSize;
         const std::string groupname = "K" + std::to_string(kID);
-        H5::writeFile2D(file, oneEnergyData, voxelSize,groupname);
+        H5::writeFile2D(file, &mean[offset], voxelSize, groupname, "projection", options);
+        H5::writeFile2D(file, &variance[offset], voxelSize, groupname, "variance", options);
       }
       file.close();
     }
+}
 
-    delete[] oneEnergyData;
+/**
+ * @brief writes the intensity of a sparse q evaluation to QPoints.h5, with the dataset intensity[energy][k][q point]
+ * and the coordinates energy (eV) and qPoints[q point][qx, qy] (nm^-1).
+ * @param inputData Input data
+ * @param qPoints detector q points
+ * @param intensity E angle averaged intensity
+ * @param dirName output directory
+ */
+static void writeQPointsH5(const InputData & inputData, const std::vector<Real2> & qPoints, const Real * intensity,
+                           const std::string dirName = "HDF5"){
+    createDirectory(dirName);
+#ifdef DOUBLE_PRECISION
+    const H5::PredType & type = H5::PredType::NATIVE_DOUBLE;
+#else
+    const H5::PredType & type = H5::PredType::NATIVE_FLOAT;
+#endif
+    std::lock_guard<std::mutex> hdf5Lock(getHDF5Mutex());
+    H5::H5File file((dirName + "/QPoints.h5").c_str(), H5F_ACC_TRUNC);
+    writeKList(file, inputData);
+    {
+      const hsize_t dims[1]{inputData.energies.size()};
+      H5::DataSpace dataspace(1, dims);
+      H5::DataSet dataset = file.createDataSet("energy", type, dataspace);
+      dataset.write(inputData.energies.data(), type);
+    }
+    {
+      const hsize_t dims[2]{qPoints.size(), 2};
+      H5::DataSpace dataspace(2, dims);
+      H5::DataSet dataset = file.createDataSet("qPoints", type, dataspace);
+      dataset.write(qPoints.data(), type);
+    }
+    {
+      const hsize_t dims[3]{inputData.energies.size(), inputData.kVectors.size(), qPoints.size()};
+      H5::DataSpace dataspace(3, dims);
+      H5::DataSet dataset = file.createDataSet("intensity", type, dataspace);
+      dataset.write(intensity, type);
+    }
+    file.close();
 }
+
 /**
  * @brief writes to VTI file in parallel
  * @param inputData Input data
@@ -202,10 +289,13 @@ static void printCopyrightInfo(std::ofstream & fout){
 /**
  * @brief Writes meta data
  * @param inputData Input data
+ * @param rotationMatrix rotation matrices
+ * @param fname name of the log file
  */
 
-static void printMetaData(const InputData & inputData, const RotationMatrix & rotationMatrix){
-  std::ofstream file("CyRSoXS.log");
+static void printMetaData(const InputData & inputData, const RotationMatrix & rotationMatrix,
+                          const std::string & fname = "CyRSoXS.log"){
+  std::ofstream file(fname);
   printCopyrightInfo(file);
   file << "\n\nCyRSoXS: \n";
   file << "=========================================================================================\n";
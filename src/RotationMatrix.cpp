@@ -27,7 +27,28 @@ RotationMatrix::RotationMatrix(const InputData *inputData)
 
 }
 
+bool RotationMatrix::isUpToDate() const {
+  const auto isEqual = [](const Real3 &a, const Real3 &b) {
+    return ((a.x == b.x) and (a.y == b.y) and (a.z == b.z));
+  };
+  if ((not isComputed_) or (computedKVectors_.size() != inputData_->kVectors.size())) {
+    return false;
+  }
+  if (not isEqual(computedDetectorCoordinates_, inputData_->detectorCoordinates)) {
+    return false;
+  }
+  for (UINT i = 0; i < computedKVectors_.size(); i++) {
+    if (not isEqual(computedKVectors_[i], inputData_->kVectors[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void RotationMatrix::initComputation() {
+  if (isUpToDate()) {
+    return;
+  }
   const UINT sz = inputData_->kVectors.size();
   baseConfig_.resize(inputData_->kVectors.size());
   baseAxis_.resize(inputData_->kVectors.size());
@@ -47,7 +68,9 @@ void RotationMatrix::initComputation() {
 
 
   computeRotationMatrixK(inputData_->detectorCoordinates,detectorRotationMatrix_);
-
+  computedKVectors_ = kVecs;
+  computedDetectorCoordinates_ = inputData_->detectorCoordinates;
+  isComputed_ = true;
 }
 
 void RotationMatrix::printToFile(std::ofstream & fout) const{
@@ -0,0 +1,171 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <SimulationContext.h>
+#include <cudaMain.h>
+
+bool DeviceWorkspace::isCompatible(const InputData &idata) const {
+  if (not allocated) {
+    return false;
+  }
+  const int NUM_STREAMS = (idata.algorithmType == Algorithm::CommunicationMinimizing) ? NUM_FFT_STREAMS
+                                                                                      : std::max(idata.numMaxStreams, NUM_FFT_STREAMS);
+  return ((voxelDims[0] == idata.voxelDims[0]) and (voxelDims[1] == idata.voxelDims[1])
+          and (voxelDims[2] == idata.voxelDims[2]) and (numMaterial == idata.NUM_MATERIAL)
+          and (algorithm == idata.algorithmType) and (scatterApproach == idata.scatterApproach)
+          and (rotMask == idata.rotMask) and (numStreams == NUM_STREAMS));
+}
+
+std::size_t DeviceWorkspace::getStageBytes(const InputData &idata, const UINT scatterApproach) {
+  const BigUINT numVoxels = idata.voxelDims[0] * idata.voxelDims[1] * idata.voxelDims[2];
+  const UINT numVoxel2D = idata.voxelDims[0] * idata.voxelDims[1];
+  const std::size_t ntStage = Arena::getBytes<Voxel>(numVoxels);
+  std::size_t polarizationStage = 3 * Arena::getBytes<Complex>(numVoxels) + 3 * Arena::getBytes<Real>(numVoxel2D);
+  if (scatterApproach == ScatterApproach::FULL) {
+    polarizationStage += Arena::getBytes<Real>(numVoxels);
+  }
+  if (idata.rotMask) {
+    polarizationStage += Arena::getBytes<UINT>(numVoxel2D);
+  }
+  return std::max(ntStage, polarizationStage);
+}
+
+void DeviceWorkspace::allocate(const InputData &idata) {
+  release();
+  const UINT *voxel = idata.voxelDims;
+  const BigUINT numVoxels = voxel[0] * voxel[1] * voxel[2];
+  const UINT numVoxel2D = voxel[0] * voxel[1];
+
+  std::memcpy(voxelDims, idata.voxelDims, sizeof(UINT) * 3);
+  numMaterial = idata.NUM_MATERIAL;
+  algorithm = idata.algorithmType;
+  scatterApproach = idata.scatterApproach;
+  rotMask = idata.rotMask;
+  numStreams = (algorithm == Algorithm::CommunicationMinimizing) ? NUM_FFT_STREAMS
+                                                                 : std::max(idata.numMaxStreams, NUM_FFT_STREAMS);
+
+  streams.resize(numStreams);
+  for (int i = 0; i < numStreams; i++) {
+    gpuErrchk(cudaStreamCreate(&streams[i]));
+  }
+  for (int i = 0; i < NUM_FFT_STREAMS; i++) {
+    cufftPlan3d(&plan[i], voxel[2], voxel[1], voxel[0], fftType);
+    cufftSetStream(plan[i], streams[i]);
+  }
+  cublasCreate(&handle);
+
+  mallocGPU(d_materialConstants, numMaterial);
+  if (algorithm == Algorithm::CommunicationMinimizing) {
+    mallocGPU(d_voxelInput, numVoxels * numMaterial);
+    mallocGPU(d_polarizationX, numVoxels);
+    mallocGPU(d_polarizationY, numVoxels);
+    mallocGPU(d_polarizationZ, numVoxels);
+    if (scatterApproach == ScatterApproach::FULL) {
+      mallocGPU(d_scatter3D, numVoxels);
+    }
+#ifndef EOC
+    mallocGPU(d_projection, numVoxel2D);
+    mallocGPU(d_rotProjection, numVoxel2D);
+    if (rotMask) {
+      mallocGPU(d_mask, numVoxel2D);
+    }
+    mallocGPU(d_projectionAverage, numVoxel2D);
+#endif
+  } else {
+    mallocGPU(d_Nt, numVoxels * 6);
+  }
+  voxelVersion = 0;
+  allocated = true;
+}
+
+void DeviceWorkspace::release() {
+  if (not allocated) {
+    return;
+  }
+  cudaSetDevice(deviceID);
+  Complex *complexBuffers[]{d_Nt, d_polarizationX, d_polarizationY, d_polarizationZ};
+  for (Complex *buffer: complexBuffers) {
+    if (buffer != nullptr) {
+      freeCudaMemory(buffer);
+    }
+  }
+  Real *realBuffers[]{d_scatter3D, d_projection, d_rotProjection, d_projectionAverage};
+  for (Real *buffer: realBuffers) {
+    if (buffer != nullptr) {
+      freeCudaMemory(buffer);
+    }
+  }
+  if (d_mask != nullptr) {
+    freeCudaMemory(d_mask);
+  }
+  if (d_voxelInput != nullptr) {
+    freeCudaMemory(d_voxelInput);
+  }
+  if (d_materialConstants != nullptr) {
+    freeCudaMemory(d_materialConstants);
+  }
+  d_Nt = d_polarizationX = d_polarizationY = d_polarizationZ = nullptr;
+  d_scatter3D = d_projection = d_rotProjection = d_projectionAverage = nullptr;
+  d_mask = nullptr;
+  d_voxelInput = nullptr;
+  d_materialConstants = nullptr;
+  stageArena.release();
+  pinnedArena.release();
+
+  for (int i = 0; i < NUM_FFT_STREAMS; i++) {
+    cufftDestroy(plan[i]);
+  }
+  for (auto &stream: streams) {
+    gpuErrchk(cudaStreamDestroy(stream));
+  }
+  streams.clear();
+  cublasDestroy(handle);
+  voxelVersion = 0;
+  allocated = false;
+}
+
+SimulationContext::~SimulationContext() {
+  release();
+}
+
+void SimulationContext::reserve(int numGPU) {
+  if (workspaces_.size() < static_cast<std::size_t>(numGPU)) {
+    workspaces_.resize(numGPU);
+  }
+}
+
+DeviceWorkspace &SimulationContext::acquire(int deviceID, const InputData &idata) {
+  DeviceWorkspace &workspace = workspaces_[deviceID];
+  workspace.deviceID = deviceID;
+  if (not workspace.isCompatible(idata)) {
+    workspace.allocate(idata);
+  }
+  return workspace;
+}
+
+void SimulationContext::release() {
+  for (auto &workspace: workspaces_) {
+    workspace.release();
+  }
+}
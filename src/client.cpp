@@ -0,0 +1,113 @@
+/////////////////////////////////////////////////////////////////////////////////
+// MIT License
+//
+//Copyright (c) 2019 - 2022 Iowa State University
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <Daemon/Protocol.h>
+#include <iostream>
+#include <cstdlib>
+#include <climits>
+#include <cerrno>
+
+/**
+ * @brief Converts the path to an absolute path, as the daemon runs in a different directory.
+ * @param path path
+ * @return absolute path
+ */
+static std::string absolutePath(const std::string &path) {
+  if ((not(path.empty())) and (path[0] == '/')) {
+    return path;
+  }
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, PATH_MAX) == nullptr) {
+    return path;
+  }
+  return std::string(cwd) + "/" + path;
+}
+
+static void printUsage(const char *name) {
+  std::cout << "Usage : " << name << " SocketPath submit ConfigFile HDF5FileName OutputDirname [Priority]\n";
+  std::cout << "        " << name << " SocketPath status\n";
+  std::cout << "        " << name << " SocketPath shutdown\n";
+}
+
+/**
+ * Submits jobs to the CyRSoXS daemon and prints the status streamed back.
+ * @param argc
+ * @param argv
+ * @return EXIT_SUCCESS if the request (and the job) succeeded.
+ */
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const std::string command = argv[2];
+  std::string request;
+  if (command == "submit") {
+    if (argc < 6) {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    const std::string priority = (argc > 6) ? argv[6] : "0";
+    request = Daemon::joinFields({Daemon::commandName[Daemon::Command::SUBMIT], priority,
+                                  absolutePath(argv[3]), absolutePath(argv[4]), absolutePath(argv[5])});
+  } else if (command == "status") {
+    request = Daemon::commandName[Daemon::Command::STATUS];
+  } else if (command == "shutdown") {
+    request = Daemon::commandName[Daemon::Command::SHUTDOWN];
+  } else {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  sockaddr_un address;
+  if (not(Daemon::makeAddress(argv[1], address))) {
+    std::cout << "Socket path too long\n";
+    return EXIT_FAILURE;
+  }
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ((fd < 0) or (connect(fd, (sockaddr *) &address, sizeof(address)) != 0)) {
+    std::cout << "Could not connect to " << argv[1] << " (" << strerror(errno) << ")\n";
+    return EXIT_FAILURE;
+  }
+  if (not(Daemon::writeLine(fd, request))) {
+    std::cout << "Could not send the request\n";
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  /// The daemon closes the connection after the last message
+  std::string line, lastReply;
+  while (Daemon::readLine(fd, line)) {
+    std::vector<std::string> fields = Daemon::splitFields(line);
+    lastReply = fields[0];
+    for (std::size_t i = 0; i < fields.size(); i++) {
+      std::cout << fields[i] << ((i + 1 < fields.size()) ? " " : "\n");
+    }
+    std::cout.flush();
+  }
+  close(fd);
+  const bool success = (lastReply == Daemon::replyName[Daemon::Reply::DONE])
+                       or (lastReply == Daemon::replyName[Daemon::Reply::OK]);
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
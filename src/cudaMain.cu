@@ -36,6 +36,11 @@
 #include <chrono>
 #include <npp.h>
 #include <Output/outputUtils.h>
+#include <Output/FrameStager.h>
+#include <AngleRefinement.h>
+#include <SparseQ.h>
+#include <stdexcept>
+#include <NUFFT.h>
 //#include <RotationMatrix.h>
 #define START_TIMER(X) if(ompThreadID == 0){timerArrayStart[X] = std::chrono::high_resolution_clock::now();}
 #define END_TIMER(X) if(ompThreadID == 0){timerArrayEnd[X] = std::chrono::high_resolution_clock::now(); \
@@ -65,7 +70,7 @@ __global__ void replaceDCComponentWithAverage(Complex *polarization, const uint3
     // DC component is at index [0,0,0]
     const int dcIndex = 0;
     
-    // Calculate average of 6 immediate face-adjacent neighbors in 3D
+    // Calculate average of 6 immediate face-adjacent neighbors in 3D, 4 in the plane in 2D
     Complex sum = {0.0f, 0.0f};
     int count = 0;
     
@@ -81,12 +86,6 @@ __global__ void replaceDCComponentWithAverage(Complex *polarization, const uint3
     sum.y += polarization[idx].y;
     count++;
     
-    // Neighbor at (0,0,1)
-    idx = vx.x * vx.y;
-    sum.x += polarization[idx].x;
-    sum.y += polarization[idx].y;
-    count++;
-    
     // Neighbor at (vx.x-1,0,0) - wrap around due to periodicity
     idx = vx.x - 1;
     sum.x += polarization[idx].x;
@@ -99,11 +98,20 @@ __global__ void replaceDCComponentWithAverage(Complex *polarization, const uint3
     sum.y += polarization[idx].y;
     count++;
     
-    // Neighbor at (0,0,vx.z-1) - wrap around due to periodicity
-    idx = (vx.z - 1) * vx.x * vx.y;
-    sum.x += polarization[idx].x;
-    sum.y += polarization[idx].y;
-    count++;
+    // A 2D morphology has no neighbors along Z: (0,0,1) is out of bounds and (0,0,vx.z-1) is the DC component
+    if (vx.z > 1) {
+      // Neighbor at (0,0,1)
+      idx = vx.x * vx.y;
+      sum.x += polarization[idx].x;
+      sum.y += polarization[idx].y;
+      count++;
+
+      // Neighbor at (0,0,vx.z-1) - wrap around due to periodicity
+      idx = (vx.z - 1) * vx.x * vx.y;
+      sum.x += polarization[idx].x;
+      sum.y += polarization[idx].y;
+      count++;
+    }
     
     // Replace DC component with average
     polarization[dcIndex].x = sum.x / count;
@@ -131,8 +139,7 @@ __host__  int performScatter3DComputation(const Complex *d_polarizationX, const
                                                   d_scatter3D,  kMagnitude , voxelSize, vx,
                                                   physSize,
                                                   enable2D, kVector);
-  cudaDeviceSynchronize();
-  gpuErrchk(cudaPeekAtLastError());
+  endStage();
   return EXIT_SUCCESS;
 }
 
@@ -144,13 +151,13 @@ __host__ int peformEwaldProjectionGPU(Real *d_projection,
                                       const Interpolation::EwaldsInterpolation &interpolation,
                                       const bool &enable2D,
                                       const UINT &blockSize,
-                                      const Real3 & kVector) {
+                                      const Real3 & kVector,
+                                      const FrameROI & roi) {
   computeEwaldProjectionGPU <<< blockSize, NUM_THREADS >>>(d_projection, d_scatter, vx,
                                                            kMagnitude, physSize,
                                                            interpolation,
-                                                           enable2D,kVector);
-  cudaDeviceSynchronize();
-  gpuErrchk(cudaPeekAtLastError());
+                                                           enable2D,kVector,roi);
+  endStage();
 
   return EXIT_SUCCESS;
 
@@ -166,14 +173,14 @@ __host__ int peformEwaldProjectionGPU(Real *d_projection,
                                       const Interpolation::EwaldsInterpolation &interpolation,
                                       const bool &enable2D,
                                       const UINT &blockSize,
-                                      const Real3 & kVector) {
+                                      const Real3 & kVector,
+                                      const FrameROI & roi) {
   computeEwaldProjectionGPU <<< blockSize, NUM_THREADS >>>(d_projection, d_polarizationX, d_polarizationY,
                                                            d_polarizationZ, vx,
                                                            kMagnitude, physSize,
                                                            interpolation,
-                                                           enable2D,kVector);
-  cudaDeviceSynchronize();
-  gpuErrchk(cudaPeekAtLastError());
+                                                           enable2D,kVector,roi);
+  endStage();
   return EXIT_SUCCESS;
 
 }
@@ -262,8 +269,7 @@ __host__ int computePolarization(const Material  * d_materialConstants,
                                                                                 enable2D,
                                                                                 morphologyType,rotationMatrix,numVoxels,NUM_MATERIAL);
   }
-  cudaDeviceSynchronize();
-  gpuErrchk(cudaPeekAtLastError());
+  endStage();
   return EXIT_SUCCESS;
 }
 
@@ -289,6 +295,63 @@ __host__ int computeNt(const Material * d_materialConstants,
   return (EXIT_SUCCESS);
 }
 
+__host__ int transformNt(Complex * d_Nt,
+                         Complex * const d_scratch[3],
+                         cufftHandle * plan,
+                         const std::vector<cudaStream_t> & streams,
+                         const uint3 & vx,
+                         const UINT & blockSize,
+                         const BigUINT & numVoxels) {
+  /// Components (0,1,2) and (3,4,5) are transformed three at a time
+  for(UINT startID = 0; startID < 6; startID += 3){
+    cufftResult result[3];
+    for(UINT i = 0; i < 3; i++){
+      copyNtComponent<false><<<blockSize, NUM_THREADS, 0, streams[i]>>>(d_Nt, d_scratch[i], startID + i, numVoxels);
+      result[i] = performFFT(d_scratch[i], plan[i]);
+      replaceDCComponent(d_scratch[i], vx, streams[i]);
+      performFFTShift(d_scratch[i], blockSize, vx, streams[i]);
+      copyNtComponent<true><<<blockSize, NUM_THREADS, 0, streams[i]>>>(d_Nt, d_scratch[i], startID + i, numVoxels);
+    }
+    cudaDeviceSynchronize();
+    gpuErrchk(cudaPeekAtLastError());
+    if ((result[0] != CUFFT_SUCCESS) or (result[1] != CUFFT_SUCCESS) or (result[2] != CUFFT_SUCCESS)) {
+      std::cout << "CUFFT failed with result " << result[0] << " " << result[1] << " " << result[2] << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief copies the average of the E angles computed so far to the angle refinement
+ * @param [in,out] refinement angle refinement
+ * @param [out] d_average device buffer for the average
+ * @param [in] d_sum sum of the rotated projections
+ * @param [in] d_mask number of valid values of every pixel (only with rotation mask)
+ * @param [in] numAngles number of angles computed so far
+ * @param [in] rotMask rotation mask
+ * @param [in] handle cublas handle
+ * @param [in] blockSize blocksize of 2D GPU kernel
+ * @param [in] vx voxel dims in all direction
+ * @param [in] rowOffset first pixel of the rows compared
+ * @param [in] numPixels number of pixels compared
+ */
+static void copyAngleAverage(AngleRefinement & refinement, Real * d_average, const Real * d_sum, const UINT * d_mask,
+                             const UINT numAngles, const bool rotMask, cublasHandle_t handle, const UINT blockSize,
+                             const uint3 & vx, const std::size_t rowOffset, const UINT numPixels) {
+  hostDeviceExchange(&d_average[rowOffset], &d_sum[rowOffset], numPixels, cudaMemcpyDeviceToDevice);
+  if (rotMask) {
+    averageRotation<<<blockSize, NUM_THREADS>>>(d_average, d_mask, vx);
+    endStage();
+  } else {
+    const Real alphaFac = static_cast<Real>(1.0 / numAngles);
+    if (cublasScale(handle, numPixels, &alphaFac, &d_average[rowOffset], 1) != CUBLAS_STATUS_SUCCESS) {
+      throw std::runtime_error("CUBLAS during averaging failed");
+    }
+  }
+  hostDeviceExchange(refinement.getBuffer(numPixels), &d_average[rowOffset], numPixels, cudaMemcpyDeviceToHost);
+}
+
 __host__ int computePolarization(const Complex * __restrict__ d_Nt, Complex *d_pX,
                                  Complex *d_pY, Complex *d_pZ,
                                  const UINT &blockSize,
@@ -305,22 +368,390 @@ __host__ int computePolarization(const Complex * __restrict__ d_Nt, Complex *d_p
                                                                                                      d_pY, d_pZ,rotationMatrix,numVoxels);
     }
 
-    cudaDeviceSynchronize();
-    gpuErrchk(cudaPeekAtLastError());
+    endStage();
     return EXIT_SUCCESS;
   }
 
+/**
+ * @brief NPP rectangle of a region of the pattern
+ * @param roi region
+ * @return rectangle
+ */
+static NppiRect getRect(const FrameROI & roi){
+  NppiRect rect;
+  rect.x = static_cast<int>(roi.x0);
+  rect.y = static_cast<int>(roi.y0);
+  rect.width = static_cast<int>(roi.nx);
+  rect.height = static_cast<int>(roi.ny);
+  return rect;
+}
+
+/**
+ * @brief Waits until the frames of a GPU are written and releases the stager
+ * @param [in,out] frameStager stager of the GPU. Can be nullptr.
+ * @return false if the sink failed to write a frame
+ */
+static bool finishFrames(std::unique_ptr<FrameStager> & frameStager){
+  bool isWritten = true;
+  if (frameStager != nullptr) {
+    try {
+      frameStager->finish();
+    } catch (const std::exception & error) {
+      std::cout << RED << "[ERROR] Writing a frame failed: " << error.what() << NRM << "\n";
+      isWritten = false;
+    } catch (...) {
+      std::cout << RED << "[ERROR] Writing a frame failed" << NRM << "\n";
+      isWritten = false;
+    }
+  }
+  frameStager.reset();
+  return isWritten;
+}
+
+/**
+ * @brief Detector rotation of a k vector and the regions of the pattern it needs. Both rotations preserve
+ * distances, so the regions follow from the output region.
+ */
+struct DetectorGeometry {
+  /// Detector rotation composed with the rotation of the k vector
+  Matrix detectorRotation;
+  /// Region computed by the Ewald projection (before the E rotation)
+  FrameROI ewaldROI;
+  /// NPP rectangles before the E rotation, before the detector rotation and of the output
+  NppiRect ewaldRect, rotationRect, outputRect;
+  /// blocksize of the Ewald projection kernel
+  UINT blockSizeROI;
+  /// first pixel of the rows the detector rotation reads from
+  std::size_t rowOffset;
+  /// number of pixels of the rows the detector rotation reads from
+  UINT numRotationPixels;
+};
+
+/**
+ * @brief Device buffers of the projection of the polarization to the detector. cudaMain takes them from the
+ * workspace, cudaMainStreams from the stage arena.
+ */
+struct ProjectionBuffers {
+  Complex *d_polarizationX, *d_polarizationY, *d_polarizationZ;
+  /// 3D scattering (ScatterApproach::FULL only)
+  Real *d_scatter3D;
+  Real *d_projection, *d_rotProjection, *d_projectionAverage;
+  /// number of valid values of every pixel (only with rotation mask)
+  UINT *d_mask;
+};
+
+/**
+ * @brief Computes the detector rotation and the regions of a k vector
+ * @param [in] idata input data
+ * @param [in] voxel voxel dims
+ * @param [in] outputROI region written to the output
+ * @param [in] detectorMatrix rotation of the detector
+ * @param [in] rotationMatrixK rotation of the k vector
+ * @return geometry of the k vector
+ */
+static DetectorGeometry getDetectorGeometry(const InputData & idata, const UINT * voxel, const FrameROI & outputROI,
+                                            const Matrix & detectorMatrix, const Matrix & rotationMatrixK) {
+  DetectorGeometry geometry;
+  geometry.detectorRotation.performMatrixMultiplication<false,false>(detectorMatrix, rotationMatrixK);
+  const FrameROI rotationROI = getSourceROI(outputROI, idata, geometry.detectorRotation);
+  geometry.ewaldROI = getSourceROI(rotationROI, idata, 1.0, 1.0);
+  geometry.ewaldRect = getRect(geometry.ewaldROI);
+  geometry.rotationRect = getRect(rotationROI);
+  geometry.outputRect = getRect(outputROI);
+  geometry.blockSizeROI = static_cast<UINT>(ceil(geometry.ewaldROI.nx * geometry.ewaldROI.ny * 1.0 / NUM_THREADS));
+  geometry.rowOffset = static_cast<std::size_t>(rotationROI.y0) * voxel[0];
+  geometry.numRotationPixels = rotationROI.ny * voxel[0];
+  return geometry;
+}
+
+/**
+ * @brief Projects the Fourier transformed polarization of an E angle on the Ewald sphere into d_projection
+ * @param [in] idata input data
+ * @param [in] voxel voxel dims
+ * @param [in] buffers device buffers
+ * @param [in] geometry geometry of the k vector
+ * @param [in] kMagnitude magnitude of k
+ * @param [in] kVec k vector
+ * @param [in] blockSize blocksize of 3D GPU kernel
+ * @param [in] i index of the E angle
+ */
+static void projectEwald(const InputData & idata, const UINT * voxel, const ProjectionBuffers & buffers,
+                         const DetectorGeometry & geometry, const Real kMagnitude, const Real3 & kVec,
+                         const UINT blockSize, const UINT i) {
+  const BigUINT numVoxels = voxel[0] * voxel[1] * voxel[2];
+  const UINT numVoxel2D = voxel[0] * voxel[1];
+  const uint3 vx{voxel[0], voxel[1], voxel[2]};
+  cudaZeroEntries(buffers.d_rotProjection, numVoxel2D);
+  cudaZeroEntries(buffers.d_projection, numVoxel2D);
+
+  if (idata.scatterApproach == ScatterApproach::FULL) {
+
+    performScatter3DComputation(buffers.d_polarizationX, buffers.d_polarizationY, buffers.d_polarizationZ,
+                                buffers.d_scatter3D, kMagnitude, numVoxels, vx, idata.physSize,
+                                idata.if2DComputation(), blockSize, kVec);
+
+#if defined(EOC) or defined(DUMP_FILES)
+    std::vector<Real> scatter3D(numVoxels);
+    CUDA_CHECK_RETURN(cudaMemcpy(scatter3D.data(), buffers.d_scatter3D, sizeof(Real) * numVoxels,
+                                 cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaPeekAtLastError());
+#endif
+#ifdef DUMP_FILES
+    {
+      FILE *scatter = fopen("scatter_3D.dmp", "wb");
+      fwrite(scatter3D.data(), sizeof(Real), numVoxels, scatter);
+      fclose(scatter);
+      std::string dirname = "Scatter/";
+      std::string fname = dirname + "scatter" + std::to_string(i);
+      VTI::writeDataScalar(scatter3D.data(), voxel, fname.c_str(), "scatter3D");
+    }
+#endif
+
+#ifdef EOC
+    std::vector<Real> projectionCPU(numVoxel2D);
+    computeEwaldProjectionCPU(projectionCPU.data(), scatter3D.data(), vx, kMagnitude);
+#else
+    peformEwaldProjectionGPU(buffers.d_projection, buffers.d_scatter3D, kMagnitude, vx, idata.physSize,
+                             static_cast<Interpolation::EwaldsInterpolation>(idata.ewaldsInterpolation),
+                             idata.if2DComputation(), geometry.blockSizeROI, kVec, geometry.ewaldROI);
+#ifdef DUMP_FILES
+    std::vector<Real> projection(numVoxel2D);
+    hostDeviceExchange(projection.data(), buffers.d_projection, numVoxel2D, cudaMemcpyDeviceToHost);
+    std::string dirname = "Ewald/";
+    std::string fname = dirname + "ewlad" + std::to_string(i);
+    VTI::writeDataScalar2DFP(projection.data(), voxel, fname.c_str(), "ewald");
+    FILE *pProjection = fopen("projection_scatterFull.dmp", "wb");
+    fwrite(projection.data(), sizeof(Real), numVoxel2D, pProjection);
+    fclose(pProjection);
+#endif
+#endif
+  } else {
+    peformEwaldProjectionGPU(buffers.d_projection, buffers.d_polarizationX, buffers.d_polarizationY,
+                             buffers.d_polarizationZ, kMagnitude, vx, idata.physSize,
+                             static_cast<Interpolation::EwaldsInterpolation>(idata.ewaldsInterpolation),
+                             idata.if2DComputation(), geometry.blockSizeROI, kVec, geometry.ewaldROI);
+#ifdef DUMP_FILES
+    std::vector<Real> projection(numVoxel2D);
+    hostDeviceExchange(projection.data(), buffers.d_projection, numVoxel2D, cudaMemcpyDeviceToHost);
+    std::string dirname = "Ewald/";
+    std::string fname = dirname + "ewlad" + std::to_string(i);
+    VTI::writeDataScalar2DFP(projection.data(), voxel, fname.c_str(), "ewald");
+    FILE *pProjection = fopen("projection_scatterPartial.dmp", "wb");
+    fwrite(projection.data(), sizeof(Real), numVoxel2D, pProjection);
+    fclose(pProjection);
+#endif
+  }
+}
+
+/**
+ * @brief Rotates the projection of an E angle by that angle and by the angles that differ by 180 degrees, and
+ * accumulates them in d_projectionAverage. At the end of a level of the E angle refinement, the average so far is
+ * handed to the refinement.
+ * @param [in] idata input data
+ * @param [in] voxel voxel dims
+ * @param [in] buffers device buffers
+ * @param [in] geometry geometry of the k vector
+ * @param [in,out] angleRefinement E angle refinement
+ * @param [in] i index of the E angle
+ * @param [in] angleID position of the E angle in the order of the refinement
+ * @param [in] baseRotAngle base rotation angle of the k vector (in degrees)
+ * @param [in] handle cublas handle
+ * @return true if the E angle refinement converged
+ */
+static bool accumulateRotations(const InputData & idata, const UINT * voxel, const ProjectionBuffers & buffers,
+                                const DetectorGeometry & geometry, AngleRefinement & angleRefinement, const UINT i,
+                                const UINT angleID, const Real baseRotAngle, cublasHandle_t handle) {
+  const UINT numVoxel2D = voxel[0] * voxel[1];
+  const uint3 vx{voxel[0], voxel[1], voxel[2]};
+  const UINT BlockSize2 = static_cast<UINT>(ceil(numVoxel2D * 1.0 / NUM_THREADS));
+  NppiSize sizeImage;
+  sizeImage.height = voxel[0];
+  sizeImage.width = voxel[1];
+  cublasStatus_t stat;
+
+  /// Angles that differ by 180 degrees share the projection. Each of them is rotated and accumulated.
+  for (const UINT partnerID : angleRefinement.getPartners(i)) {
+    Real _factor;
+    _factor = NAN;
+
+    stat = cublasScale(handle, numVoxel2D, &_factor, buffers.d_rotProjection, 1);
+
+
+    if (stat != CUBLAS_STATUS_SUCCESS) {
+      throw std::runtime_error("CUBLAS during scaling failed with status " + std::to_string(stat));
+    }
+
+    const Real partnerAngle = static_cast<Real>((baseRotAngle + idata.startAngle + partnerID * idata.incrementAngle) * M_PI / 180.0);
+    const double alpha = cos(partnerAngle);
+    const double beta = sin(partnerAngle);
+
+    /**https://docs.opencv.org/2.4/modules/imgproc/doc/geometric_transformations.html?highlight=warpaffine**/
+    const double coeffs[2][3]{
+      alpha, beta, static_cast<Real>(((1 - alpha) * voxel[0] / 2 - beta * voxel[1] / 2.)),
+      -beta, alpha, static_cast<Real>(beta * voxel[0] / 2. + (1 - alpha) * voxel[1] / 2.)
+    };
+
+
+    NppStatus status = warpAffine(buffers.d_projection,
+                                  sizeImage,
+                                  voxel[1] * sizeof(Real),
+                                  geometry.ewaldRect,
+                                  buffers.d_rotProjection,
+                                  voxel[1] * sizeof(Real),
+                                  geometry.rotationRect,
+                                  coeffs,
+                                  NPPI_INTER_LINEAR);
+
+    if (status < 0) {
+      throw std::runtime_error("Image rotation failed with error = " + std::to_string(status));
+    }
+    if (status != NPP_SUCCESS) {
+      std::cout << YLW << "[WARNING] Image rotation warning = " << status << NRM << "\n";
+    }
+
+    if (idata.rotMask) {
+      computeRotationMask<<< BlockSize2, NUM_THREADS >>>(buffers.d_rotProjection, buffers.d_mask, vx);
+      endStage();
+    }
+
+    const Real factor = static_cast<Real>(1.0);
+    /// Only the rows the detector rotation reads from are accumulated
+    stat = cublasAXPY(handle, geometry.numRotationPixels, &factor, &buffers.d_rotProjection[geometry.rowOffset], 1,
+                      &buffers.d_projectionAverage[geometry.rowOffset], 1);
+    if (stat != CUBLAS_STATUS_SUCCESS) {
+      throw std::runtime_error("CUBLAS during sum failed with status " + std::to_string(stat));
+    }
+  }
+
+  if (angleRefinement.isLevelEnd(angleID + 1)) {
+    copyAngleAverage(angleRefinement, buffers.d_projection, buffers.d_projectionAverage, buffers.d_mask, angleID + 1,
+                     idata.rotMask, handle, BlockSize2, vx, geometry.rowOffset, geometry.numRotationPixels);
+    return angleRefinement.isConverged();
+  }
+  return false;
+}
+
+/**
+ * @brief Averages the accumulated E angles and rotates the average to the detector. The pattern is left in
+ * d_projectionAverage.
+ * @param [in] idata input data
+ * @param [in] voxel voxel dims
+ * @param [in] buffers device buffers
+ * @param [in] geometry geometry of the k vector
+ * @param [in] numAnglesUsed number of E angles accumulated
+ * @param [in] handle cublas handle
+ */
+static void finishPattern(const InputData & idata, const UINT * voxel, const ProjectionBuffers & buffers,
+                          const DetectorGeometry & geometry, const UINT numAnglesUsed, cublasHandle_t handle) {
+  const UINT numVoxel2D = voxel[0] * voxel[1];
+  const uint3 vx{voxel[0], voxel[1], voxel[2]};
+  const UINT BlockSize2 = static_cast<UINT>(ceil(numVoxel2D * 1.0 / NUM_THREADS));
+  NppiSize sizeImage;
+  sizeImage.height = voxel[0];
+  sizeImage.width = voxel[1];
+  cublasStatus_t stat;
+
+  if (idata.rotMask) {
+    averageRotation<<<BlockSize2, NUM_THREADS>>>(buffers.d_projectionAverage, buffers.d_mask, vx);
+    endStage();
+  } else {
+    /// The averaging out for all angles
+    const Real alphaFac = static_cast<Real>(1.0 / numAnglesUsed);
+    stat = cublasScale(handle, voxel[0] * voxel[1], &alphaFac, buffers.d_projectionAverage, 1);
+    if (stat != CUBLAS_STATUS_SUCCESS) {
+      throw std::runtime_error("CUBLAS during averaging failed with status " + std::to_string(stat));
+    }
+  }
+
+  //// Rotate Image
+  hostDeviceExchange(buffers.d_projection, buffers.d_projectionAverage, numVoxel2D, cudaMemcpyDeviceToDevice);
+  const double srcPoints[3][2]{{voxel[0] / 2.,  voxel[1] / 2.},
+                               {voxel[0] * 0.5, voxel[1] * 1.0},
+                               {voxel[0] * 1.0, voxel[1] * 0.5}};
+  Real3 _dstPts[3], _srcPts;
+  double center[2]{voxel[0] / 2., voxel[1] / 2.};
+  for (int i = 0; i < 3; i++) {
+    _srcPts.x = srcPoints[i][0] - center[0];
+    _srcPts.y = srcPoints[i][1] - center[1];
+    _srcPts.z = 0;
+    doMatVec<false>(geometry.detectorRotation, _srcPts, _dstPts[i]);
+    _dstPts[i].x = _dstPts[i].x + center[0];
+    _dstPts[i].y = _dstPts[i].y + center[1];
+    _dstPts[i].z = 0;
+  }
+
+  const double destPoints[3][2]{{_dstPts[0].x, _dstPts[0].y},
+                                {_dstPts[1].x, _dstPts[1].y},
+                                {_dstPts[2].x, _dstPts[2].y}};
+  double coeffs[2][3];
+  computeWarpAffineMatrix(srcPoints, destPoints, coeffs);
+  Real _factor = idata.rotMask ? 0 : NAN;
+  stat = cublasScale(handle, numVoxel2D, &_factor, buffers.d_projectionAverage, 1);
+  NppStatus status = warpAffine(buffers.d_projection,
+                                sizeImage,
+                                voxel[1] * sizeof(Real),
+                                geometry.rotationRect,
+                                buffers.d_projectionAverage,
+                                voxel[1] * sizeof(Real),
+                                geometry.outputRect,
+                                coeffs,
+                                NPPI_INTER_LINEAR);
+
+  if (status < 0) {
+    throw std::runtime_error("Image rotation failed with error = " + std::to_string(status));
+  }
+  if (status != NPP_SUCCESS) {
+    std::cout << YLW << "[WARNING] Image rotation warning = " << status << NRM << "\n";
+  }
+}
+
+/**
+ * @brief Hands the pattern of an (energy, k) to the stager, or copies it to the host output
+ * @param [in] idata input data
+ * @param [in] voxel voxel dims
+ * @param [in] d_pattern pattern on the device
+ * @param [in] frameStager stager of the GPU. nullptr without sink.
+ * @param [out] projectionGPUAveraged host output (only without sink)
+ * @param [in] energyID energy ID
+ * @param [in] kID k vector ID
+ * @param [in] numAnglesUsed number of E angles averaged
+ */
+static void outputPattern(const InputData & idata, const UINT * voxel, const Real * d_pattern,
+                          FrameStager * frameStager, Real * projectionGPUAveraged, const UINT energyID,
+                          const UINT kID, const UINT numAnglesUsed) {
+  const UINT numVoxel2D = voxel[0] * voxel[1];
+  if (idata.eAngleAdaptive) {
+    std::cout << " [STAT] Energy = " << idata.energies[energyID] << " k = " << kID << " : " << numAnglesUsed
+              << " E angles\n";
+  }
+  if (frameStager != nullptr) {
+    /// Only the region of interest is copied
+    frameStager->push(d_pattern, energyID, kID, idata.eAngleAdaptive ? numAnglesUsed : 0);
+  } else {
+    FrameROI fullFrame;
+    fullFrame.nx = voxel[0];
+    fullFrame.ny = voxel[1];
+    const std::size_t disp = static_cast<std::size_t>(numVoxel2D) * static_cast<std::size_t>(energyID * idata.kVectors.size()) + static_cast<std::size_t>(kID * numVoxel2D);
+    hostDeviceExchange(&projectionGPUAveraged[disp],
+                       d_pattern, numVoxel2D,
+                       cudaMemcpyDeviceToHost);
+    maskOutsideROI(idata, fullFrame, &projectionGPUAveraged[disp]);
+  }
+}
+
 int cudaMain(const UINT *voxel,
              const InputData &idata,
              const std::vector<Material>  &materialInput,
              Real *projectionGPUAveraged,
              RotationMatrix & rotationMatrix,
-             const Voxel *voxelInput) {
+             const Voxel *voxelInput,
+             SimulationContext * context,
+             FrameSink * sink) {
 
 
   if ((static_cast<uint64_t>(voxel[0]) * voxel[1] * voxel[2]) > std::numeric_limits<BigUINT>::max()) {
     std::cout << "[Compile error] Exiting. Compile by Enabling 64 Bit indices\n";
-    exit(EXIT_FAILURE);
+    return (EXIT_FAILURE);
   }
 
   const BigUINT numVoxels = voxel[0] * voxel[1] * voxel[2]; /// Voxel size
@@ -384,6 +815,13 @@ int cudaMain(const UINT *voxel,
   VTI::writeVoxelDataVector(voxelInput, voxel, "S1", varnameVector,NUM_MATERIAL);
   VTI::writeVoxelDataScalar(voxelInput, voxel, "Phi", varnameScalar,NUM_MATERIAL);
 #endif
+  SimulationContext localContext;
+  SimulationContext & simulationContext = (context == nullptr) ? localContext : *context;
+  simulationContext.reserve(num_gpu);
+  rotationMatrix.initComputation();
+
+  /// Set by the GPU threads if the computation or the sink failed
+  bool isFailed = false;
   omp_set_num_threads(num_gpu);
 #pragma omp parallel
   {
@@ -399,30 +837,23 @@ int cudaMain(const UINT *voxel,
     }
     else{
       std::cout << "Warmup failed on GPU " << dprop.name << "\n";
-#pragma omp cancel parallel
-      exit (EXIT_FAILURE);
+#pragma omp atomic write
+      isFailed = true;
     }
 #endif
-    static constexpr int NUM_STREAMS=3;
-    cudaStream_t streams[NUM_STREAMS];
-    cufftResult result[NUM_STREAMS];
-    cufftHandle plan[NUM_STREAMS];
-    for (int i = 0; i < NUM_STREAMS; i++) {
-      gpuErrchk(cudaStreamCreate(&streams[i]));
-    }
-
-    for(int i = 0; i < NUM_STREAMS; i++){
-      cufftPlan3d(&plan[i], voxel[2], voxel[1], voxel[0], fftType);
-      cufftSetStream(plan[i],streams[i]);
+    const UINT ompThreadID = omp_get_thread_num();
+#ifdef PROFILING
+    {
+      START_TIMER(TIMERS::MALLOC);
     }
-
-    cublasHandle_t handle;
-    cublasStatus_t stat;
-    cublasCreate(&handle);
-
-    NppiSize sizeImage;
-    sizeImage.height = voxel[0];
-    sizeImage.width = voxel[1];
+#endif
+    /// Streams, plans and device buffers are reused from previous launches if the configuration matches
+    DeviceWorkspace & workspace = simulationContext.acquire(omp_get_thread_num(), idata);
+    static constexpr int NUM_STREAMS = DeviceWorkspace::NUM_FFT_STREAMS;
+    const cudaStream_t * streams = workspace.streams.data();
+    cufftResult result[NUM_STREAMS];
+    cufftHandle * plan = workspace.plan;
+    cublasHandle_t & handle = workspace.handle;
 
     NppiRect rect;
     rect.height = voxel[0];
@@ -431,7 +862,6 @@ int cudaMain(const UINT *voxel,
     rect.y = 0;
 
 
-    const UINT ompThreadID = omp_get_thread_num();
     const UINT numEnergyPerGPU = static_cast<UINT>(std::ceil(numEnergyLevel * 1.0 / num_gpu));
     const UINT numStart = (numEnergyPerGPU * ompThreadID);
     UINT numEnd = (numEnergyPerGPU * (ompThreadID + 1));
@@ -447,51 +877,20 @@ int cudaMain(const UINT *voxel,
     }
 
 
-#ifdef PROFILING
-    {
-      START_TIMER(TIMERS::MALLOC);
-    }
-#endif
 #ifdef DUMP_FILES
     Complex *polarizationZ = new Complex[numVoxels];
     Complex *polarizationX = new Complex[numVoxels];
     Complex *polarizationY = new Complex[numVoxels];
-#endif
-#if defined(EOC) or defined(DUMP_FILES)
-    Real *scatter3D = new Real[numVoxels];
-#endif
-
-#ifdef EOC
-    Real *projectionCPU = new Real[BATCH * voxel[0] * voxel[1]];
-#else
-
 #endif
 
-    Voxel *d_voxelInput;
-    mallocGPU(d_voxelInput, numVoxels*NUM_MATERIAL);
-
-    Complex *d_polarizationZ, *d_polarizationX, *d_polarizationY;
-    Real *d_scatter3D;
-    UINT *d_mask;
-    Material * d_materialConstants;
-
-    mallocGPU(d_polarizationX, numVoxels);
-    mallocGPU(d_polarizationY, numVoxels);
-    mallocGPU(d_polarizationZ, numVoxels);
-    mallocGPU(d_materialConstants, NUM_MATERIAL);
-
-    if (idata.scatterApproach == ScatterApproach::FULL) {
-      mallocGPU(d_scatter3D, numVoxels);
-    }
-#ifndef EOC
-    Real *d_projection, *d_rotProjection, *d_projectionAverage;
-    mallocGPU(d_projection, numVoxel2D);
-    mallocGPU(d_rotProjection, numVoxel2D);
-    if (idata.rotMask) {
-      mallocGPU(d_mask, numVoxel2D);
-    }
-    mallocGPU(d_projectionAverage, numVoxel2D);
-#endif
+    Voxel *d_voxelInput = workspace.d_voxelInput;
+    Complex *d_polarizationZ = workspace.d_polarizationZ;
+    Complex *d_polarizationX = workspace.d_polarizationX;
+    Complex *d_polarizationY = workspace.d_polarizationY;
+    Material * d_materialConstants = workspace.d_materialConstants;
+    const ProjectionBuffers buffers{d_polarizationX, d_polarizationY, d_polarizationZ, workspace.d_scatter3D,
+                                    workspace.d_projection, workspace.d_rotProjection, workspace.d_projectionAverage,
+                                    workspace.d_mask};
 
 
 #ifdef PROFILING
@@ -501,14 +900,16 @@ int cudaMain(const UINT *voxel,
     }
 #endif
 
-    hostDeviceExchange(d_voxelInput, voxelInput, numVoxels*NUM_MATERIAL, cudaMemcpyHostToDevice);
+    /// Morphology is only uploaded if it changed since the last launch on this GPU
+    if (workspace.voxelVersion != simulationContext.voxelVersion()) {
+      hostDeviceExchange(d_voxelInput, voxelInput, numVoxels*NUM_MATERIAL, cudaMemcpyHostToDevice);
+      workspace.voxelVersion = simulationContext.voxelVersion();
+    }
 #ifdef PROFILING
     {
       END_TIMER(TIMERS::MEMCOPY_CPU_GPU)
     }
 #endif
-    // TODO: Make this async and overlap with computation
-    rotationMatrix.initComputation();
     const auto & baseConfigurations = rotationMatrix.getBaseConfigurations();
 
 
@@ -516,441 +917,280 @@ int cudaMain(const UINT *voxel,
 
 
     UINT BlockSize  = static_cast<UINT>(ceil(numVoxels * 1.0 / NUM_THREADS));
-    UINT BlockSize2 = static_cast<UINT>(ceil(numVoxel2D * 1.0 / NUM_THREADS));
-
-    for (UINT j = numStart; j < numEnd; j++) {
+    /// Region written to the output: the full frame without q region of interest
+    const FrameROI outputROI = getOutputROI(idata);
+    /// Order of the E angles, refined level by level with EAngleAdaptive
+    AngleRefinement angleRefinement(idata, numAnglesRotation);
+    const std::vector<UINT> & angleOrder = angleRefinement.getOrder();
+    /// The staging buffers are returned to the workspace on every exit path, so that the next launch can reuse it
+    const ArenaScope pinnedScope(workspace.pinnedArena);
+    /// Frames are copied and handed to the sink while the device computes the next (energy, k)
+    std::unique_ptr<FrameStager> frameStager;
+    if (sink != nullptr) {
+      workspace.pinnedArena.reserve(FrameStager::getBytes(outputROI));
+      frameStager.reset(new FrameStager(idata, outputROI, sink, omp_get_thread_num(), workspace.pinnedArena));
+    }
 
-      hostDeviceExchange(d_materialConstants, &materialInput[j * NUM_MATERIAL], NUM_MATERIAL, cudaMemcpyHostToDevice);
-      const Real &energy = (idata.energies[j]);
-      std::cout << " [STAT] Energy = " << energy << " starting " << "\n";
-      for (UINT kstart = 0; kstart < kVectors.size(); kstart++) {
-        const auto & baseConfig = baseConfigurations[kstart];
-        const Real baseRotAngle = baseConfig.baseRotAngle;
-        const Matrix & rotationMatrixK = baseConfig.matrix;
-        const Real3 &kVec = idata.kVectors[kstart];
-        cudaZeroEntries(d_projectionAverage, numVoxel2D);
-        if (idata.rotMask) {
-          cudaZeroEntries(d_mask, numVoxel2D);
+    try {
+      for (UINT j = numStart; j < numEnd; j++) {
+        if ((sink != nullptr) and sink->isComplete(j)) {
+          continue;
         }
 
+        hostDeviceExchange(d_materialConstants, &materialInput[j * NUM_MATERIAL], NUM_MATERIAL, cudaMemcpyHostToDevice);
+        const Real &energy = (idata.energies[j]);
+        std::cout << " [STAT] Energy = " << energy << " starting " << "\n";
+        for (UINT kstart = 0; kstart < kVectors.size(); kstart++) {
+          const auto & baseConfig = baseConfigurations[kstart];
+          const Real baseRotAngle = baseConfig.baseRotAngle;
+          const Matrix & rotationMatrixK = baseConfig.matrix;
+          const Real3 &kVec = idata.kVectors[kstart];
+
+          /// Regions needed before the detector rotation and before the E rotation (distance preserving)
+          const DetectorGeometry geometry = getDetectorGeometry(idata, voxel, outputROI,
+                                                                rotationMatrix.getDetectorRotationMatrix(),
+                                                                rotationMatrixK);
+          cudaZeroEntries(buffers.d_projectionAverage, numVoxel2D);
+          if (idata.rotMask) {
+            cudaZeroEntries(buffers.d_mask, numVoxel2D);
+          }
+
 #ifdef  PROFILING
-        START_TIMER(TIMERS::ENERGY)
+          START_TIMER(TIMERS::ENERGY)
 #endif
 
 
 
-        const Real wavelength = static_cast<Real>(1239.84197 / energy);
-        const Real kMagnitude = static_cast<Real>(2 * M_PI / wavelength);;
-        Real Eangle;
-        Matrix ERotationMatrix;
-        for (UINT i = 0; i < numAnglesRotation; i++) {
-          Eangle = static_cast<Real>((baseRotAngle + idata.startAngle + i * idata.incrementAngle) * M_PI / 180.0);
-          computeRotationMatrix(kVec, rotationMatrixK, ERotationMatrix, Eangle);
+          const Real wavelength = static_cast<Real>(1239.84197 / energy);
+          const Real kMagnitude = static_cast<Real>(2 * M_PI / wavelength);;
+          Real Eangle;
+          Matrix ERotationMatrix;
+          angleRefinement.reset();
+          UINT numAnglesUsed = numAnglesRotation;
+          for (UINT angleID = 0; angleID < numAnglesRotation; angleID++) {
+            const UINT i = angleOrder[angleID];
+            if (not(angleRefinement.isRepresentative(i))) {
+              continue;
+            }
+            Eangle = static_cast<Real>((baseRotAngle + idata.startAngle + i * idata.incrementAngle) * M_PI / 180.0);
+            computeRotationMatrix(kVec, rotationMatrixK, ERotationMatrix, Eangle);
 #ifdef PROFILING
-          {
-            START_TIMER(TIMERS::POLARIZATION)
-          }
+            {
+              START_TIMER(TIMERS::POLARIZATION)
+            }
 #endif
-          computePolarization(d_materialConstants, d_voxelInput, vx, d_polarizationX, d_polarizationY,
-                              d_polarizationZ, static_cast<FFT::FFTWindowing >(idata.windowingType),
-                              idata.if2DComputation(), static_cast<MorphologyType>(idata.morphologyType), BlockSize,
-                              static_cast<ReferenceFrame>(idata.referenceFrame), ERotationMatrix, numVoxels,idata.NUM_MATERIAL);
+            computePolarization(d_materialConstants, d_voxelInput, vx, d_polarizationX, d_polarizationY,
+                                d_polarizationZ, static_cast<FFT::FFTWindowing >(idata.windowingType),
+                                idata.if2DComputation(), static_cast<MorphologyType>(idata.morphologyType), BlockSize,
+                                static_cast<ReferenceFrame>(idata.referenceFrame), ERotationMatrix, numVoxels,idata.NUM_MATERIAL);
 
 #ifdef DUMP_FILES
 
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationX,
-                                       d_polarizationX,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationZ,
-                                       d_polarizationZ,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationY,
-                                       d_polarizationY,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          {
-            FILE *pX = fopen("polarizeX.dmp", "wb");
-            fwrite(polarizationX, sizeof(Complex), numVoxels, pX);
-            fclose(pX);
-            FILE *pY = fopen("polarizeY.dmp", "wb");
-            fwrite(polarizationY, sizeof(Complex), numVoxels, pY);
-            fclose(pY);
-            FILE *pZ = fopen("polarizeZ.dmp", "wb");
-            fwrite(polarizationZ, sizeof(Complex), numVoxels, pZ);
-            fclose(pZ);
-            std::string dirname = "Polarize/";
-            std::string fname = dirname + "polarizationX" + std::to_string(i);
-            VTI::writeDataScalar(polarizationX, voxel, fname.c_str(), "polarizeX");
-            fname = dirname + "polarizationY" + std::to_string(i);
-            VTI::writeDataScalar(polarizationY, voxel, fname.c_str(), "polarizeY");
-            fname = dirname + "polarizationZ" + std::to_string(i);
-            VTI::writeDataScalar(polarizationZ, voxel, fname.c_str(), "polarizeZ");
-          }
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationX,
+                                         d_polarizationX,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationZ,
+                                         d_polarizationZ,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationY,
+                                         d_polarizationY,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            {
+              FILE *pX = fopen("polarizeX.dmp", "wb");
+              fwrite(polarizationX, sizeof(Complex), numVoxels, pX);
+              fclose(pX);
+              FILE *pY = fopen("polarizeY.dmp", "wb");
+              fwrite(polarizationY, sizeof(Complex), numVoxels, pY);
+              fclose(pY);
+              FILE *pZ = fopen("polarizeZ.dmp", "wb");
+              fwrite(polarizationZ, sizeof(Complex), numVoxels, pZ);
+              fclose(pZ);
+              std::string dirname = "Polarize/";
+              std::string fname = dirname + "polarizationX" + std::to_string(i);
+              VTI::writeDataScalar(polarizationX, voxel, fname.c_str(), "polarizeX");
+              fname = dirname + "polarizationY" + std::to_string(i);
+              VTI::writeDataScalar(polarizationY, voxel, fname.c_str(), "polarizeY");
+              fname = dirname + "polarizationZ" + std::to_string(i);
+              VTI::writeDataScalar(polarizationZ, voxel, fname.c_str(), "polarizeZ");
+            }
 #endif
 
 #ifdef PROFILING
-          {
-            END_TIMER(TIMERS::POLARIZATION)
-            START_TIMER(TIMERS::FFT)
-          }
+            {
+              END_TIMER(TIMERS::POLARIZATION)
+              START_TIMER(TIMERS::FFT)
+            }
 #endif
-          /** FFT Computation **/
-          result[0] = performFFT(d_polarizationX, plan[0]);
-          result[1] = performFFT(d_polarizationY, plan[1]);
-          result[2] = performFFT(d_polarizationZ, plan[2]);
-
-          // Replace DC component with average of surrounding voxels
-          replaceDCComponent(d_polarizationX, vx, streams[0]);
-          replaceDCComponent(d_polarizationY, vx, streams[1]);
-          replaceDCComponent(d_polarizationZ, vx, streams[2]);
-          cudaDeviceSynchronize();
-          gpuErrchk(cudaPeekAtLastError());
+            /** FFT Computation **/
+            result[0] = performFFT(d_polarizationX, plan[0]);
+            result[1] = performFFT(d_polarizationY, plan[1]);
+            result[2] = performFFT(d_polarizationZ, plan[2]);
+
+            // Replace DC component with average of surrounding voxels
+            replaceDCComponent(d_polarizationX, vx, streams[0]);
+            replaceDCComponent(d_polarizationY, vx, streams[1]);
+            replaceDCComponent(d_polarizationZ, vx, streams[2]);
+            endStage();
 
 #ifdef DUMP_FILES
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationX,
-                                       d_polarizationX,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationY,
-                                       d_polarizationY,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationZ,
-                                       d_polarizationZ,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          {
-            FILE *pX = fopen("fftpolarizeXbshift.dmp", "wb");
-            fwrite(polarizationX, sizeof(Complex), numVoxels, pX);
-            fclose(pX);
-            FILE *pY = fopen("fftpolarizeYbshift.dmp", "wb");
-            fwrite(polarizationY, sizeof(Complex), numVoxels, pY);
-            fclose(pY);
-            FILE *pZ = fopen("fftpolarizeZbshift.dmp", "wb");
-            fwrite(polarizationZ, sizeof(Complex), numVoxels, pZ);
-            fclose(pZ);
-            std::string dirname = "FFT/";
-            std::string fname = dirname + "polarizationXfftbshift" + std::to_string(i);
-            VTI::writeDataScalar(polarizationX, voxel, fname.c_str(), "polarizeXfft");
-            fname = dirname + "polarizationYfftbshift" + std::to_string(i);
-            VTI::writeDataScalar(polarizationY, voxel, fname.c_str(), "polarizeYfft");
-            fname = dirname + "polarizationZfftbshift" + std::to_string(i);
-            VTI::writeDataScalar(polarizationZ, voxel, fname.c_str(), "polarizeZfft");
-          }
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationX,
+                                         d_polarizationX,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationY,
+                                         d_polarizationY,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationZ,
+                                         d_polarizationZ,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            {
+              FILE *pX = fopen("fftpolarizeXbshift.dmp", "wb");
+              fwrite(polarizationX, sizeof(Complex), numVoxels, pX);
+              fclose(pX);
+              FILE *pY = fopen("fftpolarizeYbshift.dmp", "wb");
+              fwrite(polarizationY, sizeof(Complex), numVoxels, pY);
+              fclose(pY);
+              FILE *pZ = fopen("fftpolarizeZbshift.dmp", "wb");
+              fwrite(polarizationZ, sizeof(Complex), numVoxels, pZ);
+              fclose(pZ);
+              std::string dirname = "FFT/";
+              std::string fname = dirname + "polarizationXfftbshift" + std::to_string(i);
+              VTI::writeDataScalar(polarizationX, voxel, fname.c_str(), "polarizeXfft");
+              fname = dirname + "polarizationYfftbshift" + std::to_string(i);
+              VTI::writeDataScalar(polarizationY, voxel, fname.c_str(), "polarizeYfft");
+              fname = dirname + "polarizationZfftbshift" + std::to_string(i);
+              VTI::writeDataScalar(polarizationZ, voxel, fname.c_str(), "polarizeZfft");
+            }
 #endif
-          performFFTShift(d_polarizationX, BlockSize, vx,streams[0]);
-          performFFTShift(d_polarizationY, BlockSize, vx,streams[1]);
-          performFFTShift(d_polarizationZ, BlockSize, vx,streams[2]);
-          cudaDeviceSynchronize();
-          gpuErrchk(cudaPeekAtLastError());
-          if ((result[0] != CUFFT_SUCCESS) or (result[1] != CUFFT_SUCCESS) or (result[2] != CUFFT_SUCCESS)) {
-            std::cout << "CUFFT failed with result " << result[0] << " " << result[1] << " " << result[2] << "\n";
-#pragma omp cancel parallel
-            exit(EXIT_FAILURE);
-          }
+            performFFTShift(d_polarizationX, BlockSize, vx,streams[0]);
+            performFFTShift(d_polarizationY, BlockSize, vx,streams[1]);
+            performFFTShift(d_polarizationZ, BlockSize, vx,streams[2]);
+            endStage();
+            if ((result[0] != CUFFT_SUCCESS) or (result[1] != CUFFT_SUCCESS) or (result[2] != CUFFT_SUCCESS)) {
+              throw std::runtime_error("CUFFT failed with result " + std::to_string(result[0]) + " "
+                                       + std::to_string(result[1]) + " " + std::to_string(result[2]));
+            }
 #ifdef DUMP_FILES
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationX,
-                                       d_polarizationX,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationY,
-                                       d_polarizationY,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationZ,
-                                       d_polarizationZ,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          {
-            FILE *pX = fopen("fftpolarizeX.dmp", "wb");
-            fwrite(polarizationX, sizeof(Complex), numVoxels, pX);
-            fclose(pX);
-            FILE *pY = fopen("fftpolarizeY.dmp", "wb");
-            fwrite(polarizationY, sizeof(Complex), numVoxels, pY);
-            fclose(pY);
-            FILE *pZ = fopen("fftpolarizeZ.dmp", "wb");
-            fwrite(polarizationZ, sizeof(Complex), numVoxels, pZ);
-            fclose(pZ);
-            std::string dirname = "FFT/";
-            std::string fname = dirname + "polarizationXfft" + std::to_string(i);
-            VTI::writeDataScalar(polarizationX, voxel, fname.c_str(), "polarizeXfft");
-            fname = dirname + "polarizationYfft" + std::to_string(i);
-            VTI::writeDataScalar(polarizationY, voxel, fname.c_str(), "polarizeYfft");
-            fname = dirname + "polarizationZfft" + std::to_string(i);
-            VTI::writeDataScalar(polarizationZ, voxel, fname.c_str(), "polarizeZfft");
-          }
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationX,
+                                         d_polarizationX,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationY,
+                                         d_polarizationY,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationZ,
+                                         d_polarizationZ,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            {
+              FILE *pX = fopen("fftpolarizeX.dmp", "wb");
+              fwrite(polarizationX, sizeof(Complex), numVoxels, pX);
+              fclose(pX);
+              FILE *pY = fopen("fftpolarizeY.dmp", "wb");
+              fwrite(polarizationY, sizeof(Complex), numVoxels, pY);
+              fclose(pY);
+              FILE *pZ = fopen("fftpolarizeZ.dmp", "wb");
+              fwrite(polarizationZ, sizeof(Complex), numVoxels, pZ);
+              fclose(pZ);
+              std::string dirname = "FFT/";
+              std::string fname = dirname + "polarizationXfft" + std::to_string(i);
+              VTI::writeDataScalar(polarizationX, voxel, fname.c_str(), "polarizeXfft");
+              fname = dirname + "polarizationYfft" + std::to_string(i);
+              VTI::writeDataScalar(polarizationY, voxel, fname.c_str(), "polarizeYfft");
+              fname = dirname + "polarizationZfft" + std::to_string(i);
+              VTI::writeDataScalar(polarizationZ, voxel, fname.c_str(), "polarizeZfft");
+            }
 #endif
 
 #ifdef PROFILING
-          {
-              END_TIMER(TIMERS::FFT)
-              START_TIMER(TIMERS::SCATTER3D)
-          }
-#endif
-          cudaZeroEntries(d_rotProjection, numVoxel2D);
-          cudaZeroEntries(d_projection, numVoxel2D);
-
-          if (idata.scatterApproach == ScatterApproach::FULL) {
-
-            performScatter3DComputation(d_polarizationX, d_polarizationY, d_polarizationZ, d_scatter3D, kMagnitude,
-                                        numVoxels, vx, idata.physSize, idata.if2DComputation(), BlockSize, kVec);
-
-#ifdef DUMP_FILES
-            CUDA_CHECK_RETURN(cudaMemcpy(scatter3D, d_scatter3D, sizeof(Real) * numVoxels, cudaMemcpyDeviceToHost));
-            gpuErrchk(cudaPeekAtLastError())
             {
-              FILE *scatter = fopen("scatter_3D.dmp", "wb");
-              fwrite(scatter3D, sizeof(Real), numVoxels, scatter);
-              fclose(scatter);
-              std::string dirname = "Scatter/";
-              std::string fname = dirname + "scatter" + std::to_string(i);
-              VTI::writeDataScalar(scatter3D, voxel, fname.c_str(), "scatter3D");
+                END_TIMER(TIMERS::FFT)
+                START_TIMER(TIMERS::SCATTER3D)
             }
-
 #endif
-
-
-#ifdef EOC
-            CUDA_CHECK_RETURN(cudaMemcpy(scatter3D, d_scatter3D, sizeof(Real) * numVoxels, cudaMemcpyDeviceToHost));
-            gpuErrchk(cudaPeekAtLastError());
-
+            projectEwald(idata, voxel, buffers, geometry, kMagnitude, kVec, BlockSize, i);
 #ifdef PROFILING
             {
-
+              END_TIMER(TIMERS::SCATTER3D)
+              START_TIMER(TIMERS::IMAGE_ROTATION)
             }
 #endif
-            computeEwaldProjectionCPU(projectionCPU, scatter3D, vx, eleField.k.x);
-#else
-            peformEwaldProjectionGPU(d_projection, d_scatter3D, kMagnitude, vx, idata.physSize,
-                                     static_cast<Interpolation::EwaldsInterpolation>(idata.ewaldsInterpolation),
-                                     idata.if2DComputation(), BlockSize2, kVec);
-#ifdef DUMP_FILES
-            hostDeviceExchange(projectionGPUAveraged, d_projection, voxel[0] * voxel[1], cudaMemcpyDeviceToHost);
-            std::string dirname = "Ewald/";
-            std::string fname = dirname + "ewlad" + std::to_string(i);
-            VTI::writeDataScalar2DFP(projectionGPUAveraged, voxel, fname.c_str(), "ewald");
-            FILE *projection = fopen("projection_scatterFull.dmp", "wb");
-            fwrite(projectionGPUAveraged, sizeof(Real), numVoxels, projection);
-            fclose(projection);
+#ifndef EOC
+            const bool isConverged = accumulateRotations(idata, voxel, buffers, geometry, angleRefinement, i, angleID,
+                                                         baseRotAngle, handle);
+#ifdef PROFILING
+            {
+              END_TIMER(TIMERS::IMAGE_ROTATION)
+            }
 #endif
-          } else {
-            peformEwaldProjectionGPU(d_projection, d_polarizationX, d_polarizationY, d_polarizationZ,kMagnitude,
-                                      vx,idata.physSize,
-                                     static_cast<Interpolation::EwaldsInterpolation>(idata.ewaldsInterpolation),
-                                     idata.if2DComputation(), BlockSize2, kVec);
-#ifdef DUMP_FILES
-
-            hostDeviceExchange(projectionGPUAveraged, d_projection, voxel[0] * voxel[1], cudaMemcpyDeviceToHost);
-            std::string dirname = "Ewald/";
-            std::string fname = dirname + "ewlad" + std::to_string(i);
-            VTI::writeDataScalar2DFP(projectionGPUAveraged, voxel, fname.c_str(), "ewald");
-            FILE *projection = fopen("projection_scatterPartial.dmp", "wb");
-            fwrite(projectionGPUAveraged, sizeof(Real), numVoxels, projection);
-            fclose(projection);
+            if (isConverged) {
+              numAnglesUsed = angleID + 1;
+              break;
+            }
 #endif
           }
 
-
-          Real _factor;
-          _factor = NAN;
-
-          stat = cublasScale(handle, numVoxel2D, &_factor, d_rotProjection, 1);
-
-
-          if (stat != CUBLAS_STATUS_SUCCESS) {
-            std::cout << "CUBLAS during scaling failed  with status " << stat << "\n";
-            exit(EXIT_FAILURE);
-          }
-
-
 #ifdef PROFILING
           {
-            END_TIMER(TIMERS::SCATTER3D)
             START_TIMER(TIMERS::IMAGE_ROTATION)
           }
 #endif
-          const double alpha = cos(Eangle);
-          const double beta = sin(Eangle);
-
-          /**https://docs.opencv.org/2.4/modules/imgproc/doc/geometric_transformations.html?highlight=warpaffine**/
-          const double coeffs[2][3]{
-            alpha, beta, static_cast<Real>(((1 - alpha) * voxel[0] / 2 - beta * voxel[1] / 2.)),
-            -beta, alpha, static_cast<Real>(beta * voxel[0] / 2. + (1 - alpha) * voxel[1] / 2.)
-          };
-
-
-          NppStatus status = warpAffine(d_projection,
-                                        sizeImage,
-                                        voxel[1] * sizeof(Real),
-                                        rect,
-                                        d_rotProjection,
-                                        voxel[1] * sizeof(Real),
-                                        rect,
-                                        coeffs,
-                                        NPPI_INTER_LINEAR);
-
-          if (status < 0) {
-            std::cout << "Image rotation failed with error = " << status << "\n";
-            exit(-1);
-          }
-          if (status != NPP_SUCCESS) {
-            std::cout << YLW << "[WARNING] Image rotation warning = " << status << NRM << "\n";
-          }
-
-          if (idata.rotMask) {
-            computeRotationMask<<< BlockSize2, NUM_THREADS >>>(d_rotProjection, d_mask, vx);
-            cudaDeviceSynchronize();
-          }
-
-          const Real factor = static_cast<Real>(1.0);
-          stat = cublasAXPY(handle, numVoxel2D, &factor, d_rotProjection, 1, d_projectionAverage, 1);
-          if (stat != CUBLAS_STATUS_SUCCESS) {
-            std::cout << "CUBLAS during sum failed  with status " << stat << "\n";
-            exit(EXIT_FAILURE);
-          }
-
+          finishPattern(idata, voxel, buffers, geometry, numAnglesUsed, handle);
 #ifdef PROFILING
           {
             END_TIMER(TIMERS::IMAGE_ROTATION)
+            START_TIMER(TIMERS::MEMCOPY_GPU_CPU)
           }
 #endif
-#endif
-        }
-
-        if (idata.rotMask) {
-          averageRotation<<<BlockSize2, NUM_THREADS>>>(d_projectionAverage, d_mask, vx);
-          cudaDeviceSynchronize();
-          gpuErrchk(cudaPeekAtLastError());
-        } else {
-          /// The averaging out for all angles
-          const Real alphaFac = static_cast<Real>(1.0 / numAnglesRotation);
-          stat = cublasScale(handle, voxel[0] * voxel[1], &alphaFac, d_projectionAverage, 1);
-          if (stat != CUBLAS_STATUS_SUCCESS) {
-            std::cout << "CUBLAS during averaging failed  with status " << stat << "\n";
-            exit(EXIT_FAILURE);
-          }
-        }
-
+          outputPattern(idata, voxel, buffers.d_projectionAverage, frameStager.get(), projectionGPUAveraged, j, kstart,
+                        numAnglesUsed);
 #ifdef PROFILING
-        {
-          START_TIMER(TIMERS::IMAGE_ROTATION)
-        }
+          {
+            END_TIMER(TIMERS::MEMCOPY_GPU_CPU)
+          }
 #endif
-        //// Rotate Image
-        hostDeviceExchange(d_projection, d_projectionAverage, numVoxel2D, cudaMemcpyDeviceToDevice);
-        const double srcPoints[3][2]{{voxel[0] / 2.,  voxel[1] / 2.},
-                                     {voxel[0] * 0.5, voxel[1] * 1.0},
-                                     {voxel[0] * 1.0, voxel[1] * 0.5}};
-        Real3 _dstPts[3], _srcPts;
-        double center[2]{voxel[0] / 2., voxel[1] / 2.};
-        for (int i = 0; i < 3; i++) {
-          _srcPts.x = srcPoints[i][0] - center[0];
-          _srcPts.y = srcPoints[i][1] - center[1];
-          _srcPts.z = 0;
-          const Matrix & detectorMatrix = rotationMatrix.getDetectorRotationMatrix();
-          Matrix rotMat;
-          rotMat.performMatrixMultiplication<false,false>(detectorMatrix,rotationMatrixK);
-          doMatVec<false>(rotMat, _srcPts, _dstPts[i]);
-          _dstPts[i].x = _dstPts[i].x + center[0];
-          _dstPts[i].y = _dstPts[i].y + center[1];
-          _dstPts[i].z = 0;
-        }
-
-        const double destPoints[3][2]{{_dstPts[0].x, _dstPts[0].y},
-                                      {_dstPts[1].x, _dstPts[1].y},
-                                      {_dstPts[2].x, _dstPts[2].y}};
-        double coeffs[2][3];
-        computeWarpAffineMatrix(srcPoints, destPoints, coeffs);
-        Real _factor = idata.rotMask ? 0 : NAN;
-        stat = cublasScale(handle, numVoxel2D, &_factor, d_projectionAverage, 1);
-        NppStatus status = warpAffine(d_projection,
-                                      sizeImage,
-                                      voxel[1] * sizeof(Real),
-                                      rect,
-                                      d_projectionAverage,
-                                      voxel[1] * sizeof(Real),
-                                      rect,
-                                      coeffs,
-                                      NPPI_INTER_LINEAR);
-
-        if (status < 0) {
-          std::cout << "Image rotation failed with error = " << status << "\n";
-          exit(EXIT_FAILURE);
-        }
-        if (status != NPP_SUCCESS) {
-          std::cout << YLW << "[WARNING] Image rotation warning = " << status << NRM << "\n";
         }
 #ifdef PROFILING
         {
-          END_TIMER(TIMERS::IMAGE_ROTATION)
-          START_TIMER(TIMERS::MEMCOPY_GPU_CPU)
+        END_TIMER(TIMERS::ENERGY)
         }
 #endif
+      }
+    } catch (const std::exception & error) {
+      std::cout << RED << "[ERROR] " << error.what() << NRM << "\n";
+#pragma omp atomic write
+      isFailed = true;
+    } catch (...) {
+      std::cout << RED << "[ERROR] The computation failed" << NRM << "\n";
+#pragma omp atomic write
+      isFailed = true;
+    }
 
-        const std::size_t disp  = static_cast<std::size_t>(numVoxel2D) * static_cast<std::size_t>(j*idata.kVectors.size()) + static_cast<std::size_t>(kstart*numVoxel2D);
-        hostDeviceExchange(&projectionGPUAveraged[disp],
-                           d_projectionAverage, numVoxel2D,
-                           cudaMemcpyDeviceToHost);
-#ifdef PROFILING
-        {
-          END_TIMER(TIMERS::MEMCOPY_GPU_CPU)
-        }
-#endif
-      }
-#ifdef PROFILING
-      {
-      END_TIMER(TIMERS::ENERGY)
-      }
-#endif
-    }
-
-    /** Freeing bunch of memories not required now **/
-    freeCudaMemory(d_polarizationX);
-    freeCudaMemory(d_polarizationY);
-    freeCudaMemory(d_polarizationZ);
-    freeCudaMemory(d_materialConstants);
-    if (idata.scatterApproach == ScatterApproach::FULL) {
-      freeCudaMemory(d_scatter3D);
+    /** Device buffers, plans, streams and the staging buffers are owned by the workspace **/
+    if (not(finishFrames(frameStager))) {
+#pragma omp atomic write
+      isFailed = true;
     }
-    freeCudaMemory(d_voxelInput);
-
-#ifndef EOC
-    freeCudaMemory(d_projection);
-    freeCudaMemory(d_projectionAverage);
-    freeCudaMemory(d_rotProjection);
-    if (idata.rotMask) {
-      freeCudaMemory(d_mask);
-    }
-#endif
 #ifdef DUMP_FILES
     delete[] polarizationX;
     delete[] polarizationY;
     delete[] polarizationZ;
 
-#endif
-#if (defined(DUMP_FILES) or defined(EOC))
-    delete[] scatter3D;
-#endif
-
-    for(int i = 0; i < NUM_STREAMS; i++) {
-      cufftDestroy(plan[i]);
-      gpuErrchk(cudaStreamDestroy(streams[i]))
-    }
-    cublasDestroy(handle);
-
-#ifdef EOC
-    delete[] projectionCPU;
 #endif
   }
 
@@ -964,19 +1204,37 @@ int cudaMain(const UINT *voxel,
 #endif
 
 
-  return (EXIT_SUCCESS);
+  return (isFailed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
+/**
+ * @brief Adds the change of a few voxels to the transformed Nt of an energy, which stays on the device. The DC
+ * component is replaced again afterwards, as in the full transform. The buffers are taken from the stage arena.
+ * @param [in] idata inputData object
+ * @param [in] d_materialConstants optical constants of the energy
+ * @param [in] update changed voxels
+ * @param [in] vx number of voxels in each direction
+ * @param [in] stageArena arena the Nt of the changed voxels is computed in
+ * @param [in,out] d_fourierNt transformed Nt of the energy in the layout of the Fourier cache
+ */
+static void updateFourierNtOnDevice(const InputData & idata, const Material * d_materialConstants,
+                                    const FourierNtUpdate & update, const uint3 & vx, Arena & stageArena,
+                                    Complex * d_fourierNt);
+
 int cudaMainStreams(const UINT *voxel,
                     const InputData &idata,
                     const std::vector<Material > &materialInput,
                     Real *projectionGPUAveraged,
                     RotationMatrix & rotationMatrix,
-                    const Voxel *voxelInput){
+                    const Voxel *voxelInput,
+                    SimulationContext * context,
+                    FrameSink * sink,
+                    FourierCache * fourierCache,
+                    const FourierNtUpdate * fourierUpdate){
 
   if ((static_cast<uint64_t>(voxel[0]) * voxel[1] * voxel[2]) > std::numeric_limits<BigUINT>::max()) {
     std::cout << "Exiting. Compile by Enabling 64 Bit indices\n";
-    exit(EXIT_FAILURE);
+    return (EXIT_FAILURE);
   }
 
   const BigUINT numVoxels = voxel[0] * voxel[1] * voxel[2]; /// Voxel size
@@ -1046,6 +1304,13 @@ int cudaMainStreams(const UINT *voxel,
   VTI::writeVoxelDataScalar(voxelInput, voxel, "Phi", varnameScalar,NUM_MATERIAL);
 #endif
 
+  SimulationContext localContext;
+  SimulationContext & simulationContext = (context == nullptr) ? localContext : *context;
+  simulationContext.reserve(num_gpu);
+  rotationMatrix.initComputation();
+
+  /// Set by the GPU threads if the computation or the sink failed
+  bool isFailed = false;
   omp_set_num_threads(num_gpu);
 #pragma omp parallel
   {
@@ -1061,29 +1326,24 @@ int cudaMainStreams(const UINT *voxel,
     }
     else{
       std::cout << "Warmup failed on GPU " << dprop.name << "\n";
-#pragma omp cancel parallel
-      exit (EXIT_FAILURE);
+#pragma omp atomic write
+      isFailed = true;
     }
 #endif
-    static constexpr int NUM_FFT_STREAMS = 3;
-    const int NUM_STREAMS = std::max(idata.numMaxStreams,NUM_FFT_STREAMS); // We need minimum of 3 streams for FFT
-    std::vector<cudaStream_t> streams(NUM_STREAMS);
-    cufftResult result[NUM_FFT_STREAMS];
-    cufftHandle plan[NUM_FFT_STREAMS];
-    for (int i = 0; i < NUM_STREAMS; i++) {
-      gpuErrchk(cudaStreamCreate(&streams[i]));
-    }
-    for(int i = 0; i < NUM_FFT_STREAMS; i++){
-      cufftPlan3d(&plan[i], voxel[2], voxel[1], voxel[0], fftType);
-      cufftSetStream(plan[i],streams[i]);
+    const UINT ompThreadID = omp_get_thread_num();
+#ifdef PROFILING
+    {
+      START_TIMER(TIMERS::MALLOC);
     }
-    cublasHandle_t handle;
-    cublasStatus_t stat;
-    cublasCreate(&handle);
-
-    NppiSize sizeImage;
-    sizeImage.height = voxel[0];
-    sizeImage.width = voxel[1];
+#endif
+    /// Streams, plans and Nt are reused from previous launches if the configuration matches
+    DeviceWorkspace & workspace = simulationContext.acquire(omp_get_thread_num(), idata);
+    static constexpr int NUM_FFT_STREAMS = DeviceWorkspace::NUM_FFT_STREAMS;
+    const int NUM_STREAMS = workspace.numStreams; // We need minimum of 3 streams for FFT
+    const std::vector<cudaStream_t> & streams = workspace.streams;
+    cufftResult result[NUM_FFT_STREAMS];
+    cufftHandle * plan = workspace.plan;
+    cublasHandle_t & handle = workspace.handle;
 
     NppiRect rect;
     rect.height = voxel[0];
@@ -1092,7 +1352,6 @@ int cudaMainStreams(const UINT *voxel,
     rect.y = 0;
 
 
-    const UINT ompThreadID = omp_get_thread_num();
     const UINT numEnergyPerGPU = static_cast<UINT>(std::ceil(numEnergyLevel * 1.0 / num_gpu));
     const UINT numStart = (numEnergyPerGPU * ompThreadID);
     UINT numEnd = (numEnergyPerGPU * (ompThreadID + 1));
@@ -1108,32 +1367,15 @@ int cudaMainStreams(const UINT *voxel,
     }
 
 
-#ifdef PROFILING
-    {
-      START_TIMER(TIMERS::MALLOC);
-    }
-#endif
 #ifdef DUMP_FILES
     Complex *polarizationZ = new Complex[numVoxels];
     Complex *polarizationX = new Complex[numVoxels];
     Complex *polarizationY = new Complex[numVoxels];
-#endif
-#if defined(EOC) or defined(DUMP_FILES)
-    Real *scatter3D = new Real[numVoxels];
-#endif
-
-#ifdef EOC
-    Real *projectionCPU = new Real[BATCH * voxel[0] * voxel[1]];
-#else
-
 #endif
 
     Voxel *d_voxelInput;
-    Complex * d_Nt;
-    Material * d_materialConstants;
-
-    mallocGPU(d_Nt, numVoxels*6);
-    mallocGPU(d_materialConstants, NUM_MATERIAL);
+    Complex * d_Nt = workspace.d_Nt;
+    Material * d_materialConstants = workspace.d_materialConstants;
     const UINT perBatchVoxels = ceil(numVoxels/(NUM_STREAMS*1.0));
     std::vector<UINT> batchID(NUM_STREAMS+1);
     batchID[0] = 0;
@@ -1141,6 +1383,19 @@ int cudaMainStreams(const UINT *voxel,
       batchID[i] = (i)*perBatchVoxels;
     }
     batchID[NUM_STREAMS] = numVoxels;
+    /// The stage buffers are handed out by the arena of the workspace, which is only allocated if it is too small
+    Arena & stageArena = workspace.stageArena;
+    stageArena.reserve(DeviceWorkspace::getStageBytes(idata, idata.scatterApproach));
+    Arena & pinnedArena = workspace.pinnedArena;
+    pinnedArena.reserve(((sink != nullptr) ? FrameStager::getBytes(getOutputROI(idata)) : 0)
+                        + ((fourierCache != nullptr) ? Arena::getBytes<Complex>(numVoxels * 6) : 0));
+    /// The buffers are returned to the workspace on every exit path, so that the next launch can reuse it
+    const ArenaScope stageScope(stageArena), pinnedScope(pinnedArena);
+    /// Staging buffer for the Fourier transformed Nt exchanged with the cache
+    Complex *cacheNt = nullptr;
+    if (fourierCache != nullptr) {
+      cacheNt = pinnedArena.allocate<Complex>(numVoxels * 6);
+    }
 
 #ifdef PROFILING
     {
@@ -1150,415 +1405,310 @@ int cudaMainStreams(const UINT *voxel,
 
 
 
-    // TODO: Make this async and overlap with computation
-    rotationMatrix.initComputation();
     const auto & baseConfigurations = rotationMatrix.getBaseConfigurations();
 
     const auto & kVectors = idata.kVectors;
 
 
     UINT BlockSize  = static_cast<UINT>(ceil(numVoxels * 1.0 / NUM_THREADS));
-    UINT BlockSize2 = static_cast<UINT>(ceil(numVoxel2D * 1.0 / NUM_THREADS));
-
-    for (UINT j = numStart; j < numEnd; j++) {
-      hostDeviceExchange(d_materialConstants,&materialInput[j*NUM_MATERIAL],NUM_MATERIAL,cudaMemcpyHostToDevice);
-      const Real &energy = (idata.energies[j]);
-      std::cout << " [STAT] Energy = " << energy << " starting " << "\n";
-#ifdef PROFILING
-      {
-        START_TIMER(TIMERS::ENERGY)
-        START_TIMER(TIMERS::MALLOC)
-      }
-#endif
-      cudaZeroEntries(d_Nt,numVoxels*6);
-      mallocGPU(d_voxelInput, numVoxels);
-#ifdef PROFILING
-      {
-        END_TIMER(TIMERS::MALLOC)
-        START_TIMER(TIMERS::NtComputation)
-      }
-#endif
+    /// Region written to the output: the full frame without q region of interest
+    const FrameROI outputROI = getOutputROI(idata);
+    /// Order of the E angles, refined level by level with EAngleAdaptive
+    AngleRefinement angleRefinement(idata, numAnglesRotation);
+    const std::vector<UINT> & angleOrder = angleRefinement.getOrder();
+    /// Frames are copied and handed to the sink while the device computes the next (energy, k)
+    std::unique_ptr<FrameStager> frameStager;
+    if (sink != nullptr) {
+      frameStager.reset(new FrameStager(idata, outputROI, sink, omp_get_thread_num(), pinnedArena));
+    }
 
-      for(int streamID = 0; streamID < NUM_STREAMS; streamID++){
-        for(int numMat = 0; numMat < NUM_MATERIAL; numMat++){
-          cudaMemcpyAsync(&d_voxelInput[batchID[streamID]], &voxelInput[numMat*numVoxels + batchID[streamID]],
-                     sizeof(Voxel)*(batchID[streamID+1] -  batchID[streamID]), cudaMemcpyHostToDevice,streams[streamID]);
-          computeNt(d_materialConstants,d_voxelInput,d_Nt,(MorphologyType)idata.morphologyType,BlockSize,numVoxels,batchID[streamID],batchID[streamID+1],numMat,NUM_STREAMS,streams[streamID],NUM_MATERIAL);
+    try {
+      for (UINT j = numStart; j < numEnd; j++) {
+        if ((sink != nullptr) and sink->isComplete(j)) {
+          continue;
         }
-      }
-      cudaDeviceSynchronize();
-      gpuErrchk(cudaPeekAtLastError());
-#ifdef PROFILING
-      {
-        END_TIMER(TIMERS::NtComputation)
-        START_TIMER(TIMERS::FREE_MEMORY)
-      }
-#endif
-
-
-      freeCudaMemory(d_voxelInput);
+        hostDeviceExchange(d_materialConstants,&materialInput[j*NUM_MATERIAL],NUM_MATERIAL,cudaMemcpyHostToDevice);
+        const Real &energy = (idata.energies[j]);
+        std::cout << " [STAT] Energy = " << energy << " starting " << "\n";
 #ifdef PROFILING
-      {
-        END_TIMER(TIMERS::FREE_MEMORY)
-        START_TIMER(TIMERS::MALLOC)
-      }
-#endif
-
-      Complex *d_polarizationZ, *d_polarizationX, *d_polarizationY;
-      Real *d_scatter3D;
-      UINT *d_mask;
-      mallocGPU(d_polarizationX, numVoxels);
-      mallocGPU(d_polarizationY, numVoxels);
-      mallocGPU(d_polarizationZ, numVoxels);
-
-      if (idata.scatterApproach == ScatterApproach::FULL) {
-        mallocGPU(d_scatter3D, numVoxels);
-      }
-#ifndef EOC
-      Real *d_projection, *d_rotProjection, *d_projectionAverage;
-      mallocGPU(d_projection, numVoxel2D);
-      mallocGPU(d_rotProjection, numVoxel2D);
-      if (idata.rotMask) {
-        mallocGPU(d_mask, numVoxel2D);
-      }
-      mallocGPU(d_projectionAverage, numVoxel2D);
+        {
+          START_TIMER(TIMERS::ENERGY)
+          START_TIMER(TIMERS::MALLOC)
+        }
 #endif
+        /// Nt read from the Fourier cache is already transformed
+        const bool isCached = (fourierCache != nullptr) and fourierCache->load(j, cacheNt);
+        if (isCached) {
+          std::cout << " [STAT] Energy = " << energy << " reprojecting cached Nt\n";
+          hostDeviceExchange(d_Nt, cacheNt, numVoxels * 6, cudaMemcpyHostToDevice);
+          /// The change of the edited voxels is added on the device, and the cache keeps the updated Nt
+          if ((fourierUpdate != nullptr) and not(fourierUpdate->changedVoxels.empty())) {
+            updateFourierNtOnDevice(idata, d_materialConstants, *fourierUpdate, vx, stageArena, d_Nt);
+            hostDeviceExchange(cacheNt, d_Nt, numVoxels * 6, cudaMemcpyDeviceToHost);
+            fourierCache->store(j, cacheNt);
+          }
+        } else {
+          cudaZeroEntries(d_Nt,numVoxels*6);
+          d_voxelInput = stageArena.allocate<Voxel>(numVoxels);
 #ifdef PROFILING
-      {
-        END_TIMER(TIMERS::MALLOC)
-      }
+          {
+            END_TIMER(TIMERS::MALLOC)
+            START_TIMER(TIMERS::NtComputation)
+          }
 #endif
-      for (UINT kID = 0; kID < kVectors.size(); kID++) {
-        const auto & baseConfig = baseConfigurations[kID];
-        const Real baseRotAngle = baseConfig.baseRotAngle;
-        const Matrix & rotationMatrixK = baseConfig.matrix;
-        const Real3 &kVec = idata.kVectors[kID];
-        cudaZeroEntries(d_projectionAverage, numVoxel2D);
-        if (idata.rotMask) {
-          cudaZeroEntries(d_mask, numVoxel2D);
-        }
 
-
-        const Real wavelength = static_cast<Real>(1239.84197 / energy);
-        const Real kMagnitude = static_cast<Real>(2 * M_PI / wavelength);
-        Real Eangle;
-        Matrix ERotationMatrix;
-
-        for (UINT i = 0; i < numAnglesRotation; i++) {
-          Eangle = static_cast<Real>((baseRotAngle + idata.startAngle + i * idata.incrementAngle) * M_PI / 180.0);
-          computeRotationMatrix(kVec, rotationMatrixK, ERotationMatrix, Eangle);
+          for(int streamID = 0; streamID < NUM_STREAMS; streamID++){
+            for(int numMat = 0; numMat < NUM_MATERIAL; numMat++){
+              cudaMemcpyAsync(&d_voxelInput[batchID[streamID]], &voxelInput[numMat*numVoxels + batchID[streamID]],
+                         sizeof(Voxel)*(batchID[streamID+1] -  batchID[streamID]), cudaMemcpyHostToDevice,streams[streamID]);
+              computeNt(d_materialConstants,d_voxelInput,d_Nt,(MorphologyType)idata.morphologyType,BlockSize,numVoxels,batchID[streamID],batchID[streamID+1],numMat,NUM_STREAMS,streams[streamID],NUM_MATERIAL);
+            }
+          }
+          cudaDeviceSynchronize();
+          gpuErrchk(cudaPeekAtLastError());
 #ifdef PROFILING
           {
-            START_TIMER(TIMERS::POLARIZATION)
+            END_TIMER(TIMERS::NtComputation)
+            START_TIMER(TIMERS::FREE_MEMORY)
           }
 #endif
-          computePolarization(d_Nt,d_polarizationX,d_polarizationY,d_polarizationZ,BlockSize,(ReferenceFrame)idata.referenceFrame,ERotationMatrix,numVoxels);
 
-#ifdef DUMP_FILES
 
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationX,
-                                       d_polarizationX,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationZ,
-                                       d_polarizationZ,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
-          CUDA_CHECK_RETURN(cudaMemcpy(polarizationY,
-                                       d_polarizationY,
-                                       sizeof(Complex) * numVoxels,
-                                       cudaMemcpyDeviceToHost));
-          gpuErrchk(cudaPeekAtLastError());
+          /// The polarization stage reuses the memory of the morphology
+          stageArena.reset();
+#ifdef PROFILING
           {
-            FILE *pX = fopen("polarizeX.dmp", "wb");
-            fwrite(polarizationX, sizeof(Complex), numVoxels, pX);
-            fclose(pX);
-            FILE *pY = fopen("polarizeY.dmp", "wb");
-            fwrite(polarizationY, sizeof(Complex), numVoxels, pY);
-            fclose(pY);
-            FILE *pZ = fopen("polarizeZ.dmp", "wb");
-            fwrite(polarizationZ, sizeof(Complex), numVoxels, pZ);
-            fclose(pZ);
-            std::string dirname = "Polarize/";
-            std::string fname = dirname + "polarizationX" + std::to_string(i);
-            VTI::writeDataScalar(polarizationX, voxel, fname.c_str(), "polarizeX");
-            fname = dirname + "polarizationY" + std::to_string(i);
-            VTI::writeDataScalar(polarizationY, voxel, fname.c_str(), "polarizeY");
-            fname = dirname + "polarizationZ" + std::to_string(i);
-            VTI::writeDataScalar(polarizationZ, voxel, fname.c_str(), "polarizeZ");
+            END_TIMER(TIMERS::FREE_MEMORY)
+            START_TIMER(TIMERS::MALLOC)
           }
 #endif
+        }
+
+        Complex *d_polarizationZ, *d_polarizationX, *d_polarizationY;
+        Real *d_scatter3D = nullptr;
+        UINT *d_mask = nullptr;
+        d_polarizationX = stageArena.allocate<Complex>(numVoxels);
+        d_polarizationY = stageArena.allocate<Complex>(numVoxels);
+        d_polarizationZ = stageArena.allocate<Complex>(numVoxels);
 
+        if (idata.scatterApproach == ScatterApproach::FULL) {
+          d_scatter3D = stageArena.allocate<Real>(numVoxels);
+        }
+        /// With the Fourier cache, Nt is transformed once per energy instead of the polarization for every angle
+        if ((fourierCache != nullptr) and not(isCached)) {
 #ifdef PROFILING
           {
-            END_TIMER(TIMERS::POLARIZATION)
+            END_TIMER(TIMERS::MALLOC)
             START_TIMER(TIMERS::FFT)
           }
 #endif
-          /** FFT Computation **/
-          result[0] = performFFT(d_polarizationX, plan[0]);
-          result[1] = performFFT(d_polarizationY, plan[1]);
-          result[2] = performFFT(d_polarizationZ, plan[2]);
-
-          // Replace DC component with average of surrounding voxels
-          replaceDCComponent(d_polarizationX, vx, streams[0]);
-          replaceDCComponent(d_polarizationY, vx, streams[1]);
-          replaceDCComponent(d_polarizationZ, vx, streams[2]);
-          cudaDeviceSynchronize();
-          gpuErrchk(cudaPeekAtLastError());
-
-          performFFTShift(d_polarizationX, BlockSize, vx,streams[0]);
-          performFFTShift(d_polarizationY, BlockSize, vx,streams[1]);
-          performFFTShift(d_polarizationZ, BlockSize, vx,streams[2]);
-          cudaDeviceSynchronize();
-
-          if ((result[0] != CUFFT_SUCCESS) or (result[1] != CUFFT_SUCCESS) or (result[2] != CUFFT_SUCCESS)) {
-            std::cout << "CUFFT failed with result " << result[0] << " " << result[1] << " " << result[2] << "\n";
-#pragma omp cancel parallel
-            exit(EXIT_FAILURE);
+          Complex * const d_scratch[3]{d_polarizationX, d_polarizationY, d_polarizationZ};
+          if (transformNt(d_Nt, d_scratch, plan, streams, vx, BlockSize, numVoxels) != EXIT_SUCCESS) {
+            throw std::runtime_error("The FFT of Nt failed");
           }
-
+          hostDeviceExchange(cacheNt, d_Nt, numVoxels * 6, cudaMemcpyDeviceToHost);
+          fourierCache->store(j, cacheNt);
 #ifdef PROFILING
           {
-              END_TIMER(TIMERS::FFT)
-              START_TIMER(TIMERS::SCATTER3D)
+            END_TIMER(TIMERS::FFT)
+            START_TIMER(TIMERS::MALLOC)
           }
 #endif
-          cudaZeroEntries(d_rotProjection, numVoxel2D);
-          cudaZeroEntries(d_projection, numVoxel2D);
+        }
+#ifndef EOC
+        Real *d_projection, *d_rotProjection, *d_projectionAverage;
+        d_projection = stageArena.allocate<Real>(numVoxel2D);
+        d_rotProjection = stageArena.allocate<Real>(numVoxel2D);
+        if (idata.rotMask) {
+          d_mask = stageArena.allocate<UINT>(numVoxel2D);
+        }
+        d_projectionAverage = stageArena.allocate<Real>(numVoxel2D);
+#endif
+        const ProjectionBuffers buffers{d_polarizationX, d_polarizationY, d_polarizationZ, d_scatter3D, d_projection,
+                                        d_rotProjection, d_projectionAverage, d_mask};
+#ifdef PROFILING
+        {
+          END_TIMER(TIMERS::MALLOC)
+        }
+#endif
+        for (UINT kID = 0; kID < kVectors.size(); kID++) {
+          const auto & baseConfig = baseConfigurations[kID];
+          const Real baseRotAngle = baseConfig.baseRotAngle;
+          const Matrix & rotationMatrixK = baseConfig.matrix;
+          const Real3 &kVec = idata.kVectors[kID];
+
+          /// Regions needed before the detector rotation and before the E rotation (distance preserving)
+          const DetectorGeometry geometry = getDetectorGeometry(idata, voxel, outputROI,
+                                                                rotationMatrix.getDetectorRotationMatrix(),
+                                                                rotationMatrixK);
+          cudaZeroEntries(d_projectionAverage, numVoxel2D);
+          if (idata.rotMask) {
+            cudaZeroEntries(d_mask, numVoxel2D);
+          }
 
-          if (idata.scatterApproach == ScatterApproach::FULL) {
 
-            performScatter3DComputation(d_polarizationX, d_polarizationY, d_polarizationZ, d_scatter3D,kMagnitude,
-                                        numVoxels, vx, idata.physSize, idata.if2DComputation(), BlockSize, kVec);
+          const Real wavelength = static_cast<Real>(1239.84197 / energy);
+          const Real kMagnitude = static_cast<Real>(2 * M_PI / wavelength);
+          Real Eangle;
+          Matrix ERotationMatrix;
 
-#ifdef DUMP_FILES
-            CUDA_CHECK_RETURN(cudaMemcpy(scatter3D, d_scatter3D, sizeof(Real) * numVoxels, cudaMemcpyDeviceToHost));
-            gpuErrchk(cudaPeekAtLastError())
+          angleRefinement.reset();
+          UINT numAnglesUsed = numAnglesRotation;
+          for (UINT angleID = 0; angleID < numAnglesRotation; angleID++) {
+            const UINT i = angleOrder[angleID];
+            if (not(angleRefinement.isRepresentative(i))) {
+              continue;
+            }
+            Eangle = static_cast<Real>((baseRotAngle + idata.startAngle + i * idata.incrementAngle) * M_PI / 180.0);
+            computeRotationMatrix(kVec, rotationMatrixK, ERotationMatrix, Eangle);
+#ifdef PROFILING
             {
-              FILE *scatter = fopen("scatter_3D.dmp", "wb");
-              fwrite(scatter3D, sizeof(Real), numVoxels, scatter);
-              fclose(scatter);
-              std::string dirname = "Scatter/";
-              std::string fname = dirname + "scatter" + std::to_string(i);
-              VTI::writeDataScalar(scatter3D, voxel, fname.c_str(), "scatter3D");
+              START_TIMER(TIMERS::POLARIZATION)
             }
-
 #endif
+            computePolarization(d_Nt,d_polarizationX,d_polarizationY,d_polarizationZ,BlockSize,(ReferenceFrame)idata.referenceFrame,ERotationMatrix,numVoxels);
 
+#ifdef DUMP_FILES
 
-#ifdef EOC
-            CUDA_CHECK_RETURN(cudaMemcpy(scatter3D, d_scatter3D, sizeof(Real) * numVoxels, cudaMemcpyDeviceToHost));
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationX,
+                                         d_polarizationX,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationZ,
+                                         d_polarizationZ,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
             gpuErrchk(cudaPeekAtLastError());
+            CUDA_CHECK_RETURN(cudaMemcpy(polarizationY,
+                                         d_polarizationY,
+                                         sizeof(Complex) * numVoxels,
+                                         cudaMemcpyDeviceToHost));
+            gpuErrchk(cudaPeekAtLastError());
+            {
+              FILE *pX = fopen("polarizeX.dmp", "wb");
+              fwrite(polarizationX, sizeof(Complex), numVoxels, pX);
+              fclose(pX);
+              FILE *pY = fopen("polarizeY.dmp", "wb");
+              fwrite(polarizationY, sizeof(Complex), numVoxels, pY);
+              fclose(pY);
+              FILE *pZ = fopen("polarizeZ.dmp", "wb");
+              fwrite(polarizationZ, sizeof(Complex), numVoxels, pZ);
+              fclose(pZ);
+              std::string dirname = "Polarize/";
+              std::string fname = dirname + "polarizationX" + std::to_string(i);
+              VTI::writeDataScalar(polarizationX, voxel, fname.c_str(), "polarizeX");
+              fname = dirname + "polarizationY" + std::to_string(i);
+              VTI::writeDataScalar(polarizationY, voxel, fname.c_str(), "polarizeY");
+              fname = dirname + "polarizationZ" + std::to_string(i);
+              VTI::writeDataScalar(polarizationZ, voxel, fname.c_str(), "polarizeZ");
+            }
+#endif
 
 #ifdef PROFILING
             {
+              END_TIMER(TIMERS::POLARIZATION)
+              START_TIMER(TIMERS::FFT)
+            }
+#endif
+            /** FFT Computation **/
+            if (fourierCache == nullptr) {
+              result[0] = performFFT(d_polarizationX, plan[0]);
+              result[1] = performFFT(d_polarizationY, plan[1]);
+              result[2] = performFFT(d_polarizationZ, plan[2]);
+
+              // Replace DC component with average of surrounding voxels
+              replaceDCComponent(d_polarizationX, vx, streams[0]);
+              replaceDCComponent(d_polarizationY, vx, streams[1]);
+              replaceDCComponent(d_polarizationZ, vx, streams[2]);
+              endStage();
+
+              performFFTShift(d_polarizationX, BlockSize, vx,streams[0]);
+              performFFTShift(d_polarizationY, BlockSize, vx,streams[1]);
+              performFFTShift(d_polarizationZ, BlockSize, vx,streams[2]);
+              endStage();
+
+              if ((result[0] != CUFFT_SUCCESS) or (result[1] != CUFFT_SUCCESS) or (result[2] != CUFFT_SUCCESS)) {
+                throw std::runtime_error("CUFFT failed with result " + std::to_string(result[0]) + " "
+                                         + std::to_string(result[1]) + " " + std::to_string(result[2]));
+              }
+            }
 
+#ifdef PROFILING
+            {
+                END_TIMER(TIMERS::FFT)
+                START_TIMER(TIMERS::SCATTER3D)
             }
 #endif
-            computeEwaldProjectionCPU(projectionCPU, scatter3D, vx, eleField.k.x);
-#else
-            peformEwaldProjectionGPU(d_projection, d_scatter3D, kMagnitude, vx, idata.physSize,
-                                     static_cast<Interpolation::EwaldsInterpolation>(idata.ewaldsInterpolation),
-                                     idata.if2DComputation(), BlockSize2, kVec);
-#ifdef DUMP_FILES
-            hostDeviceExchange(projectionGPUAveraged, d_projection, voxel[0] * voxel[1], cudaMemcpyDeviceToHost);
-            std::string dirname = "Ewald/";
-            std::string fname = dirname + "ewlad" + std::to_string(i);
-            VTI::writeDataScalar2DFP(projectionGPUAveraged, voxel, fname.c_str(), "ewald");
-            FILE *projection = fopen("projection_scatterFull.dmp", "wb");
-            fwrite(projectionGPUAveraged, sizeof(Real), numVoxels, projection);
-            fclose(projection);
+            projectEwald(idata, voxel, buffers, geometry, kMagnitude, kVec, BlockSize, i);
+#ifdef PROFILING
+            {
+              END_TIMER(TIMERS::SCATTER3D)
+              START_TIMER(TIMERS::IMAGE_ROTATION)
+            }
 #endif
-          } else {
-            peformEwaldProjectionGPU(d_projection, d_polarizationX, d_polarizationY, d_polarizationZ, kMagnitude, vx,
-                                     idata.physSize,
-                                     static_cast<Interpolation::EwaldsInterpolation>(idata.ewaldsInterpolation),
-                                     idata.if2DComputation(), BlockSize2, kVec);
-#ifdef DUMP_FILES
-
-            hostDeviceExchange(projectionGPUAveraged, d_projection, voxel[0] * voxel[1], cudaMemcpyDeviceToHost);
-            std::string dirname = "Ewald/";
-            std::string fname = dirname + "ewlad" + std::to_string(i);
-            VTI::writeDataScalar2DFP(projectionGPUAveraged, voxel, fname.c_str(), "ewald");
-            FILE *projection = fopen("projection_scatterPartial.dmp", "wb");
-            fwrite(projectionGPUAveraged, sizeof(Real), numVoxels, projection);
-            fclose(projection);
+#ifndef EOC
+            const bool isConverged = accumulateRotations(idata, voxel, buffers, geometry, angleRefinement, i, angleID,
+                                                         baseRotAngle, handle);
+#ifdef PROFILING
+            {
+              END_TIMER(TIMERS::IMAGE_ROTATION)
+            }
+#endif
+            if (isConverged) {
+              numAnglesUsed = angleID + 1;
+              break;
+            }
 #endif
           }
-
-
-          Real _factor;
-          _factor = NAN;
-
-          stat = cublasScale(handle, numVoxel2D, &_factor, d_rotProjection, 1);
-
-
-          if (stat != CUBLAS_STATUS_SUCCESS) {
-            std::cout << "CUBLAS during scaling failed  with status " << stat << "\n";
-            exit(EXIT_FAILURE);
-          }
-
-
 #ifdef PROFILING
           {
-            END_TIMER(TIMERS::SCATTER3D)
             START_TIMER(TIMERS::IMAGE_ROTATION)
           }
 #endif
-          const double alpha = cos(Eangle);
-          const double beta = sin(Eangle);
-
-          /**https://docs.opencv.org/2.4/modules/imgproc/doc/geometric_transformations.html?highlight=warpaffine**/
-          const double coeffs[2][3]{
-            alpha, beta, static_cast<Real>(((1 - alpha) * voxel[0] / 2 - beta * voxel[1] / 2.)),
-            -beta, alpha, static_cast<Real>(beta * voxel[0] / 2. + (1 - alpha) * voxel[1] / 2.)
-          };
-
-
-          NppStatus status = warpAffine(d_projection,
-                                        sizeImage,
-                                        voxel[1] * sizeof(Real),
-                                        rect,
-                                        d_rotProjection,
-                                        voxel[1] * sizeof(Real),
-                                        rect,
-                                        coeffs,
-                                        NPPI_INTER_LINEAR);
-
-          if (status < 0) {
-            std::cout << "Image rotation failed with error = " << status << "\n";
-            exit(-1);
-          }
-          if (status != NPP_SUCCESS) {
-            std::cout << YLW << "[WARNING] Image rotation warning = " << status << NRM << "\n";
-          }
-
-          if (idata.rotMask) {
-            computeRotationMask<<< BlockSize2, NUM_THREADS >>>(d_rotProjection, d_mask, vx);
-            cudaDeviceSynchronize();
-          }
-
-          const Real factor = static_cast<Real>(1.0);
-          stat = cublasAXPY(handle, numVoxel2D, &factor, d_rotProjection, 1, d_projectionAverage, 1);
-          if (stat != CUBLAS_STATUS_SUCCESS) {
-            std::cout << "CUBLAS during sum failed  with status " << stat << "\n";
-            exit(EXIT_FAILURE);
-          }
-
+          finishPattern(idata, voxel, buffers, geometry, numAnglesUsed, handle);
 #ifdef PROFILING
           {
             END_TIMER(TIMERS::IMAGE_ROTATION)
+            START_TIMER(TIMERS::MEMCOPY_GPU_CPU)
           }
 #endif
+          outputPattern(idata, voxel, buffers.d_projectionAverage, frameStager.get(), projectionGPUAveraged, j, kID,
+                        numAnglesUsed);
+#ifdef PROFILING
+          {
+            END_TIMER(TIMERS::MEMCOPY_GPU_CPU)
+          }
 #endif
         }
 #ifdef PROFILING
         {
-          START_TIMER(TIMERS::IMAGE_ROTATION)
+          START_TIMER(TIMERS::FREE_MEMORY)
         }
 #endif
-        if (idata.rotMask) {
-          averageRotation<<<BlockSize2, NUM_THREADS>>>(d_projectionAverage, d_mask, vx);
-          cudaDeviceSynchronize();
-          gpuErrchk(cudaPeekAtLastError());
-        } else {
-          /// The averaging out for all angles
-          const Real alphaFac = static_cast<Real>(1.0 / numAnglesRotation);
-          stat = cublasScale(handle, voxel[0] * voxel[1], &alphaFac, d_projectionAverage, 1);
-          if (stat != CUBLAS_STATUS_SUCCESS) {
-            std::cout << "CUBLAS during averaging failed  with status " << stat << "\n";
-            exit(EXIT_FAILURE);
-          }
-        }
-        //// Rotate Image
-        hostDeviceExchange(d_projection, d_projectionAverage, numVoxel2D, cudaMemcpyDeviceToDevice);
-        const double srcPoints[3][2]{{voxel[0] / 2.,  voxel[1] / 2.},
-                                     {voxel[0] * 0.5, voxel[1] * 1.0},
-                                     {voxel[0] * 1.0, voxel[1] * 0.5}};
-        Real3 _dstPts[3], _srcPts;
-        double center[2]{voxel[0] / 2., voxel[1] / 2.};
-        for (int i = 0; i < 3; i++) {
-          _srcPts.x = srcPoints[i][0] - center[0];
-          _srcPts.y = srcPoints[i][1] - center[1];
-          _srcPts.z = 0;
-          const Matrix & detectorMatrix = rotationMatrix.getDetectorRotationMatrix();
-          Matrix rotMat;
-          rotMat.performMatrixMultiplication<false,false>(detectorMatrix,rotationMatrixK);
-          doMatVec<false>(rotMat, _srcPts, _dstPts[i]);
-          _dstPts[i].x = _dstPts[i].x + center[0];
-          _dstPts[i].y = _dstPts[i].y + center[1];
-          _dstPts[i].z = 0;
-        }
-
-        const double destPoints[3][2]{{_dstPts[0].x, _dstPts[0].y},
-                                      {_dstPts[1].x, _dstPts[1].y},
-                                      {_dstPts[2].x, _dstPts[2].y}};
-        double coeffs[2][3];
-        computeWarpAffineMatrix(srcPoints, destPoints, coeffs);
-        Real _factor = idata.rotMask ? 0 : NAN;
-        stat = cublasScale(handle, numVoxel2D, &_factor, d_projectionAverage, 1);
-        NppStatus status = warpAffine(d_projection,
-                                      sizeImage,
-                                      voxel[1] * sizeof(Real),
-                                      rect,
-                                      d_projectionAverage,
-                                      voxel[1] * sizeof(Real),
-                                      rect,
-                                      coeffs,
-                                      NPPI_INTER_LINEAR);
-
-        if (status < 0) {
-          std::cout << "Image rotation failed with error = " << status << "\n";
-          exit(EXIT_FAILURE);
-        }
-        if (status != NPP_SUCCESS) {
-          std::cout << YLW << "[WARNING] Image rotation warning = " << status << NRM << "\n";
-        }
+        /// The buffers of the polarization stage are dead. The arena is reused by the next energy.
+        stageArena.reset();
 #ifdef PROFILING
         {
-          END_TIMER(TIMERS::IMAGE_ROTATION)
-          START_TIMER(TIMERS::MEMCOPY_GPU_CPU)
+          END_TIMER(TIMERS::FREE_MEMORY)
+          END_TIMER(TIMERS::ENERGY)
         }
 #endif
-        const std::size_t disp  = static_cast<std::size_t>(numVoxel2D) * static_cast<std::size_t>(j*idata.kVectors.size()) + static_cast<std::size_t>(kID*numVoxel2D);
-        hostDeviceExchange(&projectionGPUAveraged[disp],
-                           d_projectionAverage, numVoxel2D,
-                           cudaMemcpyDeviceToHost);
-
-      }
-#ifdef PROFILING
-      {
-        END_TIMER(TIMERS::MEMCOPY_GPU_CPU)
-        START_TIMER(TIMERS::FREE_MEMORY)
-      }
-#endif
-      freeCudaMemory(d_polarizationX);
-      freeCudaMemory(d_polarizationY);
-      freeCudaMemory(d_polarizationZ);
-      if (idata.scatterApproach == ScatterApproach::FULL) {
-        freeCudaMemory(d_scatter3D);
-      }
-#ifndef EOC
-      freeCudaMemory(d_projection);
-      freeCudaMemory(d_projectionAverage);
-      freeCudaMemory(d_rotProjection);
-      if (idata.rotMask) {
-        freeCudaMemory(d_mask);
-      }
-#endif
-#ifdef PROFILING
-      {
-        END_TIMER(TIMERS::FREE_MEMORY)
-        END_TIMER(TIMERS::ENERGY)
       }
-#endif
+    } catch (const std::exception & error) {
+      std::cout << RED << "[ERROR] " << error.what() << NRM << "\n";
+#pragma omp atomic write
+      isFailed = true;
+    } catch (...) {
+      std::cout << RED << "[ERROR] The computation failed" << NRM << "\n";
+#pragma omp atomic write
+      isFailed = true;
     }
 
-
-freeCudaMemory(d_Nt);
+    if (not(finishFrames(frameStager))) {
+#pragma omp atomic write
+      isFailed = true;
+    }
 
 
 #ifdef DUMP_FILES
@@ -1566,19 +1716,6 @@ freeCudaMemory(d_Nt);
     delete[] polarizationY;
     delete[] polarizationZ;
 
-#endif
-#if (defined(DUMP_FILES) or defined(EOC))
-    delete[] scatter3D;
-#endif
-    for(int i = 0; i < NUM_FFT_STREAMS; i++) {
-      cufftDestroy(plan[i]);
-    }
-    for(int i = 0; i < NUM_STREAMS; i++) {
-      gpuErrchk(cudaStreamDestroy(streams[i]))
-    }
-    cublasDestroy(handle);
-#ifdef EOC
-    delete[] projectionCPU;
 #endif
   }
 
@@ -1592,8 +1729,729 @@ freeCudaMemory(d_Nt);
 #endif
 
 
+  return (isFailed ? EXIT_FAILURE : EXIT_SUCCESS);
+
+}
+
+/**
+ * @brief Evaluates the Fourier transform of the six components of Nt at arbitrary q by direct summation. Each
+ * block evaluates NUM_Q_PER_BLOCK q vectors, so that every value of Nt read from global memory is used for all
+ * of them, and reduces the partial sums of its threads in shared memory.
+ * @param [in] Nt Nt stored as the pairs (0,1) (2,3) (4,5) per voxel
+ * @param [in] q q vectors (in nm^-1)
+ * @param [in] numQ number of q vectors
+ * @param [in] voxel number of voxels in each direction
+ * @param [in] physSize physical size (in nm)
+ * @param [in] hanning apply the Hanning window
+ * @param [in] enable2D 2D morphology
+ * @param [out] NtQ 6 components of the Fourier transformed Nt for every q
+ */
+static constexpr UINT NUM_Q_PER_BLOCK = 4;
+__global__ void evaluateNtAtQ(const Real4 * __restrict__ Nt, const Real3 * __restrict__ q, const UINT numQ,
+                              const uint3 voxel, const Real physSize, const bool hanning, const bool enable2D,
+                              Complex * NtQ) {
+  __shared__ Real reduction[NUM_THREADS];
+  const UINT qStart = blockIdx.x * NUM_Q_PER_BLOCK;
+  const BigUINT numVoxels = static_cast<BigUINT>(voxel.x) * voxel.y * voxel.z;
+  Real3 qBlock[NUM_Q_PER_BLOCK];
+  Real sum[NUM_Q_PER_BLOCK][12];
+  for (UINT b = 0; b < NUM_Q_PER_BLOCK; b++) {
+    qBlock[b] = (qStart + b < numQ) ? q[qStart + b] : Real3{0, 0, 0};
+    for (UINT c = 0; c < 12; c++) {
+      sum[b][c] = 0;
+    }
+  }
+  for (BigUINT id = threadIdx.x; id < numVoxels; id += blockDim.x) {
+    UINT X, Y, Z;
+    reshape1Dto3D(id, X, Y, Z, voxel);
+    Real weight = 1;
+    if (hanning) {
+      weight = getHanningWeight(X, voxel.x) * getHanningWeight(Y, voxel.y);
+      if (not(enable2D)) {
+        weight *= getHanningWeight(Z, voxel.z);
+      }
+    }
+    const Real4 N[3]{Nt[id], Nt[id + numVoxels], Nt[id + 2 * numVoxels]};
+    for (UINT b = 0; b < NUM_Q_PER_BLOCK; b++) {
+      const Real phase = -(qBlock[b].x * X + qBlock[b].y * Y + qBlock[b].z * Z) * physSize;
+      const Real re = weight * cos(phase), im = weight * sin(phase);
+      for (UINT p = 0; p < 3; p++) {
+        sum[b][4 * p + 0] += N[p].x * re - N[p].y * im;
+        sum[b][4 * p + 1] += N[p].x * im + N[p].y * re;
+        sum[b][4 * p + 2] += N[p].z * re - N[p].w * im;
+        sum[b][4 * p + 3] += N[p].z * im + N[p].w * re;
+      }
+    }
+  }
+  for (UINT b = 0; b < NUM_Q_PER_BLOCK; b++) {
+    for (UINT c = 0; c < 12; c++) {
+      reduction[threadIdx.x] = sum[b][c];
+      __syncthreads();
+      for (UINT stride = blockDim.x / 2; stride > 0; stride /= 2) {
+        if (threadIdx.x < stride) {
+          reduction[threadIdx.x] += reduction[threadIdx.x + stride];
+        }
+        __syncthreads();
+      }
+      if ((threadIdx.x == 0) and (qStart + b < numQ)) {
+        Real * result = reinterpret_cast<Real *>(&NtQ[6 * (qStart + b)]);
+        result[c] = reduction[0];
+      }
+      __syncthreads();
+    }
+  }
+}
+
+/**
+ * @brief Scattered intensity at q from the Fourier transformed Nt. The polarization follows exactly as in the
+ * polarization kernels, which is valid because the polarization is linear in Nt.
+ * @param [in] N 6 components of the Fourier transformed Nt at q
+ * @param [in] rotationMatrix rotation matrix of the E field
+ * @param [in] q q on the Ewald sphere (in nm^-1)
+ * @param [in] kVec k vector
+ * @param [in] kMagnitude magnitude of the k vector
+ * @param [in] referenceFrame reference frame where the P is calculated: LAB/MATERIAL
+ * @param [in] enable2D 2D morphology
+ * @return intensity
+ */
+__host__ __device__ static inline Real computeIntensityFromNt(const Complex * N, const Matrix & rotationMatrix,
+                                                              const Real3 & q, const Real3 & kVec,
+                                                              const Real kMagnitude,
+                                                              const ReferenceFrame referenceFrame,
+                                                              const bool enable2D) {
+  const Real OneBy4Pi = static_cast<Real> (1.0 / (4.0 * M_PI));
+  const Real3 eleField{1,0,0};
+  Real3 matVec;
+  doMatVec<false>(rotationMatrix, eleField, matVec);
+  Complex p[3];
+  p[0].x = (N[0].x * matVec.x + N[1].x * matVec.y + N[2].x * matVec.z) * OneBy4Pi;
+  p[0].y = (N[0].y * matVec.x + N[1].y * matVec.y + N[2].y * matVec.z) * OneBy4Pi;
+  p[1].x = (N[1].x * matVec.x + N[3].x * matVec.y + N[4].x * matVec.z) * OneBy4Pi;
+  p[1].y = (N[1].y * matVec.x + N[3].y * matVec.y + N[4].y * matVec.z) * OneBy4Pi;
+  p[2].x = (N[2].x * matVec.x + N[4].x * matVec.y + N[5].x * matVec.z) * OneBy4Pi;
+  p[2].y = (N[2].y * matVec.x + N[4].y * matVec.y + N[5].y * matVec.z) * OneBy4Pi;
+  if (referenceFrame == ReferenceFrame::MATERIAL) {
+    rotate<true>(rotationMatrix, p[0], p[1], p[2]);
+  }
+  const Real qVec[3]{kMagnitude * kVec.x + q.x, kMagnitude * kVec.y + q.y,
+                     kMagnitude * kVec.z + (enable2D ? 0 : q.z)};
+  return computeMagVec1TimesVec1TTimesVec2(qVec, p, kMagnitude);
+}
+
+/**
+ * @brief Averages the intensity of every q point over the E angles.
+ * @param [in] idata input data
+ * @param [in] evaluations (q point, E angle) pairs, with the E angle running fastest
+ * @param [in] NtQ 6 components of the Fourier transformed Nt for every evaluation
+ * @param [in] kVec k vector
+ * @param [in] kMagnitude magnitude of the k vector
+ * @param [in] numAngles number of E angles
+ * @param [out] intensity E angle averaged intensity of every q point. NaN where no E angle is valid, or
+ * without rotation mask, where any E angle is invalid.
+ */
+static void averageQEvaluations(const InputData & idata, const std::vector<QEvaluation> & evaluations,
+                                const Complex * NtQ, const Real3 & kVec, const Real kMagnitude,
+                                const UINT numAngles, Real * intensity) {
+  const UINT numPoints = evaluations.size() / numAngles;
+#pragma omp parallel for
+  for (UINT pointID = 0; pointID < numPoints; pointID++) {
+    Real sum = 0;
+    UINT numValid = 0;
+    for (UINT i = 0; i < numAngles; i++) {
+      const BigUINT id = static_cast<BigUINT>(pointID) * numAngles + i;
+      const QEvaluation & evaluation = evaluations[id];
+      if (not(evaluation.isValid)) {
+        continue;
+      }
+      sum += computeIntensityFromNt(&NtQ[6 * id], evaluation.rotationMatrix, evaluation.q, kVec, kMagnitude,
+                                    static_cast<ReferenceFrame>(idata.referenceFrame), idata.if2DComputation());
+      numValid++;
+    }
+    const bool isValid = (numValid > 0) and (idata.rotMask or (numValid == numAngles));
+    intensity[pointID] = isValid ? sum / numValid : NAN;
+  }
+}
+
+/**
+ * @brief Computes Nt of one energy on the device, with the voxels split over the streams
+ * @param [in] idata input data
+ * @param [in] d_materialConstants optical constants of the energy on the device
+ * @param [in] voxelInput voxel input
+ * @param [in] numVoxels number of voxels
+ * @param [in] batchID first voxel of every stream, followed by numVoxels
+ * @param [in] streams streams
+ * @param [in] stageArena arena the morphology of one material is staged in
+ * @param [out] d_Nt Nt on the device
+ */
+static void computeNtOnDevice(const InputData & idata, const Material * d_materialConstants, const Voxel * voxelInput,
+                              const BigUINT numVoxels, const std::vector<UINT> & batchID,
+                              const std::vector<cudaStream_t> & streams, Arena & stageArena, Complex * d_Nt) {
+  const int NUM_STREAMS = streams.size();
+  const int & NUM_MATERIAL = idata.NUM_MATERIAL;
+  const UINT BlockSize = static_cast<UINT>(ceil(numVoxels * 1.0 / NUM_THREADS));
+  cudaZeroEntries(d_Nt,numVoxels*6);
+  stageArena.reserve(Arena::getBytes<Voxel>(numVoxels));
+  const ArenaScope stageScope(stageArena);
+  Voxel *d_voxelInput = stageArena.allocate<Voxel>(numVoxels);
+  for(int streamID = 0; streamID < NUM_STREAMS; streamID++){
+    for(int numMat = 0; numMat < NUM_MATERIAL; numMat++){
+      cudaMemcpyAsync(&d_voxelInput[batchID[streamID]], &voxelInput[numMat*numVoxels + batchID[streamID]],
+                      sizeof(Voxel)*(batchID[streamID+1] -  batchID[streamID]), cudaMemcpyHostToDevice,streams[streamID]);
+      computeNt(d_materialConstants,d_voxelInput,d_Nt,(MorphologyType)idata.morphologyType,BlockSize,numVoxels,batchID[streamID],batchID[streamID+1],numMat,NUM_STREAMS,streams[streamID],NUM_MATERIAL);
+    }
+  }
+  cudaDeviceSynchronize();
+  gpuErrchk(cudaPeekAtLastError());
+}
+
+int cudaMainQPoints(const UINT *voxel,
+                    const InputData &idata,
+                    const std::vector<Material > &materialInput,
+                    const std::vector<Real2> &qPoints,
+                    Real *intensity,
+                    RotationMatrix & rotationMatrix,
+                    const Voxel *voxelInput,
+                    SimulationContext * context){
+
+  if ((static_cast<uint64_t>(voxel[0]) * voxel[1] * voxel[2]) > std::numeric_limits<BigUINT>::max()) {
+    std::cout << "Exiting. Compile by Enabling 64 Bit indices\n";
+    return (EXIT_FAILURE);
+  }
+
+  const BigUINT numVoxels = voxel[0] * voxel[1] * voxel[2]; /// Voxel size
+  const uint3 vx{voxel[0], voxel[1], voxel[2]};
+  const UINT
+    numAnglesRotation = static_cast<UINT>(std::round((idata.endAngle - idata.startAngle) / idata.incrementAngle + 1));
+  const UINT &numEnergyLevel = idata.energies.size();
+  const UINT numPoints = qPoints.size();
+  const bool hanning = (idata.windowingType == FFT::FFTWindowing::HANNING);
+
+  const int & NUM_MATERIAL = idata.NUM_MATERIAL;
+
+  int num_gpu;
+  cudaGetDeviceCount(&num_gpu);
+  std::cout << "Number of CUDA devices:" << num_gpu << "\n";
+
+  if (num_gpu < 1) {
+    std::cout << "No GPU found. Exiting" << "\n";
+    return (EXIT_FAILURE);
+  }
+
+  SimulationContext localContext;
+  SimulationContext & simulationContext = (context == nullptr) ? localContext : *context;
+  simulationContext.reserve(num_gpu);
+  rotationMatrix.initComputation();
+
+  omp_set_num_threads(num_gpu);
+#pragma omp parallel
+  {
+    cudaSetDevice(omp_get_thread_num());
+    cudaDeviceProp dprop;
+    cudaGetDeviceProperties(&dprop, omp_get_thread_num());
+    const UINT ompThreadID = omp_get_thread_num();
+
+    /// Streams and Nt are reused from previous launches if the configuration matches
+    DeviceWorkspace & workspace = simulationContext.acquire(omp_get_thread_num(), idata);
+    const int NUM_STREAMS = workspace.numStreams;
+    const std::vector<cudaStream_t> & streams = workspace.streams;
+    Complex * d_Nt = workspace.d_Nt;
+    Material * d_materialConstants = workspace.d_materialConstants;
+
+    const UINT numEnergyPerGPU = static_cast<UINT>(std::ceil(numEnergyLevel * 1.0 / num_gpu));
+    const UINT numStart = (numEnergyPerGPU * ompThreadID);
+    UINT numEnd = (numEnergyPerGPU * (ompThreadID + 1));
+    numEnd = std::min(numEnd, numEnergyLevel);
+    if (numStart >= numEnergyLevel) {
+      std::cout << "[INFO] [GPU = " << dprop.name << "] -> No computation. Idle\n";
+    } else {
+      std::cout << "[INFO] [GPU = " << dprop.name << "] : " << idata.energies[numStart] << "eV -> "
+                << idata.energies[numEnd - 1] << "eV\n";
+    }
+
+    const UINT perBatchVoxels = ceil(numVoxels/(NUM_STREAMS*1.0));
+    std::vector<UINT> batchID(NUM_STREAMS+1);
+    batchID[0] = 0;
+    for(int i = 1; i < NUM_STREAMS; i++){
+      batchID[i] = (i)*perBatchVoxels;
+    }
+    batchID[NUM_STREAMS] = numVoxels;
+
+    /// Every (q point, E angle) pair of one k vector
+    const std::size_t numEvaluations = static_cast<std::size_t>(numPoints) * numAnglesRotation;
+    std::vector<QEvaluation> evaluations;
+    std::vector<Real3> qEvaluations(numEvaluations);
+    Complex * NtQ = new Complex[6 * numEvaluations];
+    Complex * hostNt = nullptr;
+    Real3 * d_q = nullptr;
+    Complex * d_NtQ = nullptr;
+    if (idata.qPointsOnHost) {
+      mallocCPUPinned(hostNt, numVoxels * 6);
+    } else {
+      mallocGPU(d_q, numEvaluations);
+      mallocGPU(d_NtQ, 6 * numEvaluations);
+    }
+
+    for (UINT j = numStart; j < numEnd; j++) {
+      hostDeviceExchange(d_materialConstants,&materialInput[j*NUM_MATERIAL],NUM_MATERIAL,cudaMemcpyHostToDevice);
+      const Real &energy = (idata.energies[j]);
+      std::cout << " [STAT] Energy = " << energy << " starting " << "\n";
+
+      computeNtOnDevice(idata, d_materialConstants, voxelInput, numVoxels, batchID, streams, workspace.stageArena, d_Nt);
+      if (idata.qPointsOnHost) {
+        hostDeviceExchange(hostNt, d_Nt, numVoxels * 6, cudaMemcpyDeviceToHost);
+      }
+
+      const Real wavelength = static_cast<Real>(1239.84197 / energy);
+      const Real kMagnitude = static_cast<Real>(2 * M_PI / wavelength);
+      for (UINT kID = 0; kID < idata.kVectors.size(); kID++) {
+        getQEvaluations(idata, qPoints, rotationMatrix, kID, kMagnitude, numAnglesRotation, evaluations);
+        if (idata.qPointsOnHost) {
+          evaluateNtAtQHost(reinterpret_cast<const Real4 *>(hostNt), evaluations, vx, idata.physSize, hanning,
+                            idata.if2DComputation(), NtQ);
+        } else {
+          /// Invalid q are evaluated at q = 0 and ignored in the average
+          for (std::size_t id = 0; id < numEvaluations; id++) {
+            qEvaluations[id] = evaluations[id].isValid ? evaluations[id].q : Real3{0, 0, 0};
+          }
+          hostDeviceExchange(d_q, qEvaluations.data(), numEvaluations, cudaMemcpyHostToDevice);
+          const UINT numBlocks = static_cast<UINT>(ceil(numEvaluations * 1.0 / NUM_Q_PER_BLOCK));
+          evaluateNtAtQ<<<numBlocks, NUM_THREADS>>>(reinterpret_cast<const Real4 *>(d_Nt), d_q, numEvaluations, vx,
+                                                    idata.physSize, hanning, idata.if2DComputation(), d_NtQ);
+          cudaDeviceSynchronize();
+          gpuErrchk(cudaPeekAtLastError());
+          hostDeviceExchange(NtQ, d_NtQ, 6 * numEvaluations, cudaMemcpyDeviceToHost);
+        }
+        averageQEvaluations(idata, evaluations, NtQ, idata.kVectors[kID], kMagnitude, numAnglesRotation,
+                            &intensity[(static_cast<std::size_t>(j) * idata.kVectors.size() + kID) * numPoints]);
+      }
+    }
+
+    delete[] NtQ;
+    if (hostNt != nullptr) {
+      cudaFreeHost(hostNt);
+    }
+    freeCudaMemory(d_q);
+    freeCudaMemory(d_NtQ);
+  }
   return (EXIT_SUCCESS);
+}
+
+/**
+ * @brief Places one component of Nt on the oversampled grid of the non-uniform FFT, divided by the Fourier
+ * transform of the kernel. The grid has to be zero initialized.
+ * @param [in] Nt Nt stored as the pairs (0,1) (2,3) (4,5) per voxel
+ * @param [in] componentID component of Nt (0 - 5)
+ * @param [in] correction correction factor of every voxel index, for x, y and z one after the other
+ * @param [in] voxel number of voxels in each direction
+ * @param [in] gridDims size of the oversampled grid
+ * @param [in] hanning apply the Hanning window
+ * @param [in] enable2D 2D morphology
+ * @param [out] grid oversampled grid
+ */
+__global__ void prepareNUFFTGrid(const Complex * __restrict__ Nt, const UINT componentID,
+                                 const Real * __restrict__ correction, const uint3 voxel, const uint3 gridDims,
+                                 const bool hanning, const bool enable2D, Complex * grid) {
+  const BigUINT numVoxels = static_cast<BigUINT>(voxel.x) * voxel.y * voxel.z;
+  const BigUINT threadID = static_cast<BigUINT>(blockIdx.x) * blockDim.x + threadIdx.x;
+  if (threadID >= numVoxels) {
+    return;
+  }
+  UINT X, Y, Z;
+  reshape1Dto3D(threadID, X, Y, Z, voxel);
+  Real weight = correction[X] * correction[voxel.x + Y] * correction[voxel.x + voxel.y + Z];
+  if (hanning) {
+    weight *= getHanningWeight(X, voxel.x) * getHanningWeight(Y, voxel.y);
+    if (not(enable2D)) {
+      weight *= getHanningWeight(Z, voxel.z);
+    }
+  }
+  const Complex value = Nt[2 * (threadID + (componentID / 2) * numVoxels) + componentID % 2];
+  Complex & gridValue = grid[getNUFFTGridIndex(X, Y, Z, voxel, gridDims)];
+  gridValue.x = weight * value.x;
+  gridValue.y = weight * value.y;
+}
+
+/**
+ * @brief Computes the E angle averaged intensity of every pixel of the region of interest with the non-uniform FFT.
+ * The detector rotation and the rotation by the E angle are inverted for every pixel, and the six components of
+ * Nt are interpolated at the q on the Ewald sphere, so the frame is never formed on the voxel grid.
+ * @param [in] grid FFT of the corrected Nt on the oversampled grid, one component after the other
+ * @param [in] gridDims size of the oversampled grid
+ * @param [in] width support of the kernel
+ * @param [in] beta shape parameter of the kernel
+ * @param [in] angles E angles
+ * @param [in] numAngles number of E angles
+ * @param [in] inverseDetector inverse of the 2 x 2 detector rotation (row major)
+ * @param [in] kVec k vector
+ * @param [in] kMagnitude magnitude of the k vector
+ * @param [in] roi region of the frame that is evaluated
+ * @param [in] voxel number of voxels in each direction
+ * @param [in] physSize physical size (in nm)
+ * @param [in] referenceFrame reference frame where the P is calculated: LAB/MATERIAL
+ * @param [in] enable2D 2D morphology
+ * @param [in] rotMask average over the valid E angles only
+ * @param [out] frame intensity of the region (roi.nx x roi.ny)
+ */
+__global__ void evaluateNUFFTFrame(const Complex * __restrict__ grid, const uint3 gridDims, const UINT width,
+                                   const Real beta, const NUFFTAngle * __restrict__ angles, const UINT numAngles,
+                                   const Real4 inverseDetector, const Real3 kVec, const Real kMagnitude,
+                                   const FrameROI roi, const uint3 voxel, const Real physSize,
+                                   const ReferenceFrame referenceFrame, const bool enable2D, const bool rotMask,
+                                   Real * frame) {
+  const UINT threadID = blockIdx.x * blockDim.x + threadIdx.x;
+  if (threadID >= roi.nx * roi.ny) {
+    return;
+  }
+  const UINT X = roi.x0 + threadID % roi.nx, Y = roi.y0 + threadID / roi.nx;
+  const double qxDetector = getPixelQ(X, voxel.x, physSize), qyDetector = getPixelQ(Y, voxel.y, physSize);
+  /// q before the detector rotation
+  const double qx = inverseDetector.x * qxDetector + inverseDetector.y * qyDetector;
+  const double qy = inverseDetector.z * qxDetector + inverseDetector.w * qyDetector;
+  const double qMax = M_PI / physSize;
+  Real sum = 0;
+  UINT numValid = 0;
+  for (UINT i = 0; i < numAngles; i++) {
+    Real3 q;
+    if (not(projectOnEwaldSphere(qx, qy, angles[i].cosAngle, angles[i].sinAngle, kVec, kMagnitude, qMax, enable2D, q))) {
+      continue;
+    }
+    Complex N[6];
+    interpolateNUFFT(grid, gridDims, width, beta, q, physSize, N);
+    sum += computeIntensityFromNt(N, angles[i].rotationMatrix, q, kVec, kMagnitude, referenceFrame, enable2D);
+    numValid++;
+  }
+  const bool isValid = (numValid > 0) and (rotMask or (numValid == numAngles));
+  frame[threadID] = isValid ? sum / numValid : NAN;
+}
 
+int cudaMainNUFFT(const UINT *voxel,
+                  const InputData &idata,
+                  const std::vector<Material > &materialInput,
+                  Real *projectionAverage,
+                  RotationMatrix & rotationMatrix,
+                  const Voxel *voxelInput,
+                  SimulationContext * context,
+                  FrameSink * sink){
+
+  if ((static_cast<uint64_t>(voxel[0]) * voxel[1] * voxel[2]) > std::numeric_limits<BigUINT>::max()) {
+    std::cout << "Exiting. Compile by Enabling 64 Bit indices\n";
+    return (EXIT_FAILURE);
+  }
+
+  const BigUINT numVoxels = voxel[0] * voxel[1] * voxel[2]; /// Voxel size
+  const UINT numVoxel2D = voxel[0] * voxel[1];
+  const uint3 vx{voxel[0], voxel[1], voxel[2]};
+  const UINT
+    numAnglesRotation = static_cast<UINT>(std::round((idata.endAngle - idata.startAngle) / idata.incrementAngle + 1));
+  const UINT &numEnergyLevel = idata.energies.size();
+  const bool hanning = (idata.windowingType == FFT::FFTWindowing::HANNING);
+
+  const int & NUM_MATERIAL = idata.NUM_MATERIAL;
+
+  int num_gpu;
+  cudaGetDeviceCount(&num_gpu);
+  std::cout << "Number of CUDA devices:" << num_gpu << "\n";
+
+  if (num_gpu < 1) {
+    std::cout << "No GPU found. Exiting" << "\n";
+    return (EXIT_FAILURE);
+  }
+
+  const NUFFTKernel nufftKernel = getNUFFTKernel(idata, voxel);
+  const uint3 & gridDims = nufftKernel.gridDims;
+  const BigUINT numGridPoints = static_cast<BigUINT>(gridDims.x) * gridDims.y * gridDims.z;
+  std::cout << "[INFO] NUFFT grid [" << gridDims.x << " " << gridDims.y << " " << gridDims.z << "], kernel width "
+            << nufftKernel.width << "\n";
+
+  SimulationContext localContext;
+  SimulationContext & simulationContext = (context == nullptr) ? localContext : *context;
+  simulationContext.reserve(num_gpu);
+  rotationMatrix.initComputation();
+
+  /// Set by the GPU threads if the computation or the sink failed
+  bool isFailed = false;
+  omp_set_num_threads(num_gpu);
+#pragma omp parallel
+  {
+    cudaSetDevice(omp_get_thread_num());
+    cudaDeviceProp dprop;
+    cudaGetDeviceProperties(&dprop, omp_get_thread_num());
+    const UINT ompThreadID = omp_get_thread_num();
+
+    /// Streams and Nt are reused from previous launches if the configuration matches
+    DeviceWorkspace & workspace = simulationContext.acquire(omp_get_thread_num(), idata);
+    const int NUM_STREAMS = workspace.numStreams;
+    const std::vector<cudaStream_t> & streams = workspace.streams;
+    Complex * d_Nt = workspace.d_Nt;
+    Material * d_materialConstants = workspace.d_materialConstants;
+
+    const UINT numEnergyPerGPU = static_cast<UINT>(std::ceil(numEnergyLevel * 1.0 / num_gpu));
+    const UINT numStart = (numEnergyPerGPU * ompThreadID);
+    UINT numEnd = (numEnergyPerGPU * (ompThreadID + 1));
+    numEnd = std::min(numEnd, numEnergyLevel);
+    if (numStart >= numEnergyLevel) {
+      std::cout << "[INFO] [GPU = " << dprop.name << "] -> No computation. Idle\n";
+    } else {
+      std::cout << "[INFO] [GPU = " << dprop.name << "] : " << idata.energies[numStart] << "eV -> "
+                << idata.energies[numEnd - 1] << "eV\n";
+    }
+
+    const UINT perBatchVoxels = ceil(numVoxels/(NUM_STREAMS*1.0));
+    std::vector<UINT> batchID(NUM_STREAMS+1);
+    batchID[0] = 0;
+    for(int i = 1; i < NUM_STREAMS; i++){
+      batchID[i] = (i)*perBatchVoxels;
+    }
+    batchID[NUM_STREAMS] = numVoxels;
+
+    /// Region written to the output: the full frame without q region of interest
+    const FrameROI outputROI = getOutputROI(idata);
+    const UINT numROIPixels = outputROI.nx * outputROI.ny;
+
+    Complex * d_grid;
+    Real * d_correction, * d_frame;
+    NUFFTAngle * d_angles;
+    mallocGPU(d_grid, 6 * numGridPoints);
+    mallocGPU(d_correction, nufftKernel.correction.size());
+    mallocGPU(d_angles, numAnglesRotation);
+    mallocGPU(d_frame, numROIPixels);
+    hostDeviceExchange(d_correction, nufftKernel.correction.data(), nufftKernel.correction.size(), cudaMemcpyHostToDevice);
+    Real * frame;
+    mallocCPUPinned(frame, numROIPixels);
+    std::vector<NUFFTAngle> angles(numAnglesRotation);
+    cufftHandle plan;
+    cufftResult result = cufftPlan3d(&plan, gridDims.z, gridDims.y, gridDims.x, fftType);
+    const bool isPlanned = (result == CUFFT_SUCCESS);
+
+    const UINT BlockSize = static_cast<UINT>(ceil(numVoxels * 1.0 / NUM_THREADS));
+    const UINT BlockSizeROI = static_cast<UINT>(ceil(numROIPixels * 1.0 / NUM_THREADS));
+    const auto & baseConfigurations = rotationMatrix.getBaseConfigurations();
+
+    try {
+      if (not(isPlanned)) {
+        throw std::runtime_error("CUFFT plan of the NUFFT grid failed with result " + std::to_string(result));
+      }
+      for (UINT j = numStart; j < numEnd; j++) {
+        if ((sink != nullptr) and sink->isComplete(j)) {
+          continue;
+        }
+        hostDeviceExchange(d_materialConstants,&materialInput[j*NUM_MATERIAL],NUM_MATERIAL,cudaMemcpyHostToDevice);
+        const Real &energy = (idata.energies[j]);
+        std::cout << " [STAT] Energy = " << energy << " starting " << "\n";
+
+        computeNtOnDevice(idata, d_materialConstants, voxelInput, numVoxels, batchID, streams, workspace.stageArena, d_Nt);
+        /// The FFT of the oversampled grid is shared by every k and E angle of the energy
+        cudaZeroEntries(d_grid, 6 * numGridPoints);
+        for (UINT componentID = 0; componentID < 6; componentID++) {
+          Complex * d_component = &d_grid[componentID * numGridPoints];
+          prepareNUFFTGrid<<<BlockSize, NUM_THREADS>>>(d_Nt, componentID, d_correction, vx, gridDims, hanning,
+                                                       idata.if2DComputation(), d_component);
+          result = performFFT(d_component, plan);
+          if (result != CUFFT_SUCCESS) {
+            throw std::runtime_error("CUFFT failed with result " + std::to_string(result));
+          }
+        }
+        cudaDeviceSynchronize();
+        gpuErrchk(cudaPeekAtLastError());
+
+        const Real wavelength = static_cast<Real>(1239.84197 / energy);
+        const Real kMagnitude = static_cast<Real>(2 * M_PI / wavelength);
+        for (UINT kID = 0; kID < idata.kVectors.size(); kID++) {
+          const Real3 & kVec = idata.kVectors[kID];
+          const auto & baseConfig = baseConfigurations[kID];
+          for (UINT i = 0; i < numAnglesRotation; i++) {
+            const Real Eangle = static_cast<Real>((baseConfig.baseRotAngle + idata.startAngle + i * idata.incrementAngle) * M_PI / 180.0);
+            computeRotationMatrix(kVec, baseConfig.matrix, angles[i].rotationMatrix, Eangle);
+            angles[i].cosAngle = std::cos(Eangle);
+            angles[i].sinAngle = std::sin(Eangle);
+          }
+          hostDeviceExchange(d_angles, angles.data(), numAnglesRotation, cudaMemcpyHostToDevice);
+          Matrix detectorRotation;
+          detectorRotation.performMatrixMultiplication<false, false>(rotationMatrix.getDetectorRotationMatrix(),
+                                                                     baseConfig.matrix);
+          const Real a = detectorRotation.getValue<0, 0>(), b = detectorRotation.getValue<0, 1>();
+          const Real c = detectorRotation.getValue<1, 0>(), d = detectorRotation.getValue<1, 1>();
+          const Real det = a * d - b * c;
+          if (not(std::isfinite(det)) or (det == 0)) {
+            throw std::runtime_error("The detector rotation of k = " + std::to_string(kID) + " is singular");
+          }
+          const Real4 inverseDetector{d / det, -b / det, -c / det, a / det};
+          evaluateNUFFTFrame<<<BlockSizeROI, NUM_THREADS>>>(d_grid, gridDims, nufftKernel.width, nufftKernel.beta,
+                                                            d_angles, numAnglesRotation, inverseDetector, kVec,
+                                                            kMagnitude, outputROI, vx, idata.physSize,
+                                                            static_cast<ReferenceFrame>(idata.referenceFrame),
+                                                            idata.if2DComputation(), idata.rotMask, d_frame);
+          cudaDeviceSynchronize();
+          gpuErrchk(cudaPeekAtLastError());
+          hostDeviceExchange(frame, d_frame, numROIPixels, cudaMemcpyDeviceToHost);
+          maskOutsideROI(idata, outputROI, frame);
+          if (sink != nullptr) {
+            sink->write(j, kID, frame);
+          } else {
+            /// Pixels outside the region of interest are NaN
+            Real * projection = &projectionAverage[(static_cast<std::size_t>(j) * idata.kVectors.size() + kID) * numVoxel2D];
+            std::fill(projection, projection + numVoxel2D, static_cast<Real>(NAN));
+            for (UINT Y = 0; Y < outputROI.ny; Y++) {
+              std::copy(&frame[static_cast<std::size_t>(Y) * outputROI.nx], &frame[static_cast<std::size_t>(Y + 1) * outputROI.nx],
+                        &projection[static_cast<std::size_t>(outputROI.y0 + Y) * voxel[0] + outputROI.x0]);
+            }
+          }
+        }
+      }
+    } catch (const std::exception & error) {
+      std::cout << RED << "[ERROR] " << error.what() << NRM << "\n";
+#pragma omp atomic write
+      isFailed = true;
+    } catch (...) {
+      std::cout << RED << "[ERROR] The computation failed" << NRM << "\n";
+#pragma omp atomic write
+      isFailed = true;
+    }
+
+    if (isPlanned) {
+      cufftDestroy(plan);
+    }
+    cudaFreeHost(frame);
+    freeCudaMemory(d_grid);
+    freeCudaMemory(d_correction);
+    freeCudaMemory(d_angles);
+    freeCudaMemory(d_frame);
+  }
+  return (isFailed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * @brief Adds the change of Nt at a few voxels to the transformed Nt by direct summation. The transformed Nt is
+ * stored FFT shifted, so the frequency of the stored index X is (N / 2 - X) mod N along each axis. Each block
+ * loads a tile of changed voxels into shared memory and every thread adds their contribution to its frequency.
+ * @param [in] d_NtNew Nt of the changed voxels after the change
+ * @param [in] d_NtOld Nt of the changed voxels before the change
+ * @param [in] changedVoxels indices of the changed voxels
+ * @param [in] numChanged number of changed voxels
+ * @param [in] voxel number of voxels in each direction
+ * @param [in,out] fourierNt transformed Nt
+ */
+__global__ void updateFourierNt(const Complex * __restrict__ d_NtNew, const Complex * __restrict__ d_NtOld,
+                                const BigUINT * __restrict__ changedVoxels, const UINT numChanged,
+                                const uint3 voxel, Complex * fourierNt) {
+  __shared__ uint3 position[NUM_THREADS];
+  __shared__ Complex delta[NUM_THREADS][6];
+  const BigUINT numVoxels = static_cast<BigUINT>(voxel.x) * voxel.y * voxel.z;
+  const BigUINT threadID = static_cast<BigUINT>(blockIdx.x) * blockDim.x + threadIdx.x;
+  uint3 m{0, 0, 0};
+  if (threadID < numVoxels) {
+    UINT X, Y, Z;
+    reshape1Dto3D(threadID, X, Y, Z, voxel);
+    m.x = (voxel.x / 2 + voxel.x - X) % voxel.x;
+    m.y = (voxel.y / 2 + voxel.y - Y) % voxel.y;
+    m.z = (voxel.z / 2 + voxel.z - Z) % voxel.z;
+  }
+  Complex sum[6];
+  for (UINT c = 0; c < 6; c++) {
+    sum[c] = {0, 0};
+  }
+  for (UINT tileStart = 0; tileStart < numChanged; tileStart += NUM_THREADS) {
+    const UINT id = tileStart + threadIdx.x;
+    if (id < numChanged) {
+      reshape1Dto3D(changedVoxels[id], position[threadIdx.x].x, position[threadIdx.x].y, position[threadIdx.x].z, voxel);
+      for (UINT c = 0; c < 6; c++) {
+        const BigUINT index = 2 * (id + (c / 2) * static_cast<BigUINT>(numChanged)) + c % 2;
+        delta[threadIdx.x][c].x = d_NtNew[index].x - d_NtOld[index].x;
+        delta[threadIdx.x][c].y = d_NtNew[index].y - d_NtOld[index].y;
+      }
+    }
+    __syncthreads();
+    const UINT tileSize = (numChanged - tileStart < NUM_THREADS) ? numChanged - tileStart : NUM_THREADS;
+    if (threadID < numVoxels) {
+      for (UINT b = 0; b < tileSize; b++) {
+        /// The phase is reduced with integers, so that it stays accurate for large grids
+        const Real cycles = static_cast<Real>((static_cast<uint64_t>(m.x) * position[b].x) % voxel.x) / voxel.x
+                          + static_cast<Real>((static_cast<uint64_t>(m.y) * position[b].y) % voxel.y) / voxel.y
+                          + static_cast<Real>((static_cast<uint64_t>(m.z) * position[b].z) % voxel.z) / voxel.z;
+        const Real phase = static_cast<Real>(-2 * M_PI) * cycles;
+        const Real re = cos(phase), im = sin(phase);
+        for (UINT c = 0; c < 6; c++) {
+          sum[c].x += delta[b][c].x * re - delta[b][c].y * im;
+          sum[c].y += delta[b][c].x * im + delta[b][c].y * re;
+        }
+      }
+    }
+    __syncthreads();
+  }
+  if (threadID < numVoxels) {
+    for (UINT c = 0; c < 6; c++) {
+      Complex & value = fourierNt[2 * (threadID + (c / 2) * numVoxels) + c % 2];
+      value.x += sum[c].x;
+      value.y += sum[c].y;
+    }
+  }
+}
+
+/**
+ * @brief Replaces the DC component of the six FFT shifted components of Nt with the average of its face neighbors,
+ * as replaceDCComponent() does before the shift. Both average the four neighbors in the plane for 2D morphologies.
+ * @param [in,out] fourierNt transformed Nt
+ * @param [in] voxel number of voxels in each direction
+ */
+__global__ void replaceShiftedDCComponent(Complex * fourierNt, const uint3 voxel) {
+  if ((threadIdx.x != 0) or (blockIdx.x != 0)) {
+    return;
+  }
+  const BigUINT numVoxels = static_cast<BigUINT>(voxel.x) * voxel.y * voxel.z;
+  const uint3 mid{voxel.x / 2, voxel.y / 2, voxel.z / 2};
+  const UINT numNeighbors = (voxel.z == 1) ? 4 : 6;
+  const uint3 neighbors[6]{{mid.x - 1, mid.y, mid.z}, {(mid.x + 1) % voxel.x, mid.y, mid.z},
+                           {mid.x, mid.y - 1, mid.z}, {mid.x, (mid.y + 1) % voxel.y, mid.z},
+                           {mid.x, mid.y, (mid.z + voxel.z - 1) % voxel.z}, {mid.x, mid.y, (mid.z + 1) % voxel.z}};
+  for (UINT c = 0; c < 6; c++) {
+    Complex * component = &fourierNt[2 * ((c / 2) * numVoxels) + c % 2];
+    Complex sum{0, 0};
+    for (UINT i = 0; i < numNeighbors; i++) {
+      const BigUINT id = reshape3Dto1D(neighbors[i].x, neighbors[i].y, neighbors[i].z, voxel);
+      sum.x += component[2 * id].x;
+      sum.y += component[2 * id].y;
+    }
+    Complex & dc = component[2 * reshape3Dto1D(mid.x, mid.y, mid.z, voxel)];
+    dc.x = sum.x / numNeighbors;
+    dc.y = sum.y / numNeighbors;
+  }
+}
+
+static void updateFourierNtOnDevice(const InputData & idata, const Material * d_materialConstants,
+                                    const FourierNtUpdate & update, const uint3 & vx, Arena & stageArena,
+                                    Complex * d_fourierNt) {
+  const UINT numChanged = update.changedVoxels.size();
+  if (numChanged == 0) {
+    return;
+  }
+  const BigUINT numVoxels = static_cast<BigUINT>(vx.x) * vx.y * vx.z;
+  const int & NUM_MATERIAL = idata.NUM_MATERIAL;
+  const ArenaScope stageScope(stageArena);
+  Voxel * d_changedVoxelInput = stageArena.allocate<Voxel>(numChanged);
+  Complex * d_NtNew = stageArena.allocate<Complex>(6 * numChanged);
+  Complex * d_NtOld = stageArena.allocate<Complex>(6 * numChanged);
+  BigUINT * d_changedVoxels = stageArena.allocate<BigUINT>(numChanged);
+  hostDeviceExchange(d_changedVoxels, update.changedVoxels.data(), numChanged, cudaMemcpyHostToDevice);
+  const UINT BlockSizeChanged = static_cast<UINT>(ceil(numChanged * 1.0 / NUM_THREADS));
+  const UINT BlockSize = static_cast<UINT>(ceil(numVoxels * 1.0 / NUM_THREADS));
+
+  /// Nt of the changed voxels before and after the change. The voxels are laid out as a morphology of numChanged voxels.
+  Complex * const d_Nt[2]{d_NtOld, d_NtNew};
+  const Voxel * const voxelInput[2]{update.oldVoxels.data(), update.newVoxels.data()};
+  for (int i = 0; i < 2; i++) {
+    cudaZeroEntries(d_Nt[i], 6 * numChanged);
+    for (int numMat = 0; numMat < NUM_MATERIAL; numMat++) {
+      hostDeviceExchange(d_changedVoxelInput, &voxelInput[i][numMat * numChanged], numChanged, cudaMemcpyHostToDevice);
+      computeNt(d_materialConstants, d_changedVoxelInput, d_Nt[i], (MorphologyType)idata.morphologyType,
+                BlockSizeChanged, numChanged, 0, numChanged, numMat, 1, 0, NUM_MATERIAL);
+      cudaDeviceSynchronize();
+    }
+  }
+  gpuErrchk(cudaPeekAtLastError());
+  updateFourierNt<<<BlockSize, NUM_THREADS>>>(d_NtNew, d_NtOld, d_changedVoxels, numChanged, vx, d_fourierNt);
+  replaceShiftedDCComponent<<<1, 1>>>(d_fourierNt, vx);
+  cudaDeviceSynchronize();
+  gpuErrchk(cudaPeekAtLastError());
 }
 
 int computePolarization(const UINT *voxel, const InputData &idata, const std::vector<Material > &materialInput,
@@ -1603,7 +2461,7 @@ int computePolarization(const UINT *voxel, const InputData &idata, const std::ve
 
   if ((static_cast<uint64_t>(voxel[0]) * voxel[1] * voxel[2]) > std::numeric_limits<BigUINT>::max()) {
     std::cout << "Exiting. Compile by Enabling 64 Bit indices\n";
-    exit(EXIT_FAILURE);
+    return (EXIT_FAILURE);
   }
 
   if(idata.caseType != DEFAULT){
@@ -88,15 +88,12 @@
  */
 
 #include <cudaMain.h>
-#include <Input/readH5.h>
 #include <cstdlib>
-#include <Input/InputData.h>
-#include <Output/writeH5.h>
 #include <cstring>
 #include <omp.h>
 #include <iomanip>
-#include <utils.h>
-//#include <RotationMatrix.h>
+#include <Simulation.h>
+#include <Daemon/Daemon.h>
 
 /**
  * main function
@@ -106,69 +103,67 @@
  */
 int main(int argc, char **argv) {
 
+  /// --resume and --dry-run can be given anywhere on the command line
+  bool resume = false, dryRun = false;
+  std::vector<char *> args;
+  for (int i = 0; i < argc; i++) {
+    if (std::strcmp(argv[i], "--resume") == 0) {
+      resume = true;
+    } else if (std::strcmp(argv[i], "--dry-run") == 0) {
+      dryRun = true;
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+  argc = static_cast<int>(args.size());
+  argv = args.data();
 
   if (argc < 2) {
-    std::cout << "Usage : " << argv[0] << " " << "HDF5FileName" << " HDF5OutputDirname [optional]";
+    std::cout << "Usage : " << argv[0] << " " << "HDF5FileName" << " HDF5OutputDirname [optional] [--resume] [--dry-run]\n";
+    std::cout << "        " << argv[0] << " " << "--batch Manifest HDF5OutputDirname [optional] [--resume]\n";
+    std::cout << "        " << argv[0] << " " << "--ensemble Manifest HDF5OutputDirname [optional]\n";
+    std::cout << "        " << argv[0] << " " << "--daemon SocketPath\n";
     exit(EXIT_FAILURE);
   }
-  std::string fname = argv[1];
-
-  std::vector<Material> materialInput;
-  InputData inputData;
-  inputData.NUM_MATERIAL = H5::getNumberOfMaterial(fname);
-  inputData.readRefractiveIndexData(materialInput);
-  inputData.validate();
-  const int & NUM_MATERIAL = inputData.NUM_MATERIAL;
-  if (argc > 2) {
-    inputData.HDF5DirName = argv[2];
+  if (std::strcmp(argv[1], "--batch") == 0) {
+    if (argc < 3) {
+      std::cout << "Usage : " << argv[0] << " " << "--batch Manifest HDF5OutputDirname [optional]\n";
+      exit(EXIT_FAILURE);
+    }
+    const int status = runBatch(argv[2], (argc > 3) ? argv[3] : "", resume);
+    std::cout << "Complete. Exiting \n";
+    return status;
   }
-  H5::getDimensionAndOrder(fname, (MorphologyType) inputData.morphologyType, inputData.voxelDims,inputData.physSize,
-                           inputData.morphologyOrder);
-  inputData.check2D();
-  inputData.print();
-  if(inputData.caseType != CaseTypes::DEFAULT){
-    std::cout << BLU << "This is an experimental feature which is not tested. " << NRM <<"\n";
-  }
-  RotationMatrix matrix(&inputData);
-  Voxel *voxelData;
-  BigUINT voxelSize = inputData.voxelDims[0] * inputData.voxelDims[1] * inputData.voxelDims[2];
-
-  mallocCPUPinned(voxelData, voxelSize * NUM_MATERIAL);
-  H5::readFile(fname, inputData.voxelDims, voxelData, static_cast<MorphologyType>(inputData.morphologyType),
-               inputData.morphologyOrder, NUM_MATERIAL, true);
-  if(inputData.dumpMorphology){
-    H5::writeXDMF(inputData,voxelData);
+  if (std::strcmp(argv[1], "--ensemble") == 0) {
+    if (argc < 3) {
+      std::cout << "Usage : " << argv[0] << " " << "--ensemble Manifest HDF5OutputDirname [optional]\n";
+      exit(EXIT_FAILURE);
+    }
+    const int status = runEnsemble(argv[2], (argc > 3) ? argv[3] : "");
+    std::cout << "Complete. Exiting \n";
+    return status;
   }
-  if(not(checkMorphology(voxelData,inputData.voxelDims,NUM_MATERIAL))){
-    throw std::runtime_error("Nan detected in the morphology");
+  if (std::strcmp(argv[1], "--daemon") == 0) {
+    if (argc < 3) {
+      std::cout << "Usage : " << argv[0] << " " << "--daemon SocketPath\n";
+      exit(EXIT_FAILURE);
+    }
+    return runDaemon(argv[2]);
   }
-  Real *projectionGPUAveraged;
-  const UINT
-    numEnergyLevel = inputData.energies.size();
 
-  const std::size_t totalArraySize = static_cast<std::size_t>(numEnergyLevel) * static_cast<std::size_t>(inputData.voxelDims[0] * inputData.voxelDims[1]) *
-                                     inputData.kVectors.size();
-  projectionGPUAveraged = new Real[totalArraySize];
-
-  printCopyrightInfo();
-  RotationMatrix rotationMatrix(&inputData);
-  if (inputData.algorithmType == Algorithm::MemoryMinizing) {
-    cudaMainStreams(inputData.voxelDims, inputData, materialInput, projectionGPUAveraged, rotationMatrix, voxelData);
-  } else {
-    cudaMain(inputData.voxelDims, inputData, materialInput, projectionGPUAveraged, rotationMatrix, voxelData);
-  }
-  if (inputData.writeHDF5) {
-    writeH5(inputData, inputData.voxelDims, projectionGPUAveraged, inputData.HDF5DirName);
+  SimulationJob job;
+  job.morphologyFile = argv[1];
+  if (argc > 2) {
+    job.outputDir = argv[2];
   }
-  if (inputData.writeVTI) {
-    writeVTI(inputData, inputData.voxelDims, projectionGPUAveraged, inputData.VTIDirName);
+  job.resume = resume;
+  job.dryRun = dryRun;
+  SimulationDriver driver;
+  if (runJob([&] { return driver.run(job); }) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
   }
-  printMetaData(inputData, rotationMatrix);
-  delete[] projectionGPUAveraged;
-  cudaFreeHost(voxelData);
   std::cout << "Complete. Exiting \n";
 
   return EXIT_SUCCESS;
 
 }
-
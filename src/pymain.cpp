@@ -33,12 +33,15 @@
 #include "version.h"
 #include <Input/readH5.h>
 #include <iomanip>
+#include <stdexcept>
 #include <pybind11/iostream.h>
 #include <utils.h>
 #include <PyClass/VoxelData.h>
 #include <PyClass/RefractiveIndex.h>
 #include <PyClass/ScatteringPattern.h>
 #include <PyClass/Polarization.h>
+#include <PyClass/Session.h>
+#include <PyClass/AsyncLaunch.h>
 
 namespace py = pybind11;
 
@@ -78,20 +81,7 @@ void computePolarizationDebug(const InputData &inputData, const RefractiveIndexD
 void  launch(const InputData &inputData, const RefractiveIndexData &energyData,
             const VoxelData &voxelData,ScatteringPattern & scatteringPattern,
             bool ifWriteMetadata = true) {
-  if (not(inputData.validate())) {
-    py::print("Issues with Input Data");
-    return ;
-  }
-  if(inputData.caseType != CaseTypes::DEFAULT){
-    py::print("This is an experimental feature which is not tested");
-  }
-  if (not(energyData.validate())) {
-    py::print("Issues with Energy data");
-    return ;
-  }
-
-  if (not(voxelData.validate())) {
-    py::print("Issues with Voxel Data input");
+  if (not(validateLaunchInput(inputData, energyData, voxelData))) {
     return ;
   }
 
@@ -102,12 +92,16 @@ void  launch(const InputData &inputData, const RefractiveIndexData &energyData,
   RotationMatrix rotationMatrix(&inputData);
 
   std::cout << "\n [STAT] Executing: \n\n";
+  int status;
   if(inputData.algorithmType == Algorithm::CommunicationMinimizing) {
-    cudaMain(inputData.voxelDims, inputData, energyData.getRefractiveIndexData(), scatteringPattern.data(),
-             rotationMatrix, voxelData.data());
+    status = cudaMain(inputData.voxelDims, inputData, energyData.getRefractiveIndexData(), scatteringPattern.data(),
+                      rotationMatrix, voxelData.data());
   }
   else{
-    cudaMainStreams(inputData.voxelDims,inputData,energyData.getRefractiveIndexData(),scatteringPattern.data(),rotationMatrix,voxelData.data());
+    status = cudaMainStreams(inputData.voxelDims,inputData,energyData.getRefractiveIndexData(),scatteringPattern.data(),rotationMatrix,voxelData.data());
+  }
+  if (status != EXIT_SUCCESS) {
+    throw std::runtime_error("The computation failed");
   }
   if(ifWriteMetadata) {
       printMetaData(inputData,rotationMatrix);
@@ -165,6 +159,15 @@ PYBIND11_MODULE(@OUTPUT_BASE_NAME@, module) {
      .value("Material",ReferenceFrame::MATERIAL)
      .export_values();
 
+  py::enum_<Output::Compression>(module,"OutputCompression")
+    .value("NoCompression",Output::Compression::NONE)
+    .value("Deflate",Output::Compression::DEFLATE);
+
+  py::enum_<Output::Precision>(module,"OutputPrecision")
+    .value("Full",Output::Precision::FULL)
+    .value("Float16",Output::Precision::HALF)
+    .value("ScaledUInt16",Output::Precision::SCALED_UINT16);
+
   py::enum_<MorphologyOrder>(module,"MorphologyOrder")
     .value("XYZ",MorphologyOrder::XYZ)
     .value("ZYX",MorphologyOrder::ZYX)
@@ -189,7 +192,11 @@ PYBIND11_MODULE(@OUTPUT_BASE_NAME@, module) {
       .def_readwrite("rotMask",&InputData::rotMask,"Rotation Mask")
       .def_readwrite("openMP", &InputData::num_threads, "number of OpenMP threads")
       .def_readwrite("scatterApproach", &InputData::scatterApproach, "sets the scatter approach")
-      .def_readwrite("referenceFrame",&InputData::referenceFrame,"sets the reference frame");
+      .def_readwrite("referenceFrame",&InputData::referenceFrame,"sets the reference frame")
+      .def_readwrite("outputCompression",&InputData::outputCompression,"compression of the HDF5 output")
+      .def_readwrite("compressionLevel",&InputData::compressionLevel,"deflate level (1-9) of the HDF5 output")
+      .def_readwrite("outputPrecision",&InputData::outputPrecision,"type the HDF5 output is stored as")
+      .def_readwrite("numWriterThreads",&InputData::numWriterThreads,"number of threads writing the HDF5 output");
 
 
   py::class_<RefractiveIndexData>(module, "RefractiveIndex")
@@ -209,6 +216,10 @@ PYBIND11_MODULE(@OUTPUT_BASE_NAME@, module) {
          "Adds the EulerAngle components to the given material", py::arg("S"),py::arg("Theta"),py::arg("Psi"), py::arg("Vfrac"),py::arg("MaterialID"))
       .def("addVoxelData", &VoxelData::addMaterialDataEulerAnglesOnlyVFrac,
          "Adds the EulerAngle components to the given material. S/Theta/Phi = 0", py::arg("Vfrac"),py::arg("MaterialID"))
+      .def("setVoxelDataView", &VoxelData::setMaterialDataView,
+         "Sets all the materials from an array of shape (NumMaterial, Z, Y, X, 4). A contiguous array in ZYX order of the simulation floating point type is used without copying",
+         py::arg("VoxelData"))
+      .def("markModified", &VoxelData::markModified,"Marks the voxel data as modified after changing the array of setVoxelDataView in place")
       .def("clear", &VoxelData::clear,"Clears the voxel data")
       .def("validate", &VoxelData::validate,"validate the Voxel data")
       .def("readFromH5", &VoxelData::readFromH5, "Reads from HDF5",py::arg("Filename"))
@@ -233,8 +244,33 @@ PYBIND11_MODULE(@OUTPUT_BASE_NAME@, module) {
       .def("writeToHDF5",&Polarization::writeToHDF5,"write to HDF5")
       .def("writeToNumpy",&Polarization::writeToNumpy,"returns numpy array",py::arg("id"));      
 
+  py::class_<Session>(module,"Session")
+      .def(py::init<const InputData &, const RefractiveIndexData &, const VoxelData &>(), "Constructor",
+           py::arg("InputData"), py::arg("RefractiveIndexData"), py::arg("VoxelData"),
+           py::keep_alive<1, 2>(), py::keep_alive<1, 3>(), py::keep_alive<1, 4>())
+      .def("run", &Session::run, "GPU computation reusing the device resources of previous runs",
+           py::arg("ScatteringPattern"), py::arg("WriteMetaData") = false)
+      .def("update", &Session::update,
+           "GPU computation after a few voxels were modified, updating the Fourier transform of the previous update",
+           py::arg("ScatteringPattern"), py::arg("ChangedVoxels"), py::arg("MaxChangedVoxels") = -1,
+           py::arg("WriteMetaData") = false)
+      .def("release", &Session::release, "Frees the device resources");
+
+  py::class_<AsyncLaunch>(module,"AsyncLaunch")
+      .def("done", &AsyncLaunch::done, "True if the computation and the callbacks are complete")
+      .def("wait", &AsyncLaunch::wait, "Waits for the computation and the callbacks. Returns True if complete",
+           py::arg("Timeout") = -1.0)
+      .def("cancel", &AsyncLaunch::cancel, "Skips the energies not started yet and drops the frames not consumed yet")
+      .def("cancelled", &AsyncLaunch::isCancelled, "True if the launch was cancelled")
+      .def("__iter__", [](AsyncLaunch &asyncLaunch) -> AsyncLaunch & { return asyncLaunch; },
+           py::return_value_policy::reference_internal)
+      .def("__next__", &AsyncLaunch::next, "Returns the next (energy, kID, frame) as soon as it is computed");
+
   module.def("launch", &launch, "GPU computation", py::arg("InputData"), py::arg("RefractiveIndexData"),
              py::arg("VoxelData"),py::arg("ScatteringPattern"),py::arg("WriteMetaData")=true);
+  module.def("launch_async", &launchAsync, "GPU computation in the background, returning an AsyncLaunch handle",
+             py::arg("InputData"), py::arg("RefractiveIndexData"), py::arg("VoxelData"), py::arg("Callback") = py::none(),
+             py::arg("MaxQueuedFrames") = 4, py::keep_alive<0, 1>(), py::keep_alive<0, 2>(), py::keep_alive<0, 3>());
   module.def("cleanup", &cleanup, "Cleanup",  py::arg("RefractiveIndex"), py::arg("VoxelData"),py::arg("ScatteringPattern"));
   module.def("computePolarization", &computePolarizationDebug, "Computes the polarization vector for debugging",py::arg("InputData"),
              py::arg("RefractiveIndex"),py::arg("VoxelData"),py::arg("Polarization"),py::arg("Energy"),py::arg("EAngle"));